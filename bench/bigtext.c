@@ -0,0 +1,108 @@
+/*
+ * bigtext - a program with 8 MB of text, for the effect of SP_PREFETCH.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Usage: bigtext [DELAY [RUN]]
+ *
+ * 3000 functions of about 2.7 KB each make up the text; every other one
+ * is hot, so 1500 functions are spread over all of it.  After DELAY
+ * milliseconds (default 0), standing for startup work of a real program,
+ * calls all hot functions once and prints how long that took and the
+ * page faults it took, then once more for the steady state.  Then keeps
+ * calling them for RUN more milliseconds (default 0), which gives a
+ * profile with samples in all of them.
+ *
+ * Build with -fno-ipa-icf, or the compiler folds identical functions.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static volatile unsigned long s;
+
+#define S(k)	s += s * k;
+#define S10(k)	S(k##0) S(k##1) S(k##2) S(k##3) S(k##4) \
+		S(k##5) S(k##6) S(k##7) S(k##8) S(k##9)
+#define BODY	S10(1) S10(2) S10(3) S10(4) S10(5) S10(6) S10(7) S10(8)
+
+#define F(n)	__attribute__((noinline)) void f##n (void) { BODY }
+#define F10(n)	F(n##0) F(n##1) F(n##2) F(n##3) F(n##4) \
+		F(n##5) F(n##6) F(n##7) F(n##8) F(n##9)
+#define F100(n)	F10(n##0) F10(n##1) F10(n##2) F10(n##3) F10(n##4) \
+		F10(n##5) F10(n##6) F10(n##7) F10(n##8) F10(n##9)
+#define F1000(n) F100(n##0) F100(n##1) F100(n##2) F100(n##3) F100(n##4) \
+		F100(n##5) F100(n##6) F100(n##7) F100(n##8) F100(n##9)
+
+F1000(1) F1000(2) F1000(3)
+
+/* Every other function. */
+#define T10(n)	f##n##0, f##n##2, f##n##4, f##n##6, f##n##8,
+#define T100(n)	T10(n##0) T10(n##1) T10(n##2) T10(n##3) T10(n##4) \
+		T10(n##5) T10(n##6) T10(n##7) T10(n##8) T10(n##9)
+#define T1000(n) T100(n##0) T100(n##1) T100(n##2) T100(n##3) T100(n##4) \
+		T100(n##5) T100(n##6) T100(n##7) T100(n##8) T100(n##9)
+
+static void (*const hot[])(void) = { T1000(1) T1000(2) T1000(3) };
+
+#define NHOT	(sizeof(hot) / sizeof(hot[0]))
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Calls all hot functions once, and prints what it took. */
+static void
+pass (const char *what)
+{
+  struct rusage before, after;
+
+  getrusage(RUSAGE_SELF, &before);
+  const double start = now();
+  for (size_t i = 0; i < NHOT; i++)
+    hot[i]();
+  const double ms = now() - start;
+  getrusage(RUSAGE_SELF, &after);
+  printf("%s %.3f ms %ld major %ld minor faults\n", what, ms,
+	 after.ru_majflt - before.ru_majflt, after.ru_minflt - before.ru_minflt);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const long delay = argc > 1 ? atol(argv[1]) : 0;
+  const long run = argc > 2 ? atol(argv[2]) : 0;
+
+  if (delay > 0)
+    usleep(delay * 1000);
+  pass("first");
+  pass("second");
+
+  const double end = now() + run;
+  while (now() < end)
+    for (size_t i = 0; i < NHOT; i++)
+      hot[i]();
+  return 0;
+}
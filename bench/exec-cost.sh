@@ -0,0 +1,27 @@
+#!/bin/sh
+# Cost of simpleprof.so per exec of a trivial program, normal and with
+# SP_SHORT, as the difference from running it without LD_AUDIT (in
+# microseconds; see execcost.c).
+#
+# Usage: exec-cost.sh path/to/simpleprof.so [COUNT]
+#
+# simpleprof.so must be loadable as an audit module, i.e. linked with
+# -shared rather than as a PIE.  Profiles go to a temporary directory.
+
+set -e
+so=$(realpath "$1")
+count=${2:-2000}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$(dirname "$0")"
+cc -O2 -o "$dir/execcost" execcost.c
+echo 'int main (void) { return 0; }' > "$dir/true.c"
+cc -O2 -o "$dir/true" "$dir/true.c"
+
+"$dir/execcost" "$count" "$dir/true" \
+	"" \
+	"LD_AUDIT=$so SP_PROFILE=none" \
+	"LD_AUDIT=$so SP_PROFILE=true SP_PROFILE_OUTPUT=$dir" \
+	"LD_AUDIT=$so SP_PROFILE=true SP_PROFILE_OUTPUT=$dir SP_SHORT=1" \
+	| sed "s|$dir|\$TMP|g; s|$so|simpleprof.so|g"
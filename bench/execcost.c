@@ -0,0 +1,125 @@
+/*
+ * execcost - time fork and exec of a program, for the cost of
+ * simpleprof.so at startup and exit.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs PROGRAM COUNT times under each SETTING, a space-separated list
+ * of VAR=VALUE put in its environment (which may be empty), taking the
+ * settings in turn so that changes in the load of the machine affect
+ * all of them alike.  Prints for each the medians of the wall-clock
+ * time from fork to wait and of the CPU time of the child, and the
+ * latter relative to the first SETTING, in microseconds.  CPU time is
+ * the less disturbed by other processes.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+static double
+now (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  const double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double
+median (double *v, size_t n)
+{
+  qsort(v, n, sizeof(*v), compare);
+  return v[n / 2];
+}
+
+static void
+run (const char *program, const char *setting, double *wall, double *cpu)
+{
+  const double start = now();
+  const pid_t pid = fork();
+  if (pid < 0)
+    error(EXIT_FAILURE, errno, "fork");
+  if (pid == 0)
+    {
+      char *const copy = strdup(setting);
+      for (char *var = strtok(copy, " "); var; var = strtok(NULL, " "))
+	putenv(var);
+      execl(program, program, (char *) NULL);
+      _exit(127);
+    }
+
+  int status;
+  struct rusage ru;
+  if (wait4(pid, &status, 0, &ru) < 0)
+    error(EXIT_FAILURE, errno, "wait4");
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    error(EXIT_FAILURE, 0, "%s failed with %s", program, setting);
+  *wall = now() - start;
+  *cpu = ((ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e6
+	  + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (argc < 4)
+    {
+      fprintf(stderr, "Usage: %s COUNT PROGRAM SETTING...\n",
+	      program_invocation_short_name);
+      return EXIT_FAILURE;
+    }
+  const long count = strtol(argv[1], NULL, 10);
+  const char *const program = argv[2];
+  char **const settings = argv + 3;
+  const int nsettings = argc - 3;
+  if (count <= 0)
+    error(EXIT_FAILURE, 0, "invalid count %s", argv[1]);
+
+  double *const wall = malloc(nsettings * count * sizeof(*wall));
+  double *const cpu = malloc(nsettings * count * sizeof(*cpu));
+  if (!wall || !cpu)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (long i = 0; i < count; i++)
+    for (int s = 0; s < nsettings; s++)
+      run(program, settings[s], &wall[s * count + i], &cpu[s * count + i]);
+
+  double base = 0;
+  for (int s = 0; s < nsettings; s++)
+    {
+      const double w = median(&wall[s * count], count);
+      const double c = median(&cpu[s * count], count);
+      if (s == 0)
+	base = c;
+      printf("wall %5.0f  CPU %5.0f  %+5.0f  %s\n", w, c, c - base,
+	     *settings[s] ? settings[s] : "(none)");
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+# Effect of SP_PREFETCH on a program with 8 MB of text (see bigtext.c):
+# time and minor faults of its first pass over its hot functions after
+# startup, and of the second one (the steady state), as medians of COUNT
+# runs with and without prefetching, taken in turn.
+#
+# Usage: prefetch.sh path/to/simpleprof.so [COUNT [TRAIN]]
+#
+# A run of TRAIN seconds (default 30) fills the profile first.
+# simpleprof.so must be loadable as an audit module, i.e. linked with
+# -shared rather than as a PIE.  Profiles go to a temporary directory.
+# Compiling bigtext.c takes a few minutes.
+
+set -e
+so=$(realpath "$1")
+count=${2:-20}
+train=${3:-30}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cd "$(dirname "$0")"
+cc -O2 -fno-ipa-icf -o "$dir/bigtext" bigtext.c
+
+audit="LD_AUDIT=$so SP_PROFILE=bigtext SP_PROFILE_OUTPUT=$dir"
+env $audit "$dir/bigtext" 0 "$((train * 1000))" > /dev/null
+
+# Some startup work, during which prefetching goes on.
+delay=10
+for i in $(seq "$count"); do
+	env $audit "$dir/bigtext" $delay | sed 's/^/without /'
+	env $audit SP_PREFETCH=1 "$dir/bigtext" $delay | sed 's/^/with /'
+done | awk '
+function median(list,	n, v, i, j, t) {
+	n = split(list, v, " ")
+	for (i = 2; i <= n; i++)
+		for (j = i; j > 1 && v[j - 1] > v[j]; j--) {
+			t = v[j]; v[j] = v[j - 1]; v[j - 1] = t
+		}
+	return v[int((n + 1) / 2)]
+}
+{
+	key = $1 " " $2
+	if (!(key in ms))
+		keys[++nkeys] = key
+	ms[key] = ms[key] " " $3
+	minor[key] = minor[key] " " $7
+}
+END {
+	printf "%-16s %10s %14s\n", "", "ms", "minor faults"
+	for (i = 1; i <= nkeys; i++)
+		printf "%-16s %10.3f %14d\n", keys[i] " pass",
+		       median(ms[keys[i]]), median(minor[keys[i]])
+}'
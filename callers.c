@@ -0,0 +1,417 @@
+/*
+ * Simple Profiler - attribution of library samples to their callers.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_CALLERS set, a sample outside the main program (in memcpy of
+ * libc, say) is attributed to the call site in the main program it came
+ * from: the link register if it points there (on aarch64), or else the
+ * first word in the top STACK_WORDS words of the stack which looks like
+ * a return address into the main program, i.e. follows a call
+ * instruction.  No unwinding is done, so a call site may be some frames
+ * up from the library function the sample was in.
+ *
+ * Such samples are counted at their call sites in a histogram of the
+ * same layout as the profile, and as a call graph arc from the call site
+ * to the target of the call (its PLT entry, for a call into a shared
+ * library) if it is a direct call, with the count of samples as its
+ * count.  At exit, both are added to <profile>.callers.profile, a gmon
+ * file of its own, under the lock of the output directory.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "simpleprof.h"
+#include "gmonmeta.h"
+
+#if defined __x86_64__ || defined __i386__ || defined __aarch64__
+# define HAVE_CALL_DECODE	1
+#endif
+
+/* Words on top of the stack to look for a return address. */
+#define STACK_WORDS	16
+
+/* Distinct call sites counted; further ones are dropped. */
+#define MAX_SITES	4096
+
+struct call_site
+{
+  uintptr_t ret;		/* return address; 0 if unused */
+  uintptr_t target;		/* called address, or 0 if indirect */
+  uint32_t count;
+};
+
+static uint32_t *bins;
+static size_t nbins;
+static struct call_site *sites;
+static uintptr_t text_lo, text_hi, load_bias;
+static uint64_t attributed, unattributed;
+static pid_t owner;
+
+/* Called from la_preinit with the number of bins of the program's profile. */
+void
+callers_init (size_t n)
+{
+  if (!sp_env_flag(ENV_PREFIX "CALLERS"))
+    return;
+#ifndef HAVE_CALL_DECODE
+  EPRINTF("%s is not supported on this architecture", ENV_PREFIX "CALLERS");
+#else
+  const struct sp_object *const obj = objmap_get(0);
+  if (!sampler_has_context() || !obj || !obj->highpc)
+    {
+      EPRINTF("%s is not supported on this architecture", ENV_PREFIX "CALLERS");
+      return;
+    }
+
+  const size_t size = n * sizeof(*bins) + MAX_SITES * sizeof(*sites);
+  void *const p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return;
+    }
+  sites = p;
+  bins = (uint32_t *) (sites + MAX_SITES);
+  nbins = n;
+  text_lo = obj->lowpc;
+  text_hi = obj->highpc;
+  load_bias = obj->base;
+  owner = getpid();
+  if (sp_debug)
+    DPRINTF("attributing library samples to callers");
+#endif
+}
+
+/*
+ * Whether RET is a return address into the main program, i.e. follows
+ * a call instruction there.  If so, sets *TARGET to the address called,
+ * or 0 if the call is indirect.
+ */
+static _Bool
+is_call_site (uintptr_t ret, uintptr_t *target)
+{
+  if (ret < text_lo || ret >= text_hi)
+    return 0;
+
+  *target = 0;
+#if defined __x86_64__ || defined __i386__
+  const unsigned char *const p = (const unsigned char *) ret;
+
+  if (ret - 5 >= text_lo && p[-5] == 0xe8)
+    {
+      /* call rel32 */
+      int32_t rel;
+      memcpy(&rel, p - 4, sizeof(rel));
+      const uintptr_t t = ret + rel;
+      if (t >= text_lo && t < text_hi)
+	*target = t;
+      return 1;
+    }
+  /* call *disp32(%rip) (-fno-plt), or call *%reg */
+  return ((ret - 6 >= text_lo && p[-6] == 0xff && p[-5] == 0x15) ||
+	  (ret - 2 >= text_lo && p[-2] == 0xff && (p[-1] & 0xf8) == 0xd0));
+#elif defined __aarch64__
+  if (ret % 4 || ret - 4 < text_lo)
+    return 0;
+
+  const uint32_t insn = *(const uint32_t *) (ret - 4);
+  if ((insn & 0xfc000000) == 0x94000000)
+    {
+      /* bl imm26 */
+      const uintptr_t t = ret - 4 + (intptr_t) ((int32_t) (insn << 6) >> 6) * 4;
+      if (t >= text_lo && t < text_hi)
+	*target = t;
+      return 1;
+    }
+  /* blr xN */
+  return (insn & 0xfffffc1f) == 0xd63f0000;
+#else
+  return 0;
+#endif
+}
+
+/* Return address into the main program of SAMPLE, or 0. */
+static uintptr_t
+find_caller (const struct sp_sample *sample, uintptr_t *target)
+{
+  if (sample->lr && is_call_site(sample->lr, target))
+    return sample->lr;
+
+  /* The stack may end within STACK_WORDS words. */
+  uintptr_t words[STACK_WORDS];
+  struct iovec local = { words, sizeof(words) };
+  struct iovec remote = { (void *) sample->sp, sizeof(words) };
+  const ssize_t n = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+
+  for (ssize_t i = 0; i < n / (ssize_t) sizeof(words[0]); i++)
+    if (is_call_site(words[i], target))
+      return words[i];
+  return 0;
+}
+
+static void
+count_site (uintptr_t ret, uintptr_t target, unsigned int weight)
+{
+  size_t i = ((uint64_t) ret * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+
+  for (size_t probe = 0; probe < MAX_SITES; probe++, i++)
+    {
+      struct call_site *const s = &sites[i % MAX_SITES];
+      uintptr_t k = __atomic_load_n(&s->ret, __ATOMIC_ACQUIRE);
+
+      if (k == 0 &&
+	  __atomic_compare_exchange_n(&s->ret, &k, ret, 0,
+				      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	  /* Claimed; the target is the same for any thread. */
+	  __atomic_store_n(&s->target, target, __ATOMIC_RELEASE);
+	  k = ret;
+	}
+      if (k == ret)
+	{
+	  __atomic_fetch_add(&s->count, weight, __ATOMIC_RELAXED);
+	  return;
+	}
+    }
+}
+
+/* Called from SIGPROF handler. */
+void
+callers_sample (const struct sp_sample *sample, unsigned int weight)
+{
+  if (!bins || weight == 0 || sampler_bin(sample->pc) != SIZE_MAX)
+    return;
+
+  uintptr_t target;
+  const uintptr_t ret = find_caller(sample, &target);
+  const size_t i = ret ? sampler_bin(ret - 1) : SIZE_MAX;
+  if (i == SIZE_MAX)
+    {
+      __atomic_fetch_add(&unattributed, weight, __ATOMIC_RELAXED);
+      return;
+    }
+  __atomic_fetch_add(&bins[i], weight, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&attributed, weight, __ATOMIC_RELAXED);
+  if (target)
+    count_site(ret, target, weight);
+}
+
+struct arc
+{
+  uintptr_t from_pc, self_pc;
+  uint32_t count;
+};
+
+/*
+ * Reads arcs and bins of the callers profile at IMAGE of SIZE bytes into
+ * *ARCS (malloc'ed) and OLD_BINS.  Returns number of arcs, or -1 if the
+ * file does not match the profile.
+ */
+static ssize_t
+parse_callers (const unsigned char *image, size_t size,
+	       unsigned short *old_bins, struct arc **arcs)
+{
+  const char *const header = sp_profile_header();
+  size_t trailer_size;
+  unsigned char *const trailer = sp_profile_trailer("callers", &trailer_size);
+  if (!trailer)
+    return -1;
+
+  const size_t spare_offset = offsetof(struct gmon_hdr, spare);
+  const size_t spare_end = spare_offset + sizeof(struct sp_gmon_spare);
+  const size_t bins_end = SP_HEADER_SIZE + nbins * sizeof(unsigned short);
+  if (size < bins_end + trailer_size ||
+      (size - bins_end - trailer_size) % GMON_META_RECORD ||
+      memcmp(image, header, spare_offset) ||
+      memcmp(image + spare_end, header + spare_end, SP_HEADER_SIZE - spare_end) ||
+      memcmp(image + size - trailer_size, trailer, trailer_size))
+    {
+      free(trailer);
+      return -1;
+    }
+  free(trailer);
+
+  memcpy(old_bins, image + SP_HEADER_SIZE, nbins * sizeof(unsigned short));
+  const size_t n = (size - bins_end - trailer_size) / GMON_META_RECORD;
+  *arcs = malloc((n + MAX_SITES) * sizeof(**arcs));
+  if (!*arcs)
+    return -1;
+  for (size_t i = 0; i < n; i++)
+    {
+      const unsigned char *const p = image + bins_end + i * GMON_META_RECORD;
+      struct arc *const a = &(*arcs)[i];
+
+      if (p[0] != GMON_TAG_CG_ARC)
+	{
+	  free(*arcs);
+	  return -1;
+	}
+      memcpy(&a->from_pc, p + 1, sizeof(a->from_pc));
+      memcpy(&a->self_pc, p + 1 + sizeof(a->from_pc), sizeof(a->self_pc));
+      memcpy(&a->count, p + 1 + 2 * sizeof(a->from_pc), sizeof(a->count));
+    }
+  return n;
+}
+
+static void
+write_callers (const char *path)
+{
+  unsigned short *const merged = calloc(nbins, sizeof(*merged));
+  struct arc *arcs = NULL;
+  ssize_t narcs = 0;
+  unsigned int runs = 1;
+  if (!merged)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0)
+    {
+      unsigned char *const image = malloc(st.st_size);
+      if (!image || read(fd, image, st.st_size) != st.st_size ||
+	  (narcs = parse_callers(image, st.st_size, merged, &arcs)) < 0)
+	{
+	  EPRINTF("%#s: profile metadata mismatch", path);
+	  free(image);
+	  free(merged);
+	  close(fd);
+	  return;
+	}
+      runs += sp_gmon_spare(image)->runs;
+      free(image);
+    }
+  else if (fd >= 0 || errno != ENOENT)
+    {
+      EPRINTF("%#s: %s", path, strerror(errno));
+      free(merged);
+      if (fd >= 0)
+	close(fd);
+      return;
+    }
+  if (fd >= 0)
+    close(fd);
+  if (!arcs && !(arcs = malloc(MAX_SITES * sizeof(*arcs))))
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      free(merged);
+      return;
+    }
+
+  /* In samples at the normal rate, as in the profile. */
+  const unsigned int ratio = sampler_ratio();
+  for (size_t i = 0; i < nbins; i++)
+    {
+      const uint32_t v = merged[i] + (bins[i] + ratio / 2) / ratio;
+      merged[i] = v < USHRT_MAX ? v : USHRT_MAX;
+    }
+  for (size_t i = 0; i < MAX_SITES; i++)
+    {
+      const struct call_site *const s = &sites[i];
+      const uint32_t count = (s->count + ratio / 2) / ratio;
+      const uintptr_t target = __atomic_load_n(&s->target, __ATOMIC_ACQUIRE);
+      if (!s->ret || !target || !count)
+	continue;
+
+      const uintptr_t from_pc = s->ret - load_bias;
+      ssize_t j;
+      for (j = 0; j < narcs && arcs[j].from_pc != from_pc; j++)
+	;
+      if (j == narcs)
+	arcs[narcs++] = (struct arc) { from_pc, target - load_bias, 0 };
+      arcs[j].count = (arcs[j].count <= UINT32_MAX - count
+		       ? arcs[j].count + count : UINT32_MAX);
+    }
+
+  unsigned char *const records = malloc(narcs * GMON_META_RECORD + 1);
+  if (!records)
+    EPRINTF("malloc: %s", strerror(errno));
+  else
+    {
+      for (ssize_t i = 0; i < narcs; i++)
+	{
+	  unsigned char *const p = records + i * GMON_META_RECORD;
+
+	  p[0] = GMON_TAG_CG_ARC;
+	  memcpy(p + 1, &arcs[i].from_pc, sizeof(arcs[i].from_pc));
+	  memcpy(p + 1 + sizeof(uintptr_t), &arcs[i].self_pc, sizeof(arcs[i].self_pc));
+	  memcpy(p + 1 + 2 * sizeof(uintptr_t), &arcs[i].count, sizeof(arcs[i].count));
+	}
+      if (sp_write_profile(path, "callers", merged, records, narcs * GMON_META_RECORD, runs) == 0 &&
+	  sp_debug)
+	DPRINTF("%" PRIu64 " library samples attributed to callers, %" PRIu64 " not",
+		attributed, unattributed);
+      free(records);
+    }
+  free(arcs);
+  free(merged);
+}
+
+static void __attribute__((destructor))
+callers_fini (void)
+{
+  if (!bins || owner != getpid())
+    return;
+  /* A run with nothing to add is not one of its runs. */
+  if (!__atomic_load_n(&attributed, __ATOMIC_RELAXED))
+    {
+      if (sp_debug)
+	DPRINTF("no library samples attributed to callers");
+      return;
+    }
+  if (!sp_prepare_profile())
+    return;
+
+  /* your-program.profile -> your-program.callers.profile */
+  const char *const profile = sp_profile_path();
+  const size_t len = strlen(profile);
+  const size_t stem = (len > sizeof(".profile") - 1 &&
+		       !strcmp(profile + len - (sizeof(".profile") - 1), ".profile")
+		       ? len - (sizeof(".profile") - 1) : len);
+  char path[stem + sizeof(".callers.profile")];
+  memcpy(path, profile, stem);
+  strcpy(path + stem, ".callers.profile");
+
+  const int lockfd = rotate_lock_dir(path);
+  write_callers(path);
+  rotate_unlock(lockfd);
+}
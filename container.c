@@ -0,0 +1,417 @@
+/*
+ * Simple Profiler - self-contained profile container.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_CONTAINER, a snapshot of the profile is written at exit into
+ * a container (see spcontainer.h) next to it, together with the load
+ * map, run metadata and symbols of the functions which got samples.
+ * The container replaces any previous one, so it always reflects the
+ * profile accumulated so far.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "simpleprof.h"
+#include "gmonmeta.h"
+#include "spcontainer.h"
+
+static char *container_path;
+static const void *profile;
+static size_t profile_size, bins_offset, nbins;
+static uintptr_t low_pc, high_pc;
+static time_t start_time;
+static pid_t owner;
+
+/*
+ * Arranges for a container to be written at exit if SP_CONTAINER is set.
+ * PATH is of the profile mapped at IMAGE (SIZE bytes), of which NBINS
+ * histogram bins at OFFSET cover link-time addresses LOW to HIGH.
+ */
+void
+container_init (const char *path, const void *image, size_t size,
+		size_t offset, size_t n, uintptr_t low, uintptr_t high)
+{
+  if (!sp_env_flag(ENV_PREFIX "CONTAINER"))
+    return;
+
+  const size_t len = strlen(path);
+  const size_t base = len > 8 && !strcmp(path + len - 8, ".profile") ? len - 8 : len;
+  if (!(container_path = malloc(base + sizeof(".spc"))))
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+  memcpy(container_path, path, base);
+  strcpy(container_path + base, ".spc");
+
+  profile = image;
+  profile_size = size;
+  bins_offset = offset;
+  nbins = n;
+  low_pc = low;
+  high_pc = high;
+  start_time = time(NULL);
+  owner = getpid();
+}
+
+/* Growable buffer for sections. */
+struct buf
+{
+  char *data;
+  size_t len, cap;
+  _Bool failed;
+};
+
+static void
+buf_add (struct buf *b, const void *p, size_t n)
+{
+  if (b->failed)
+    return;
+  if (b->cap - b->len < n)
+    {
+      size_t cap = b->cap ? b->cap : 1024;
+      while (cap - b->len < n)
+	cap *= 2;
+      char *const data = realloc(b->data, cap);
+      if (!data)
+	{
+	  b->failed = 1;
+	  return;
+	}
+      b->data = data;
+      b->cap = cap;
+    }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void __attribute__((format(printf, 2, 3)))
+buf_printf (struct buf *b, const char *fmt, ...)
+{
+  char *s;
+  va_list ap;
+
+  va_start(ap, fmt);
+  const int n = vasprintf(&s, fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    b->failed = 1;
+  else
+    {
+      buf_add(b, s, n);
+      free(s);
+    }
+}
+
+/* Copy of the profile, consistent under its seqlock. */
+static void *
+snapshot (void)
+{
+  void *const copy = malloc(profile_size);
+  if (!copy)
+    return NULL;
+
+  gmon_seq_copy(profile, 0, profile_size, copy, 100);
+  return copy;			/* Good enough even if inconsistent. */
+}
+
+static unsigned int
+bin_at (const unsigned char *bins, size_t i)
+{
+  unsigned short v;
+  memcpy(&v, bins + i * sizeof(v), sizeof(v));
+  return v;
+}
+
+struct hot_sym
+{
+  uint64_t addr;
+  uint32_t size;
+  const char *name;
+};
+
+static int
+compare_hot_sym (const void *a, const void *b)
+{
+  const struct hot_sym *const x = a;
+  const struct hot_sym *const y = b;
+
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Adds functions of the main program whose range has samples in BINS
+ * to SYMS and STRS.  Symbols are read from the executable file, which
+ * is still there as we are running it.
+ */
+static void
+hot_symbols (const unsigned char *bins, struct buf *syms, struct buf *strs)
+{
+  const int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st))
+    {
+      if (fd >= 0)
+	close(fd);
+      return;
+    }
+  const unsigned char *const image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return;
+
+  const ElfW(Ehdr) *const ehdr = (const ElfW(Ehdr) *) image;
+  if ((size_t) st.st_size < sizeof(*ehdr) ||
+      memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+      ehdr->e_shoff + (uint64_t) ehdr->e_shnum * sizeof(ElfW(Shdr)) > (uint64_t) st.st_size)
+    goto out;
+
+  const ElfW(Shdr) *const shdr = (const ElfW(Shdr) *) (image + ehdr->e_shoff);
+  const ElfW(Shdr) *symsec = NULL;
+  for (unsigned int i = 0; i < ehdr->e_shnum; i++)
+    if (shdr[i].sh_type == SHT_SYMTAB ||
+	(shdr[i].sh_type == SHT_DYNSYM && !symsec))
+      symsec = &shdr[i];
+  if (!symsec || symsec->sh_link >= ehdr->e_shnum ||
+      symsec->sh_offset + symsec->sh_size > (uint64_t) st.st_size)
+    goto out;
+
+  const ElfW(Shdr) *const strsec = &shdr[symsec->sh_link];
+  if (strsec->sh_offset + strsec->sh_size > (uint64_t) st.st_size)
+    goto out;
+
+  const ElfW(Sym) *const sym = (const ElfW(Sym) *) (image + symsec->sh_offset);
+  const size_t nsym = symsec->sh_size / sizeof(ElfW(Sym));
+  const char *const strtab = (const char *) image + strsec->sh_offset;
+  struct hot_sym *hot = NULL;
+  size_t nhot = 0;
+
+  for (size_t i = 0; i < nsym; i++)
+    {
+      const unsigned int type = ELF64_ST_TYPE(sym[i].st_info);
+      const uint64_t lo = sym[i].st_value;
+      const uint64_t hi = lo + (sym[i].st_size ? sym[i].st_size : 1);
+
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+	  sym[i].st_shndx == SHN_UNDEF || sym[i].st_name >= strsec->sh_size ||
+	  hi <= low_pc || lo >= high_pc)
+	continue;
+
+      /* Bins overlapping [lo, hi), with gprof's bin arithmetic. */
+      const double per_bin = (double) (high_pc - low_pc) / nbins;
+      size_t b = lo > low_pc ? (size_t) ((lo - low_pc) / per_bin) : 0;
+      const size_t e = hi < high_pc ? (size_t) ((hi - low_pc) / per_bin) + 1 : nbins;
+      while (b < e && b < nbins && !bin_at(bins, b))
+	b++;
+      if (b >= e || b >= nbins)
+	continue;
+
+      struct hot_sym *const p = realloc(hot, (nhot + 1) * sizeof(*p));
+      if (!p)
+	break;
+      hot = p;
+      hot[nhot].addr = lo;
+      hot[nhot].size = sym[i].st_size;
+      hot[nhot].name = strtab + sym[i].st_name;
+      nhot++;
+    }
+
+  qsort(hot, nhot, sizeof(*hot), compare_hot_sym);
+  for (size_t i = 0; i < nhot; i++)
+    {
+      /* Keep only the first of aliases. */
+      if (i && hot[i].addr == hot[i - 1].addr)
+	continue;
+
+      const struct spc_sym s = { hot[i].addr, hot[i].size, strs->len };
+      buf_add(syms, &s, sizeof(s));
+      buf_add(strs, hot[i].name, strlen(hot[i].name) + 1);
+    }
+  free(hot);
+
+ out:
+  munmap((void *) image, st.st_size);
+}
+
+static void
+write_container (void)
+{
+  unsigned char *const image = snapshot();
+  if (!image)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+  const unsigned char *const bins = image + bins_offset;
+
+  struct buf meta = { 0 }, stats = { 0 }, maps = { 0 }, syms = { 0 }, strs = { 0 };
+
+  /* Run metadata. */
+  const struct sp_object *const main_obj = objmap_get(0);
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  buf_printf(&meta, "program=%s\nbuild-id=%s\nhost=%s\nargv=",
+	     sp_progname(), main_obj && main_obj->build_id ? main_obj->build_id : "",
+	     host);
+  const int cfd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+  if (cfd >= 0)
+    {
+      char cmdline[4096];
+      ssize_t n = read(cfd, cmdline, sizeof(cmdline));
+      /* Arguments end with '\0', unless they did not fit. */
+      if (n > 0 && cmdline[n - 1] == '\0')
+	n--;
+      for (ssize_t i = 0; i < n; i++)
+	if (cmdline[i] == '\0' || cmdline[i] == '\n')
+	  cmdline[i] = ' ';
+      if (n > 0)
+	buf_add(&meta, cmdline, n);
+      close(cfd);
+    }
+  buf_printf(&meta, "\npid=%ld\nstart=%lld\nend=%lld\nruns=%u\nhz=%u\n",
+	     (long) getpid(), (long long) start_time, (long long) time(NULL),
+	     (unsigned int) sp_gmon_spare(image)->runs, sampler_frequency());
+
+  /* Sample statistics. */
+  unsigned long long total = 0;
+  size_t nonzero = 0;
+  unsigned int max = 0;
+  for (size_t i = 0; i < nbins; i++)
+    {
+      const unsigned int v = bin_at(bins, i);
+      if (v)
+	{
+	  total += v;
+	  nonzero++;
+	  if (v > max)
+	    max = v;
+	}
+    }
+  buf_printf(&stats, "samples=%llu\nbins=%zu\nmax-bin=%u\n", total, nonzero, max);
+
+  /* Load map. */
+  const struct sp_object *obj;
+  for (unsigned int i = 0; (obj = objmap_get(i)) != NULL; i++)
+    if (obj->highpc)
+      buf_printf(&maps, "%lx %lx %lx %s %s\n",
+		 (unsigned long) obj->lowpc, (unsigned long) obj->highpc,
+		 (unsigned long) obj->base,
+		 obj->build_id ? obj->build_id : "-", obj->name);
+
+  hot_symbols(bins, &syms, &strs);
+
+  const struct
+  {
+    unsigned int type;
+    const void *data;
+    size_t size;
+    _Bool failed;
+  } sections[] =
+      {
+	{ SPC_GMON, image, profile_size, 0 },
+	{ SPC_META, meta.data, meta.len, meta.failed },
+	{ SPC_STATS, stats.data, stats.len, stats.failed },
+	{ SPC_MAPS, maps.data, maps.len, maps.failed },
+	{ SPC_SYMS, syms.data, syms.len, syms.failed },
+	{ SPC_STRS, strs.data, strs.len, strs.failed },
+      };
+#define NSECTIONS	(sizeof(sections) / sizeof(sections[0]))
+
+  struct spc_header header = { .magic = SPC_MAGIC, .version = SPC_VERSION,
+			       .nsections = NSECTIONS };
+  struct spc_section table[NSECTIONS];
+  struct iovec iov[2 + NSECTIONS];
+  uint64_t offset = sizeof(header) + sizeof(table);
+  size_t total_size = offset;
+  _Bool failed = 0;
+
+  iov[0] = (struct iovec) { &header, sizeof(header) };
+  iov[1] = (struct iovec) { table, sizeof(table) };
+  for (unsigned int i = 0; i < NSECTIONS; i++)
+    {
+      table[i] = (struct spc_section) { .type = sections[i].type,
+					.offset = offset,
+					.size = sections[i].size };
+      iov[2 + i] = (struct iovec) { (void *) sections[i].data, sections[i].size };
+      offset += sections[i].size;
+      total_size += sections[i].size;
+      failed |= sections[i].failed;
+    }
+
+  char tmpname[strlen(container_path) + sizeof(".XXXXXX")];
+  sprintf(tmpname, "%s.XXXXXX", container_path);
+  int fd = -1;
+  if (failed)
+    EPRINTF("malloc: %s", strerror(ENOMEM));
+  else if ((fd = mkostemp(tmpname, O_CLOEXEC)) < 0)
+    EPRINTF("cannot create %#s: %s", tmpname, strerror(errno));
+  else
+    {
+      fchmod(fd, sp_file_mode);
+      if (writev(fd, iov, 2 + NSECTIONS) != (ssize_t) total_size ||
+	  rename(tmpname, container_path))
+	{
+	  EPRINTF("cannot write %#s: %s", container_path, strerror(errno));
+	  unlink(tmpname);
+	}
+      else if (sp_debug)
+	DPRINTF("wrote %#s", container_path);
+      close(fd);
+    }
+
+  free(meta.data);
+  free(stats.data);
+  free(maps.data);
+  free(syms.data);
+  free(strs.data);
+  free(image);
+}
+
+static void __attribute__((destructor))
+container_fini (void)
+{
+  if (!container_path || owner != getpid())
+    return;
+
+  /* Include samples not flushed yet. */
+  flush_sync();
+  write_container();
+}
@@ -0,0 +1,1672 @@
+/*
+ * DWARF source lines and inlined calls for Simple Profiler tools.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The line tables (.debug_line) and DW_TAG_inlined_subroutine entries
+ * of .debug_info, DWARF 2 to 5, are flattened into a single table of
+ * address regions, each with its source line and the innermost inlined
+ * call it is part of (see struct srcmap in sptool.h).  Only what is
+ * needed for that is understood: no location lists, type units, split
+ * DWARF or dwz (.gnu_debugaltlink).
+ *
+ * Debug information is read from the ELF file itself or, if it has
+ * none, from its separate debug file (see debug_file_find in symtab.c).
+ *
+ * The table is cached as <build-id>.src next to the symbol cache.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/stat.h>
+#ifdef HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+#include "sptool.h"
+
+/* The few DWARF constants we need. */
+enum
+  {
+    DW_TAG_inlined_subroutine = 0x1d,
+    DW_TAG_subprogram = 0x2e,
+
+    DW_AT_name = 0x03,
+    DW_AT_stmt_list = 0x10,
+    DW_AT_low_pc = 0x11,
+    DW_AT_high_pc = 0x12,
+    DW_AT_comp_dir = 0x1b,
+    DW_AT_abstract_origin = 0x31,
+    DW_AT_specification = 0x47,
+    DW_AT_ranges = 0x55,
+    DW_AT_call_file = 0x58,
+    DW_AT_call_line = 0x59,
+    DW_AT_linkage_name = 0x6e,
+    DW_AT_str_offsets_base = 0x72,
+    DW_AT_addr_base = 0x73,
+    DW_AT_rnglists_base = 0x74,
+    DW_AT_MIPS_linkage_name = 0x2007,
+
+    DW_FORM_addr = 0x01,
+    DW_FORM_block2 = 0x03,
+    DW_FORM_block4 = 0x04,
+    DW_FORM_data2 = 0x05,
+    DW_FORM_data4 = 0x06,
+    DW_FORM_data8 = 0x07,
+    DW_FORM_string = 0x08,
+    DW_FORM_block = 0x09,
+    DW_FORM_block1 = 0x0a,
+    DW_FORM_data1 = 0x0b,
+    DW_FORM_flag = 0x0c,
+    DW_FORM_sdata = 0x0d,
+    DW_FORM_strp = 0x0e,
+    DW_FORM_udata = 0x0f,
+    DW_FORM_ref_addr = 0x10,
+    DW_FORM_ref1 = 0x11,
+    DW_FORM_ref2 = 0x12,
+    DW_FORM_ref4 = 0x13,
+    DW_FORM_ref8 = 0x14,
+    DW_FORM_ref_udata = 0x15,
+    DW_FORM_indirect = 0x16,
+    DW_FORM_sec_offset = 0x17,
+    DW_FORM_exprloc = 0x18,
+    DW_FORM_flag_present = 0x19,
+    DW_FORM_strx = 0x1a,
+    DW_FORM_addrx = 0x1b,
+    DW_FORM_ref_sup4 = 0x1c,
+    DW_FORM_strp_sup = 0x1d,
+    DW_FORM_data16 = 0x1e,
+    DW_FORM_line_strp = 0x1f,
+    DW_FORM_ref_sig8 = 0x20,
+    DW_FORM_implicit_const = 0x21,
+    DW_FORM_loclistx = 0x22,
+    DW_FORM_rnglistx = 0x23,
+    DW_FORM_ref_sup8 = 0x24,
+    DW_FORM_strx1 = 0x25,
+    DW_FORM_strx2 = 0x26,
+    DW_FORM_strx3 = 0x27,
+    DW_FORM_strx4 = 0x28,
+    DW_FORM_addrx1 = 0x29,
+    DW_FORM_addrx2 = 0x2a,
+    DW_FORM_addrx3 = 0x2b,
+    DW_FORM_addrx4 = 0x2c,
+    DW_FORM_GNU_addr_index = 0x1f01,
+    DW_FORM_GNU_str_index = 0x1f02,
+    DW_FORM_GNU_ref_alt = 0x1f20,
+    DW_FORM_GNU_strp_alt = 0x1f21,
+
+    DW_UT_type = 0x02,
+    DW_UT_skeleton = 0x04,
+    DW_UT_split_compile = 0x05,
+    DW_UT_split_type = 0x06,
+
+    DW_LNS_copy = 1,
+    DW_LNS_advance_pc,
+    DW_LNS_advance_line,
+    DW_LNS_set_file,
+    DW_LNS_set_column,
+    DW_LNS_negate_stmt,
+    DW_LNS_set_basic_block,
+    DW_LNS_const_add_pc,
+    DW_LNS_fixed_advance_pc,
+    DW_LNE_end_sequence = 1,
+    DW_LNE_set_address = 2,
+    DW_LNCT_path = 1,
+    DW_LNCT_directory_index = 2,
+
+    DW_RLE_end_of_list = 0,
+    DW_RLE_base_addressx,
+    DW_RLE_startx_endx,
+    DW_RLE_startx_length,
+    DW_RLE_offset_pair,
+    DW_RLE_base_address,
+    DW_RLE_start_end,
+    DW_RLE_start_length,
+  };
+
+/* Deepest DIE nesting followed. */
+#define MAX_LEVEL	256
+/* Longest chain of DW_AT_abstract_origin / DW_AT_specification followed. */
+#define MAX_ORIGINS	8
+
+struct section
+{
+  const unsigned char *data;
+  size_t size;
+};
+
+struct cursor
+{
+  const unsigned char *p, *end;
+  _Bool bad;
+};
+
+struct attrspec
+{
+  uint64_t name, form;
+  int64_t value;		/* of DW_FORM_implicit_const */
+};
+
+struct abbrev
+{
+  uint64_t code, tag;
+  _Bool children;
+  struct attrspec *attrs;
+  size_t nattrs;
+};
+
+struct abbrevs
+{
+  struct abbrev *v;
+  size_t n;
+};
+
+struct attr
+{
+  uint64_t form, value;
+  const char *str;		/* of DW_FORM_string */
+};
+
+/* Attributes of a DIE we look at; FORM is 0 for those missing. */
+struct die
+{
+  const struct abbrev *abbrev;
+  struct attr name, linkage_name, origin, low_pc, high_pc, ranges;
+  struct attr call_file, call_line, stmt_list, comp_dir;
+  struct attr str_offsets_base, addr_base, rnglists_base;
+};
+
+struct unit
+{
+  uint64_t offset, end;		/* in .debug_info */
+  const unsigned char *dies;
+  unsigned int version, addr_size, offset_size;
+  const struct abbrevs *abbrevs;
+  uint64_t base, addr_base, str_offsets_base, rnglists_base;
+  uint32_t *files;		/* by DW_AT_call_file */
+  size_t nfiles;
+};
+
+struct row
+{
+  uint64_t addr;
+  uint32_t file, line;		/* SRC_NONE file for end of sequence */
+  size_t order;
+};
+
+struct range
+{
+  uint64_t low, high;
+  uint32_t inlined, depth;
+};
+
+/* Hash from 64-bit keys (other than ~0) to 32-bit values. */
+struct hashmap
+{
+  uint64_t *keys;
+  uint32_t *values;
+  size_t size, count;
+};
+
+struct dwarf
+{
+  struct section info, abbrev, line, str, line_str, ranges, rnglists;
+  struct section addr, str_offsets;
+  void **buffers;		/* decompressed sections */
+  size_t nbuffers;
+
+  struct abbrevs **abbrevs;
+  size_t nabbrevs, abbrevs_alloc;
+  struct hashmap abbrev_ids;	/* .debug_abbrev offset to index */
+  struct unit *units;
+  size_t nunits, units_alloc;
+  struct row *rows;
+  size_t nrows, rows_alloc;
+  struct range *ranges_v;
+  size_t nranges, ranges_alloc;
+  struct src_inline *inlines;
+  uint32_t *depths;
+  size_t ninlines, inlines_alloc, depths_alloc;
+
+  char *strings;
+  size_t strsize, strings_alloc;
+  uint32_t *string_slots;	/* open hash of offsets in STRINGS */
+  size_t string_slots_size, nstrings;
+  struct hashmap names;		/* DIE offset to function name */
+};
+
+static void *
+grow (void *p, size_t *alloc, size_t n, size_t elsize)
+{
+  if (n < *alloc)
+    return p;
+  *alloc = *alloc ? *alloc * 2 : 64;
+  if (!(p = realloc(p, *alloc * elsize)))
+    error(EXIT_FAILURE, errno, "malloc");
+  return p;
+}
+
+/* Cursor primitives.  Reads past the end return 0 and set BAD. */
+
+static uint64_t
+get_u (struct cursor *c, size_t n)
+{
+  uint64_t v = 0;
+
+  if ((size_t) (c->end - c->p) < n)
+    {
+      c->bad = 1;
+      c->p = c->end;
+      return 0;
+    }
+  for (size_t i = 0; i < n; i++)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = v << 8 | c->p[i];
+#else
+    v |= (uint64_t) c->p[i] << (8 * i);
+#endif
+  c->p += n;
+  return v;
+}
+
+static uint64_t
+get_uleb (struct cursor *c)
+{
+  uint64_t v = 0;
+  unsigned int shift = 0;
+
+  while (c->p < c->end)
+    {
+      const unsigned char b = *c->p++;
+      if (shift < 64)
+	v |= (uint64_t) (b & 0x7f) << shift;
+      shift += 7;
+      if (!(b & 0x80))
+	return v;
+    }
+  c->bad = 1;
+  return 0;
+}
+
+static int64_t
+get_sleb (struct cursor *c)
+{
+  uint64_t v = 0;
+  unsigned int shift = 0;
+
+  while (c->p < c->end)
+    {
+      const unsigned char b = *c->p++;
+      if (shift < 64)
+	v |= (uint64_t) (b & 0x7f) << shift;
+      shift += 7;
+      if (!(b & 0x80))
+	{
+	  if (shift < 64 && (b & 0x40))
+	    v |= ~(uint64_t) 0 << shift;
+	  return v;
+	}
+    }
+  c->bad = 1;
+  return 0;
+}
+
+static const char *
+get_str (struct cursor *c)
+{
+  const unsigned char *const nul = memchr(c->p, '\0', c->end - c->p);
+
+  if (!nul)
+    {
+      c->bad = 1;
+      c->p = c->end;
+      return NULL;
+    }
+  const char *const s = (const char *) c->p;
+  c->p = nul + 1;
+  return s;
+}
+
+static void
+skip (struct cursor *c, uint64_t n)
+{
+  if ((uint64_t) (c->end - c->p) < n)
+    {
+      c->bad = 1;
+      c->p = c->end;
+    }
+  else
+    c->p += n;
+}
+
+/* Reads an initial length field, setting *OFFSET_SIZE to 4 or 8. */
+static uint64_t
+get_length (struct cursor *c, unsigned int *offset_size)
+{
+  uint64_t len = get_u(c, 4);
+
+  *offset_size = 4;
+  if (len == 0xffffffff)
+    {
+      len = get_u(c, 8);
+      *offset_size = 8;
+    }
+  if (len > (uint64_t) (c->end - c->p))
+    c->bad = 1;
+  return len;
+}
+
+/* A cursor at OFFSET of SEC, or an empty bad one. */
+static struct cursor
+section_at (const struct section *sec, uint64_t offset)
+{
+  struct cursor c = { sec->data + sec->size, sec->data + sec->size, 1 };
+
+  if (sec->data && offset < sec->size)
+    c = (struct cursor) { sec->data + offset, sec->data + sec->size, 0 };
+  return c;
+}
+
+static const char *
+section_string (const struct section *sec, uint64_t offset)
+{
+  struct cursor c = section_at(sec, offset);
+  return c.bad ? NULL : get_str(&c);
+}
+
+static size_t
+hash_index (const struct hashmap *map, uint64_t key)
+{
+  return (key * 0x9e3779b97f4a7c15ULL >> 20) & (map->size - 1);
+}
+
+/* Returns the slot of KEY, which is ~0 in KEYS if it is missing. */
+static size_t
+hash_find (const struct hashmap *map, uint64_t key)
+{
+  size_t i = hash_index(map, key);
+
+  while (map->keys[i] != key && map->keys[i] != ~(uint64_t) 0)
+    i = (i + 1) & (map->size - 1);
+  return i;
+}
+
+static void
+hash_put (struct hashmap *map, uint64_t key, uint32_t value)
+{
+  if (2 * (map->count + 1) > map->size)
+    {
+      struct hashmap bigger = { NULL, NULL, map->size ? map->size * 2 : 1024, 0 };
+      if (!(bigger.keys = malloc(bigger.size * sizeof(*bigger.keys))) ||
+	  !(bigger.values = malloc(bigger.size * sizeof(*bigger.values))))
+	error(EXIT_FAILURE, errno, "malloc");
+      memset(bigger.keys, 0xff, bigger.size * sizeof(*bigger.keys));
+      for (size_t i = 0; i < map->size; i++)
+	if (map->keys[i] != ~(uint64_t) 0)
+	  hash_put(&bigger, map->keys[i], map->values[i]);
+      free(map->keys);
+      free(map->values);
+      *map = bigger;
+    }
+
+  const size_t i = hash_find(map, key);
+  if (map->keys[i] == ~(uint64_t) 0)
+    map->count++;
+  map->keys[i] = key;
+  map->values[i] = value;
+}
+
+static _Bool
+hash_get (const struct hashmap *map, uint64_t key, uint32_t *value)
+{
+  if (!map->size)
+    return 0;
+  const size_t i = hash_find(map, key);
+  if (map->keys[i] == ~(uint64_t) 0)
+    return 0;
+  *value = map->values[i];
+  return 1;
+}
+
+static size_t
+string_hash (const char *s)
+{
+  uint64_t h = 14695981039346656037ULL;
+  for (; *s; s++)
+    h = (h ^ (unsigned char) *s) * 1099511628211ULL;
+  return h;
+}
+
+/* Returns the offset of S in the string pool, adding it if new. */
+static uint32_t
+intern (struct dwarf *d, const char *s)
+{
+  if (2 * (d->nstrings + 1) > d->string_slots_size)
+    {
+      const size_t size = d->string_slots_size ? d->string_slots_size * 2 : 4096;
+      uint32_t *const slots = malloc(size * sizeof(*slots));
+      if (!slots)
+	error(EXIT_FAILURE, errno, "malloc");
+      memset(slots, 0xff, size * sizeof(*slots));
+      for (size_t i = 0; i < d->string_slots_size; i++)
+	{
+	  const uint32_t offset = d->string_slots[i];
+	  if (offset == SRC_NONE)
+	    continue;
+	  size_t j = string_hash(d->strings + offset) & (size - 1);
+	  while (slots[j] != SRC_NONE)
+	    j = (j + 1) & (size - 1);
+	  slots[j] = offset;
+	}
+      free(d->string_slots);
+      d->string_slots = slots;
+      d->string_slots_size = size;
+    }
+
+  size_t i = string_hash(s) & (d->string_slots_size - 1);
+  for (; d->string_slots[i] != SRC_NONE; i = (i + 1) & (d->string_slots_size - 1))
+    if (!strcmp(d->strings + d->string_slots[i], s))
+      return d->string_slots[i];
+
+  const size_t len = strlen(s) + 1;
+  if (d->strsize + len >= SRC_NONE)
+    error(EXIT_FAILURE, 0, "too many strings in debug information");
+  while (d->strsize + len > d->strings_alloc)
+    d->strings = grow(d->strings, &d->strings_alloc, d->strings_alloc, 1);
+  const uint32_t offset = d->strsize;
+  memcpy(d->strings + offset, s, len);
+  d->strsize += len;
+  d->string_slots[i] = offset;
+  d->nstrings++;
+  return offset;
+}
+
+static const struct abbrevs *
+get_abbrevs (struct dwarf *d, uint64_t offset)
+{
+  uint32_t index;
+  if (hash_get(&d->abbrev_ids, offset, &index))
+    return d->abbrevs[index];
+
+  struct abbrevs *const a = calloc(1, sizeof(*a));
+  if (!a)
+    error(EXIT_FAILURE, errno, "malloc");
+  d->abbrevs = grow(d->abbrevs, &d->abbrevs_alloc, d->nabbrevs, sizeof(*d->abbrevs));
+  hash_put(&d->abbrev_ids, offset, d->nabbrevs);
+  d->abbrevs[d->nabbrevs++] = a;
+
+  struct cursor c = section_at(&d->abbrev, offset);
+  size_t alloc = 0;
+  for (;;)
+    {
+      const uint64_t code = get_uleb(&c);
+      if (c.bad || code == 0)
+	break;
+      a->v = grow(a->v, &alloc, a->n, sizeof(*a->v));
+      struct abbrev *const ab = &a->v[a->n++];
+      ab->code = code;
+      ab->tag = get_uleb(&c);
+      ab->children = get_u(&c, 1);
+      ab->attrs = NULL;
+      ab->nattrs = 0;
+
+      size_t attrs_alloc = 0;
+      for (;;)
+	{
+	  const uint64_t name = get_uleb(&c), form = get_uleb(&c);
+	  if (c.bad || (name == 0 && form == 0))
+	    break;
+	  ab->attrs = grow(ab->attrs, &attrs_alloc, ab->nattrs, sizeof(*ab->attrs));
+	  ab->attrs[ab->nattrs].name = name;
+	  ab->attrs[ab->nattrs].form = form;
+	  ab->attrs[ab->nattrs].value = (form == DW_FORM_implicit_const
+					 ? get_sleb(&c) : 0);
+	  ab->nattrs++;
+	}
+    }
+  return a;
+}
+
+static const struct abbrev *
+find_abbrev (const struct abbrevs *a, uint64_t code)
+{
+  /* Codes are usually 1, 2, 3, ... in order. */
+  if (code - 1 < a->n && a->v[code - 1].code == code)
+    return &a->v[code - 1];
+  for (size_t i = 0; i < a->n; i++)
+    if (a->v[i].code == code)
+      return &a->v[i];
+  return NULL;
+}
+
+/* Reads a value of FORM.  Returns 0 if it cannot be read or skipped. */
+static _Bool
+read_attr (struct cursor *c, const struct unit *u, uint64_t form,
+	   int64_t implicit, struct attr *a)
+{
+  a->form = form;
+  a->value = 0;
+  a->str = NULL;
+  switch (form)
+    {
+    case DW_FORM_addr:
+      a->value = get_u(c, u->addr_size);
+      break;
+    case DW_FORM_data1: case DW_FORM_ref1: case DW_FORM_flag:
+    case DW_FORM_strx1: case DW_FORM_addrx1:
+      a->value = get_u(c, 1);
+      break;
+    case DW_FORM_data2: case DW_FORM_ref2:
+    case DW_FORM_strx2: case DW_FORM_addrx2:
+      a->value = get_u(c, 2);
+      break;
+    case DW_FORM_strx3: case DW_FORM_addrx3:
+      a->value = get_u(c, 3);
+      break;
+    case DW_FORM_data4: case DW_FORM_ref4: case DW_FORM_ref_sup4:
+    case DW_FORM_strx4: case DW_FORM_addrx4:
+      a->value = get_u(c, 4);
+      break;
+    case DW_FORM_data8: case DW_FORM_ref8: case DW_FORM_ref_sig8:
+    case DW_FORM_ref_sup8:
+      a->value = get_u(c, 8);
+      break;
+    case DW_FORM_data16:
+      skip(c, 16);
+      break;
+    case DW_FORM_sdata:
+      a->value = get_sleb(c);
+      break;
+    case DW_FORM_udata: case DW_FORM_ref_udata:
+    case DW_FORM_strx: case DW_FORM_addrx:
+    case DW_FORM_loclistx: case DW_FORM_rnglistx:
+    case DW_FORM_GNU_addr_index: case DW_FORM_GNU_str_index:
+      a->value = get_uleb(c);
+      break;
+    case DW_FORM_strp: case DW_FORM_line_strp: case DW_FORM_sec_offset:
+    case DW_FORM_strp_sup: case DW_FORM_GNU_ref_alt: case DW_FORM_GNU_strp_alt:
+      a->value = get_u(c, u->offset_size);
+      break;
+    case DW_FORM_ref_addr:
+      a->value = get_u(c, u->version <= 2 ? u->addr_size : u->offset_size);
+      break;
+    case DW_FORM_string:
+      a->str = get_str(c);
+      break;
+    case DW_FORM_block1:
+      skip(c, get_u(c, 1));
+      break;
+    case DW_FORM_block2:
+      skip(c, get_u(c, 2));
+      break;
+    case DW_FORM_block4:
+      skip(c, get_u(c, 4));
+      break;
+    case DW_FORM_block: case DW_FORM_exprloc:
+      skip(c, get_uleb(c));
+      break;
+    case DW_FORM_flag_present:
+      a->value = 1;
+      break;
+    case DW_FORM_implicit_const:
+      a->value = implicit;
+      break;
+    case DW_FORM_indirect:
+      return read_attr(c, u, get_uleb(c), implicit, a);
+    default:
+      return 0;
+    }
+  return !c->bad;
+}
+
+/* Reads the DIE at C.  Returns 0 at a null entry or on error (with BAD). */
+static _Bool
+read_die (struct cursor *c, const struct unit *u, struct die *die)
+{
+  memset(die, 0, sizeof(*die));
+
+  const uint64_t code = get_uleb(c);
+  if (c->bad || code == 0)
+    return 0;
+  if (!(die->abbrev = find_abbrev(u->abbrevs, code)))
+    {
+      c->bad = 1;
+      return 0;
+    }
+
+  for (size_t i = 0; i < die->abbrev->nattrs; i++)
+    {
+      const struct attrspec *const spec = &die->abbrev->attrs[i];
+      struct attr a;
+
+      if (!read_attr(c, u, spec->form, spec->value, &a))
+	{
+	  c->bad = 1;
+	  return 0;
+	}
+      switch (spec->name)
+	{
+	case DW_AT_name: die->name = a; break;
+	case DW_AT_linkage_name:
+	case DW_AT_MIPS_linkage_name: die->linkage_name = a; break;
+	case DW_AT_abstract_origin:
+	case DW_AT_specification: die->origin = a; break;
+	case DW_AT_low_pc: die->low_pc = a; break;
+	case DW_AT_high_pc: die->high_pc = a; break;
+	case DW_AT_ranges: die->ranges = a; break;
+	case DW_AT_call_file: die->call_file = a; break;
+	case DW_AT_call_line: die->call_line = a; break;
+	case DW_AT_stmt_list: die->stmt_list = a; break;
+	case DW_AT_comp_dir: die->comp_dir = a; break;
+	case DW_AT_str_offsets_base: die->str_offsets_base = a; break;
+	case DW_AT_addr_base: die->addr_base = a; break;
+	case DW_AT_rnglists_base: die->rnglists_base = a; break;
+	}
+    }
+  return 1;
+}
+
+static const char *
+attr_string (const struct dwarf *d, const struct unit *u, const struct attr *a)
+{
+  switch (a->form)
+    {
+    case DW_FORM_string:
+      return a->str;
+    case DW_FORM_strp:
+      return section_string(&d->str, a->value);
+    case DW_FORM_line_strp:
+      return section_string(&d->line_str, a->value);
+    case DW_FORM_strx: case DW_FORM_strx1: case DW_FORM_strx2:
+    case DW_FORM_strx3: case DW_FORM_strx4: case DW_FORM_GNU_str_index:
+      {
+	struct cursor c = section_at(&d->str_offsets,
+				     u->str_offsets_base + a->value * u->offset_size);
+	const uint64_t offset = get_u(&c, u->offset_size);
+	return c.bad ? NULL : section_string(&d->str, offset);
+      }
+    }
+  return NULL;
+}
+
+/* Address of the .debug_addr entry INDEX. */
+static uint64_t
+indexed_addr (const struct dwarf *d, const struct unit *u, uint64_t index)
+{
+  struct cursor c = section_at(&d->addr, u->addr_base + index * u->addr_size);
+  return get_u(&c, u->addr_size);
+}
+
+static _Bool
+is_addr_form (uint64_t form)
+{
+  switch (form)
+    {
+    case DW_FORM_addr:
+    case DW_FORM_addrx: case DW_FORM_addrx1: case DW_FORM_addrx2:
+    case DW_FORM_addrx3: case DW_FORM_addrx4: case DW_FORM_GNU_addr_index:
+      return 1;
+    }
+  return 0;
+}
+
+static uint64_t
+attr_addr (const struct dwarf *d, const struct unit *u, const struct attr *a)
+{
+  switch (a->form)
+    {
+    case DW_FORM_addrx: case DW_FORM_addrx1: case DW_FORM_addrx2:
+    case DW_FORM_addrx3: case DW_FORM_addrx4: case DW_FORM_GNU_addr_index:
+      return indexed_addr(d, u, a->value);
+    }
+  return a->value;
+}
+
+/* Offset in .debug_info of the DIE referred to, or ~0. */
+static uint64_t
+attr_ref (const struct unit *u, const struct attr *a)
+{
+  switch (a->form)
+    {
+    case DW_FORM_ref1: case DW_FORM_ref2: case DW_FORM_ref4:
+    case DW_FORM_ref8: case DW_FORM_ref_udata:
+      return u->offset + a->value;
+    case DW_FORM_ref_addr:
+      return a->value;
+    }
+  return ~(uint64_t) 0;
+}
+
+static const struct unit *
+find_unit (const struct dwarf *d, uint64_t offset)
+{
+  size_t lo = 0, hi = d->nunits;
+
+  while (lo < hi)
+    {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (d->units[mid].end <= offset)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo < d->nunits && d->units[lo].offset <= offset ? &d->units[lo] : NULL;
+}
+
+/*
+ * Name of the function whose DIE is at OFFSET, preferring the linkage
+ * name, which sp-report demangles.  Abstract instances of inlined
+ * functions often have only DW_AT_specification to the declaration in
+ * the class, so references are followed up to LIMIT times.
+ */
+static uint32_t
+die_name (struct dwarf *d, uint64_t offset, int limit)
+{
+  uint32_t name;
+  if (hash_get(&d->names, offset, &name))
+    return name;
+
+  const struct unit *const u = find_unit(d, offset);
+  if (!u || limit == 0)
+    return SRC_NONE;
+
+  struct cursor c = { d->info.data + offset, d->info.data + u->end, 0 };
+  struct die die;
+  name = SRC_NONE;
+  if (read_die(&c, u, &die))
+    {
+      const char *s;
+      if ((s = attr_string(d, u, &die.linkage_name)) != NULL)
+	name = intern(d, s);
+      else if (die.origin.form &&
+	       (name = die_name(d, attr_ref(u, &die.origin), limit - 1)) != SRC_NONE)
+	;
+      else if ((s = attr_string(d, u, &die.name)) != NULL)
+	name = intern(d, s);
+    }
+  hash_put(&d->names, offset, name);
+  return name;
+}
+
+static void
+add_range (struct dwarf *d, uint64_t low, uint64_t high, uint32_t inlined)
+{
+  /* Code discarded by the linker is left at 0. */
+  if (low == 0 || high <= low)
+    return;
+  d->ranges_v = grow(d->ranges_v, &d->ranges_alloc, d->nranges, sizeof(*d->ranges_v));
+  d->ranges_v[d->nranges++] = (struct range) { low, high, inlined, d->depths[inlined] };
+}
+
+/* Adds the ranges of DW_AT_ranges A of an inlined call. */
+static void
+add_ranges (struct dwarf *d, const struct unit *u, const struct attr *a,
+	    uint32_t inlined)
+{
+  uint64_t base = u->base;
+
+  if (u->version < 5)
+    {
+      struct cursor c = section_at(&d->ranges, a->value);
+      const uint64_t max = u->addr_size == 8 ? ~(uint64_t) 0 : 0xffffffff;
+      for (;;)
+	{
+	  const uint64_t start = get_u(&c, u->addr_size);
+	  const uint64_t end = get_u(&c, u->addr_size);
+	  if (c.bad || (start == 0 && end == 0))
+	    break;
+	  if (start == max)
+	    base = end;
+	  else
+	    add_range(d, base + start, base + end, inlined);
+	}
+      return;
+    }
+
+  uint64_t offset = a->value;
+  if (a->form == DW_FORM_rnglistx)
+    {
+      struct cursor c = section_at(&d->rnglists,
+				   u->rnglists_base + a->value * u->offset_size);
+      offset = u->rnglists_base + get_u(&c, u->offset_size);
+      if (c.bad)
+	return;
+    }
+  struct cursor c = section_at(&d->rnglists, offset);
+  while (!c.bad)
+    {
+      uint64_t start, end;
+      switch (get_u(&c, 1))
+	{
+	case DW_RLE_base_addressx:
+	  base = indexed_addr(d, u, get_uleb(&c));
+	  continue;
+	case DW_RLE_startx_endx:
+	  start = indexed_addr(d, u, get_uleb(&c));
+	  end = indexed_addr(d, u, get_uleb(&c));
+	  break;
+	case DW_RLE_startx_length:
+	  start = indexed_addr(d, u, get_uleb(&c));
+	  end = start + get_uleb(&c);
+	  break;
+	case DW_RLE_offset_pair:
+	  start = base + get_uleb(&c);
+	  end = base + get_uleb(&c);
+	  break;
+	case DW_RLE_base_address:
+	  base = get_u(&c, u->addr_size);
+	  continue;
+	case DW_RLE_start_end:
+	  start = get_u(&c, u->addr_size);
+	  end = get_u(&c, u->addr_size);
+	  break;
+	case DW_RLE_start_length:
+	  start = get_u(&c, u->addr_size);
+	  end = start + get_uleb(&c);
+	  break;
+	default:		/* DW_RLE_end_of_list */
+	  return;
+	}
+      if (!c.bad)
+	add_range(d, start, end, inlined);
+    }
+}
+
+static uint32_t
+file_name (struct dwarf *d, const char *dir, const char *name)
+{
+  if (!name)
+    return SRC_NONE;
+  if (name[0] == '/' || !dir || !*dir)
+    return intern(d, name);
+
+  char *path;
+  if (asprintf(&path, "%s/%s", dir, name) < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  const uint32_t id = intern(d, path);
+  free(path);
+  return id;
+}
+
+struct entry
+{
+  const char *path;
+  uint64_t dir;
+};
+
+/* Reads a DWARF 5 directory or file name table. */
+static struct entry *
+read_entries (struct dwarf *d, struct cursor *c, const struct unit *u,
+	      size_t *count)
+{
+  const unsigned int nformats = get_u(c, 1);
+  uint64_t formats[2 * 256];
+  for (unsigned int i = 0; i < nformats; i++)
+    {
+      formats[2 * i] = get_uleb(c);
+      formats[2 * i + 1] = get_uleb(c);
+    }
+
+  const uint64_t n = get_uleb(c);
+  if (c->bad || n > (uint64_t) (c->end - c->p))
+    {
+      c->bad = 1;
+      return NULL;
+    }
+  struct entry *const entries = calloc(n + 1, sizeof(*entries));
+  if (!entries)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (uint64_t i = 0; i < n && !c->bad; i++)
+    for (unsigned int j = 0; j < nformats; j++)
+      {
+	struct attr a;
+	if (!read_attr(c, u, formats[2 * j + 1], 0, &a))
+	  {
+	    c->bad = 1;
+	    break;
+	  }
+	if (formats[2 * j] == DW_LNCT_path)
+	  entries[i].path = attr_string(d, u, &a);
+	else if (formats[2 * j] == DW_LNCT_directory_index)
+	  entries[i].dir = a.value;
+      }
+  *count = n;
+  return entries;
+}
+
+/* Reads the line number program at OFFSET for the unit U. */
+static void
+read_lines (struct dwarf *d, struct unit *u, uint64_t offset, const char *comp_dir)
+{
+  struct cursor c = section_at(&d->line, offset);
+  unsigned int offset_size;
+  const uint64_t len = get_length(&c, &offset_size);
+  if (c.bad)
+    return;
+  c.end = c.p + len;
+
+  const unsigned int version = get_u(&c, 2);
+  if (version < 2 || version > 5)
+    return;
+  struct unit lu = *u;		/* for forms, with sizes of this table */
+  lu.offset_size = offset_size;
+  if (version >= 5)
+    {
+      lu.addr_size = get_u(&c, 1);
+      get_u(&c, 1);		/* segment selector size */
+    }
+  const uint64_t header_length = get_u(&c, offset_size);
+  if (c.bad || header_length > (uint64_t) (c.end - c.p))
+    return;
+  const unsigned char *const program = c.p + header_length;
+  const unsigned int min_insn = get_u(&c, 1);
+  if (version >= 4)
+    get_u(&c, 1);		/* maximum operations per instruction */
+  get_u(&c, 1);			/* default is_stmt */
+  const int line_base = (signed char) get_u(&c, 1);
+  const unsigned int line_range = get_u(&c, 1);
+  const unsigned int opcode_base = get_u(&c, 1);
+  const unsigned char *const lengths = c.p;
+  skip(&c, opcode_base ? opcode_base - 1 : 0);
+  if (c.bad || line_range == 0)
+    return;
+
+  /* Paths of files by index; 0 is the primary file in DWARF 5, and
+     unused before. */
+  size_t nfiles = 0, files_alloc = 0;
+  uint32_t *files = NULL;
+  if (version >= 5)
+    {
+      size_t ndirs, n;
+      struct entry *const dirs = read_entries(d, &c, &lu, &ndirs);
+      struct entry *const names = dirs ? read_entries(d, &c, &lu, &n) : NULL;
+      if (names)
+	{
+	  if (!(files = malloc((n + 1) * sizeof(*files))))
+	    error(EXIT_FAILURE, errno, "malloc");
+	  for (size_t i = 0; i < n; i++)
+	    files[i] = file_name(d, (names[i].dir < ndirs
+				     ? dirs[names[i].dir].path : NULL),
+				 names[i].path);
+	  nfiles = n;
+	}
+      free(names);
+      free(dirs);
+    }
+  else
+    {
+      const char **dirs = NULL;
+      size_t ndirs = 1, dirs_alloc = 0;
+      const char *s;
+
+      dirs = grow(dirs, &dirs_alloc, 0, sizeof(*dirs));
+      dirs[0] = comp_dir;
+      while ((s = get_str(&c)) != NULL && *s)
+	{
+	  dirs = grow(dirs, &dirs_alloc, ndirs, sizeof(*dirs));
+	  dirs[ndirs++] = s;
+	}
+      files = grow(files, &files_alloc, 0, sizeof(*files));
+      files[nfiles++] = SRC_NONE;
+      while ((s = get_str(&c)) != NULL && *s)
+	{
+	  const uint64_t dir = get_uleb(&c);
+	  get_uleb(&c);		/* modification time */
+	  get_uleb(&c);		/* length */
+	  files = grow(files, &files_alloc, nfiles, sizeof(*files));
+	  files[nfiles++] = file_name(d, dir < ndirs ? dirs[dir] : NULL, s);
+	}
+      free(dirs);
+    }
+  free(u->files);
+  u->files = files;
+  u->nfiles = nfiles;
+  if (c.bad || program > c.end)
+    return;
+
+  /* Run the state machine.  Sequences at 0 are of discarded code. */
+  c.p = program;
+  uint64_t addr = 0, file = 1, line = 1;
+  size_t sequence = d->nrows;
+  _Bool at_zero = 0;
+  while (c.p < c.end && !c.bad)
+    {
+      const unsigned int op = get_u(&c, 1);
+      _Bool emit = 0, end = 0;
+
+      if (op >= opcode_base)
+	{
+	  const unsigned int adj = op - opcode_base;
+	  addr += (uint64_t) (adj / line_range) * min_insn;
+	  line += line_base + (int) (adj % line_range);
+	  emit = 1;
+	}
+      else
+	switch (op)
+	  {
+	  case 0:
+	    {
+	      const uint64_t n = get_uleb(&c);
+	      if (n == 0 || n > (uint64_t) (c.end - c.p))
+		{
+		  c.bad = 1;
+		  break;
+		}
+	      const unsigned char *const next = c.p + n;
+	      switch (get_u(&c, 1))
+		{
+		case DW_LNE_end_sequence:
+		  emit = end = 1;
+		  break;
+		case DW_LNE_set_address:
+		  addr = get_u(&c, n - 1);
+		  break;
+		}
+	      c.p = next;
+	    }
+	    break;
+	  case DW_LNS_copy:
+	    emit = 1;
+	    break;
+	  case DW_LNS_advance_pc:
+	    addr += get_uleb(&c) * min_insn;
+	    break;
+	  case DW_LNS_advance_line:
+	    line += get_sleb(&c);
+	    break;
+	  case DW_LNS_set_file:
+	    file = get_uleb(&c);
+	    break;
+	  case DW_LNS_const_add_pc:
+	    addr += (uint64_t) ((255 - opcode_base) / line_range) * min_insn;
+	    break;
+	  case DW_LNS_fixed_advance_pc:
+	    addr += get_u(&c, 2);
+	    break;
+	  default:
+	    for (unsigned int i = 0; i < lengths[op - 1]; i++)
+	      get_uleb(&c);
+	    break;
+	  }
+
+      if (!emit)
+	continue;
+      if (d->nrows == sequence)
+	at_zero = addr == 0;
+      d->rows = grow(d->rows, &d->rows_alloc, d->nrows, sizeof(*d->rows));
+      d->rows[d->nrows] = (struct row) {
+	addr,
+	end || file >= nfiles || line == 0 ? SRC_NONE : files[file],
+	line, d->nrows };
+      d->nrows++;
+      if (end)
+	{
+	  if (at_zero)
+	    d->nrows = sequence;
+	  sequence = d->nrows;
+	  addr = 0;
+	  file = line = 1;
+	}
+    }
+  if (d->nrows > sequence && at_zero)
+    d->nrows = sequence;
+}
+
+static void
+read_unit_dies (struct dwarf *d, const struct unit *u)
+{
+  struct cursor c = { u->dies, d->info.data + u->end, 0 };
+  uint32_t parents[MAX_LEVEL];	/* innermost inlined call, by level */
+  unsigned int level = 0;
+  struct die die;
+
+  parents[0] = SRC_NONE;
+  while (c.p < c.end)
+    {
+      if (!read_die(&c, u, &die))
+	{
+	  if (c.bad)
+	    break;
+	  if (level > 0)
+	    level--;
+	  continue;
+	}
+
+      uint32_t parent = parents[level];
+      if (die.abbrev->tag == DW_TAG_subprogram)
+	parent = SRC_NONE;
+      else if (die.abbrev->tag == DW_TAG_inlined_subroutine)
+	{
+	  const uint32_t i = d->ninlines;
+	  const uint64_t call_file = die.call_file.value;
+
+	  if (i == SRC_NONE)
+	    break;
+	  d->inlines = grow(d->inlines, &d->inlines_alloc, d->ninlines,
+			    sizeof(*d->inlines));
+	  d->depths = grow(d->depths, &d->depths_alloc, d->ninlines,
+			   sizeof(*d->depths));
+	  d->inlines[i].parent = parent;
+	  d->inlines[i].name = (die.origin.form
+				? die_name(d, attr_ref(u, &die.origin), MAX_ORIGINS)
+				: SRC_NONE);
+	  d->inlines[i].call_file = (die.call_file.form && call_file < u->nfiles
+				     ? u->files[call_file] : SRC_NONE);
+	  d->inlines[i].call_line = die.call_line.value;
+	  d->depths[i] = parent == SRC_NONE ? 1 : d->depths[parent] + 1;
+	  d->ninlines++;
+
+	  if (die.ranges.form)
+	    add_ranges(d, u, &die.ranges, i);
+	  else if (die.low_pc.form && die.high_pc.form)
+	    {
+	      const uint64_t low = attr_addr(d, u, &die.low_pc);
+	      /* DW_AT_high_pc of a constant class is the size. */
+	      const uint64_t high = (is_addr_form(die.high_pc.form)
+				     ? attr_addr(d, u, &die.high_pc)
+				     : low + die.high_pc.value);
+	      add_range(d, low, high, i);
+	    }
+	  parent = i;
+	}
+
+      if (die.abbrev->children)
+	{
+	  if (level + 1 >= MAX_LEVEL)
+	    break;
+	  parents[++level] = parent;
+	}
+    }
+}
+
+/* Reads unit headers, the first DIE of each, and their line tables. */
+static void
+read_units (struct dwarf *d)
+{
+  struct cursor c = section_at(&d->info, 0);
+
+  while (c.p < c.end && !c.bad)
+    {
+      struct unit u;
+      memset(&u, 0, sizeof(u));
+      u.offset = c.p - d->info.data;
+      const uint64_t len = get_length(&c, &u.offset_size);
+      if (c.bad)
+	break;
+      const unsigned char *const end = c.p + len;
+      u.end = end - d->info.data;
+
+      uint64_t abbrev_offset;
+      unsigned int type = 0;
+      u.version = get_u(&c, 2);
+      if (u.version >= 5)
+	{
+	  type = get_u(&c, 1);
+	  u.addr_size = get_u(&c, 1);
+	  abbrev_offset = get_u(&c, u.offset_size);
+	  if (type == DW_UT_skeleton || type == DW_UT_split_compile)
+	    get_u(&c, 8);
+	}
+      else
+	{
+	  abbrev_offset = get_u(&c, u.offset_size);
+	  u.addr_size = get_u(&c, 1);
+	}
+      if (c.bad || u.version < 2 || u.version > 5 ||
+	  type == DW_UT_type || type == DW_UT_split_type ||
+	  (u.addr_size != 4 && u.addr_size != 8))
+	{
+	  c.p = end;
+	  continue;
+	}
+      u.dies = c.p;
+      u.abbrevs = get_abbrevs(d, abbrev_offset);
+
+      struct cursor dc = { u.dies, end, 0 };
+      struct die die;
+      if (read_die(&dc, &u, &die))
+	{
+	  u.str_offsets_base = die.str_offsets_base.value;
+	  u.addr_base = die.addr_base.value;
+	  u.rnglists_base = die.rnglists_base.value;
+	  u.base = die.low_pc.form ? attr_addr(d, &u, &die.low_pc) : 0;
+	  if (die.stmt_list.form)
+	    read_lines(d, &u, die.stmt_list.value, attr_string(d, &u, &die.comp_dir));
+	}
+
+      d->units = grow(d->units, &d->units_alloc, d->nunits, sizeof(*d->units));
+      d->units[d->nunits++] = u;
+      c.p = end;
+    }
+}
+
+static int
+compare_rows (const void *a, const void *b)
+{
+  const struct row *const x = a, *const y = b;
+
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  /* Ends of sequences first, so that a sequence starting there wins. */
+  if ((x->file == SRC_NONE) != (y->file == SRC_NONE))
+    return x->file == SRC_NONE ? -1 : 1;
+  return (x->order > y->order) - (x->order < y->order);
+}
+
+static int
+compare_ranges (const void *a, const void *b)
+{
+  const struct range *const x = a, *const y = b;
+  return (x->low > y->low) - (x->low < y->low);
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Whether range A is inside range B, or deeper. */
+static _Bool
+range_inner (const struct range *a, const struct range *b)
+{
+  return a->depth != b->depth ? a->depth > b->depth : a->low > b->low;
+}
+
+/* Merges rows and ranges into regions of MAP. */
+static void
+build_regions (struct dwarf *d, struct srcmap *map)
+{
+  qsort(d->rows, d->nrows, sizeof(*d->rows), compare_rows);
+  qsort(d->ranges_v, d->nranges, sizeof(*d->ranges_v), compare_ranges);
+
+  /* Of rows at the same address, the last one holds. */
+  size_t nrows = 0;
+  for (size_t i = 0; i < d->nrows; i++)
+    {
+      if (nrows && d->rows[nrows - 1].addr == d->rows[i].addr)
+	nrows--;
+      d->rows[nrows++] = d->rows[i];
+    }
+
+  const size_t nbounds = nrows + 2 * d->nranges;
+  uint64_t *const bounds = malloc((nbounds + 1) * sizeof(*bounds));
+  const struct range **const heap = malloc((d->nranges + 1) * sizeof(*heap));
+  if (!bounds || !heap)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (size_t i = 0; i < nrows; i++)
+    bounds[i] = d->rows[i].addr;
+  for (size_t i = 0; i < d->nranges; i++)
+    {
+      bounds[nrows + 2 * i] = d->ranges_v[i].low;
+      bounds[nrows + 2 * i + 1] = d->ranges_v[i].high;
+    }
+  qsort(bounds, nbounds, sizeof(*bounds), compare_u64);
+
+  /* Sweep, keeping ranges begun in a heap with the innermost on top;
+     those ended are removed only when on top. */
+  size_t alloc = 0, row = 0, range = 0, nheap = 0;
+  for (size_t b = 0; b < nbounds; b++)
+    {
+      const uint64_t addr = bounds[b];
+      if (b > 0 && addr == bounds[b - 1])
+	continue;
+
+      while (row < nrows && d->rows[row].addr <= addr)
+	row++;
+      for (; range < d->nranges && d->ranges_v[range].low <= addr; range++)
+	{
+	  size_t i = nheap++;
+	  for (; i > 0 && range_inner(&d->ranges_v[range], heap[(i - 1) / 2]);
+	       i = (i - 1) / 2)
+	    heap[i] = heap[(i - 1) / 2];
+	  heap[i] = &d->ranges_v[range];
+	}
+      while (nheap > 0 && heap[0]->high <= addr)
+	{
+	  const struct range *const last = heap[--nheap];
+	  size_t i = 0;
+	  for (;;)
+	    {
+	      size_t child = 2 * i + 1;
+	      if (child >= nheap)
+		break;
+	      if (child + 1 < nheap && range_inner(heap[child + 1], heap[child]))
+		child++;
+	      if (!range_inner(heap[child], last))
+		break;
+	      heap[i] = heap[child];
+	      i = child;
+	    }
+	  heap[i] = last;
+	}
+
+      struct src_region r = { .addr = addr, .file = SRC_NONE, .inlined = SRC_NONE };
+      if (row > 0 && d->rows[row - 1].file != SRC_NONE)
+	{
+	  r.file = d->rows[row - 1].file;
+	  r.line = d->rows[row - 1].line;
+	}
+      if (nheap > 0)
+	r.inlined = heap[0]->inlined;
+
+      const struct src_region *const prev = (map->nregions
+					     ? &map->regions[map->nregions - 1] : NULL);
+      if (prev ? (prev->file == r.file && prev->line == r.line &&
+		  prev->inlined == r.inlined)
+	  : (r.file == SRC_NONE && r.inlined == SRC_NONE))
+	continue;
+      map->regions = grow(map->regions, &alloc, map->nregions, sizeof(*map->regions));
+      map->regions[map->nregions++] = r;
+    }
+  free(bounds);
+  free(heap);
+}
+
+static void
+dwarf_free (struct dwarf *d)
+{
+  for (size_t i = 0; i < d->nabbrevs; i++)
+    {
+      for (size_t j = 0; j < d->abbrevs[i]->n; j++)
+	free(d->abbrevs[i]->v[j].attrs);
+      free(d->abbrevs[i]->v);
+      free(d->abbrevs[i]);
+    }
+  free(d->abbrevs);
+  free(d->abbrev_ids.keys);
+  free(d->abbrev_ids.values);
+  for (size_t i = 0; i < d->nunits; i++)
+    free(d->units[i].files);
+  for (size_t i = 0; i < d->nbuffers; i++)
+    free(d->buffers[i]);
+  free(d->buffers);
+  free(d->units);
+  free(d->rows);
+  free(d->ranges_v);
+  free(d->depths);
+  free(d->string_slots);
+  free(d->names.keys);
+  free(d->names.values);
+}
+
+/* Sets SEC to the contents of NAME, decompressing it if need be. */
+static void
+load_section (struct dwarf *d, const struct elf *elf, const char *name,
+	      struct section *sec)
+{
+  const ElfW(Shdr) *const s = elf_section(elf, name);
+  if (!s)
+    return;
+  const unsigned char *const data = (const unsigned char *) elf->image + s->sh_offset;
+  if (!(s->sh_flags & SHF_COMPRESSED))
+    {
+      sec->data = data;
+      sec->size = s->sh_size;
+      return;
+    }
+
+#ifdef HAVE_ZLIB_H
+  const ElfW(Chdr) *const chdr = (const ElfW(Chdr) *) data;
+  uLongf size;
+  unsigned char *buf;
+  if (s->sh_size < sizeof(*chdr) || chdr->ch_type != ELFCOMPRESS_ZLIB ||
+      (size = chdr->ch_size) != chdr->ch_size ||
+      !(buf = malloc(size + 1)))
+    return;
+  if (uncompress(buf, &size, data + sizeof(*chdr), s->sh_size - sizeof(*chdr)) != Z_OK)
+    {
+      free(buf);
+      return;
+    }
+  d->buffers = realloc(d->buffers, (d->nbuffers + 1) * sizeof(*d->buffers));
+  if (!d->buffers)
+    error(EXIT_FAILURE, errno, "malloc");
+  d->buffers[d->nbuffers++] = buf;
+  sec->data = buf;
+  sec->size = size;
+#else
+  error(0, 0, "warning: %s is compressed; rebuild with zlib to read it", name);
+#endif
+}
+
+/* Reads the source map of the ELF file PATH, or returns NULL. */
+static struct srcmap *
+srcmap_load (const char *path)
+{
+  struct elf elf;
+  if (!elf_open(path, &elf))
+    {
+      error(0, errno, "%s", path);
+      return NULL;
+    }
+  char *const debug = debug_file_find(path, &elf, ".debug_info");
+  elf_close(&elf);
+  if (!debug)
+    {
+      error(0, 0, "%s: no debug information found", path);
+      return NULL;
+    }
+  if (!elf_open(debug, &elf))
+    {
+      error(0, errno, "%s", debug);
+      free(debug);
+      return NULL;
+    }
+
+  struct dwarf d;
+  memset(&d, 0, sizeof(d));
+  load_section(&d, &elf, ".debug_info", &d.info);
+  load_section(&d, &elf, ".debug_abbrev", &d.abbrev);
+  load_section(&d, &elf, ".debug_line", &d.line);
+  load_section(&d, &elf, ".debug_str", &d.str);
+  load_section(&d, &elf, ".debug_line_str", &d.line_str);
+  load_section(&d, &elf, ".debug_ranges", &d.ranges);
+  load_section(&d, &elf, ".debug_rnglists", &d.rnglists);
+  load_section(&d, &elf, ".debug_addr", &d.addr);
+  load_section(&d, &elf, ".debug_str_offsets", &d.str_offsets);
+
+  read_units(&d);
+  for (size_t i = 0; i < d.nunits; i++)
+    read_unit_dies(&d, &d.units[i]);
+
+  struct srcmap *const map = calloc(1, sizeof(*map));
+  if (!map)
+    error(EXIT_FAILURE, errno, "malloc");
+  build_regions(&d, map);
+  map->inlines = d.inlines;
+  map->ninlines = d.ninlines;
+  map->strings = d.strings ? d.strings : calloc(1, 1);
+  map->strsize = d.strsize;
+  if (!map->strings)
+    error(EXIT_FAILURE, errno, "malloc");
+  dwarf_free(&d);
+  elf_close(&elf);
+  free(debug);
+  return map;
+}
+
+const struct src_region *
+srcmap_lookup (const struct srcmap *map, uint64_t addr)
+{
+  size_t lo = 0, hi = map->nregions;
+
+  while (lo < hi)
+    {
+      const size_t mid = lo + (hi - lo) / 2;
+
+      if (map->regions[mid].addr <= addr)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  return lo ? &map->regions[lo - 1] : NULL;
+}
+
+void
+srcmap_free (struct srcmap *map)
+{
+  if (!map)
+    return;
+  free(map->regions);
+  free(map->inlines);
+  free(map->strings);
+  free(map);
+}
+
+/*
+ * On-disk cache, in the directory of the symbol cache: <build-id>.src
+ * holds
+ *	struct srccache_header
+ *	struct src_region[nregions]
+ *	struct src_inline[ninlines]
+ *	char strings[strsize]
+ * in host byte order, written atomically by rename(2).
+ */
+
+#define SRCCACHE_MAGIC	"SPSRCC01"
+
+struct srccache_header
+{
+  char magic[8];
+  uint64_t nregions, ninlines, strsize;
+};
+
+/* Whether all strings and inlined calls MAP refers to are in it, as
+   srcmap_load makes them (a caller before its callee). */
+static _Bool
+srccache_valid (const struct srcmap *map)
+{
+  for (size_t i = 0; i < map->nregions; i++)
+    {
+      const struct src_region *const r = &map->regions[i];
+      if ((r->file != SRC_NONE && r->file >= map->strsize) ||
+	  (r->inlined != SRC_NONE && r->inlined >= map->ninlines))
+	return 0;
+    }
+  for (size_t i = 0; i < map->ninlines; i++)
+    {
+      const struct src_inline *const in = &map->inlines[i];
+      if ((in->parent != SRC_NONE && in->parent >= i) ||
+	  (in->name != SRC_NONE && in->name >= map->strsize) ||
+	  (in->call_file != SRC_NONE && in->call_file >= map->strsize))
+	return 0;
+    }
+  return 1;
+}
+
+static struct srcmap *
+srccache_read (const char *path)
+{
+  FILE *const fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  struct srcmap *map = NULL;
+  struct srccache_header hdr;
+  struct stat st;
+  if (fstat(fileno(fp), &st) == 0 &&
+      fread(&hdr, sizeof(hdr), 1, fp) == 1 &&
+      !memcmp(hdr.magic, SRCCACHE_MAGIC, sizeof(hdr.magic)) &&
+      hdr.nregions <= (uint64_t) st.st_size / sizeof(struct src_region) &&
+      hdr.ninlines <= (uint64_t) st.st_size / sizeof(struct src_inline) &&
+      (uint64_t) st.st_size == (sizeof(hdr) + hdr.nregions * sizeof(struct src_region)
+				+ hdr.ninlines * sizeof(struct src_inline) + hdr.strsize))
+    {
+      if (!(map = calloc(1, sizeof(*map))) ||
+	  !(map->regions = malloc(hdr.nregions * sizeof(*map->regions) + 1)) ||
+	  !(map->inlines = malloc(hdr.ninlines * sizeof(*map->inlines) + 1)) ||
+	  !(map->strings = malloc(hdr.strsize + 1)))
+	error(EXIT_FAILURE, errno, "malloc");
+      map->nregions = hdr.nregions;
+      map->ninlines = hdr.ninlines;
+      map->strsize = hdr.strsize;
+      map->strings[hdr.strsize] = '\0';
+      if (fread(map->regions, sizeof(*map->regions), map->nregions, fp) != map->nregions ||
+	  fread(map->inlines, sizeof(*map->inlines), map->ninlines, fp) != map->ninlines ||
+	  fread(map->strings, 1, map->strsize, fp) != map->strsize ||
+	  !srccache_valid(map))
+	{
+	  srcmap_free(map);
+	  map = NULL;
+	}
+    }
+  fclose(fp);
+  return map;
+}
+
+static void
+srccache_write (const char *dir, const char *path, const struct srcmap *map)
+{
+  struct srccache_header hdr;
+  memcpy(hdr.magic, SRCCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.nregions = map->nregions;
+  hdr.ninlines = map->ninlines;
+  hdr.strsize = map->strsize;
+
+  char *tmp;
+  if (asprintf(&tmp, "%s.%ld.tmp", path, (long) getpid()) < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  mkdir(dir, 0777);
+  FILE *fp = fopen(tmp, "w");
+  if (fp)
+    {
+      fwrite(&hdr, sizeof(hdr), 1, fp);
+      fwrite(map->regions, sizeof(*map->regions), map->nregions, fp);
+      fwrite(map->inlines, sizeof(*map->inlines), map->ninlines, fp);
+      fwrite(map->strings, 1, map->strsize, fp);
+      if (fclose(fp) || rename(tmp, path))
+	unlink(tmp);
+    }
+  free(tmp);
+}
+
+/*
+ * Same as srcmap_load, but looks up the build ID of PATH in the
+ * on-disk cache first, so that debug information of a binary is
+ * read only once.
+ */
+struct srcmap *
+srcmap_load_cached (const char *path)
+{
+  unsigned char id[BUILD_ID_MAX];
+  const size_t idlen = elf_build_id(path, id);
+  char *const dir = idlen ? symcache_dir() : NULL;
+  char *cache = NULL;
+  if (dir)
+    {
+      char *const hex = build_id_hex(id, idlen);
+      if (asprintf(&cache, "%s/%s.src", dir, hex) < 0)
+	error(EXIT_FAILURE, errno, "malloc");
+      free(hex);
+    }
+
+  struct srcmap *map = cache ? srccache_read(cache) : NULL;
+  if (!map && (map = srcmap_load(path)) != NULL && cache)
+    srccache_write(dir, cache, map);
+  free(cache);
+  free(dir);
+  return map;
+}
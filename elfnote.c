@@ -0,0 +1,70 @@
+/*
+ * ELF note parsing for Simple Profiler.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/* This file is linked into both simpleprof.so and the tools. */
+
+#include <string.h>
+#include <elf.h>
+#include <link.h>
+
+#include "elfnote.h"
+
+#define NOTE_ALIGN(n)	(((n) + 3) & ~(size_t) 3)
+
+size_t
+note_build_id (const void *notes, size_t size, unsigned char *id)
+{
+  const unsigned char *p = notes;
+  const unsigned char *const end = p + size;
+
+  while ((size_t) (end - p) >= sizeof(ElfW(Nhdr)))
+    {
+      ElfW(Nhdr) nhdr;
+
+      memcpy(&nhdr, p, sizeof(nhdr));
+      p += sizeof(nhdr);
+      if (NOTE_ALIGN(nhdr.n_namesz) > (size_t) (end - p))
+	break;
+
+      const unsigned char *const name = p;
+      p += NOTE_ALIGN(nhdr.n_namesz);
+      if (NOTE_ALIGN(nhdr.n_descsz) > (size_t) (end - p))
+	break;
+
+      if (nhdr.n_type == NT_GNU_BUILD_ID &&
+	  nhdr.n_namesz == sizeof(ELF_NOTE_GNU) &&
+	  !memcmp(name, ELF_NOTE_GNU, sizeof(ELF_NOTE_GNU)) &&
+	  nhdr.n_descsz > 0 && nhdr.n_descsz <= BUILD_ID_MAX)
+	{
+	  memcpy(id, p, nhdr.n_descsz);
+	  return nhdr.n_descsz;
+	}
+      p += NOTE_ALIGN(nhdr.n_descsz);
+    }
+  return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Simple Profiler - ELF note parsing.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ELFNOTE_H
+#define ELFNOTE_H
+
+#include <stddef.h>
+
+/* Longest build ID we handle; GNU ld emits 20 (SHA-1) by default. */
+#define BUILD_ID_MAX	64
+
+/* Copies NT_GNU_BUILD_ID found in the notes to ID and returns its
+   length, or returns 0 if there is none. */
+extern size_t note_build_id (const void *notes, size_t size, unsigned char *id);
+
+#endif /* ELFNOTE_H */
@@ -0,0 +1,337 @@
+/*
+ * Simple Profiler - attribution of samples to user-space fibers.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * When SP_FIBER is set, la_symbind redirects makecontext, swapcontext
+ * and setcontext of libc, and calls to sp_fiber_switch in any object,
+ * to wrappers below which keep track of the fiber each thread is
+ * running.  Samples then carry the fiber's ID, its task (the function
+ * given to makecontext, or whatever the scheduler passes), and its stack
+ * bounds for the frame pointer walk.
+ *
+ * A fiber is known by the address of its ucontext_t, or of whatever
+ * object the scheduler passes to sp_fiber_switch.  A ucontext_t saved
+ * by swapcontext belongs to the fiber which saved it.  getcontext is
+ * not wrapped since it returns twice, so a context it saved is taken
+ * to belong to the thread itself.
+ *
+ * A sample whose stack pointer is outside the current fiber's stack
+ * (e.g. between the wrapper and the actual switch) is not attributed
+ * to any fiber.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "simpleprof.h"
+
+#define DEFAULT_FIBERS	65536
+
+/* makecontext arguments passed on. */
+#define MAX_ARGS	8
+
+/* Context or scheduler object -> fiber, or NULL for the thread itself. */
+struct fiber_key
+{
+  uintptr_t key;		/* 0 if unused */
+  struct sp_fiber *fiber;
+};
+
+static _Bool fiber_enabled;
+static struct fiber_key *fiber_keys;
+static size_t fiber_keys_mask;
+static struct sp_fiber *fibers;
+static uintptr_t *fiber_owners;	/* key which made each fiber */
+static size_t max_fibers, nfibers;
+static uint64_t last_id, fiber_dropped;
+
+/* Initial-exec, since it is read in the SIGPROF handler. */
+static __thread const struct sp_fiber *current
+  __attribute__((tls_model("initial-exec")));
+
+_Bool
+fiber_init (void)
+{
+  if (!sp_env_flag(ENV_PREFIX "FIBER"))
+    return 0;
+
+  size_t n = DEFAULT_FIBERS;
+  const char *env = getenv(ENV_PREFIX "FIBER_MAX");
+  if (env)
+    {
+      char dummy[1];
+
+      if (sscanf(env, "%zu %c", &n, dummy) != 1 || n == 0 ||
+	  n > (SIZE_MAX >> 2) / (sizeof(struct fiber_key) + sizeof(struct sp_fiber)))
+	{
+	  EPRINTF("invalid %s %#s", ENV_PREFIX "FIBER_MAX", env);
+	  return 0;
+	}
+    }
+  /* Keys at most half full; fibers reused by makecontext take no more. */
+  size_t nkeys = 2 * n;
+  while (nkeys & (nkeys - 1))
+    nkeys = (nkeys | (nkeys - 1)) + 1;
+
+  const size_t size = (nkeys * sizeof(struct fiber_key)
+		      + n * (sizeof(struct sp_fiber) + sizeof(uintptr_t)));
+  void *const p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return 0;
+    }
+  fiber_keys = p;
+  fiber_keys_mask = nkeys - 1;
+  fibers = (struct sp_fiber *) (fiber_keys + nkeys);
+  fiber_owners = (uintptr_t *) (fibers + n);
+  max_fibers = n;
+  fiber_enabled = 1;
+
+  if (sp_debug)
+    DPRINTF("fiber tracking enabled (%zu fibers)", n);
+  return 1;
+}
+
+/* Returns the slot of KEY, adding it if CREATE, or NULL. */
+static struct fiber_key *
+lookup (uintptr_t key, _Bool create)
+{
+  size_t i = ((uint64_t) key * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+
+  for (size_t probe = 0; probe <= fiber_keys_mask; probe++, i++)
+    {
+      struct fiber_key *const k = &fiber_keys[i & fiber_keys_mask];
+      uintptr_t old = __atomic_load_n(&k->key, __ATOMIC_ACQUIRE);
+
+      if (old == 0)
+	{
+	  if (!create)
+	    return NULL;
+	  if (__atomic_compare_exchange_n(&k->key, &old, key, 0,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	    return k;
+	}
+      if (old == key)
+	return k;
+    }
+  __atomic_fetch_add(&fiber_dropped, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Makes K a new fiber, reusing the one it made before if any. */
+static struct sp_fiber *
+new_fiber (struct fiber_key *k, uintptr_t task, uintptr_t stack_lo, size_t size)
+{
+  struct sp_fiber *f = __atomic_load_n(&k->fiber, __ATOMIC_ACQUIRE);
+
+  if (!f || fiber_owners[f - fibers] != k->key)
+    {
+      const size_t idx = __atomic_fetch_add(&nfibers, 1, __ATOMIC_RELAXED);
+      if (idx >= max_fibers)
+	{
+	  __atomic_fetch_add(&fiber_dropped, 1, __ATOMIC_RELAXED);
+	  __atomic_store_n(&k->fiber, NULL, __ATOMIC_RELEASE);
+	  return NULL;
+	}
+      f = &fibers[idx];
+      fiber_owners[idx] = k->key;
+    }
+  f->id = __atomic_add_fetch(&last_id, 1, __ATOMIC_RELAXED);
+  f->task = task;
+  f->stack_lo = size ? stack_lo : 0;
+  f->stack_hi = size ? stack_lo + size : 0;
+  __atomic_store_n(&k->fiber, f, __ATOMIC_RELEASE);
+  return f;
+}
+
+static const struct sp_fiber *
+fiber_of (const void *key)
+{
+  struct fiber_key *const k = lookup((uintptr_t) key, 0);
+  return k ? __atomic_load_n(&k->fiber, __ATOMIC_ACQUIRE) : NULL;
+}
+
+static void
+set_current (const struct sp_fiber *f)
+{
+  /* Only the SIGPROF handler of this thread reads it. */
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  current = f;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Called from SIGPROF handler. */
+const struct sp_fiber *
+fiber_current (uintptr_t sp)
+{
+  if (!fiber_enabled)
+    return NULL;
+
+  const struct sp_fiber *const f = current;
+  if (f && f->stack_hi && (sp < f->stack_lo || sp >= f->stack_hi))
+    return NULL;
+  return f;
+}
+
+static void (*real_makecontext) (ucontext_t *, void (*) (void), int, ...);
+static int (*real_swapcontext) (ucontext_t *, const ucontext_t *);
+static int (*real_setcontext) (const ucontext_t *);
+
+static void
+wrap_makecontext (ucontext_t *ucp, void (*func) (void), int argc, ...)
+{
+  /* Read and passed on as full registers, as glibc's makecontext reads
+     them, so that pointers which programs pass anyway survive. */
+  unsigned long int args[MAX_ARGS] = { 0 };
+  va_list ap;
+
+  if (argc > MAX_ARGS)
+    EPRINTF("makecontext: only %d arguments are passed on", MAX_ARGS);
+  va_start(ap, argc);
+  for (int i = 0; i < argc && i < MAX_ARGS; i++)
+    args[i] = va_arg(ap, unsigned long int);
+  va_end(ap);
+
+  struct fiber_key *const k = lookup((uintptr_t) ucp, 1);
+  if (k)
+    new_fiber(k, (uintptr_t) func, (uintptr_t) ucp->uc_stack.ss_sp,
+	      ucp->uc_stack.ss_size);
+
+  real_makecontext(ucp, func, argc, args[0], args[1], args[2], args[3],
+		   args[4], args[5], args[6], args[7]);
+}
+
+static int
+wrap_swapcontext (ucontext_t *oucp, const ucontext_t *ucp)
+{
+  const struct sp_fiber *const self = current;
+
+  struct fiber_key *const k = lookup((uintptr_t) oucp, 1);
+  if (k)
+    __atomic_store_n(&k->fiber, (struct sp_fiber *) self, __ATOMIC_RELEASE);
+
+  set_current(fiber_of(ucp));
+  const int ret = real_swapcontext(oucp, ucp);
+  /* Back in SELF, whoever switched to it. */
+  set_current(self);
+  return ret;
+}
+
+static int
+wrap_setcontext (const ucontext_t *ucp)
+{
+  const struct sp_fiber *const self = current;
+
+  set_current(fiber_of(ucp));
+  const int ret = real_setcontext(ucp);
+  set_current(self);
+  return ret;
+}
+
+/*
+ * For schedulers which switch by other means (e.g. boost.context):
+ * call this right before switching to FIBER, which is any address
+ * identifying the fiber, or NULL when switching back to the thread's
+ * own stack.  TASK identifies the kind of work the fiber does, and is
+ * shown as a symbol (e.g. its entry point).  STACK and SIZE are bounds
+ * of its stack, or 0 if not known.
+ */
+static void
+wrap_fiber_switch (const void *fiber, const void *task,
+		   const void *stack, size_t size)
+{
+  if (!fiber)
+    {
+      set_current(NULL);
+      return;
+    }
+
+  struct fiber_key *const k = lookup((uintptr_t) fiber, 1);
+  if (!k)
+    {
+      set_current(NULL);
+      return;
+    }
+
+  const struct sp_fiber *f = __atomic_load_n(&k->fiber, __ATOMIC_ACQUIRE);
+  if (!f || f->task != (uintptr_t) task ||
+      f->stack_lo != (size ? (uintptr_t) stack : 0) ||
+      f->stack_hi != (size ? (uintptr_t) stack + size : 0))
+    f = new_fiber(k, (uintptr_t) task, (uintptr_t) stack, size);
+  set_current(f);
+}
+
+uintptr_t
+fiber_symbind (const char *symname, uintptr_t value,
+	       const struct link_map *defmap)
+{
+  if (!fiber_enabled)
+    return value;
+
+  void **real = NULL;
+  void *wrapper;
+
+  if (!strcmp(symname, "sp_fiber_switch"))
+    wrapper = (void *) wrap_fiber_switch;
+  else if (!strcmp(symname, "makecontext"))
+    real = (void **) &real_makecontext, wrapper = (void *) wrap_makecontext;
+  else if (!strcmp(symname, "swapcontext"))
+    real = (void **) &real_swapcontext, wrapper = (void *) wrap_swapcontext;
+  else if (!strcmp(symname, "setcontext"))
+    real = (void **) &real_setcontext, wrapper = (void *) wrap_setcontext;
+  else
+    return value;
+
+  if (real)
+    {
+      if (!objmap_is_libc(defmap))
+	return value;
+      *real = (void *) value;
+    }
+  if (sp_debug)
+    DPRINTF("wrapping %s", symname);
+  return (uintptr_t) wrapper;
+}
+
+static void __attribute__((destructor))
+fiber_fini (void)
+{
+  if (fiber_enabled && sp_debug)
+    DPRINTF("%" PRIu64 " fibers seen, %" PRIu64 " not tracked",
+	    __atomic_load_n(&last_id, __ATOMIC_RELAXED),
+	    __atomic_load_n(&fiber_dropped, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,178 @@
+/*
+ * Simple Profiler - private histogram with periodic flush.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_FLUSH_INTERVAL, samples are counted in an anonymous buffer
+ * instead of the shared mapping of the profile, and a helper thread
+ * folds them into the profile every SP_FLUSH_INTERVAL seconds and at
+ * exit.  Pages of the profile are thus dirtied once per interval rather
+ * than continuously, and the kernel writes each back at most once.
+ *
+ * Folding is done with atomic adds into the shared mapping, so that any
+ * number of processes may fold into the same profile without locking.
+ * Samples not yet flushed are lost if the process is killed or execs.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "simpleprof.h"
+
+static unsigned short *shared_bins, *private_bins;
+static uint16_t *seq_begin, *seq_end;
+static size_t nbins;
+static unsigned int interval;
+static pid_t owner;
+
+/* Moves counts from the private buffer to the profile. */
+static void
+flush (void)
+{
+  const size_t nwords = nbins * sizeof(unsigned short) / sizeof(unsigned long);
+  const unsigned long *const words = (const unsigned long *) private_bins;
+  const size_t per_word = sizeof(unsigned long) / sizeof(unsigned short);
+
+  __atomic_fetch_add(seq_begin, 1, __ATOMIC_SEQ_CST);
+  for (size_t w = 0; w <= nwords; w++)
+    {
+      /* Skip zero words quickly; the tail is checked bin by bin. */
+      if (w < nwords && !__atomic_load_n(&words[w], __ATOMIC_RELAXED))
+	continue;
+
+      const size_t end = w < nwords ? (w + 1) * per_word : nbins;
+      for (size_t i = w * per_word; i < end; i++)
+	if (private_bins[i])
+	  {
+	    const unsigned short n = __atomic_exchange_n(&private_bins[i], 0,
+							 __ATOMIC_RELAXED);
+	    __atomic_fetch_add(&shared_bins[i], n, __ATOMIC_RELAXED);
+	  }
+    }
+  __atomic_fetch_add(seq_end, 1, __ATOMIC_SEQ_CST);
+}
+
+static void *
+flush_thread (void *arg)
+{
+  struct timespec ts = { .tv_sec = interval };
+
+  for (;;)
+    {
+      while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+	;
+      flush();
+      ts.tv_sec = interval;
+      ts.tv_nsec = 0;
+    }
+  return NULL;
+}
+
+/*
+ * Returns a buffer for the sampler to count into: BINS itself
+ * (NBINS elements in the profile mapping) unless SP_FLUSH_INTERVAL
+ * is set, or a private buffer flushed into BINS periodically, within
+ * the seqlock SEQ_BEGIN and SEQ_END.
+ */
+unsigned short *
+flush_init (unsigned short *bins, size_t n,
+	    uint16_t *begin, uint16_t *end)
+{
+  const char *const env = getenv(ENV_PREFIX "FLUSH_INTERVAL");
+  if (!env || !*env)
+    return bins;
+
+  char dummy[1];
+  if (sscanf(env, "%u %c", &interval, dummy) != 1 || interval == 0)
+    {
+      EPRINTF("invalid %s %#s", ENV_PREFIX "FLUSH_INTERVAL", env);
+      return bins;
+    }
+
+  void *const buf = mmap(NULL, n * sizeof(*bins), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return bins;
+    }
+
+  shared_bins = bins;
+  seq_begin = begin;
+  seq_end = end;
+  private_bins = buf;
+  nbins = n;
+  owner = getpid();
+
+  /* The helper thread must not take signals meant for the program. */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  const int e = pthread_create(&thread, &attr, flush_thread, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  if (e)
+    {
+      EPRINTF("pthread_create: %s", strerror(e));
+      munmap(buf, n * sizeof(*bins));
+      private_bins = NULL;
+      return bins;
+    }
+  if (sp_debug)
+    DPRINTF("flushing every %u seconds", interval);
+  return private_bins;
+}
+
+/* Flushes now, if counting privately in this process. */
+void
+flush_sync (void)
+{
+  /* A forked child inherits counts of the parent not flushed yet. */
+  if (private_bins && owner == getpid())
+    flush();
+}
+
+static void __attribute__((destructor))
+flush_fini (void)
+{
+  flush_sync();
+}
@@ -0,0 +1,384 @@
+/*
+ * gmon.out reader for Simple Profiler tools.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Only files of the host's address size and byte order are supported,
+ * which is what simpleprof.so and glibc's gmon write.
+ *
+ * Profiles may be read while processes are still writing them; the
+ * file is copied under its seqlock (see gmonmeta.h) to get a consistent
+ * snapshot, and the checksum, if any, is verified.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/gmon_out.h>
+
+#include "sptool.h"
+#include "spcontainer.h"
+
+static void
+add_hist (struct gmon_data *data, const struct gmon_hist *hist)
+{
+  struct gmon_hist *const p = realloc(data->hists, (data->nhists + 1) * sizeof(*p));
+  if (!p)
+    error(EXIT_FAILURE, errno, "malloc");
+  data->hists = p;
+  data->hists[data->nhists++] = *hist;
+}
+
+/* Appends metadata chunk of an arc from ~0 (see gmonmeta.h). */
+static void
+add_meta (struct gmon_data *data, const void *chunk)
+{
+  if (data->metalen % 256 == 0)
+    {
+      char *const p = realloc(data->meta, data->metalen + 256 + 1);
+      if (!p)
+	error(EXIT_FAILURE, errno, "malloc");
+      data->meta = p;
+    }
+  memcpy(data->meta + data->metalen, chunk, GMON_META_CHUNK);
+  data->metalen += GMON_META_CHUNK;
+  data->meta[data->metalen] = '\0';
+}
+
+static void
+add_arc (struct gmon_data *data, const struct gmon_arc *arc)
+{
+  if (data->narcs % 256 == 0)
+    {
+      struct gmon_arc *const p = realloc(data->arcs, (data->narcs + 256) * sizeof(*p));
+      if (!p)
+	error(EXIT_FAILURE, errno, "malloc");
+      data->arcs = p;
+    }
+  data->arcs[data->narcs++] = *arc;
+}
+
+/* Returns a malloc'ed copy of SIZE bytes of section TYPE, or NULL. */
+static void *
+container_section (const unsigned char *file, size_t filesize,
+		   unsigned int type, size_t *size)
+{
+  const struct spc_header *const hdr = (const struct spc_header *) file;
+  const struct spc_section *const sec = (const struct spc_section *) (hdr + 1);
+
+  for (uint32_t i = 0; i < hdr->nsections; i++)
+    if (sec[i].type == type &&
+	sec[i].offset <= filesize && sec[i].size <= filesize - sec[i].offset)
+      {
+	/* One more byte to terminate text. */
+	char *const p = malloc(sec[i].size + 1);
+	if (!p)
+	  error(EXIT_FAILURE, errno, "malloc");
+	memcpy(p, file + sec[i].offset, sec[i].size);
+	p[sec[i].size] = '\0';
+	*size = sec[i].size;
+	return p;
+      }
+  return NULL;
+}
+
+/*
+ * Takes sections of container FILE other than the profile into DATA,
+ * and returns a copy of the profile, or NULL after reporting an error.
+ */
+static void *
+read_container (const char *path, const unsigned char *file, size_t filesize,
+		struct gmon_data *data)
+{
+  const struct spc_header *const hdr = (const struct spc_header *) file;
+  size_t size, nsyms, strsize;
+
+  if (hdr->version != SPC_VERSION ||
+      (filesize - sizeof(*hdr)) / sizeof(struct spc_section) < hdr->nsections)
+    {
+      error(0, 0, "%s: unsupported container", path);
+      return NULL;
+    }
+  void *const image = container_section(file, filesize, SPC_GMON, &data->size);
+  if (!image)
+    {
+      error(0, 0, "%s: container has no profile", path);
+      return NULL;
+    }
+
+  data->container_meta = container_section(file, filesize, SPC_META, &size);
+  data->maps = container_section(file, filesize, SPC_MAPS, &size);
+
+  struct spc_sym *const syms = container_section(file, filesize, SPC_SYMS, &nsyms);
+  char *const strings = container_section(file, filesize, SPC_STRS, &strsize);
+  nsyms /= sizeof(*syms);
+  if (syms && strings)
+    {
+      struct symtab *const tab = calloc(1, sizeof(*tab));
+      if (!tab || !(tab->syms = calloc(nsyms + 1, sizeof(*tab->syms))))
+	error(EXIT_FAILURE, errno, "malloc");
+      for (size_t i = 0; i < nsyms; i++)
+	if (syms[i].name < strsize)
+	  tab->syms[tab->nsyms++] = (struct sym) { syms[i].addr, syms[i].size,
+						   strings + syms[i].name };
+      tab->strings = strings;
+      data->symtab = tab;
+    }
+  else
+    free(strings);
+  free(syms);
+  return image;
+}
+
+/*
+ * Copies LEN bytes at OFFSET of LIVE, a profile mapped while processes
+ * may be writing it, to BUF under its seqlock, tolerating one left
+ * unbalanced by a killed process.  Returns 0, or -1 if it kept changing
+ * for a second, in which case BUF may be inconsistent.
+ */
+int
+gmon_copy_live (const void *live, size_t offset, size_t len, void *buf)
+{
+  return gmon_seq_copy(live, offset, len, buf, 1000);
+}
+
+/* Returns 0 on success, or -1 after reporting an error. */
+int
+gmon_read (const char *path, struct gmon_data *data)
+{
+  memset(data, 0, sizeof(*data));
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st))
+    {
+      error(0, errno, "%s", path);
+      if (fd >= 0)
+	close(fd);
+      return -1;
+    }
+  if ((size_t) st.st_size < sizeof(struct gmon_hdr))
+    {
+      error(0, 0, "%s: not a gmon file", path);
+      close(fd);
+      return -1;
+    }
+  void *const live = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (live == MAP_FAILED)
+    {
+      error(0, errno, "%s: mmap", path);
+      return -1;
+    }
+  void *image;
+  if ((size_t) st.st_size >= sizeof(struct spc_header) &&
+      !memcmp(live, SPC_MAGIC, sizeof(((struct spc_header *) 0)->magic)))
+    {
+      /* Containers are replaced as a whole, never changed in place. */
+      image = read_container(path, live, st.st_size, data);
+      munmap(live, st.st_size);
+      if (!image)
+	{
+	  gmon_free(data);
+	  return -1;
+	}
+      data->image = image;
+      if (data->size < sizeof(struct gmon_hdr))
+	{
+	  error(0, 0, "%s: not a gmon file", path);
+	  gmon_free(data);
+	  return -1;
+	}
+      goto parse;
+    }
+
+  image = malloc(st.st_size);
+  if (!image)
+    error(EXIT_FAILURE, errno, "malloc");
+  if (gmon_copy_live(live, 0, st.st_size, image))
+    error(0, 0, "%s: warning: file kept changing while read", path);
+  munmap(live, st.st_size);
+  data->image = image;
+  data->size = st.st_size;
+
+ parse:;
+  const unsigned char *p = image;
+  const unsigned char *const end = p + data->size;
+  uint32_t version;
+
+  memcpy(&version, ((const struct gmon_hdr *) p)->version, sizeof(version));
+  if (memcmp(p, GMON_MAGIC, 4) || version != GMON_VERSION)
+    {
+      error(0, 0, "%s: not a gmon file", path);
+      gmon_free(data);
+      return -1;
+    }
+  memcpy(&data->spare, ((const struct gmon_hdr *) p)->spare, sizeof(data->spare));
+
+  /* Checksum everything but the spare bytes and histogram bins. */
+  uint16_t sum = gmon_checksum(0, p, offsetof(struct gmon_hdr, spare));
+  const unsigned char *sum_from = p + offsetof(struct gmon_hdr, spare) + sizeof(data->spare);
+  p += sizeof(struct gmon_hdr);
+
+  while (p < end)
+    {
+      const unsigned char tag = *p++;
+
+      switch (tag)
+	{
+	case GMON_TAG_TIME_HIST:
+	  {
+	    struct gmon_hist h;
+	    const struct gmon_hist_hdr *const hh = (const struct gmon_hist_hdr *) p;
+	    uintptr_t pc;
+
+	    if ((size_t) (end - p) < sizeof(*hh))
+	      goto truncated;
+	    memcpy(&pc, hh->low_pc, sizeof(pc));
+	    h.low_pc = pc;
+	    memcpy(&pc, hh->high_pc, sizeof(pc));
+	    h.high_pc = pc;
+	    memcpy(&h.size, hh->hist_size, sizeof(h.size));
+	    memcpy(&h.rate, hh->prof_rate, sizeof(h.rate));
+	    memcpy(h.dimen, hh->dimen, sizeof(hh->dimen));
+	    h.dimen[sizeof(hh->dimen)] = '\0';
+	    h.dimen_abbrev = hh->dimen_abbrev;
+	    p += sizeof(*hh);
+	    if ((size_t) (end - p) / sizeof(unsigned short) < h.size)
+	      goto truncated;
+	    h.bins = p;
+	    h.offset = p - (const unsigned char *) image;
+	    sum = gmon_checksum(sum, sum_from, p - sum_from);
+	    p += (size_t) h.size * sizeof(unsigned short);
+	    sum_from = p;
+	    add_hist(data, &h);
+	  }
+	  break;
+	case GMON_TAG_CG_ARC:
+	  {
+	    const struct gmon_cg_arc_record *const ar = (const struct gmon_cg_arc_record *) p;
+	    struct gmon_arc a;
+	    uintptr_t pc;
+
+	    if ((size_t) (end - p) < sizeof(*ar))
+	      goto truncated;
+	    memcpy(&pc, ar->from_pc, sizeof(pc));
+	    a.from_pc = pc;
+	    memcpy(&pc, ar->self_pc, sizeof(pc));
+	    a.self_pc = pc;
+	    memcpy(&a.count, ar->count, sizeof(a.count));
+	    p += sizeof(*ar);
+	    if (a.from_pc == (uintptr_t) ~0)
+	      add_meta(data, ar->self_pc);
+	    else
+	      add_arc(data, &a);
+	  }
+	  break;
+	case GMON_TAG_BB_COUNT:
+	  {
+	    uint32_t nblocks;
+
+	    if ((size_t) (end - p) < sizeof(nblocks))
+	      goto truncated;
+	    memcpy(&nblocks, p, sizeof(nblocks));
+	    p += sizeof(nblocks);
+	    if ((size_t) (end - p) / (2 * sizeof(uintptr_t)) < nblocks)
+	      goto truncated;
+	    p += (size_t) nblocks * 2 * sizeof(uintptr_t);
+	  }
+	  break;
+	default:
+	  error(0, 0, "%s: bad record tag %u at offset %zu", path, tag,
+		(size_t) (p - 1 - (const unsigned char *) image));
+	  gmon_free(data);
+	  return -1;
+	}
+    }
+
+  sum = gmon_checksum(sum, sum_from, end - sum_from);
+  if (data->spare.checksum && data->spare.checksum != (sum ? sum : 1))
+    {
+      error(0, 0, "%s: checksum mismatch (torn or partially copied file)", path);
+      gmon_free(data);
+      return -1;
+    }
+  return 0;
+
+ truncated:
+  error(0, 0, "%s: truncated", path);
+  gmon_free(data);
+  return -1;
+}
+
+void
+gmon_free (struct gmon_data *data)
+{
+  free(data->image);
+  free(data->hists);
+  free(data->arcs);
+  free(data->meta);
+  free(data->container_meta);
+  free(data->maps);
+  symtab_free(data->symtab);
+  memset(data, 0, sizeof(*data));
+}
+
+/* Returns malloc'ed value of KEY in "key=value" lines TEXT, or NULL. */
+static char *
+find_meta (const char *text, const char *key)
+{
+  const size_t keylen = strlen(key);
+
+  for (const char *p = text; *p; )
+    {
+      const char *const eol = strchrnul(p, '\n');
+
+      if (!strncmp(p, key, keylen) && p[keylen] == '=')
+	{
+	  char *const val = strndup(p + keylen + 1, eol - (p + keylen + 1));
+	  if (!val)
+	    error(EXIT_FAILURE, errno, "malloc");
+	  return val;
+	}
+      p = *eol ? eol + 1 : eol;
+    }
+  return NULL;
+}
+
+/*
+ * Returns malloc'ed value of metadata KEY, or NULL if there is none.
+ * Metadata of the profile itself takes precedence over the container's.
+ */
+char *
+gmon_meta (const struct gmon_data *data, const char *key)
+{
+  const size_t magiclen = sizeof(GMON_META_MAGIC) - 1;
+  char *val = NULL;
+
+  if (data->meta && !strncmp(data->meta, GMON_META_MAGIC, magiclen))
+    val = find_meta(data->meta + magiclen, key);
+  if (!val && data->container_meta)
+    val = find_meta(data->container_meta, key);
+  return val;
+}
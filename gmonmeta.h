@@ -0,0 +1,288 @@
+/*
+ * Simple Profiler - metadata embedded in gmon.out files.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * gmon.out has no place for arbitrary data, but gprof silently ignores
+ * call graph arcs whose from_pc is ~0.  So metadata is stored as "key=
+ * value" lines, prefixed with GMON_META_MAGIC, in the self_pc and count
+ * fields of a run of such arcs (GMON_META_CHUNK bytes each, the last
+ * one padded with NULs).
+ *
+ * Also, simpleprof.so uses the spare bytes of gmon_hdr as below.
+ */
+
+#ifndef GMONMETA_H
+#define GMONMETA_H
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/gmon_out.h>
+
+#define GMON_META_MAGIC		"SPMETA1\n"
+#define GMON_META_CHUNK		(sizeof(uintptr_t) + 4)
+#define GMON_META_RECORD	(1 + sizeof(struct gmon_cg_arc_record))
+
+/* Bytes needed to encode metadata TEXT. */
+static inline size_t
+gmon_meta_size (const char *text)
+{
+  const size_t len = sizeof(GMON_META_MAGIC) - 1 + strlen(text);
+  return (len + GMON_META_CHUNK - 1) / GMON_META_CHUNK * GMON_META_RECORD;
+}
+
+/* Encodes TEXT into BUF of gmon_meta_size(TEXT) bytes. */
+static inline void
+gmon_meta_encode (unsigned char *buf, const char *text)
+{
+  const size_t size = gmon_meta_size(text);
+  const size_t textlen = strlen(text);
+  const size_t magiclen = sizeof(GMON_META_MAGIC) - 1;
+  unsigned char chunk[GMON_META_CHUNK];
+  const uintptr_t from_pc = ~(uintptr_t) 0;
+  size_t off = 0;
+
+  for (unsigned char *p = buf; p < buf + size; p += GMON_META_RECORD)
+    {
+      for (size_t i = 0; i < sizeof(chunk); i++, off++)
+	chunk[i] = (off < magiclen ? GMON_META_MAGIC[off]
+		    : off - magiclen < textlen ? text[off - magiclen] : '\0');
+      p[0] = GMON_TAG_CG_ARC;
+      memcpy(p + 1, &from_pc, sizeof(from_pc));
+      memcpy(p + 1 + sizeof(from_pc), chunk, sizeof(chunk));
+    }
+}
+
+/*
+ * SEQ_BEGIN and SEQ_END form a seqlock which works with any number of
+ * writers: each update of histogram bins increments SEQ_BEGIN before
+ * and SEQ_END after it.  A reader which sees the same pair, with both
+ * halves equal, before and after copying the file got a consistent
+ * snapshot.  SEQ_END thus also counts generations of the file (mod
+ * 65536).
+ *
+ * CHECKSUM is gmon_checksum() of the file except this structure and
+ * histogram bins, i.e. of everything fixed at creation.  It detects
+ * files torn at creation or copied partially.  Zero means none.
+ */
+struct sp_gmon_spare
+{
+  uint16_t seq_begin, seq_end;
+  uint32_t created;		/* time(2) of creation */
+  uint16_t runs;		/* number of processes which used the file */
+  uint16_t checksum;
+};
+
+/* Both halves of the seqlock, loaded at once. */
+static inline uint32_t
+gmon_seq_load (const struct sp_gmon_spare *spare)
+{
+  return __atomic_load_n((const uint32_t *) &spare->seq_begin, __ATOMIC_ACQUIRE);
+}
+
+/* Tries of gmon_seq_copy after which a stuck seqlock is tolerated. */
+#define GMON_SEQ_STUCK		20
+
+/* Updates in progress according to SEQ, i.e. SEQ_BEGIN - SEQ_END. */
+static inline uint16_t
+gmon_seq_lag (uint32_t seq)
+{
+  uint16_t half[2];
+  memcpy(half, &seq, sizeof(half));
+  return half[0] - half[1];
+}
+
+_Static_assert(sizeof(struct sp_gmon_spare) == sizeof(((struct gmon_hdr *) 0)->spare),
+	       "sp_gmon_spare does not fit in gmon_hdr.spare");
+
+static inline struct sp_gmon_spare *
+sp_gmon_spare (const void *image)
+{
+  return (struct sp_gmon_spare *) ((char *) image + offsetof(struct gmon_hdr, spare));
+}
+
+/*
+ * Copies LEN bytes at OFFSET of IMAGE, a profile which processes may be
+ * updating, to BUF under its seqlock, trying every millisecond up to
+ * TRIES times.  A process killed in the middle of an update leaves the
+ * seqlock one update behind for good, so after GMON_SEQ_STUCK tries the
+ * least lag seen so far is taken as idle.  Returns 0, or -1 if BUF,
+ * copied anyway, may be inconsistent.
+ */
+static inline int
+gmon_seq_copy (const void *image, size_t offset, size_t len, void *buf,
+	       unsigned int tries)
+{
+  uint16_t least = UINT16_MAX;
+
+  for (unsigned int i = 0; i < tries; i++)
+    {
+      const uint32_t seq = gmon_seq_load(sp_gmon_spare(image));
+      const uint16_t lag = gmon_seq_lag(seq);
+
+      if (lag < least)
+	least = lag;
+      if (lag == 0 || (i >= GMON_SEQ_STUCK && lag == least))
+	{
+	  memcpy(buf, (const char *) image + offset, len);
+	  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	  if (gmon_seq_load(sp_gmon_spare(image)) == seq)
+	    return 0;
+	}
+      usleep(1000);
+    }
+  memcpy(buf, (const char *) image + offset, len);
+  return -1;
+}
+
+/* Fletcher-16 checksum, updated with LEN bytes at BUF.  Start with 0. */
+static inline uint16_t
+gmon_checksum (uint16_t sum, const void *buf, size_t len)
+{
+  const unsigned char *const p = buf;
+  unsigned int a = sum & 0xff, b = sum >> 8;
+
+  for (size_t i = 0; i < len; i++)
+    {
+      a = (a + p[i]) % 255;
+      b = (b + a) % 255;
+    }
+  return b << 8 | a;
+}
+
+/*
+ * In gmon.out format, "tag" is a single byte so that following members
+ * may not align to natural boundary for the CPU.  We overcome this
+ * by putting a dummy histogram record first to (at least) align
+ * histogram bins of the main histogram record to natual boundaries.
+ */
+
+#define SP_BASE_HEADER_SIZE	(sizeof(struct gmon_hdr) + 1 + sizeof(struct gmon_hist_hdr))
+
+#define SP_NEED_DUMMY_HIST_HDR	(SP_BASE_HEADER_SIZE % alignof(unsigned short) != 0)
+#define SP_HEADER_SIZE	(SP_NEED_DUMMY_HIST_HDR \
+			 ? (SP_BASE_HEADER_SIZE + sizeof(unsigned short) + 1 + sizeof(struct gmon_hist_hdr)) \
+			 : SP_BASE_HEADER_SIZE)
+
+_Static_assert(SP_HEADER_SIZE % alignof(unsigned short) == 0,
+	       "gmon header is not properly aligned");
+
+/*
+ * Makes the header of a profile (SP_HEADER_SIZE bytes) whose histogram
+ * of NSAMPLES bins starts at link-time address LOWPC, as profil(3)
+ * with SCALE fills it at RATE samples per second.
+ */
+static inline void
+sp_gmon_header (void *const header, uintptr_t lowpc, size_t nsamples,
+		uint_fast32_t scale, uint32_t rate)
+{
+  static const struct my_gmon_hdr
+    {
+      char cookie[4];
+      uint32_t version;
+      char spare[3 * 4];
+    } ghdr = { .cookie = GMON_MAGIC,
+	       .version = GMON_VERSION };
+
+  struct my_hist_hdr
+    {
+      uintptr_t low_pc;
+      uintptr_t high_pc;
+      uint32_t hist_size;
+      uint32_t prof_rate;
+      char dimen[15];
+      char dimen_abbrev;
+    } hist_hdr;
+
+  _Static_assert(offsetof(struct my_gmon_hdr, version) == offsetof(struct gmon_hdr, version),
+		 "my_gmon_hdr.version is not properly aligned");
+  _Static_assert(sizeof(struct my_gmon_hdr) == sizeof(struct gmon_hdr),
+		 "my_gmon_hdr has wrong size");
+
+  _Static_assert(sizeof(struct my_hist_hdr) == sizeof(struct gmon_hist_hdr),
+		 "my_hist_hdr has wrong size");
+
+  hist_hdr.prof_rate = rate;
+
+  strncpy(hist_hdr.dimen, "seconds", sizeof(hist_hdr.dimen));
+  hist_hdr.dimen_abbrev = 's';
+
+  unsigned char *p = header;
+
+  memcpy(p, &ghdr, sizeof(struct my_gmon_hdr));
+  p += sizeof(struct my_gmon_hdr);
+  if (SP_NEED_DUMMY_HIST_HDR)
+    {
+      *p++ = GMON_TAG_TIME_HIST;
+      
+      hist_hdr.hist_size = 1;
+      hist_hdr.low_pc = 0;	/* XXX */
+      hist_hdr.high_pc = 0 + (65536 * 2 / scale);
+
+      memcpy(p, &hist_hdr, sizeof(struct my_hist_hdr));
+      p += sizeof(struct my_hist_hdr);
+      memset(p, '\0', sizeof(unsigned short));
+      p += sizeof(unsigned short);
+    }
+  *p++ = GMON_TAG_TIME_HIST;
+  hist_hdr.low_pc = lowpc;
+  hist_hdr.hist_size = nsamples;
+  hist_hdr.high_pc = lowpc + nsamples * (65536 * 2 / scale);
+  memcpy(p, &hist_hdr, sizeof(struct my_hist_hdr));
+  p += sizeof(struct my_hist_hdr);
+  assert(p == (unsigned char *) header + SP_HEADER_SIZE);
+}
+
+/* Checksum of HEADER and TRAILER, as in struct sp_gmon_spare. */
+static inline uint16_t
+sp_gmon_header_checksum (const char *header, const unsigned char *trailer,
+			 size_t trailer_size)
+{
+  const size_t spare_offset = offsetof(struct gmon_hdr, spare);
+  const size_t spare_end = spare_offset + sizeof(struct sp_gmon_spare);
+  uint16_t sum = gmon_checksum(0, header, spare_offset);
+
+  if (SP_NEED_DUMMY_HIST_HDR)
+    {
+      /* Skip the bin of the dummy histogram record. */
+      const size_t bin = sizeof(struct gmon_hdr) + 1 + sizeof(struct gmon_hist_hdr);
+
+      sum = gmon_checksum(sum, header + spare_end, bin - spare_end);
+      sum = gmon_checksum(sum, header + bin + sizeof(unsigned short),
+			  SP_HEADER_SIZE - bin - sizeof(unsigned short));
+    }
+  else
+    sum = gmon_checksum(sum, header + spare_end, SP_HEADER_SIZE - spare_end);
+  sum = gmon_checksum(sum, trailer, trailer_size);
+  return sum ? sum : 1;
+}
+
+#endif /* GMONMETA_H */
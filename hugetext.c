@@ -0,0 +1,182 @@
+/*
+ * Simple Profiler - hot text on huge pages.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_HUGETEXT=<n>, la_preinit looks at the profile accumulated so
+ * far and moves up to N of the hottest 2 MiB aligned regions of the
+ * program's executable segment onto transparent huge pages, to cut
+ * iTLB misses in large programs.
+ *
+ * Each region is copied into an aligned anonymous mapping advised with
+ * MADV_HUGEPAGE, given the permissions of the segment, and moved over
+ * the original text with mremap, so the text is never missing.  Nothing
+ * but the dynamic linker has run yet.  The text is then anonymous
+ * memory: it is no longer shared with other processes running the
+ * program, and tools reading /proc/<pid>/maps do not see the file there.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "simpleprof.h"
+
+#define HUGE_PAGE_SIZE	((uintptr_t) 2 << 20)
+
+struct region
+{
+  uintptr_t start;
+  uint64_t samples;
+};
+
+static int
+compare_regions (const void *a, const void *b)
+{
+  const struct region *const x = a, *const y = b;
+  return (x->samples < y->samples) - (x->samples > y->samples);
+}
+
+static _Bool
+thp_available (void)
+{
+  FILE *const fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "re");
+  char buf[128];
+  _Bool ok = 0;
+
+  if (fp)
+    {
+      ok = fgets(buf, sizeof(buf), fp) && !strstr(buf, "[never]");
+      fclose(fp);
+    }
+  return ok;
+}
+
+static int
+remap_region (uintptr_t start, int prot)
+{
+  /* Twice as large, to carve an aligned region out of it. */
+  char *const p = mmap(NULL, 2 * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    return -1;
+
+  char *const copy = (char *) (((uintptr_t) p + HUGE_PAGE_SIZE - 1)
+			       & ~(HUGE_PAGE_SIZE - 1));
+  if (copy > p)
+    munmap(p, copy - p);
+  if (copy + HUGE_PAGE_SIZE < p + 2 * HUGE_PAGE_SIZE)
+    munmap(copy + HUGE_PAGE_SIZE, p + 2 * HUGE_PAGE_SIZE - (copy + HUGE_PAGE_SIZE));
+
+  /* Advised before the first touch, which is what gets huge pages. */
+  if (!madvise(copy, HUGE_PAGE_SIZE, MADV_HUGEPAGE))
+    {
+      memcpy(copy, (const void *) start, HUGE_PAGE_SIZE);
+      if (!mprotect(copy, HUGE_PAGE_SIZE, prot) &&
+	  mremap(copy, HUGE_PAGE_SIZE, HUGE_PAGE_SIZE,
+		 MREMAP_MAYMOVE | MREMAP_FIXED, (void *) start) != MAP_FAILED)
+	return 0;
+    }
+
+  const int e = errno;
+  munmap(copy, HUGE_PAGE_SIZE);
+  errno = e;
+  return -1;
+}
+
+/*
+ * Moves hot regions of the executable segment at LOWPC of MEMSZ bytes,
+ * with protection PROT, onto huge pages, as told by the NBINS bins of
+ * the profile made with SCALE.  Called from la_preinit.
+ */
+void
+hugetext_remap (const unsigned short *bins, size_t nbins,
+		uintptr_t lowpc, size_t memsz, unsigned int scale, int prot)
+{
+  const char *const env = getenv(ENV_PREFIX "HUGETEXT");
+  if (!env || !*env)
+    return;
+
+  unsigned int max;
+  char dummy[1];
+  if (sscanf(env, "%u %c", &max, dummy) != 1 || max == 0)
+    {
+      EPRINTF("invalid %s %#s", ENV_PREFIX "HUGETEXT", env);
+      return;
+    }
+
+  /* Regions wholly within the segment. */
+  const uintptr_t first = (lowpc + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+  const uintptr_t end = (lowpc + memsz) & ~(HUGE_PAGE_SIZE - 1);
+  if (first >= end)
+    {
+      if (sp_debug)
+	DPRINTF("no huge page fits in the text");
+      return;
+    }
+  if (!thp_available())
+    {
+      EPRINTF("transparent huge pages are disabled");
+      return;
+    }
+
+  const size_t nregions = (end - first) / HUGE_PAGE_SIZE;
+  struct region *const regions = calloc(nregions, sizeof(*regions));
+  if (!regions)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+  for (size_t i = 0; i < nregions; i++)
+    regions[i].start = first + i * HUGE_PAGE_SIZE;
+
+  /* Inverse of sampler_bin. */
+  for (size_t i = 0; i < nbins; i++)
+    {
+      const uintptr_t pc = lowpc + (uintmax_t) i * 65536 * 2 / scale;
+      if (bins[i] && pc >= first && pc < end)
+	regions[(pc - first) / HUGE_PAGE_SIZE].samples += bins[i];
+    }
+  qsort(regions, nregions, sizeof(*regions), compare_regions);
+
+  for (size_t i = 0; i < nregions && i < max && regions[i].samples; i++)
+    {
+      if (remap_region(regions[i].start, prot))
+	{
+	  EPRINTF("cannot remap %#" PRIxPTR ": %s", regions[i].start, strerror(errno));
+	  break;
+	}
+      if (sp_debug)
+	DPRINTF("text at %#" PRIxPTR " (%" PRIu64 " samples) on huge page",
+		regions[i].start, regions[i].samples);
+    }
+  free(regions);
+}
@@ -0,0 +1,497 @@
+/*
+ * Blocking I/O profiler for Simple Profiler.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * When SP_IO is set, la_symbind redirects calls to common I/O entry
+ * points in libc to wrappers below.  Each wrapper measures elapsed
+ * (wall clock) time of the real function and accounts it to the call
+ * site, i.e. return address of the wrapper.  The table is dumped to
+ * <progname>.ioprof at exit of the process which set it up; a child
+ * forked without exec has a copy of the table, which it does not dump.
+ *
+ * Only calls through PLT are seen, so that I/O done inside libc itself
+ * (e.g. by stdio) is attributed to the caller of stdio routine only
+ * if that routine is also wrapped, which currently is not the case.
+ *
+ * Note that errno seen by the application is not disturbed by anything
+ * we call here, since auditing namespace has its own copy of libc.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include "simpleprof.h"
+
+/* Name, return type, parameter list and argument list.
+   First parameter of every function must be a file descriptor. */
+#define IO_FUNCTIONS							\
+  IOF(read, ssize_t, (int fd, void *buf, size_t n), (fd, buf, n))	\
+  IOF(write, ssize_t, (int fd, const void *buf, size_t n), (fd, buf, n)) \
+  IOF(pread, ssize_t, (int fd, void *buf, size_t n, off_t off),		\
+      (fd, buf, n, off))						\
+  IOF(pread64, ssize_t, (int fd, void *buf, size_t n, off64_t off),	\
+      (fd, buf, n, off))						\
+  IOF(pwrite, ssize_t, (int fd, const void *buf, size_t n, off_t off),	\
+      (fd, buf, n, off))						\
+  IOF(pwrite64, ssize_t, (int fd, const void *buf, size_t n, off64_t off), \
+      (fd, buf, n, off))						\
+  IOF(readv, ssize_t, (int fd, const struct iovec *iov, int cnt),	\
+      (fd, iov, cnt))							\
+  IOF(writev, ssize_t, (int fd, const struct iovec *iov, int cnt),	\
+      (fd, iov, cnt))							\
+  IOF(recv, ssize_t, (int fd, void *buf, size_t n, int flags),		\
+      (fd, buf, n, flags))						\
+  IOF(recvfrom, ssize_t, (int fd, void *buf, size_t n, int flags,	\
+			  struct sockaddr *addr, socklen_t *addrlen),	\
+      (fd, buf, n, flags, addr, addrlen))				\
+  IOF(recvmsg, ssize_t, (int fd, struct msghdr *msg, int flags),	\
+      (fd, msg, flags))							\
+  IOF(send, ssize_t, (int fd, const void *buf, size_t n, int flags),	\
+      (fd, buf, n, flags))						\
+  IOF(sendto, ssize_t, (int fd, const void *buf, size_t n, int flags,	\
+			const struct sockaddr *addr, socklen_t addrlen), \
+      (fd, buf, n, flags, addr, addrlen))				\
+  IOF(sendmsg, ssize_t, (int fd, const struct msghdr *msg, int flags),	\
+      (fd, msg, flags))							\
+  IOF(fsync, int, (int fd), (fd))					\
+  IOF(fdatasync, int, (int fd), (fd))
+
+enum io_func
+  {
+#define IOF(Name, Type, Params, Args)	IO_##Name,
+    IO_FUNCTIONS
+#undef IOF
+    NIO_FUNCS
+  };
+
+static const char *const io_func_names[NIO_FUNCS] =
+  {
+#define IOF(Name, Type, Params, Args)	#Name,
+    IO_FUNCTIONS
+#undef IOF
+  };
+
+enum fd_type
+  {
+    FD_UNKNOWN,			/* not classified (SP_IO_FDTYPE unset) */
+    FD_FILE,
+    FD_PIPE,
+    FD_SOCKET,
+    FD_CHAR,
+    FD_BLOCK,
+    FD_EVENTFD,
+    FD_OTHER,
+    NFD_TYPES
+  };
+
+static const char *const fd_type_names[NFD_TYPES] =
+  { "-", "file", "pipe", "socket", "chr", "blk", "eventfd", "other" };
+
+/* Latency histogram: bucket i counts calls which took [2^(i-1), 2^i) ns.
+   The last bucket also counts anything slower. */
+#define IO_NHIST	32
+
+struct io_site
+{
+  uint64_t key;			/* call site | kind << 56; 0 if unused */
+  uint64_t calls;
+  uint64_t bytes;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint32_t hist[IO_NHIST];
+};
+
+#define KEY_KIND_SHIFT	56
+#define MAKE_KIND(Func, Fdtype)	((unsigned int) (Func) << 3 | (Fdtype))
+
+_Static_assert(NIO_FUNCS <= 32 && NFD_TYPES <= 8,
+	       "kind does not fit in a byte");
+
+static _Bool io_enabled, io_classify;
+static struct io_site *io_table;
+static size_t io_table_mask;
+static uint64_t io_dropped;
+static pid_t owner;
+
+/*
+ * Types of descriptors on anonymous inodes, which only readlink tells
+ * apart.  Descriptors are closed and reused behind our back (by fclose,
+ * or inside libc), so an entry is used only for the same inode; since
+ * most anonymous descriptors share one inode, wrappers of close, dup2
+ * and dup3 forget entries too.
+ */
+#define FD_CACHE_MAX	4096
+static struct
+{
+  ino_t ino;
+  unsigned char type;		/* 0 = not yet classified */
+} fd_cache[FD_CACHE_MAX];
+
+static void
+fd_forget (int fd)
+{
+  if ((unsigned int) fd < FD_CACHE_MAX)
+    __atomic_store_n(&fd_cache[fd].type, 0, __ATOMIC_RELAXED);
+}
+
+static enum fd_type
+io_fdtype (int fd)
+{
+  struct stat st;
+  enum fd_type type;
+
+  if (fstat(fd, &st))
+    return FD_UNKNOWN;
+  switch (st.st_mode & S_IFMT)
+    {
+    case S_IFREG:  return FD_FILE;
+    case S_IFIFO:  return FD_PIPE;
+    case S_IFSOCK: return FD_SOCKET;
+    case S_IFCHR:  return FD_CHAR;
+    case S_IFBLK:  return FD_BLOCK;
+    }
+
+  const _Bool cached = (unsigned int) fd < FD_CACHE_MAX;
+  if (cached && (type = __atomic_load_n(&fd_cache[fd].type, __ATOMIC_ACQUIRE)) &&
+      fd_cache[fd].ino == st.st_ino)
+    return type;
+
+  /* eventfd, timerfd, signalfd etc. are anonymous inodes. */
+  char path[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+  char link[32];
+  ssize_t len;
+
+  snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+  len = readlink(path, link, sizeof(link) - 1);
+  if (len > 0)
+    link[len] = '\0';
+  type = (len > 0 && !strcmp(link, "anon_inode:[eventfd]")
+	  ? FD_EVENTFD : FD_OTHER);
+  if (cached)
+    {
+      fd_cache[fd].ino = st.st_ino;
+      __atomic_store_n(&fd_cache[fd].type, type, __ATOMIC_RELEASE);
+    }
+  return type;
+}
+
+static void
+io_record (enum io_func func, int fd, uintptr_t site,
+	   uint64_t bytes, uint64_t ns)
+{
+  const unsigned int kind = MAKE_KIND(func, io_classify ? io_fdtype(fd) : FD_UNKNOWN);
+  const uint64_t key = (uint64_t) site | (uint64_t) kind << KEY_KIND_SHIFT;
+  size_t i = (key * UINT64_C(0x9E3779B97F4A7C15)) >> 32;
+
+  for (size_t probe = 0; ; probe++, i++)
+    {
+      struct io_site *const s = &io_table[i & io_table_mask];
+      uint64_t k = __atomic_load_n(&s->key, __ATOMIC_ACQUIRE);
+
+      if (k == 0)
+	{
+	  if (__atomic_compare_exchange_n(&s->key, &k, key, 0,
+					  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	    k = key;
+	}
+      if (k == key)
+	{
+	  unsigned int b = ns ? 64 - __builtin_clzll(ns) : 0;
+	  if (b >= IO_NHIST)
+	    b = IO_NHIST - 1;
+
+	  __atomic_fetch_add(&s->calls, 1, __ATOMIC_RELAXED);
+	  __atomic_fetch_add(&s->bytes, bytes, __ATOMIC_RELAXED);
+	  __atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+	  __atomic_fetch_add(&s->hist[b], 1, __ATOMIC_RELAXED);
+	  uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	  while (ns > max &&
+		 !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	    ;
+	  return;
+	}
+      if (probe >= io_table_mask)
+	{
+	  __atomic_fetch_add(&io_dropped, 1, __ATOMIC_RELAXED);
+	  return;
+	}
+    }
+}
+
+static inline uint64_t
+elapsed_ns (const struct timespec *t0, const struct timespec *t1)
+{
+  return ((uint64_t) (t1->tv_sec - t0->tv_sec) * 1000000000
+	  + t1->tv_nsec - t0->tv_nsec);
+}
+
+#define IOF(Name, Type, Params, Args)					\
+  static Type (*real_##Name) Params;					\
+									\
+  static Type								\
+  wrap_##Name Params							\
+  {									\
+    const uintptr_t site = (uintptr_t) __builtin_return_address(0);	\
+    struct timespec t0, t1;						\
+									\
+    clock_gettime(CLOCK_MONOTONIC, &t0);				\
+    Type ret = real_##Name Args;					\
+    clock_gettime(CLOCK_MONOTONIC, &t1);				\
+    io_record(IO_##Name, fd, site, ret > 0 ? (uint64_t) ret : 0,	\
+	      elapsed_ns(&t0, &t1));					\
+    return ret;								\
+  }
+IO_FUNCTIONS
+#undef IOF
+
+/* close(), dup2() and dup3() are wrapped only to forget cached
+   descriptor types. */
+static int (*real_close) (int);
+static int (*real_dup2) (int, int);
+static int (*real_dup3) (int, int, int);
+
+static int
+wrap_close (int fd)
+{
+  fd_forget(fd);
+  return real_close(fd);
+}
+
+static int
+wrap_dup2 (int oldfd, int newfd)
+{
+  fd_forget(newfd);
+  return real_dup2(oldfd, newfd);
+}
+
+static int
+wrap_dup3 (int oldfd, int newfd, int flags)
+{
+  fd_forget(newfd);
+  return real_dup3(oldfd, newfd, flags);
+}
+
+static const struct
+{
+  const char *name;
+  void **real;
+  void *wrapper;
+} io_wrappers[] =
+  {
+#define IOF(Name, Type, Params, Args)	\
+    { #Name, (void **) &real_##Name, (void *) wrap_##Name },
+    IO_FUNCTIONS
+#undef IOF
+  };
+
+_Bool
+iotrace_init (void)
+{
+  if (!sp_env_flag(ENV_PREFIX "IO"))
+    return 0;
+
+  size_t nsites = 1024;
+  const char *env = getenv(ENV_PREFIX "IO_SITES");
+  if (env)
+    {
+      char dummy[1];
+
+      if (sscanf(env, "%zu %c", &nsites, dummy) != 1 ||
+	  nsites == 0 || nsites > (SIZE_MAX >> 1) / sizeof(struct io_site))
+	{
+	  EPRINTF("invalid %s %#s", ENV_PREFIX "IO_SITES", env);
+	  return 0;
+	}
+    }
+  /* Round up to a power of two. */
+  while (nsites & (nsites - 1))
+    nsites = (nsites | (nsites - 1)) + 1;
+
+  io_table = mmap(NULL, nsites * sizeof(struct io_site),
+		  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (io_table == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      io_table = NULL;
+      return 0;
+    }
+  io_table_mask = nsites - 1;
+  io_classify = sp_env_flag(ENV_PREFIX "IO_FDTYPE");
+  owner = getpid();
+  io_enabled = 1;
+
+  if (sp_debug)
+    DPRINTF("I/O profiling enabled (%zu call sites%s)",
+	    nsites, io_classify ? ", classify descriptors" : "");
+  return 1;
+}
+
+uintptr_t
+iotrace_symbind (const char *symname, uintptr_t value,
+		 const struct link_map *defmap)
+{
+  if (!io_enabled)
+    return value;
+
+  if (io_classify && objmap_is_libc(defmap))
+    {
+      if (!strcmp(symname, "close"))
+	{
+	  real_close = (int (*) (int)) value;
+	  return (uintptr_t) wrap_close;
+	}
+      if (!strcmp(symname, "dup2"))
+	{
+	  real_dup2 = (int (*) (int, int)) value;
+	  return (uintptr_t) wrap_dup2;
+	}
+      if (!strcmp(symname, "dup3"))
+	{
+	  real_dup3 = (int (*) (int, int, int)) value;
+	  return (uintptr_t) wrap_dup3;
+	}
+    }
+
+  for (size_t i = 0; i < sizeof(io_wrappers) / sizeof(io_wrappers[0]); i++)
+    if (!strcmp(symname, io_wrappers[i].name))
+      {
+	if (!objmap_is_libc(defmap))
+	  break;
+	*io_wrappers[i].real = (void *) value;
+	if (sp_debug)
+	  DPRINTF("wrapping %s", symname);
+	return (uintptr_t) io_wrappers[i].wrapper;
+      }
+  return value;
+}
+
+static int
+compare_sites (const void *a, const void *b)
+{
+  const struct io_site *const x = *(const struct io_site *const *) a;
+  const struct io_site *const y = *(const struct io_site *const *) b;
+
+  return (x->total_ns < y->total_ns) - (x->total_ns > y->total_ns);
+}
+
+static void __attribute__((destructor))
+iotrace_fini (void)
+{
+  if (!io_enabled || owner != getpid())
+    return;
+  io_enabled = 0;
+
+  size_t nused = 0;
+  for (size_t i = 0; i <= io_table_mask; i++)
+    if (__atomic_load_n(&io_table[i].key, __ATOMIC_ACQUIRE))
+      nused++;
+  if (!nused)
+    return;
+
+  struct io_site **sorted = malloc(nused * sizeof(*sorted));
+  if (!sorted)
+    return;
+  nused = 0;
+  for (size_t i = 0; i <= io_table_mask; i++)
+    if (io_table[i].key)
+      sorted[nused++] = &io_table[i];
+  qsort(sorted, nused, sizeof(*sorted), compare_sites);
+
+  char *buf = NULL;
+  size_t bufsiz = 0;
+  FILE *fp = open_memstream(&buf, &bufsiz);
+  if (!fp)
+    {
+      free(sorted);
+      return;
+    }
+
+  fprintf(fp, "# simpleprof I/O profile: pid %ld, %zu call sites",
+	  (long) getpid(), nused);
+  if (io_dropped)
+    fprintf(fp, ", %" PRIu64 " calls dropped", io_dropped);
+  fputs("\n# function\tfdtype\tcalls\tbytes\ttotal_ns\tmax_ns\tsite"
+	"\tlog2(ns):calls ...\n", fp);
+
+  for (size_t i = 0; i < nused; i++)
+    {
+      const struct io_site *const s = sorted[i];
+      const unsigned int kind = s->key >> KEY_KIND_SHIFT;
+      const uintptr_t site = s->key & ((UINT64_C(1) << KEY_KIND_SHIFT) - 1);
+      const struct sp_object *const obj = objmap_lookup(site);
+
+      fprintf(fp, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t",
+	      io_func_names[kind >> 3], fd_type_names[kind & 7],
+	      s->calls, s->bytes, s->total_ns, s->max_ns);
+      if (obj)
+	fprintf(fp, "%s+%#" PRIxPTR, obj->name, site - obj->base);
+      else
+	fprintf(fp, "%#" PRIxPTR, site);
+      char sep = '\t';
+      for (unsigned int b = 0; b < IO_NHIST; b++)
+	if (s->hist[b])
+	  {
+	    fprintf(fp, "%c%u:%" PRIu32, sep, b, s->hist[b]);
+	    sep = ' ';
+	  }
+      fputc('\n', fp);
+    }
+  fclose(fp);
+  free(sorted);
+
+  char *const fn = sp_output_path(sp_progname(), ".ioprof");
+  if (fn)
+    {
+      int fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, DEFFILEMODE);
+      if (fd < 0)
+	EPRINTF("cannot open %#s: %s", fn, strerror(errno));
+      else
+	{
+	  /* A single write to keep records of concurrent processes apart. */
+	  if (write(fd, buf, bufsiz) != (ssize_t) bufsiz)
+	    EPRINTF("write %#s: %s", fn, strerror(errno));
+	  close(fd);
+	}
+      if (sp_debug)
+	DPRINTF("I/O profile written to %#s", fn);
+      free(fn);
+    }
+  free(buf);
+}
@@ -0,0 +1,435 @@
+/*
+ * Simple Profiler - cache of library search results.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_LIBCACHE=<file>, the dynamic linker's search for libraries
+ * named without a slash is answered from an index shared by all
+ * processes, so that long LD_LIBRARY_PATH on slow filesystems is walked
+ * only once per library.  This is done for every process, whether
+ * profiled or not.
+ *
+ * la_objsearch is called with the name as needed (LA_SER_ORIG) before
+ * the search; if the index has the name under the same fingerprint
+ * (what determines the search path: LD_LIBRARY_PATH, the real path of
+ * the object needing the library and its DT_RUNPATH or DT_RPATH with
+ * $ORIGIN expanded, the executable's DT_RPATH, and the identity of
+ * /etc/ld.so.cache) and the file there is still the one learned, its
+ * path is returned and the dynamic linker opens it directly.  Otherwise
+ * the name is left pending, and the path it is found at is learned in
+ * la_objopen.
+ *
+ * The index is a fixed-size hash table in a shared mapping of the file.
+ * Each entry is guarded by a sequence counter, so a reader racing with
+ * a writer sees a miss rather than a torn path.  Entries are never
+ * invalidated: a library installed later into a directory earlier in
+ * the search path is not noticed until the file is removed or replaced.
+ *
+ * Processes which may not write the index only read it.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simpleprof.h"
+
+#define INDEX_MAGIC	UINT64_C(0x3230304c43505300)	/* "\0SPCL002" */
+#define INDEX_ENTRIES	4096
+#define PATH_SLOT	240
+
+/* Names searched for and not yet opened. */
+#define MAX_PENDING	64
+
+struct index_entry
+{
+  uint32_t seq;			/* odd while being written */
+  uint32_t miss_ns;		/* time the search took when learned */
+  uint64_t key;			/* 0 if unused */
+  uint64_t dev, ino;		/* identity of the file at PATH */
+  char path[PATH_SLOT];
+};
+
+struct index
+{
+  uint64_t magic;
+  uint64_t reserved[3];
+  struct index_entry entries[INDEX_ENTRIES];
+};
+
+struct pending
+{
+  uint64_t key;
+  uint64_t start;		/* CLOCK_MONOTONIC ns */
+  const struct index_entry *hit;
+  char name[PATH_SLOT];
+};
+
+static struct index *cache;
+static _Bool readonly;
+static uint64_t key_seed;	/* identity of ld.so.cache */
+static struct pending pending[MAX_PENDING];
+static unsigned int npending;
+static unsigned int hits, misses, learned;
+static uint64_t hit_ns, saved_ns;
+
+static uint64_t
+monotonic_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+hash_string (uint64_t h, const char *s)
+{
+  do
+    h = (h ^ (unsigned char) *s) * 0x100000001b3ULL;
+  while (*s++);
+  return h;
+}
+
+/* Maps the index if SP_LIBCACHE is set.  Called from la_version. */
+void
+libcache_init (void)
+{
+  const char *const fn = getenv(ENV_PREFIX "LIBCACHE");
+  if (!fn || !*fn)
+    return;
+
+  int fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, DEFFILEMODE);
+  if (fd < 0 && (errno == EACCES || errno == EPERM || errno == EROFS))
+    {
+      /* Use it as it is, if anyone else has made it. */
+      fd = open(fn, O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+	{
+	  if (sp_debug)
+	    DPRINTF("%#s: %s", fn, strerror(errno));
+	  return;
+	}
+      readonly = 1;
+    }
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st))
+    {
+      EPRINTF("%#s: %s", fn, strerror(errno));
+      if (fd >= 0)
+	close(fd);
+      return;
+    }
+  if (readonly && st.st_size == 0)
+    {
+      close(fd);
+      return;
+    }
+  /* Whoever comes first makes it; a larger file is someone else's. */
+  if (st.st_size != sizeof(struct index) &&
+      (readonly || st.st_size > (off_t) sizeof(struct index) ||
+       ftruncate(fd, sizeof(struct index))))
+    {
+      EPRINTF("%#s: not a library cache", fn);
+      close(fd);
+      return;
+    }
+
+  void *const p = mmap(NULL, sizeof(struct index),
+		       readonly ? PROT_READ : PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return;
+    }
+
+  uint64_t magic = 0;
+  struct index *const idx = p;
+  if (readonly)
+    magic = __atomic_load_n(&idx->magic, __ATOMIC_ACQUIRE);
+  else if (__atomic_compare_exchange_n(&idx->magic, &magic, INDEX_MAGIC, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    magic = INDEX_MAGIC;
+  if (magic != INDEX_MAGIC)
+    {
+      /* A file just made by someone else is not ready yet. */
+      if (magic != 0)
+	EPRINTF("%#s: not a library cache", fn);
+      munmap(p, sizeof(struct index));
+      return;
+    }
+  cache = idx;
+
+  /* Results change when ldconfig rewrites its cache. */
+  key_seed = 0xcbf29ce484222325ULL;
+  if (stat("/etc/ld.so.cache", &st) == 0)
+    key_seed = ((key_seed ^ st.st_ino) * 0x100000001b3ULL ^
+		(uint64_t) st.st_mtim.tv_sec) * 0x100000001b3ULL ^
+      (uint64_t) st.st_mtim.tv_nsec;
+}
+
+/* The dynamic section entry TAG of MAP, or NULL. */
+static const ElfW(Dyn) *
+dynamic_entry (const struct link_map *map, ElfW(Sxword) tag)
+{
+  if (!map->l_ld)
+    return NULL;
+  for (const ElfW(Dyn) *d = map->l_ld; d->d_tag != DT_NULL; d++)
+    if (d->d_tag == tag)
+      return d;
+  return NULL;
+}
+
+/* Hashes the search path in TAG of MAP, whose real directory is ORIGIN. */
+static uint64_t
+hash_search_path (uint64_t h, const struct link_map *map, ElfW(Sxword) tag,
+		  const char *origin)
+{
+  const ElfW(Dyn) *const path = dynamic_entry(map, tag);
+  const ElfW(Dyn) *const strtab = dynamic_entry(map, DT_STRTAB);
+  if (!path || !strtab)
+    return hash_string(h, "");
+
+  /* The dynamic linker relocates DT_STRTAB in place, except on targets
+     with a read-only dynamic section. */
+  ElfW(Addr) str = strtab->d_un.d_ptr;
+  if (str < map->l_addr)
+    str += map->l_addr;
+  const char *s = (const char *) str + path->d_un.d_val;
+
+  h = hash_string(h, tag == DT_RUNPATH ? "RUNPATH" : "RPATH");
+  for (const char *o; (o = strstr(s, "$ORIGIN")) != NULL; s = o + 7)
+    {
+      while (s < o)
+	h = (h ^ (unsigned char) *s++) * 0x100000001b3ULL;
+      h = hash_string(h, origin);
+    }
+  return hash_string(h, s);
+}
+
+/* Key of NAME needed by the object of COOKIE. */
+static uint64_t
+search_key (const char *name, const uintptr_t *cookie)
+{
+  const struct link_map *const map = (const struct link_map *) *cookie;
+  const char *requester = map && map->l_name ? map->l_name : "";
+  if (!*requester && map && !map->l_prev)
+    {
+      const char *const execfn = (const char *) getauxval(AT_EXECFN);
+      requester = execfn ? execfn : "";
+    }
+  const char *const path = getenv("LD_LIBRARY_PATH");
+
+  /* "./prog" is another program in another directory, and $ORIGIN is
+     where it really is. */
+  char real[PATH_MAX];
+  if (*requester && realpath(requester, real))
+    requester = real;
+  char origin[PATH_MAX];
+  const char *const slash = strrchr(requester, '/');
+  const size_t dirlen = slash ? (size_t) (slash - requester) : 0;
+  memcpy(origin, requester, dirlen);
+  origin[dirlen] = '\0';
+
+  uint64_t h = hash_string(key_seed, name);
+  h = hash_string(h, requester);
+  h = hash_string(h, path ? path : "");
+  if (map)
+    {
+      if (dynamic_entry(map, DT_RUNPATH))
+	h = hash_search_path(h, map, DT_RUNPATH, origin);
+      else
+	{
+	  /* DT_RPATH of the requester, then of the executable. */
+	  h = hash_search_path(h, map, DT_RPATH, origin);
+	  const struct link_map *exec = map;
+	  while (exec->l_prev)
+	    exec = exec->l_prev;
+	  if (exec != map)
+	    {
+	      const char *const execfn = (const char *) getauxval(AT_EXECFN);
+	      char exec_origin[PATH_MAX];
+	      if (!execfn || !realpath(execfn, exec_origin))
+		exec_origin[0] = '\0';
+	      char *const s = strrchr(exec_origin, '/');
+	      if (s)
+		*s = '\0';
+	      h = hash_search_path(h, exec, DT_RPATH, exec_origin);
+	    }
+	}
+    }
+  return h ? h : 1;
+}
+
+/* Reads the path of KEY into BUF and the identity of the file there
+   into DEV and INO, or returns NULL. */
+static const struct index_entry *
+lookup (uint64_t key, char *buf, uint64_t *dev, uint64_t *ino)
+{
+  size_t i = key % INDEX_ENTRIES;
+
+  for (unsigned int probe = 0; probe < INDEX_ENTRIES; probe++, i++)
+    {
+      const struct index_entry *const e = &cache->entries[i % INDEX_ENTRIES];
+      const uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      const uint64_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+
+      if (k == 0)
+	return NULL;
+      if (k != key)
+	continue;
+      memcpy(buf, e->path, PATH_SLOT);
+      *dev = e->dev;
+      *ino = e->ino;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (seq % 2 || __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq ||
+	  !memchr(buf, '\0', PATH_SLOT))
+	return NULL;
+      return e;
+    }
+  return NULL;
+}
+
+static void
+store (uint64_t key, const char *path, uint64_t miss_ns)
+{
+  struct stat st;
+  if (readonly || stat(path, &st))
+    return;
+
+  size_t i = key % INDEX_ENTRIES;
+
+  for (unsigned int probe = 0; probe < INDEX_ENTRIES; probe++, i++)
+    {
+      struct index_entry *const e = &cache->entries[i % INDEX_ENTRIES];
+      uint64_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+
+      if (k != 0 && k != key)
+	continue;
+
+      uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+      if (seq % 2 ||
+	  !__atomic_compare_exchange_n(&e->seq, &seq, seq + 1, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	return;			/* someone else is at it */
+      k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+      if (k != 0 && k != key)
+	{
+	  /* Taken meanwhile. */
+	  __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+	  continue;
+	}
+      strcpy(e->path, path);
+      e->dev = st.st_dev;
+      e->ino = st.st_ino;
+      e->miss_ns = miss_ns < UINT32_MAX ? miss_ns : UINT32_MAX;
+      __atomic_store_n(&e->key, key, __ATOMIC_RELEASE);
+      __atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+      learned++;
+      return;
+    }
+}
+
+/* la_objsearch with LA_SER_ORIG. */
+char *
+libcache_search (const char *name, uintptr_t *cookie)
+{
+  static char found[PATH_SLOT];
+
+  if (!cache || strchr(name, '/') || strlen(name) >= PATH_SLOT ||
+      npending >= MAX_PENDING)
+    return (char *) name;
+
+  struct pending *const p = &pending[npending++];
+  p->key = search_key(name, cookie);
+  p->start = monotonic_ns();
+  strcpy(p->name, name);
+  uint64_t dev, ino;
+  struct stat st;
+  p->hit = lookup(p->key, found, &dev, &ino);
+  if (p->hit && !strcmp(basename(found), name) && stat(found, &st) == 0 &&
+      st.st_dev == dev && st.st_ino == ino)
+    return found;
+  p->hit = NULL;
+  return (char *) name;
+}
+
+/* Learns the path MAP was found at, if it was searched for. */
+void
+libcache_opened (const struct link_map *map)
+{
+  if (!cache || !npending || !map->l_name)
+    return;
+
+  const char *const slash = strrchr(map->l_name, '/');
+  const char *const base = slash ? slash + 1 : map->l_name;
+  for (unsigned int i = npending; i-- > 0; )
+    {
+      struct pending *const p = &pending[i];
+      if (strcmp(p->name, base))
+	continue;
+
+      const uint64_t elapsed = monotonic_ns() - p->start;
+      if (p->hit)
+	{
+	  hits++;
+	  hit_ns += elapsed;
+	  if (p->hit->miss_ns > elapsed)
+	    saved_ns += p->hit->miss_ns - elapsed;
+	}
+      else
+	{
+	  misses++;
+	  if (strlen(map->l_name) < PATH_SLOT)
+	    store(p->key, map->l_name, elapsed);
+	}
+      *p = pending[--npending];
+      return;
+    }
+}
+
+/* Reports the hit rate of startup, for SP_DEBUG. */
+void
+libcache_report (void)
+{
+  if (!cache || !sp_debug)
+    return;
+  DPRINTF("library cache: %u hits, %u misses (%u learned), "
+	  "%" PRIu64 " us spent in hits, about %" PRIu64 " us saved",
+	  hits, misses, learned, hit_ns / 1000, saved_ns / 1000);
+}
@@ -0,0 +1,259 @@
+/*
+ * Simple Profiler - profiles of shared libraries shared by all programs.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * SP_LIBRARIES is a colon-separated list of wildcard patterns of
+ * basenames of shared libraries (e.g. "librpc.so*").  Each library
+ * matching it, whether loaded at startup or by dlopen later, gets a
+ * profile of its own, <basename>.<build ID>.profile, which every
+ * profiled program using that build of the library maps and counts its
+ * samples in, just as processes of a program share its profile.
+ *
+ * The profile has the layout of a program's, with the histogram covering
+ * the executable segment of the library at its link-time addresses, so
+ * "gprof librpc.so librpc.so.<build ID>.profile" reads it.  Rotation,
+ * budget and the seqlock apply to it as well.
+ *
+ * A library unloaded by dlclose gives up its entry, which the next
+ * library takes over.  Its profile stays mapped until then, so that the
+ * same build loaded again just counts in it again.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+#include "simpleprof.h"
+#include "gmonmeta.h"
+
+#define MAX_LIBRARIES	64
+
+struct library
+{
+  uintptr_t lowpc, highpc;	/* absolute; highpc is 0 once closed */
+  unsigned short *bins;
+  size_t nbins;
+  struct sp_gmon_spare *spare;
+  const struct link_map *map;
+  const char *build_id;		/* as objmap keeps it */
+  void *mapbase;
+  size_t mapsiz;
+};
+
+static struct library libraries[MAX_LIBRARIES];
+static unsigned int nlibraries;
+static char *patterns;
+static unsigned int pc_scale;
+
+/* Fractions of samples taken at a boosted rate (see sampler_boost). */
+static unsigned int residue;
+
+static _Bool
+match_library (const char *name)
+{
+  const char *const base = basename(name);
+  char copy[strlen(patterns) + 1];
+  char *saveptr;
+
+  strcpy(copy, patterns);
+  for (char *p = strtok_r(copy, ":", &saveptr); p; p = strtok_r(NULL, ":", &saveptr))
+    if (!fnmatch(p, base, FNM_PATHNAME))
+      return 1;
+  return 0;
+}
+
+/* Called from la_preinit with the scale of the program's profile. */
+void
+libprof_init (unsigned int scale)
+{
+  const char *const env = getenv(ENV_PREFIX "LIBRARIES");
+  if (!env || !*env)
+    return;
+  if (!sampler_has_context())
+    {
+      EPRINTF("%s is not supported on this architecture",
+	      ENV_PREFIX "LIBRARIES");
+      return;
+    }
+  if (!(patterns = strdup(env)))
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+  pc_scale = scale;
+
+  /* Index 0 is the program itself. */
+  const struct sp_object *obj;
+  for (unsigned int i = 1; (obj = objmap_get(i)); i++)
+    libprof_open(obj);
+}
+
+/* Maps the profile of OBJ if it is one of SP_LIBRARIES. */
+void
+libprof_open (const struct sp_object *obj)
+{
+  if (!patterns || !obj || !obj->map || !obj->highpc || !match_library(obj->name))
+    return;
+  if (!obj->build_id)
+    {
+      EPRINTF("%#s: no build ID, not profiled", obj->name);
+      return;
+    }
+
+  /* Same build loaded again, or else a free entry. */
+  struct library *lib = NULL;
+  const unsigned int n = nlibraries;
+  for (unsigned int i = 0; i < n; i++)
+    if (!libraries[i].highpc &&
+	(!lib || !strcmp(libraries[i].build_id, obj->build_id)))
+      lib = &libraries[i];
+  if (lib && !strcmp(lib->build_id, obj->build_id))
+    {
+      lib->map = obj->map;
+      lib->lowpc = obj->lowpc;
+      __atomic_store_n(&lib->highpc, obj->highpc, __ATOMIC_RELEASE);
+      if (sp_debug)
+	DPRINTF("%#s: profile reused", obj->name);
+      return;
+    }
+  if (!lib && n >= MAX_LIBRARIES)
+    {
+      EPRINTF("%#s: too many libraries, not profiled", obj->name);
+      return;
+    }
+
+  const size_t nbins = ((uintmax_t) (obj->highpc - obj->lowpc + 1) / 2
+			* pc_scale / 65536);
+  char header[SP_HEADER_SIZE];
+  sp_gmon_header(header, obj->lowpc - obj->base, nbins, pc_scale,
+		 sampler_frequency());
+
+  const char *const base = basename(obj->name);
+  char *meta, *name;
+  if (asprintf(&meta, "library=%s\nbuild-id=%s\n", base, obj->build_id) < 0)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+  const size_t trailer_size = gmon_meta_size(meta);
+  unsigned char *const trailer = malloc(trailer_size);
+  if (!trailer || asprintf(&name, "%s.%s", base, obj->build_id) < 0)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      free(trailer);
+      free(meta);
+      return;
+    }
+  gmon_meta_encode(trailer, meta);
+  free(meta);
+
+  char *const fn = sp_output_path(name, ".profile");
+  free(name);
+  const size_t mapsiz = SP_HEADER_SIZE + nbins * sizeof(unsigned short) + trailer_size;
+  void *const mapbase = (fn
+			 ? sp_map_file(fn, header, trailer, trailer_size, mapsiz)
+			 : NULL);
+  free(trailer);
+  if (mapbase)
+    {
+      if (lib)
+	munmap(lib->mapbase, lib->mapsiz);
+      else
+	lib = &libraries[n];
+
+      lib->lowpc = obj->lowpc;
+      lib->bins = (unsigned short *) ((char *) mapbase + SP_HEADER_SIZE);
+      lib->nbins = nbins;
+      lib->spare = sp_gmon_spare(mapbase);
+      lib->map = obj->map;
+      lib->build_id = obj->build_id;
+      lib->mapbase = mapbase;
+      lib->mapsiz = mapsiz;
+      __atomic_store_n(&lib->highpc, obj->highpc, __ATOMIC_RELEASE);
+      if (lib == &libraries[n])
+	__atomic_store_n(&nlibraries, n + 1, __ATOMIC_RELEASE);
+      if (sp_debug)
+	DPRINTF("library profile = %#s", fn);
+    }
+  free(fn);
+}
+
+/* Gives up the entry of MAP, which is being unloaded. */
+void
+libprof_close (const struct link_map *map)
+{
+  const unsigned int n = __atomic_load_n(&nlibraries, __ATOMIC_ACQUIRE);
+
+  for (unsigned int i = 0; i < n; i++)
+    if (libraries[i].highpc && libraries[i].map == map)
+      {
+	/* No sample can hit it from now on. */
+	__atomic_store_n(&libraries[i].highpc, 0, __ATOMIC_RELEASE);
+	libraries[i].map = NULL;
+	if (sp_debug)
+	  DPRINTF("library profile closed");
+      }
+}
+
+/* Called from SIGPROF handler. */
+void
+libprof_sample (const struct sp_sample *sample, unsigned int weight)
+{
+  const unsigned int n = __atomic_load_n(&nlibraries, __ATOMIC_ACQUIRE);
+  const struct library *lib = NULL;
+
+  for (unsigned int i = 0; i < n && !lib; i++)
+    if (sample->pc < __atomic_load_n(&libraries[i].highpc, __ATOMIC_ACQUIRE) &&
+	sample->pc >= libraries[i].lowpc)
+      lib = &libraries[i];
+  if (!lib)
+    return;
+
+  /* Other programs count in whole samples at the normal rate. */
+  const unsigned int ratio = sampler_ratio();
+  unsigned int count = weight / ratio;
+  const unsigned int rem = weight % ratio;
+  if (rem && __atomic_add_fetch(&residue, rem, __ATOMIC_RELAXED) % ratio < rem)
+    count++;
+
+  /* Same as sampler_bin. */
+  const size_t i = ((unsigned long long int) (sample->pc - lib->lowpc) / 2
+		    * pc_scale / 65536);
+  if (count == 0 || i >= lib->nbins ||
+      __atomic_load_n(&lib->bins[i], __ATOMIC_RELAXED) > USHRT_MAX - count)
+    return;
+
+  __atomic_fetch_add(&lib->spare->seq_begin, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add(&lib->bins[i], count, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&lib->spare->seq_end, 1, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,219 @@
+/*
+ * Loaded object map for Simple Profiler.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * We cannot use dl_iterate_phdr(3) or dladdr(3) here because they
+ * only look at the namespace of the caller, which is the auditing
+ * namespace.  Instead we remember every object reported to la_objopen
+ * and find its program headers by ourselves.
+ *
+ * Entries are never moved nor freed so that objmap_lookup can be used
+ * from signal handlers.
+ */
+
+#define _GNU_SOURCE 1
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/auxv.h>
+
+#include "simpleprof.h"
+#include "elfnote.h"
+
+#if __ELF_NATIVE_CLASS == 64
+# define NATIVE_ELFCLASS	ELFCLASS64
+#else
+# define NATIVE_ELFCLASS	ELFCLASS32
+#endif
+
+#define MAX_OBJECTS	1024
+
+static const char *
+build_id (const struct link_map *map, const ElfW(Phdr) *phdr, unsigned int phnum)
+{
+  unsigned char id[BUILD_ID_MAX];
+  size_t len = 0;
+
+  for (unsigned int i = 0; i < phnum && !len; i++)
+    if (phdr[i].p_type == PT_NOTE)
+      len = note_build_id((const void *) (map->l_addr + phdr[i].p_vaddr),
+			  phdr[i].p_memsz, id);
+  if (!len)
+    return NULL;
+
+  char *const hex = malloc(2 * len + 1);
+  if (hex)
+    for (size_t i = 0; i < len; i++)
+      {
+	static const char digits[] = "0123456789abcdef";
+	hex[2 * i] = digits[id[i] >> 4];
+	hex[2 * i + 1] = digits[id[i] & 15];
+	hex[2 * i + 2] = '\0';
+      }
+  return hex;
+}
+
+static struct sp_object objects[MAX_OBJECTS];
+static unsigned int nobjects;
+
+_Bool
+objmap_phdrs (const struct link_map *map,
+	      const ElfW(Phdr) **phdrp, unsigned int *phnump)
+{
+  if (!map->l_prev)
+    {
+      /* The main program. */
+      unsigned long phdr = getauxval(AT_PHDR);
+      unsigned long phnum = getauxval(AT_PHNUM);
+
+      if (!phdr || !phnum)
+	return 0;
+      *phdrp = (const ElfW(Phdr) *) phdr;
+      *phnump = phnum;
+      return 1;
+    }
+
+  /* Shared objects (and vDSO) normally map their ELF header
+     at the beginning of the first loadable segment. */
+  const ElfW(Ehdr) *const ehdr = (const ElfW(Ehdr) *) map->l_addr;
+  if (!ehdr ||
+      memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ehdr->e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+      ehdr->e_phentsize != sizeof(ElfW(Phdr)))
+    return 0;
+  *phdrp = (const ElfW(Phdr) *) (map->l_addr + ehdr->e_phoff);
+  *phnump = ehdr->e_phnum;
+  return 1;
+}
+
+void
+objmap_add (const struct link_map *map)
+{
+  unsigned int n = __atomic_load_n(&nobjects, __ATOMIC_ACQUIRE);
+  if (n >= MAX_OBJECTS)
+    return;
+
+  struct sp_object *const obj = &objects[n];
+  const ElfW(Phdr) *phdr;
+  unsigned int phnum;
+
+  const char *const execfn = (const char *) getauxval(AT_EXECFN);
+  if (map->l_prev)
+    obj->name = strdup(map->l_name);
+  else if (execfn && execfn[0] == '/')
+    /* As found in $PATH; readlink of /proc/self/exe costs a lot more
+       than the rest of startup in short-lived processes. */
+    obj->name = execfn;
+  else
+    {
+      char buf[PATH_MAX];
+      ssize_t len = readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+      if (len > 0)
+	{
+	  buf[len] = '\0';
+	  obj->name = strdup(buf);
+	}
+      else if (sp_progname())
+	obj->name = strdup(sp_progname());
+    }
+  if (!obj->name)
+    obj->name = "";
+
+  if (objmap_phdrs(map, &phdr, &phnum))
+    {
+      for (unsigned int i = 0; i < phnum; i++)
+	if (phdr[i].p_type == PT_LOAD &&
+	    (phdr[i].p_flags & PF_X) && phdr[i].p_memsz != 0)
+	  {
+	    obj->lowpc = map->l_addr + phdr[i].p_vaddr;
+	    obj->highpc = obj->lowpc + phdr[i].p_memsz;
+	    break;
+	  }
+      obj->build_id = build_id(map, phdr, phnum);
+    }
+
+  obj->base = map->l_addr;
+  obj->map = map;
+  __atomic_store_n(&nobjects, n + 1, __ATOMIC_RELEASE);
+}
+
+void
+objmap_remove (const struct link_map *map)
+{
+  unsigned int n = __atomic_load_n(&nobjects, __ATOMIC_ACQUIRE);
+
+  /* Keep the entry so that already-recorded addresses can still be
+     reported even after la_objclose at exit.  An object loaded later
+     at the same address shadows it, see objmap_lookup. */
+  for (unsigned int i = 0; i < n; i++)
+    if (objects[i].map == map)
+      objects[i].map = NULL;
+}
+
+const struct sp_object *
+objmap_lookup (uintptr_t pc)
+{
+  for (unsigned int i = __atomic_load_n(&nobjects, __ATOMIC_ACQUIRE); i-- > 0; )
+    if (pc >= objects[i].lowpc && pc < objects[i].highpc)
+      return &objects[i];
+  return NULL;
+}
+
+const struct sp_object *
+objmap_find (const struct link_map *map)
+{
+  unsigned int n = __atomic_load_n(&nobjects, __ATOMIC_ACQUIRE);
+
+  for (unsigned int i = 0; i < n; i++)
+    if (objects[i].map == map)
+      return &objects[i];
+  return NULL;
+}
+
+const struct sp_object *
+objmap_get (unsigned int index)
+{
+  if (index >= __atomic_load_n(&nobjects, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &objects[index];
+}
+
+/* Whether MAP is libc (or libpthread, which used to be separate). */
+_Bool
+objmap_is_libc (const struct link_map *map)
+{
+  const struct sp_object *const obj = objmap_find(map);
+  if (!obj)
+    return 0;
+
+  const char *const base = basename(obj->name);
+  return (!strncmp(base, "libc.so", sizeof("libc.so") - 1) ||
+	  !strncmp(base, "libpthread.so", sizeof("libpthread.so") - 1));
+}
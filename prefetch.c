@@ -0,0 +1,171 @@
+/*
+ * Simple Profiler - prefetching of hot text.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_PREFETCH set, a helper thread started from la_preinit brings
+ * in the pages of the program's text which have samples in the profile
+ * so far, hottest first, while the program starts up: MADV_WILLNEED
+ * starts reading all of them from disk, and then MADV_POPULATE_READ (or
+ * a read of each page, on kernels without it) maps them, so that the
+ * program takes neither major nor minor faults on them later.
+ *
+ * With SP_DEBUG, the time it took and the page faults the process took
+ * meanwhile are reported.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "simpleprof.h"
+
+#ifndef MADV_POPULATE_READ
+# define MADV_POPULATE_READ	22
+#endif
+
+struct page
+{
+  uintptr_t addr;
+  uint64_t samples;
+};
+
+static struct page *pages;
+static size_t npages;
+
+static int
+compare_pages (const void *a, const void *b)
+{
+  const struct page *const x = a, *const y = b;
+  return (x->samples < y->samples) - (x->samples > y->samples);
+}
+
+static void *
+prefetch_thread (void *arg)
+{
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  struct timespec start, end;
+  struct rusage before, after;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  getrusage(RUSAGE_SELF, &before);
+
+  for (size_t i = 0; i < npages; i++)
+    madvise((void *) pages[i].addr, pagesize, MADV_WILLNEED);
+
+  _Bool populate = 1;
+  for (size_t i = 0; i < npages; i++)
+    if (!populate ||
+	madvise((void *) pages[i].addr, pagesize, MADV_POPULATE_READ))
+      {
+	/* EINVAL before Linux 5.14. */
+	populate = 0;
+	(void) *(volatile const char *) pages[i].addr;
+      }
+
+  if (sp_debug)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      getrusage(RUSAGE_SELF, &after);
+      DPRINTF("prefetched %zu pages in %ld us "
+	      "(process took %ld major and %ld minor faults meanwhile)",
+	      npages,
+	      (long) ((end.tv_sec - start.tv_sec) * 1000000
+		      + (end.tv_nsec - start.tv_nsec) / 1000),
+	      after.ru_majflt - before.ru_majflt,
+	      after.ru_minflt - before.ru_minflt);
+    }
+  free(pages);
+  return NULL;
+}
+
+/*
+ * Starts prefetching pages of the executable segment at LOWPC of MEMSZ
+ * bytes which have samples in the NBINS bins of the profile made with
+ * SCALE.  Called from la_preinit.
+ */
+void
+prefetch_start (const unsigned short *bins, size_t nbins,
+		uintptr_t lowpc, size_t memsz, unsigned int scale)
+{
+  if (!sp_env_flag(ENV_PREFIX "PREFETCH"))
+    return;
+
+  const uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+  const uintptr_t first = lowpc & ~(pagesize - 1);
+  const size_t n = (lowpc + memsz - first + pagesize - 1) / pagesize;
+  if (!(pages = calloc(n, sizeof(*pages))))
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return;
+    }
+
+  /* Inverse of sampler_bin. */
+  for (size_t i = 0; i < nbins; i++)
+    {
+      const uintptr_t pc = lowpc + (uintmax_t) i * 65536 * 2 / scale;
+      if (bins[i] && pc < lowpc + memsz)
+	pages[(pc - first) / pagesize].samples += bins[i];
+    }
+  for (size_t i = 0; i < n; i++)
+    if (pages[i].samples)
+      pages[npages++] = (struct page) { first + i * pagesize, pages[i].samples };
+  if (npages == 0)
+    {
+      free(pages);
+      return;
+    }
+  qsort(pages, npages, sizeof(*pages), compare_pages);
+
+  /* The helper must not take signals meant for the program. */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  const int e = pthread_create(&thread, &attr, prefetch_thread, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  if (e)
+    {
+      EPRINTF("pthread_create: %s", strerror(e));
+      free(pages);
+    }
+}
@@ -0,0 +1,420 @@
+/*
+ * Simple Profiler - flight recorder of recent samples.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_RECORDER=<seconds>, every sample is also logged with its time
+ * into a ring in memory, large enough for that many seconds of samples
+ * on all CPUs, and written lock-free as the timeline is (see sptrace.h).
+ *
+ * A helper thread reads commands, one per line, from a FIFO
+ * <progname>.<pid>.ctl in the output directory:
+ *
+ *   dump [SECONDS]	write samples of the last SECONDS (default: all
+ *			the ring holds) to a profile of their own,
+ *			<progname>.<pid>.<UTC time>.recent.profile
+ *
+ * The signal SP_RECORDER_SIGNAL, if set, and calls to sp_dump_recent()
+ * (redirected by la_symbind from a no-op definition in the program)
+ * queue a dump command the same way, so that nothing but write(2) is
+ * done in the signal handler or the calling thread.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simpleprof.h"
+
+struct recent_sample
+{
+  uint64_t seq;			/* index + 1 when complete */
+  uint64_t time_ns;		/* CLOCK_MONOTONIC */
+  uintptr_t pc;
+  unsigned int weight;
+};
+
+static struct recent_sample *ring;
+static uint64_t ring_head, ring_mask;
+static unsigned int window;	/* seconds */
+static int ctl_rfd = -1, ctl_wfd = -1;
+static char *ctl_path;
+static pid_t owner;
+
+static inline uint64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+_Bool
+recorder_init (void)
+{
+  const char *const env = getenv(ENV_PREFIX "RECORDER");
+  if (!env || !*env)
+    return 0;
+
+  char dummy[1];
+  if (sscanf(env, "%u %c", &window, dummy) != 1 ||
+      window == 0 || window > 3600)
+    {
+      EPRINTF("invalid %s %#s", ENV_PREFIX "RECORDER", env);
+      return 0;
+    }
+  if (!sampler_has_context())
+    {
+      EPRINTF("%s is not supported on this architecture",
+	      ENV_PREFIX "RECORDER");
+      return 0;
+    }
+
+  /* Each CPU running the program takes its share of samples. */
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 1)
+    ncpus = 1;
+  uint64_t n = (uint64_t) window * sampler_frequency() * ncpus;
+  while (n & (n - 1))
+    n = (n | (n - 1)) + 1;
+
+  void *const p = mmap(NULL, n * sizeof(*ring), PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return 0;
+    }
+  ring = p;
+  ring_mask = n - 1;
+
+  if (sp_debug)
+    DPRINTF("recorder: %u seconds, %" PRIu64 " samples", window, n);
+  return 1;
+}
+
+/* Called from SIGPROF handler. */
+void
+recorder_sample (const struct sp_sample *sample, unsigned int weight)
+{
+  if (!ring)
+    return;
+
+  const uint64_t idx = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED);
+  struct recent_sample *const rec = &ring[idx & ring_mask];
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  rec->time_ns = now_ns();
+  rec->pc = sample->pc;
+  rec->weight = weight;
+  __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/* Queues "dump SECONDS" for the helper thread.  Async-signal-safe. */
+static void
+request_dump (unsigned int seconds)
+{
+  char cmd[sizeof("dump \n") + 3 * sizeof(seconds)];
+  char *p = cmd + sizeof(cmd);
+
+  if (ctl_wfd < 0 || getpid() != owner)
+    return;
+  *--p = '\n';
+  do
+    *--p = '0' + seconds % 10;
+  while ((seconds /= 10) != 0);
+  p -= sizeof("dump ") - 1;
+  memcpy(p, "dump ", sizeof("dump ") - 1);
+
+  const int saved_errno = errno;
+  /* Short, so written at once or not at all (if the FIFO is full). */
+  const ssize_t written = write(ctl_wfd, p, cmd + sizeof(cmd) - p);
+  (void) written;
+  errno = saved_errno;
+}
+
+static void
+dump_signal_handler (int signo)
+{
+  request_dump(0);
+}
+
+/* Replaces no-op sp_dump_recent() of the program.  SECONDS of 0 means
+   the whole window. */
+static void
+wrap_dump_recent (unsigned int seconds)
+{
+  request_dump(seconds);
+}
+
+uintptr_t
+recorder_symbind (const char *symname, uintptr_t value,
+		  const struct link_map *defmap)
+{
+  if (!ring || strcmp(symname, "sp_dump_recent"))
+    return value;
+  if (sp_debug)
+    DPRINTF("wrapping %s", symname);
+  return (uintptr_t) wrap_dump_recent;
+}
+
+/* Writes samples of the last SECONDS (0 for all) to a profile. */
+static void
+dump (unsigned int seconds)
+{
+  const size_t nbins = sp_profile_nbins();
+  uint32_t *const sums = calloc(nbins, sizeof(*sums));
+  unsigned short *const bins = calloc(nbins, sizeof(*bins));
+  if (!sums || !bins)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      free(sums);
+      free(bins);
+      return;
+    }
+
+  const uint64_t now = now_ns();
+  const uint64_t span = (uint64_t) seconds * 1000000000;
+  const uint64_t since = seconds && now > span ? now - span : 0;
+  const uint64_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+  uint64_t nrecords = 0;
+
+  for (uint64_t idx = head > ring_mask ? head - ring_mask - 1 : 0; idx < head; idx++)
+    {
+      const struct recent_sample *const rec = &ring[idx & ring_mask];
+
+      if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != idx + 1)
+	continue;
+      const uint64_t time_ns = rec->time_ns;
+      const uintptr_t pc = rec->pc;
+      const unsigned int weight = rec->weight;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) != idx + 1 ||
+	  time_ns < since)
+	continue;
+
+      const size_t i = sampler_bin(pc);
+      if (i != SIZE_MAX && sums[i] <= UINT32_MAX - weight)
+	sums[i] += weight;
+      nrecords++;
+    }
+
+  /* Back to samples at the normal rate, as in the profile. */
+  const unsigned int ratio = sampler_ratio();
+  for (size_t i = 0; i < nbins; i++)
+    {
+      const uint32_t v = (sums[i] + ratio / 2) / ratio;
+      bins[i] = v < USHRT_MAX ? v : USHRT_MAX;
+    }
+  free(sums);
+
+  char *const fn = sp_snapshot_path("recent", NULL);
+  if (fn && sp_write_profile(fn, "recent", bins, NULL, 0, 1) == 0 && sp_debug)
+    DPRINTF("recorder: wrote %" PRIu64 " samples to %#s", nrecords, fn);
+  free(fn);
+  free(bins);
+}
+
+static void
+command (const char *line)
+{
+  unsigned int seconds = 0;
+  char dummy[1];
+
+  if (!*line)
+    return;
+  if (!strcmp(line, "dump") ||
+      sscanf(line, "dump %u %c", &seconds, dummy) == 1)
+    dump(seconds);
+  else
+    EPRINTF("%#s: unknown command %#s", ctl_path ? ctl_path : "recorder", line);
+}
+
+static void *
+recorder_thread (void *arg)
+{
+  char buf[256];
+  size_t len = 0;
+
+  for (;;)
+    {
+      const ssize_t n = read(ctl_rfd, buf + len, sizeof(buf) - len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	{
+	  EPRINTF("recorder: read: %s", n ? strerror(errno) : "end of file");
+	  return NULL;
+	}
+      len += n;
+
+      char *eol;
+      while ((eol = memchr(buf, '\n', len)) != NULL)
+	{
+	  *eol = '\0';
+	  command(buf);
+	  len -= eol + 1 - buf;
+	  memmove(buf, eol + 1, len);
+	}
+      /* Too long a line is dropped. */
+      if (len == sizeof(buf))
+	len = 0;
+    }
+  return NULL;
+}
+
+/* Opens the control FIFO, or failing that, a pipe for the program only. */
+static _Bool
+open_control (void)
+{
+  char suffix[sizeof(".ctl") + 3 * sizeof(pid_t) + 1];
+  snprintf(suffix, sizeof(suffix), ".%ld.ctl", (long) owner);
+  ctl_path = sp_output_path(sp_progname(), suffix);
+  if (ctl_path)
+    {
+      unlink(ctl_path);
+      /* Opened for reading first so that opening for writing without
+	 blocking succeeds. */
+      if (mkfifo(ctl_path, S_IRUSR | S_IWUSR) == 0 &&
+	  (ctl_rfd = open(ctl_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) >= 0 &&
+	  (ctl_wfd = open(ctl_path, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) >= 0)
+	{
+	  fcntl(ctl_rfd, F_SETFL, fcntl(ctl_rfd, F_GETFL) & ~O_NONBLOCK);
+	  return 1;
+	}
+      EPRINTF("cannot create %#s: %s", ctl_path, strerror(errno));
+      if (ctl_rfd >= 0)
+	close(ctl_rfd);
+      unlink(ctl_path);
+      free(ctl_path);
+      ctl_path = NULL;
+    }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC))
+    {
+      EPRINTF("pipe: %s", strerror(errno));
+      ctl_rfd = -1;
+      return 0;
+    }
+  ctl_rfd = fds[0];
+  ctl_wfd = fds[1];
+  fcntl(ctl_wfd, F_SETFL, O_NONBLOCK);
+  return 1;
+}
+
+static int
+parse_signal (const char *name)
+{
+  static const struct { const char *name; int signo; } names[] =
+    {
+      { "HUP", SIGHUP }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+      { "URG", SIGURG }, { "WINCH", SIGWINCH }, { "PWR", SIGPWR },
+    };
+  int signo;
+  char dummy[1];
+
+  if (sscanf(name, "%d %c", &signo, dummy) == 1)
+    return signo > 0 && signo < NSIG && signo != SIGPROF ? signo : 0;
+  if (!strncmp(name, "SIG", 3))
+    name += 3;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    if (!strcmp(name, names[i].name))
+      return names[i].signo;
+  return 0;
+}
+
+/* Starts the helper thread, once the program is known. */
+void
+recorder_start (void)
+{
+  if (!ring)
+    return;
+
+  owner = getpid();
+  if (!open_control())
+    return;
+
+  /* The helper thread must not take signals meant for the program. */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  const int e = pthread_create(&thread, &attr, recorder_thread, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+  if (e)
+    {
+      EPRINTF("pthread_create: %s", strerror(e));
+      close(ctl_wfd);
+      ctl_wfd = -1;
+      return;
+    }
+
+  const char *const env = getenv(ENV_PREFIX "RECORDER_SIGNAL");
+  if (env && *env)
+    {
+      const int signo = parse_signal(env);
+      struct sigaction act;
+
+      memset(&act, 0, sizeof(act));
+      act.sa_handler = dump_signal_handler;
+      act.sa_flags = SA_RESTART;
+      if (!signo)
+	EPRINTF("invalid %s %#s", ENV_PREFIX "RECORDER_SIGNAL", env);
+      else if (sigaction(signo, &act, NULL))
+	EPRINTF("sigaction: %s", strerror(errno));
+    }
+
+  if (sp_debug)
+    DPRINTF("recorder: control %#s", ctl_path ? ctl_path : "(none)");
+}
+
+static void __attribute__((destructor))
+recorder_fini (void)
+{
+  if (ctl_path && owner == getpid())
+    unlink(ctl_path);
+}
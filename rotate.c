@@ -0,0 +1,447 @@
+/*
+ * Simple Profiler - rotation of profile files.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * A profile is rotated when a process starting up finds it older than
+ * SP_ROTATE_AGE, holding more than SP_ROTATE_SAMPLES samples or written
+ * by more than SP_ROTATE_RUNS runs.  Rotation renames (or unlinks) the
+ * file, so processes which still have it mapped keep writing into the
+ * old inode undisturbed, and the starting process creates a fresh one.
+ *
+ * All of this happens under an exclusive flock(2) on the output
+ * directory, which serializes rotation and creation of profiles.  Every
+ * process also holds a shared lock on its profile for as long as it is
+ * mapped, so that archives are compacted (zero pages punched out) only
+ * once nobody writes to them any more.  Compacted archives are marked
+ * with the extended attribute user.simpleprof.compacted.
+ *
+ * SP_PROFILE_BUDGET bounds total disk usage of profiles and archives in
+ * the output directory; when it is exceeded, archives left in use at
+ * rotation are compacted, then the oldest archives, snapshots and
+ * callers profiles are deleted to meet it, as are timeline traces (see
+ * timeline.c).  Profiles mapped by processes, of programs and of
+ * libraries, are counted but left alone, as is any of these files
+ * still held by a process.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "simpleprof.h"
+#include "gmonmeta.h"
+
+#define COMPACTED_XATTR	"user.simpleprof.compacted"
+
+static _Bool initialized, enabled, archive;
+static unsigned long max_age, max_samples, max_runs;
+static unsigned long long budget;
+
+/* Parses "<number>[<unit>]" where unit is one of UNITS, each of which
+   multiplies by the corresponding element of SCALES. */
+static _Bool
+parse_scaled (const char *name, const char *units,
+	      const unsigned long *scales, unsigned long long *valp)
+{
+  const char *const env = getenv(name);
+  if (!env || !*env)
+    return 0;
+
+  unsigned long long val;
+  char unit = '\0', dummy[1];
+  const char *u;
+  const int n = sscanf(env, "%llu %c %c", &val, &unit, dummy);
+
+  if (n < 1 || n > 2 ||
+      (n == 2 && !(u = strchr(units, unit))) ||
+      (n == 2 && __builtin_mul_overflow(val, scales[u - units], &val)))
+    {
+      EPRINTF("invalid %s %#s", name, env);
+      return 0;
+    }
+  *valp = val;
+  return val != 0;
+}
+
+static void
+rotate_init (void)
+{
+  static const unsigned long time_scales[] = { 1, 60, 3600, 86400 };
+  static const unsigned long size_scales[] = { 1UL << 10, 1UL << 20, 1UL << 30 };
+  static const unsigned long count_scales[] = { 1000, 1000000 };
+  unsigned long long val;
+
+  initialized = 1;
+  if (parse_scaled(ENV_PREFIX "ROTATE_AGE", "smhd", time_scales, &val))
+    max_age = val < ULONG_MAX ? val : ULONG_MAX;
+  if (parse_scaled(ENV_PREFIX "ROTATE_SAMPLES", "kM", count_scales, &val))
+    max_samples = val < ULONG_MAX ? val : ULONG_MAX;
+  /* Run count saturates at UINT16_MAX. */
+  if (parse_scaled(ENV_PREFIX "ROTATE_RUNS", "", NULL, &val))
+    max_runs = val < UINT16_MAX ? val : UINT16_MAX;
+  parse_scaled(ENV_PREFIX "PROFILE_BUDGET", "KMG", size_scales, &budget);
+  archive = sp_env_flag(ENV_PREFIX "ROTATE_ARCHIVE");
+
+  enabled = max_age || max_samples || max_runs || budget;
+}
+
+/* Returns a descriptor of the directory containing PATH, locked
+   exclusively, or -1 if rotation is not enabled. */
+int
+rotate_lock (const char *path)
+{
+  if (!initialized)
+    rotate_init();
+  if (!enabled)
+    return -1;
+  return rotate_lock_dir(path);
+}
+
+/* Same as rotate_lock, whether rotation is enabled or not. */
+int
+rotate_lock_dir (const char *path)
+{
+  const char *const slash = strrchr(path, '/');
+  char dir[slash ? slash - path + 2 : 2];
+  if (slash)
+    {
+      memcpy(dir, path, slash - path + 1);
+      dir[slash - path + 1] = '\0';
+    }
+  else
+    strcpy(dir, ".");
+
+  const int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    {
+      EPRINTF("%#s: %s", dir, strerror(errno));
+      return -1;
+    }
+  while (flock(fd, LOCK_EX))
+    if (errno != EINTR)
+      {
+	EPRINTF("flock %#s: %s", dir, strerror(errno));
+	close(fd);
+	return -1;
+      }
+  return fd;
+}
+
+void
+rotate_unlock (int lockfd)
+{
+  if (lockfd >= 0)
+    close(lockfd);
+}
+
+/* Whether the profile mapped at IMAGE (with histogram bins from
+   HEADER_SIZE to BINS_END) has to be rotated. */
+_Bool
+rotate_due (const void *image, size_t header_size, size_t bins_end)
+{
+  if (!enabled)
+    return 0;
+
+  const struct sp_gmon_spare *const spare = sp_gmon_spare(image);
+
+  if (max_runs && spare->runs >= max_runs)
+    {
+      if (sp_debug)
+	DPRINTF("rotating after %u runs", (unsigned int) spare->runs);
+      return 1;
+    }
+  if (max_age && spare->created &&
+      (unsigned long) time(NULL) - spare->created >= max_age)
+    {
+      if (sp_debug)
+	DPRINTF("rotating profile created %" PRIu32 " seconds ago",
+		(uint32_t) time(NULL) - spare->created);
+      return 1;
+    }
+  if (max_samples)
+    {
+      const unsigned short *const bins =
+	(const unsigned short *) ((const char *) image + header_size);
+      const size_t nbins = (bins_end - header_size) / sizeof(*bins);
+      unsigned long total = 0;
+
+      for (size_t i = 0; i < nbins; i++)
+	if (bins[i] && (total += bins[i]) >= max_samples)
+	  {
+	    if (sp_debug)
+	      DPRINTF("rotating profile with %lu samples", total);
+	    return 1;
+	  }
+    }
+  return 0;
+}
+
+/* Punches out all-zero pages of FD, unless some process still has it
+   mapped (and thus holds a shared lock) or it has been done already. */
+static void
+compact (int fd, const char *name)
+{
+  if (fgetxattr(fd, COMPACTED_XATTR, NULL, 0) >= 0 ||
+      flock(fd, LOCK_EX | LOCK_NB))
+    return;
+
+  const size_t pagesize = sysconf(_SC_PAGESIZE);
+  char buf[pagesize];
+  off_t data = 0, punch = -1, off;
+
+  while ((data = lseek(fd, data, SEEK_DATA)) >= 0)
+    {
+      const off_t hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0)
+	break;
+      for (off = data; off < hole; off += pagesize)
+	{
+	  const ssize_t n = pread(fd, buf, pagesize, off);
+	  if (n <= 0)
+	    break;
+	  const _Bool zero = !buf[0] && !memcmp(buf, buf + 1, n - 1);
+	  if (zero && punch < 0)
+	    punch = off;
+	  else if (!zero && punch >= 0)
+	    {
+	      fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			punch, off - punch);
+	      punch = -1;
+	    }
+	}
+      if (punch >= 0)
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		  punch, off - punch);
+      punch = -1;
+      data = hole;
+    }
+  fsetxattr(fd, COMPACTED_XATTR, "", 0, 0);
+  if (sp_debug)
+    DPRINTF("compacted %#s", name);
+}
+
+/* Moves the profile at PATH out of the way.  Must be called with the
+   directory locked.  Returns 0 on success. */
+int
+rotate_archive (const char *path)
+{
+  if (!archive)
+    {
+      if (unlink(path) && errno != ENOENT)
+	{
+	  EPRINTF("unlink %#s: %s", path, strerror(errno));
+	  return -1;
+	}
+      return 0;
+    }
+
+  const size_t len = strlen(path);
+  char name[len + sizeof(".YYYYmmddTHHMMSS-999")];
+  const time_t now = time(NULL);
+  struct tm tm;
+
+  memcpy(name, path, len);
+  name[len] = '.';
+  strftime(name + len + 1, sizeof(name) - len - 1, "%Y%m%dT%H%M%S",
+	   gmtime_r(&now, &tm));
+
+  const size_t stamplen = strlen(name);
+  for (unsigned int i = 1; link(path, name); i++)
+    if (errno != EEXIST || i >= 1000)
+      {
+	EPRINTF("link %#s: %s", name, strerror(errno));
+	return -1;
+      }
+    else
+      snprintf(name + stamplen, sizeof(name) - stamplen, "-%u", i);
+
+  unlink(path);
+  if (sp_debug)
+    DPRINTF("archived profile as %#s", name);
+
+  const int fd = open(name, O_RDWR | O_CLOEXEC);
+  if (fd >= 0)
+    {
+      compact(fd, name);
+      close(fd);
+    }
+  return 0;
+}
+
+/* Keeps FD (of the profile just mapped) open with a shared lock, so
+   that the file is not compacted while in use. */
+void
+rotate_hold (int fd)
+{
+  if (enabled && !flock(fd, LOCK_SH))
+    return;
+  close(fd);
+}
+
+struct entry
+{
+  time_t mtime;
+  unsigned long long size;
+  char *name;
+  _Bool is_archive;
+};
+
+static int
+compare_entry (const void *a, const void *b)
+{
+  const struct entry *const x = a;
+  const struct entry *const y = b;
+
+  return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+/* Whether NAME is of a file complete once written, which may go to meet
+   the budget: an archive, a snapshot of part of a run (see
+   sp_snapshot_path), a callers profile or a timeline trace. */
+static _Bool
+is_disposable (const char *name)
+{
+  return (!fnmatch("*.profile.[0-9]*", name, 0) ||
+	  !fnmatch("*.[0-9]*.[0-9]*T[0-9]*Z.*.profile", name, 0) ||
+	  !fnmatch("*.callers.profile", name, 0) ||
+	  !fnmatch("*.[0-9]*.trace", name, 0));
+}
+
+/* Deletes NAME in the directory of LOCKFD unless some process holds it
+   (see rotate_hold).  Returns 0 if deleted. */
+static int
+delete_unheld (int lockfd, const char *name)
+{
+  const int fd = openat(lockfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  const int ret = flock(fd, LOCK_EX | LOCK_NB) ? -1 : unlinkat(lockfd, name, 0);
+  close(fd);
+  return ret;
+}
+
+/* Deletes oldest archives and other disposable files in the directory
+   locked by LOCKFD until all profiles fit in SP_PROFILE_BUDGET.
+   Archives found in use no more are compacted first. */
+void
+rotate_enforce_budget (int lockfd)
+{
+  if (lockfd < 0 || !budget)
+    return;
+
+  const int fd = dup(lockfd);
+  DIR *const dir = fd >= 0 ? fdopendir(fd) : NULL;
+  if (!dir)
+    {
+      EPRINTF("opendir: %s", strerror(errno));
+      if (fd >= 0)
+	close(fd);
+      return;
+    }
+  rewinddir(dir);
+
+  struct entry *archives = NULL;
+  size_t narchives = 0;
+  unsigned long long total = 0;
+  const struct dirent *d;
+
+  while ((d = readdir(dir)) != NULL)
+    {
+      const _Bool is_archive = !fnmatch("*.profile.[0-9]*", d->d_name, 0);
+      struct stat st;
+
+      if ((!is_archive && fnmatch("*.profile", d->d_name, 0) &&
+	   fnmatch("*.trace", d->d_name, 0)) ||
+	  fstatat(lockfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) ||
+	  !S_ISREG(st.st_mode))
+	continue;
+      total += st.st_blocks * 512ULL;
+
+      if (!is_disposable(d->d_name))
+	continue;
+      struct entry *const p = realloc(archives, (narchives + 1) * sizeof(*p));
+      if (!p || !(p[narchives].name = strdup(d->d_name)))
+	{
+	  EPRINTF("malloc: %s", strerror(errno));
+	  if (p)
+	    archives = p;
+	  break;
+	}
+      archives = p;
+      archives[narchives].mtime = st.st_mtime;
+      archives[narchives].size = st.st_blocks * 512ULL;
+      archives[narchives].is_archive = is_archive;
+      narchives++;
+    }
+  closedir(dir);
+
+  for (size_t i = 0; i < narchives && total > budget; i++)
+    {
+      struct entry *const e = &archives[i];
+      const int afd = (e->is_archive
+		       ? openat(lockfd, e->name, O_RDWR | O_CLOEXEC) : -1);
+      struct stat st;
+      if (afd < 0)
+	continue;
+      compact(afd, e->name);
+      if (!fstat(afd, &st))
+	{
+	  total = total - e->size + st.st_blocks * 512ULL;
+	  e->size = st.st_blocks * 512ULL;
+	}
+      close(afd);
+    }
+
+  qsort(archives, narchives, sizeof(*archives), compare_entry);
+  for (size_t i = 0; i < narchives && total > budget; i++)
+    if (!delete_unheld(lockfd, archives[i].name))
+      {
+	if (sp_debug)
+	  DPRINTF("deleted %#s to meet budget", archives[i].name);
+	total -= archives[i].size;
+      }
+  if (total > budget)
+    EPRINTF("profiles exceed %s (%" PRIu64 " bytes in use)",
+	    ENV_PREFIX "PROFILE_BUDGET", (uint64_t) total);
+
+  for (size_t i = 0; i < narchives; i++)
+    free(archives[i].name);
+  free(archives);
+}
@@ -0,0 +1,369 @@
+/*
+ * Sampler for Simple Profiler.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * This is a replacement of profil(3) which does exactly what glibc's
+ * one does (ITIMER_PROF and SIGPROF), but also hands interrupted
+ * machine state to other parts of the profiler which need more than
+ * a histogram.
+ *
+ * On architectures where we do not know how to find PC in ucontext_t,
+ * we fall back to profil(3) and such features are not available.
+ */
+
+#define _GNU_SOURCE 1
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/auxv.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "simpleprof.h"
+
+/* Linux profil(3) man page does not tell where profil's interval
+   came from... */
+#ifdef HAVE___PROFILE_FREQUENCY
+# if defined HAVE_DECL___PROFILE_FREQUENCY && !HAVE_DECL___PROFILE_FREQUENCY
+extern int __profile_frequency (void);	/* Oops, libc internal function */
+# endif
+# define PROFILE_FREQUENCY()	__profile_frequency()
+#elif defined HAVE_GETAUXVAL && defined AT_CLKTCK
+# define PROFILE_FREQUENCY()	getauxval(AT_CLKTCK)
+#else
+# define PROFILE_FREQUENCY()	sysconf(_SC_CLK_TCK) /* XXX */
+#endif
+
+#if defined __x86_64__
+# define UC_PC(uc)	((uc)->uc_mcontext.gregs[REG_RIP])
+# define UC_SP(uc)	((uc)->uc_mcontext.gregs[REG_RSP])
+# define UC_FP(uc)	((uc)->uc_mcontext.gregs[REG_RBP])
+#elif defined __i386__
+# define UC_PC(uc)	((uc)->uc_mcontext.gregs[REG_EIP])
+# define UC_SP(uc)	((uc)->uc_mcontext.gregs[REG_ESP])
+# define UC_FP(uc)	((uc)->uc_mcontext.gregs[REG_EBP])
+#elif defined __aarch64__
+# define UC_PC(uc)	((uc)->uc_mcontext.pc)
+# define UC_SP(uc)	((uc)->uc_mcontext.sp)
+# define UC_FP(uc)	((uc)->uc_mcontext.regs[29])
+# define UC_LR(uc)	((uc)->uc_mcontext.regs[30])
+#endif
+
+#ifndef UC_LR
+# define UC_LR(uc)	0
+#endif
+
+static unsigned short *samples;
+static size_t nsamples;
+static uint16_t *seq_begin, *seq_end;
+static uintptr_t pc_offset;
+static unsigned int pc_scale;
+
+/* See sampler_enable and sampler_window. */
+static _Bool started, disabled;
+static unsigned short *window_bins;
+
+/* See sampler_boost. */
+static unsigned int boost_ratio = 1, boost_msec;
+static _Bool boosting;
+static uint64_t boost_period, boost_last, boost_end;	/* CPU time in ns */
+
+unsigned int
+sampler_frequency (void)
+{
+  return PROFILE_FREQUENCY();
+}
+
+_Bool
+sampler_has_context (void)
+{
+#ifdef UC_PC
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Frame pointers farther than this from the stack pointer are
+   considered bogus, unless the stack of the fiber is known. */
+#define MAX_STACK_EXTENT	(8UL << 20)
+
+/*
+ * Walk frame pointer chain.  This only works for code compiled with
+ * frame pointers, but cannot crash on bogus frames since the stack is
+ * read with process_vm_readv, which just fails on unmapped memory.
+ * pcs[0] is the interrupted PC itself.  Returns number of entries.
+ */
+unsigned int
+sampler_backtrace (const struct sp_sample *sample,
+		   uintptr_t *pcs, unsigned int max)
+{
+  unsigned int n = 0;
+
+  if (max == 0)
+    return 0;
+  pcs[n++] = sample->pc;
+
+  uintptr_t fp = sample->fp;
+  const uintptr_t lo = sample->sp;
+  const uintptr_t hi = (sample->fiber && sample->fiber->stack_hi
+			? sample->fiber->stack_hi : lo + MAX_STACK_EXTENT);
+  const pid_t pid = getpid();
+
+  while (n < max)
+    {
+      uintptr_t frame[2];	/* saved frame pointer, return address */
+
+      if (fp < lo || fp >= hi - sizeof(frame) || fp % sizeof(uintptr_t))
+	break;
+
+      struct iovec local = { frame, sizeof(frame) };
+      struct iovec remote = { (void *) fp, sizeof(frame) };
+      if (process_vm_readv(pid, &local, 1, &remote, 1, 0) != sizeof(frame))
+	break;
+      if (!frame[1])
+	break;
+      pcs[n++] = frame[1];
+      if (frame[0] <= fp)
+	break;
+      fp = frame[0];
+    }
+  return n;
+}
+
+/* Index of the bin which PC is counted in, or SIZE_MAX if none. */
+size_t
+sampler_bin (uintptr_t pc)
+{
+  /* Same as glibc's profil_count. */
+  size_t i = (pc - pc_offset) / 2;
+
+  if (sizeof(unsigned long long int) > sizeof(size_t))
+    i = (unsigned long long int) i * pc_scale / 65536;
+  else
+    i = i / 65536 * pc_scale + i % 65536 * pc_scale / 65536;
+  return i < nsamples ? i : SIZE_MAX;
+}
+
+/* Samples counted per sample at the normal rate (see sampler_boost). */
+unsigned int
+sampler_ratio (void)
+{
+  return boost_ratio;
+}
+
+#ifdef UC_PC
+static inline void
+profil_count (unsigned short *bins, uintptr_t pc, unsigned int weight)
+{
+  /* The increment is atomic as the buffer may be flushed by another
+     thread (see flush.c). */
+  const size_t i = sampler_bin(pc);
+
+  if (i == SIZE_MAX || weight == 0)
+    return;
+  if (weight == 1)
+    __atomic_fetch_add(&bins[i], 1, __ATOMIC_RELAXED);
+  else if (__atomic_load_n(&bins[i], __ATOMIC_RELAXED) <= USHRT_MAX - weight)
+    __atomic_fetch_add(&bins[i], weight, __ATOMIC_RELAXED);
+}
+
+static void
+set_timer (unsigned int frequency)
+{
+  struct itimerval timer;
+  timer.it_value.tv_sec = 0;
+  timer.it_value.tv_usec = 1000000 / frequency;
+  timer.it_interval = timer.it_value;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static uint64_t
+cpu_time (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Weight of a sample taken now. */
+static unsigned int
+sample_weight (void)
+{
+  if (!__atomic_load_n(&boosting, __ATOMIC_RELAXED))
+    return boost_ratio;
+
+  /* The timer fires at most once per kernel tick, which may be less
+     often than asked for, so count the CPU time actually spent. */
+  const uint64_t now = cpu_time();
+  const uint64_t prev = __atomic_exchange_n(&boost_last, now, __ATOMIC_RELAXED);
+  const uint64_t n = now > prev ? (now - prev + boost_period / 2) / boost_period : 0;
+
+  /* Back to the normal rate, each sample being worth RATIO. */
+  if (now >= boost_end && __atomic_exchange_n(&boosting, 0, __ATOMIC_RELAXED) &&
+      !__atomic_load_n(&disabled, __ATOMIC_ACQUIRE))
+    set_timer(sampler_frequency());
+  return n < USHRT_MAX ? n : USHRT_MAX;
+}
+
+static void
+sigprof_handler (int signo, siginfo_t *si, void *ctx)
+{
+  const ucontext_t *const uc = ctx;
+  const int saved_errno = errno;
+  const struct sp_sample sample = { .pc = UC_PC(uc),
+				    .sp = UC_SP(uc),
+				    .fp = UC_FP(uc),
+				    .lr = UC_LR(uc),
+				    .fiber = fiber_current(UC_SP(uc)) };
+
+  const unsigned int weight = sample_weight();
+
+  if (seq_begin)
+    {
+      __atomic_fetch_add(seq_begin, 1, __ATOMIC_SEQ_CST);
+      profil_count(samples, sample.pc, weight);
+      __atomic_fetch_add(seq_end, 1, __ATOMIC_SEQ_CST);
+    }
+  else
+    profil_count(samples, sample.pc, weight);
+
+  unsigned short *const window = __atomic_load_n(&window_bins, __ATOMIC_ACQUIRE);
+  if (window)
+    profil_count(window, sample.pc, weight);
+  timeline_sample(&sample);
+  recorder_sample(&sample, weight);
+  callers_sample(&sample, weight);
+  libprof_sample(&sample, weight);
+
+  errno = saved_errno;
+}
+#endif
+
+/* Makes the sampler bracket updates of the buffer with the seqlock
+   of the profile (see gmonmeta.h).  Call before sampler_start. */
+void
+sampler_seqlock (uint16_t *begin, uint16_t *end)
+{
+  seq_begin = begin;
+  seq_end = end;
+}
+
+/*
+ * Makes the sampler run at RATIO times the normal frequency for the first
+ * MSEC milliseconds of CPU time, and then at the normal one.  The buffer
+ * is then counted in units of 1/RATIO of a normal sample.  Call before
+ * sampler_start.  Returns the ratio in effect, which is 1 if boosting is
+ * not supported.
+ */
+unsigned int
+sampler_boost (unsigned int ratio, unsigned int msec)
+{
+#ifdef UC_PC
+  if (ratio > 1 && ratio <= USHRT_MAX && msec)
+    {
+      boost_ratio = ratio;
+      boost_msec = msec;
+    }
+#endif
+  return boost_ratio;
+}
+
+/*
+ * Stops or resumes sampling, from any thread.  Called with 0 before
+ * sampler_start, makes the sampler start stopped.
+ */
+void
+sampler_enable (_Bool on)
+{
+#ifdef UC_PC
+  __atomic_store_n(&disabled, !on, __ATOMIC_RELEASE);
+  if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+    return;
+  if (on)
+    set_timer(sampler_frequency()
+	      * (__atomic_load_n(&boosting, __ATOMIC_RELAXED) ? boost_ratio : 1));
+  else
+    {
+      static const struct itimerval off;
+      setitimer(ITIMER_PROF, &off, NULL);
+    }
+#endif
+}
+
+/* Makes the sampler count also into BINS, of as many bins as the
+   buffer given to sampler_start, until called with NULL. */
+void
+sampler_window (unsigned short *bins)
+{
+  __atomic_store_n(&window_bins, bins, __ATOMIC_RELEASE);
+}
+
+int
+sampler_start (unsigned short *buf, size_t bufsiz,
+	       uintptr_t lowpc, unsigned int scale)
+{
+#ifdef UC_PC
+  samples = buf;
+  nsamples = bufsiz / sizeof(*samples);
+  pc_offset = lowpc;
+  pc_scale = scale;
+
+  if (boost_msec)
+    {
+      boost_period = 1000000000 / (sampler_frequency() * boost_ratio);
+      boost_last = cpu_time();
+      boost_end = boost_last + boost_msec * UINT64_C(1000000);
+      boosting = 1;
+    }
+
+  struct sigaction act;
+  memset(&act, 0, sizeof(act));
+  act.sa_sigaction = sigprof_handler;
+  act.sa_flags = SA_RESTART | SA_SIGINFO;
+  sigfillset(&act.sa_mask);
+  if (sigaction(SIGPROF, &act, NULL))
+    return -1;
+
+  __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+  if (__atomic_load_n(&disabled, __ATOMIC_ACQUIRE))
+    return 0;
+
+  struct itimerval timer;
+  timer.it_value.tv_sec = 0;
+  timer.it_value.tv_usec = 1000000 / (sampler_frequency() * boost_ratio);
+  timer.it_interval = timer.it_value;
+  return setitimer(ITIMER_PROF, &timer, NULL);
+#else
+  return profil(buf, bufsiz, lowpc, scale);
+#endif
+}
@@ -0,0 +1,296 @@
+/*
+ * Simple Profiler - mode for many short-lived processes.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_SHORT, a process does not touch its profile at startup.  It
+ * counts samples in private memory, at SP_SHORT_BOOST times the normal
+ * rate for the first 0.1 second of CPU time so that even very short runs
+ * get some, and at exit adds them to a POSIX shared memory histogram of
+ * the program (in /dev/shm).  That histogram is in units of boosted
+ * samples, and is folded into the profile, remainders kept, by the
+ * first process exiting SP_SHORT_DRAIN seconds after the last time.
+ * Samples beyond what a bin of the profile holds stay in the histogram.
+ *
+ * A process without samples does nothing at exit, and is not counted in
+ * runs of the profile.  Samples in the shared histogram reach the profile
+ * only when the program is run again after SP_SHORT_DRAIN seconds.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simpleprof.h"
+#include "gmonmeta.h"
+
+#define DEFAULT_BOOST	10
+#define DEFAULT_DRAIN	10	/* seconds */
+
+/* The shared histogram. */
+struct shortrun_shm
+{
+  uint32_t state;		/* SHM_NEW, SHM_INIT or SHM_READY */
+  uint32_t ratio;		/* boosted samples per profile sample */
+  uint64_t nbins;
+  uint32_t runs;		/* since the last drain */
+  int32_t drainer;		/* pid of the process draining it, or 0 */
+  int64_t last_drain;		/* time(2) */
+  uint32_t bins[];
+};
+
+enum { SHM_NEW, SHM_INIT, SHM_READY };
+
+static unsigned short *bins;
+static size_t nbins;
+static unsigned int ratio;
+static pid_t owner;
+
+static _Bool
+parse_uint (const char *name, unsigned int *value)
+{
+  const char *const env = getenv(name);
+  char dummy[1];
+
+  if (!env || !*env)
+    return 1;
+  if (sscanf(env, "%u %c", value, dummy) != 1)
+    {
+      EPRINTF("invalid %s %#s", name, env);
+      return 0;
+    }
+  return 1;
+}
+
+/*
+ * Returns a private buffer of NBINS bins for the sampler to count into
+ * if SP_SHORT is set, otherwise NULL.  Sets up boosting of the sampler.
+ */
+unsigned short *
+shortrun_init (size_t n)
+{
+  if (!sp_env_flag(ENV_PREFIX "SHORT"))
+    return NULL;
+
+  unsigned int boost = DEFAULT_BOOST;
+  if (!parse_uint(ENV_PREFIX "SHORT_BOOST", &boost))
+    return NULL;
+  if (boost == 0)
+    boost = 1;
+  /* The timer period is in microseconds; a zero one disarms it. */
+  const unsigned int max_boost = 1000000 / sampler_frequency();
+  if (boost > max_boost)
+    {
+      EPRINTF("%s %u is more than %u, reduced", ENV_PREFIX "SHORT_BOOST",
+	      boost, max_boost);
+      boost = max_boost;
+    }
+
+  /* Untouched pages cost nothing. */
+  void *const buf = mmap(NULL, n * sizeof(*bins), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return NULL;
+    }
+
+  bins = buf;
+  nbins = n;
+  ratio = sampler_boost(boost, 100);
+  owner = getpid();
+  if (sp_debug)
+    DPRINTF("short run mode, boost %u", ratio);
+  return bins;
+}
+
+/* Maps the shared histogram, creating it if needed. */
+static struct shortrun_shm *
+attach (size_t size)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/simpleprof-%u-%016" PRIx64,
+	   (unsigned int) getuid(), sp_profile_hash() ^ ratio);
+
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st))
+    {
+      EPRINTF("%#s: %s", name, strerror(errno));
+      if (fd >= 0)
+	close(fd);
+      return NULL;
+    }
+  if ((st.st_size == 0 && ftruncate(fd, size)) ||
+      (st.st_size != 0 && (size_t) st.st_size != size))
+    {
+      EPRINTF("%#s: %s", name, st.st_size ? "size mismatch" : strerror(errno));
+      close(fd);
+      return NULL;
+    }
+  struct shortrun_shm *const shm = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED)
+    {
+      EPRINTF("%#s: mmap: %s", name, strerror(errno));
+      return NULL;
+    }
+
+  uint32_t state = SHM_NEW;
+  if (__atomic_compare_exchange_n(&shm->state, &state, SHM_INIT, 0,
+				  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+    {
+      shm->ratio = ratio;
+      shm->nbins = nbins;
+      shm->last_drain = time(NULL);
+      __atomic_store_n(&shm->state, SHM_READY, __ATOMIC_RELEASE);
+    }
+  else
+    for (unsigned int tries = 0;
+	 __atomic_load_n(&shm->state, __ATOMIC_ACQUIRE) != SHM_READY; tries++)
+      if (tries == 1000)
+	{
+	  EPRINTF("%#s: not initialized", name);
+	  munmap(shm, size);
+	  return NULL;
+	}
+      else
+	sched_yield();
+
+  if (shm->ratio != ratio || shm->nbins != nbins)
+    {
+      EPRINTF("%#s: layout mismatch", name);
+      munmap(shm, size);
+      return NULL;
+    }
+  return shm;
+}
+
+/* Folds whole profile samples of SHM into the profile. */
+static void
+drain (struct shortrun_shm *shm)
+{
+  /* One process at a time, taking over from one which died at it. */
+  const pid_t self = getpid();
+  int32_t drainer = 0;
+  if (!__atomic_compare_exchange_n(&shm->drainer, &drainer, self, 0,
+				   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) &&
+      (kill(drainer, 0) == 0 || errno != ESRCH ||
+       !__atomic_compare_exchange_n(&shm->drainer, &drainer, self, 0,
+				    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)))
+    return;
+
+  unsigned char *const mapbase = sp_map_profile();
+  if (mapbase)
+    {
+      struct sp_gmon_spare *const spare = sp_gmon_spare(mapbase);
+      unsigned short *const profile = (unsigned short *) (mapbase + SP_HEADER_SIZE);
+
+      __atomic_fetch_add(&spare->seq_begin, 1, __ATOMIC_SEQ_CST);
+      for (size_t i = 0; i < nbins; i++)
+	{
+	  const uint32_t q = __atomic_load_n(&shm->bins[i], __ATOMIC_RELAXED) / ratio;
+	  if (!q)
+	    continue;
+
+	  /* Processes running meanwhile add to the bin as well.  What does
+	     not fit is left for after rotation. */
+	  unsigned short old = __atomic_load_n(&profile[i], __ATOMIC_RELAXED);
+	  uint32_t n;
+	  do
+	    n = q < (uint32_t) USHRT_MAX - old ? q : (uint32_t) USHRT_MAX - old;
+	  while (n &&
+		 !__atomic_compare_exchange_n(&profile[i], &old, old + n, 1,
+					      __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	  if (n)
+	    __atomic_fetch_sub(&shm->bins[i], n * ratio, __ATOMIC_RELAXED);
+	}
+      __atomic_fetch_add(&spare->seq_end, 1, __ATOMIC_SEQ_CST);
+
+      /* Opening the profile counted one of them already. */
+      uint32_t runs = __atomic_exchange_n(&shm->runs, 0, __ATOMIC_RELAXED);
+      uint16_t old = __atomic_load_n(&spare->runs, __ATOMIC_RELAXED);
+      while (runs > 1 &&
+	     !__atomic_compare_exchange_n(&spare->runs, &old,
+					  runs - 1 < (uint32_t) UINT16_MAX - old
+					  ? old + runs - 1 : UINT16_MAX,
+					  0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+      munmap(mapbase, sp_profile_size());
+      if (sp_debug)
+	DPRINTF("drained shared histogram");
+    }
+
+  __atomic_store_n(&shm->last_drain, (int64_t) time(NULL), __ATOMIC_RELAXED);
+  __atomic_store_n(&shm->drainer, 0, __ATOMIC_RELEASE);
+}
+
+static void __attribute__((destructor))
+shortrun_fini (void)
+{
+  /* A forked child inherits counts of the parent. */
+  if (!bins || owner != getpid())
+    return;
+
+  size_t i;
+  for (i = 0; i < nbins && !__atomic_load_n(&bins[i], __ATOMIC_RELAXED); i++)
+    ;
+  if (i == nbins || !sp_prepare_profile())
+    return;
+
+  const size_t size = sizeof(struct shortrun_shm) + nbins * sizeof(uint32_t);
+  struct shortrun_shm *const shm = attach(size);
+  if (!shm)
+    return;
+
+  /* The sampler may still be running. */
+  for (; i < nbins; i++)
+    if (__atomic_load_n(&bins[i], __ATOMIC_RELAXED))
+      __atomic_fetch_add(&shm->bins[i],
+			 __atomic_exchange_n(&bins[i], 0, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+  __atomic_fetch_add(&shm->runs, 1, __ATOMIC_RELAXED);
+
+  unsigned int drain_interval = DEFAULT_DRAIN;
+  if (parse_uint(ENV_PREFIX "SHORT_DRAIN", &drain_interval) &&
+      time(NULL) - __atomic_load_n(&shm->last_drain, __ATOMIC_RELAXED)
+      >= (int64_t) drain_interval)
+    drain(shm);
+  munmap(shm, size);
+}
@@ -36,10 +36,12 @@
 #include <sys/auxv.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <fnmatch.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #include <assert.h>
 
@@ -47,31 +49,145 @@
 #include <stdalign.h>
 #include <sys/gmon_out.h>
 
-#define ENV_PREFIX	"SP_"
-
-extern void eprintf (const char *, const char *, ...);
-#define DPRINTF(Fmt, ...)	eprintf("debug", Fmt , ## __VA_ARGS__)
-#define EPRINTF(Fmt, ...)	eprintf("error", Fmt , ## __VA_ARGS__)
-
-/* Linux profil(3) man page does not tell where profil's interval
-   came from... */
-#ifdef HAVE___PROFILE_FREQUENCY
-# if defined HAVE_DECL___PROFILE_FREQUENCY && !HAVE_DECL___PROFILE_FREQUENCY
-extern int __profile_frequency (void);	/* Oops, libc internal function */
-# endif
-# define PROFILE_FREQUENCY()	__profile_frequency()
-#elif defined HAVE_GETAUXVAL && defined AT_CLKTCK
-# define PROFILE_FREQUENCY()	getauxval(AT_CLKTCK)
-#else
-# define PROFILE_FREQUENCY()	sysconf(_SC_CLK_TCK) /* XXX */
-#endif
+#include "simpleprof.h"
+#include "gmonmeta.h"
+
+_Bool sp_debug;
+mode_t sp_file_mode = DEFFILEMODE;
+
+static const char *progname;
+static _Bool want_symbind;
+static struct timespec start_time;	/* of la_preinit, for SP_DEBUG */
+
+/* The program as la_preinit found it. */
+static struct
+{
+  const char *build_id;		/* hex, or NULL */
+  uintptr_t load_addr, lowpc;
+  size_t memsz, nsamples;
+  unsigned int scale;
+} program;
+
+/* The profile, as sp_prepare_profile determined it. */
+static char *profile_path;
+static char profile_header[SP_HEADER_SIZE];
+static char *profile_meta;
+static unsigned char *profile_trailer;
+static size_t profile_trailer_size, profile_mapsiz;
+
+static const char *match_program_name (void);
 
 unsigned int
 la_version (unsigned int version)
 {
+  sp_debug = sp_env_flag(ENV_PREFIX "DEBUG");
+  /* Nothing runs besides the dynamic linker yet, so that this is the
+     only time the umask is safe to read. */
+  const mode_t mask = umask(0);
+  umask(mask);
+  sp_file_mode = DEFFILEMODE & ~mask;
+  libcache_init();
+  progname = match_program_name();
+  if (progname)
+    want_symbind = iotrace_init() | fiber_init() | recorder_init();
+
   return LAV_CURRENT;
 }
 
+_Bool
+sp_env_flag (const char *name)
+{
+  const char *const env = getenv(name);
+  return env && *env != '\0';
+}
+
+/* Name of the program if it is to be profiled, otherwise NULL. */
+const char *
+sp_progname (void)
+{
+  return progname;
+}
+
+/* Returns malloc'ed "<SP_PROFILE_OUTPUT>/<name><suffix>". */
+char *
+sp_output_path (const char *name, const char *suffix)
+{
+  const char *outputenv = getenv(ENV_PREFIX "PROFILE_OUTPUT");
+  if (!outputenv)
+    outputenv = "/var/tmp";
+
+  char *const fn = malloc(strlen(outputenv) + 1 + strlen(name) + strlen(suffix) + 1);
+  if (!fn)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return NULL;
+    }
+
+  char *p = stpcpy(fn, outputenv);
+  if (fn != p && p[-1] != '/')
+    *p++ = '/';
+  stpcpy(stpcpy(p, name), suffix);
+  return fn;
+}
+
+char *
+la_objsearch (const char *name, uintptr_t *cookie, unsigned int flag)
+{
+  return flag == LA_SER_ORIG ? libcache_search(name, cookie) : (char *) name;
+}
+
+unsigned int
+la_objopen (struct link_map *map, Lmid_t lmid, uintptr_t *cookie)
+{
+  if (lmid == LM_ID_BASE)
+    libcache_opened(map);
+  if (!progname)
+    return 0;
+
+  objmap_add(map);
+  libprof_open(objmap_find(map));
+  return want_symbind ? LA_FLG_BINDTO | LA_FLG_BINDFROM : 0;
+}
+
+unsigned int
+la_objclose (uintptr_t *cookie)
+{
+  if (progname)
+    {
+      libprof_close((const struct link_map *) *cookie);
+      objmap_remove((const struct link_map *) *cookie);
+    }
+  return 0;
+}
+
+static uintptr_t
+symbind (const ElfW(Sym) *sym, const uintptr_t *defcook, const char *symname)
+{
+  const struct link_map *const defmap = (const struct link_map *) *defcook;
+
+  uintptr_t value = iotrace_symbind(symname, sym->st_value, defmap);
+  value = fiber_symbind(symname, value, defmap);
+  return recorder_symbind(symname, value, defmap);
+}
+
+#if __ELF_NATIVE_CLASS == 64
+uintptr_t
+la_symbind64 (Elf64_Sym *sym, unsigned int ndx,
+	      uintptr_t *refcook, uintptr_t *defcook,
+	      unsigned int *flags, const char *symname)
+{
+  return symbind(sym, defcook, symname);
+}
+#else
+uintptr_t
+la_symbind32 (Elf32_Sym *sym, unsigned int ndx,
+	      uintptr_t *refcook, uintptr_t *defcook,
+	      unsigned int *flags, const char *symname)
+{
+  return symbind(sym, defcook, symname);
+}
+#endif
+
 static const char *
 match_program_name (void)
 {
@@ -83,6 +199,11 @@ match_program_name (void)
   const char *const execfn_base = execfn ? basename(execfn) : NULL;
   const char *const retval = execfn_base ? execfn_base : program_invocation_short_name;
 
+  /* Short cut for the common case, which matters when many short-lived
+     processes are run (see shortrun.c). */
+  if (env[0] == '*' && env[1] == '\0')
+    return retval;
+
   size_t envlen = strlen(env) + 1;
   char envcopy[envlen];
   memcpy(envcopy, env, envlen);
@@ -96,6 +217,12 @@ match_program_name (void)
 	    !fnmatch(p, program_invocation_name, FNM_PATHNAME))
 	  return retval;
       }
+    else if (!strpbrk(p, "*?[\\"))
+      {
+	/* fnmatch is costly on its first call, which sets up the locale. */
+	if (!strcmp(p, execfn_base) || !strcmp(p, program_invocation_short_name))
+	  return retval;
+      }
     else
       {
 	if (!fnmatch(p, execfn_base, FNM_PATHNAME) ||
@@ -107,88 +234,524 @@ match_program_name (void)
 }
 
 /*
- * In gmon.out format, "tag" is a single byte so that following members
- * may not align to natural boundary for the CPU.  We overcome this
- * by putting a dummy histogram record first to (at least) align
- * histogram bins of the main histogram record to natual boundaries.
+ * Creates the profile FN, complete with HEADER and TRAILER, atomically:
+ * it is written as an anonymous (O_TMPFILE) or temporary file first and
+ * then linked to FN.  Returns its descriptor, -1 on error, or -2 if
+ * someone else created FN first.
  */
+static int
+create_profile (const char *fn, const char *header,
+		const unsigned char *trailer, size_t trailer_size, size_t mapsiz)
+{
+  const char *const slash = strrchr(fn, '/');
+  const size_t dirlen = slash ? (size_t) (slash - fn) + 1 : 0;
+  char tmpname[dirlen + 2 + strlen(fn + dirlen) + sizeof(".XXXXXX")];
+  _Bool named = 0;
+
+  memcpy(tmpname, fn, dirlen);
+  strcpy(tmpname + dirlen, dirlen ? "." : "./.");
+  int fd = open(tmpname, O_TMPFILE | O_RDWR | O_CLOEXEC, DEFFILEMODE);
+  if (fd < 0)
+    {
+      /* Unsupported by the kernel or the filesystem. */
+      sprintf(tmpname + dirlen, ".%s.XXXXXX", fn + dirlen);
+      fd = mkostemp(tmpname, O_CLOEXEC);
+      if (fd < 0)
+	{
+	  EPRINTF("cannot create %#s: %s", tmpname, strerror(errno));
+	  return -1;
+	}
+      fchmod(fd, sp_file_mode);
+      named = 1;
+    }
 
-#define BASE_HEADER_SIZE	(sizeof(struct gmon_hdr) + 1 + sizeof(struct gmon_hist_hdr))
-
-#define NEED_DUMMY_HIST_HDR	(BASE_HEADER_SIZE % alignof(unsigned short) != 0)
-#define HEADER_SIZE	(NEED_DUMMY_HIST_HDR \
-			 ? (BASE_HEADER_SIZE + sizeof(unsigned short) + 1 + sizeof(struct gmon_hist_hdr)) \
-			 : BASE_HEADER_SIZE)
+  char hdr[SP_HEADER_SIZE];
+  memcpy(hdr, header, SP_HEADER_SIZE);
+  struct sp_gmon_spare *const spare = sp_gmon_spare(hdr);
+  spare->created = time(NULL);
+  spare->checksum = sp_gmon_header_checksum(header, trailer, trailer_size);
+
+  int e = posix_fallocate(fd, 0, mapsiz);
+  if (e)
+    EPRINTF("cannot allocate %zu bytes for %#s: %s", mapsiz, fn, strerror(e));
+  else if (pwrite(fd, hdr, SP_HEADER_SIZE, 0) != SP_HEADER_SIZE ||
+	   pwrite(fd, trailer, trailer_size, mapsiz - trailer_size) != (ssize_t) trailer_size ||
+	   fdatasync(fd))
+    {
+      e = errno;
+      EPRINTF("cannot write %#s: %s", fn, strerror(e));
+    }
+  else if (named)
+    {
+      if (link(tmpname, fn))
+	e = errno;
+    }
+  else
+    {
+      char procname[sizeof("/proc/self/fd/") + 3 * sizeof(int)];
+      sprintf(procname, "/proc/self/fd/%d", fd);
+      if (linkat(AT_FDCWD, procname, AT_FDCWD, fn, AT_SYMLINK_FOLLOW))
+	e = errno;
+    }
+  if (named)
+    unlink(tmpname);
+  if (!e)
+    return fd;
 
-_Static_assert(HEADER_SIZE % alignof(unsigned short) == 0,
-	       "gmon header is not properly aligned");
+  close(fd);
+  if (e == EEXIST)
+    return -2;
+  EPRINTF("cannot create %#s: %s", fn, strerror(e));
+  return -1;
+}
 
+/*
+ * Adds TRAILER and our spare header fields to FD, the profile FN as
+ * written by versions before metadata, if its HEADER matches.  Any
+ * process doing the same at the same time writes the same bytes, so
+ * this needs no lock.
+ */
 static void
-make_gmon_header (void *const header, uintptr_t lowpc, size_t nsamples,
-		  uint_fast32_t scale)
+upgrade_profile (int fd, const char *fn, const char *header,
+		 const unsigned char *trailer, size_t trailer_size, size_t mapsiz)
 {
-  static const struct my_gmon_hdr
+  const size_t spare_offset = offsetof(struct gmon_hdr, spare);
+  const size_t spare_end = spare_offset + sizeof(struct sp_gmon_spare);
+  char hdr[SP_HEADER_SIZE];
+
+  if (pread(fd, hdr, SP_HEADER_SIZE, 0) != SP_HEADER_SIZE ||
+      memcmp(hdr, header, spare_offset) ||
+      memcmp(hdr + spare_end, header + spare_end, SP_HEADER_SIZE - spare_end))
+    return;
+
+  struct sp_gmon_spare *const spare = sp_gmon_spare(hdr);
+  if (!spare->created)
+    spare->created = time(NULL);
+  spare->checksum = sp_gmon_header_checksum(header, trailer, trailer_size);
+
+  /* Trailer first, so that the file never has its final size without. */
+  const size_t created = spare_offset + offsetof(struct sp_gmon_spare, created);
+  if (pwrite(fd, trailer, trailer_size, mapsiz - trailer_size) != (ssize_t) trailer_size ||
+      pwrite(fd, hdr + created, spare_end - created, created) != (ssize_t) (spare_end - created))
+    EPRINTF("cannot write %#s: %s", fn, strerror(errno));
+  else if (sp_debug)
+    DPRINTF("added metadata to %#s", fn);
+}
+
+/*
+ * Maps the profile file FN of MAPSIZ bytes, creating it with HEADER
+ * and TRAILER (metadata following histogram bins) if it does not exist
+ * yet, or rotating it first if it is due.
+ */
+static void *
+map_profile (const char *fn, const char *header,
+	     const unsigned char *trailer, size_t trailer_size, size_t mapsiz)
+{
+  /* Headers are compared except for our spare bytes. */
+  const size_t spare_offset = offsetof(struct gmon_hdr, spare);
+  const size_t spare_end = spare_offset + sizeof(struct sp_gmon_spare);
+  _Bool rotated = 0, replaced = 0, upgraded = 0;
+
+  for (;;)
     {
-      char cookie[4];
-      uint32_t version;
-      char spare[3 * 4];
-    } ghdr = { .cookie = GMON_MAGIC,
-	       .version = GMON_VERSION };
+      int fd = open(fn, O_RDWR | O_CLOEXEC);
+      if (fd < 0 && errno == ENOENT)
+	{
+	  fd = create_profile(fn, header, trailer, trailer_size, mapsiz);
+	  if (fd == -2)
+	    continue;
+	  if (fd < 0)
+	    return NULL;
+	}
 
-  struct my_hist_hdr
+      struct stat statbuf;
+      if (fstat(fd, &statbuf))
+	{
+	  EPRINTF("fstat: %s", strerror(errno));
+	  close(fd);
+	  return NULL;
+	}
+
+      void *mapbase = MAP_FAILED;
+      if ((size_t) statbuf.st_size == mapsiz)
+	{
+	  mapbase = mmap(NULL, mapsiz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_FILE, fd, 0);
+	  if (mapbase == MAP_FAILED)
+	    {
+	      EPRINTF("mmap: %s", strerror(errno));
+	      close(fd);
+	      return NULL;
+	    }
+	}
+
+      /* Files created by older versions may be left torn (empty or
+	 without header) if the creating process died. */
+      if (!replaced &&
+	  (statbuf.st_size == 0 ||
+	   (mapbase != MAP_FAILED && !memcmp(mapbase, "\0\0\0\0", 4))))
+	{
+	  struct stat st;
+
+	  if (sp_debug)
+	    DPRINTF("replacing torn profile %#s", fn);
+	  if (mapbase != MAP_FAILED)
+	    munmap(mapbase, mapsiz);
+	  if (!stat(fn, &st) && st.st_dev == statbuf.st_dev &&
+	      st.st_ino == statbuf.st_ino)
+	    unlink(fn);
+	  close(fd);
+	  replaced = 1;
+	  continue;
+	}
+
+      if (mapbase == MAP_FAILED && !upgraded &&
+	  (size_t) statbuf.st_size == mapsiz - trailer_size)
+	{
+	  upgrade_profile(fd, fn, header, trailer, trailer_size, mapsiz);
+	  close(fd);
+	  upgraded = 1;
+	  continue;
+	}
+
+      if (mapbase == MAP_FAILED)
+	{
+	  EPRINTF("profile file size mismatch (shall be %zu bytes)", mapsiz);
+	  close(fd);
+	  return NULL;
+	}
+
+      if (memcmp(mapbase, header, spare_offset) ||
+	  memcmp((char *) mapbase + spare_end, header + spare_end,
+		 SP_HEADER_SIZE - spare_end))
+	{
+	  EPRINTF("profile header mismatch");
+	  munmap(mapbase, mapsiz);
+	  close(fd);
+	  return NULL;
+	}
+      else if (memcmp((char *) mapbase + mapsiz - trailer_size, trailer, trailer_size))
+	{
+	  EPRINTF("profile metadata mismatch");
+	  munmap(mapbase, mapsiz);
+	  close(fd);
+	  return NULL;
+	}
+      else if (!rotated && rotate_due(mapbase, SP_HEADER_SIZE, mapsiz - trailer_size))
+	{
+	  munmap(mapbase, mapsiz);
+	  close(fd);
+	  if (rotate_archive(fn))
+	    return NULL;
+	  rotated = 1;
+	  continue;
+	}
+
+      /* Saturating increment of the run count. */
+      uint16_t *const runs = &sp_gmon_spare(mapbase)->runs;
+      uint16_t n = __atomic_load_n(runs, __ATOMIC_RELAXED);
+      while (n != UINT16_MAX &&
+	     !__atomic_compare_exchange_n(runs, &n, n + 1, 1,
+					  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	;
+      rotate_hold(fd);
+      return mapbase;
+    }
+}
+
+/*
+ * Returns malloc'ed hex string of NT_GNU_BUILD_ID of the main program.
+ * If it has none but SP_PROFILE_BUILDID is set, a hash of its executable
+ * segment is used instead, prefixed with "hash-" to tell it from real
+ * build IDs.  Otherwise returns NULL.
+ */
+static char *
+profile_id (void)
+{
+  if (program.build_id)
+    return strdup(program.build_id);
+  if (!sp_env_flag(ENV_PREFIX "PROFILE_BUILDID"))
+    return NULL;
+
+  /* FNV-1a over 64-bit words, which is good enough to tell builds. */
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *p = (const unsigned char *) program.lowpc;
+  for (size_t i = 0; i < program.memsz; i += sizeof(uint64_t))
+    {
+      uint64_t w = 0;
+      memcpy(&w, p + i, program.memsz - i < sizeof(w) ? program.memsz - i : sizeof(w));
+      h = (h ^ w) * 0x100000001b3ULL;
+    }
+  char *hex;
+  if (asprintf(&hex, "hash-%016" PRIx64, h) < 0)
+    return NULL;
+  if (sp_debug)
+    DPRINTF("no build ID, using %s", hex);
+  return hex;
+}
+
+/*
+ * Determines name, header and metadata of the profile of the program
+ * found by la_preinit.  Returns nonzero on success.
+ */
+_Bool
+sp_prepare_profile (void)
+{
+  if (profile_path)
+    return 1;
+
+  char *const id = profile_id();
+  char *meta;
+  if (asprintf(&meta, "program=%s\n%s%s%s", progname,
+	       id ? "build-id=" : "", id ? id : "", id ? "\n" : "") < 0)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      free(id);
+      return 0;
+    }
+  const size_t trailer_size = gmon_meta_size(meta);
+  unsigned char *const trailer = malloc(trailer_size);
+  if (!trailer)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      free(meta);
+      free(id);
+      return 0;
+    }
+  gmon_meta_encode(trailer, meta);
+
+  /* Each build of the program gets its own profile. */
+  char *name = NULL;
+  if (id && asprintf(&name, "%s.%s", progname, id) < 0)
+    name = NULL;
+  free(id);
+  char *const fnbuf = sp_output_path(name ? name : progname, ".profile");
+  free(name);
+  if (!fnbuf)
+    {
+      free(trailer);
+      free(meta);
+      return 0;
+    }
+  if (sp_debug)
+    DPRINTF("file = %#s", fnbuf);
+
+  profile_path = fnbuf;
+  sp_gmon_header(profile_header, program.lowpc - program.load_addr,
+		 program.nsamples, program.scale, sampler_frequency());
+  profile_meta = meta;
+  profile_trailer = trailer;
+  profile_trailer_size = trailer_size;
+  profile_mapsiz = SP_HEADER_SIZE + program.nsamples * sizeof(unsigned short) + trailer_size;
+  return 1;
+}
+
+/*
+ * Opens (or creates) and maps the profile prepared by sp_prepare_profile,
+ * which is of sp_profile_size() bytes.  Returns NULL on error.
+ */
+void *
+sp_map_profile (void)
+{
+  return sp_map_file(profile_path, profile_header,
+		     profile_trailer, profile_trailer_size, profile_mapsiz);
+}
+
+/*
+ * Opens (or creates) and maps any profile FN of MAPSIZ bytes with HEADER
+ * and TRAILER, under the same rules as the program's.  Returns NULL on
+ * error.
+ */
+void *
+sp_map_file (const char *fn, const char *header,
+	     const unsigned char *trailer, size_t trailer_size, size_t mapsiz)
+{
+  const int lockfd = rotate_lock(fn);
+  void *const mapbase = map_profile(fn, header, trailer, trailer_size, mapsiz);
+  rotate_enforce_budget(lockfd);
+  rotate_unlock(lockfd);
+  return mapbase;
+}
+
+size_t
+sp_profile_size (void)
+{
+  return profile_mapsiz;
+}
+
+/* Identifies the layout of the profile, as a hash of its fixed parts. */
+uint64_t
+sp_profile_hash (void)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  const unsigned char *const parts[] = { (const unsigned char *) profile_path,
+					 (const unsigned char *) profile_header,
+					 profile_trailer };
+  const size_t sizes[] = { strlen(profile_path), sizeof(profile_header),
+			   profile_trailer_size };
+
+  for (unsigned int i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+    for (size_t j = 0; j < sizes[i]; j++)
+      h = (h ^ parts[i][j]) * 0x100000001b3ULL;
+  return h;
+}
+
+/*
+ * Returns malloc'ed "<progname>.<pid>.<UTC time>.<KIND>.profile" in the
+ * output directory, for profiles of part of a run.  WHEN is CLOCK_REALTIME,
+ * or NULL for now.
+ */
+char *
+sp_snapshot_path (const char *kind, const struct timespec *when)
+{
+  struct timespec ts;
+  struct tm tm;
+
+  if (!when)
     {
-      uintptr_t low_pc;
-      uintptr_t high_pc;
-      uint32_t hist_size;
-      uint32_t prof_rate;
-      char dimen[15];
-      char dimen_abbrev;
-    } hist_hdr;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      when = &ts;
+    }
+  gmtime_r(&when->tv_sec, &tm);
+
+  char suffix[3 * sizeof(pid_t) + sizeof("..YYYYmmddTHHMMSS.mmmZ..profile")
+	      + strlen(kind) + 16];
+  snprintf(suffix, sizeof(suffix), ".%ld.%04d%02d%02dT%02d%02d%02d.%03ldZ.%s.profile",
+	   (long) getpid(), tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+	   tm.tm_hour, tm.tm_min, tm.tm_sec, when->tv_nsec / 1000000, kind);
+  return sp_output_path(progname, suffix);
+}
 
-  _Static_assert(offsetof(struct my_gmon_hdr, version) == offsetof(struct gmon_hdr, version),
-		 "my_gmon_hdr.version is not properly aligned");
-  _Static_assert(sizeof(struct my_gmon_hdr) == sizeof(struct gmon_hdr),
-		 "my_gmon_hdr has wrong size");
+/* Number of histogram bins of the profile. */
+size_t
+sp_profile_nbins (void)
+{
+  return program.nsamples;
+}
 
-  _Static_assert(sizeof(struct my_hist_hdr) == sizeof(struct gmon_hist_hdr),
-		 "my_hist_hdr has wrong size");
+const char *
+sp_profile_path (void)
+{
+  return profile_path;
+}
 
-  hist_hdr.prof_rate = PROFILE_FREQUENCY();
+/* Header (SP_HEADER_SIZE bytes) of the profile. */
+const char *
+sp_profile_header (void)
+{
+  return profile_header;
+}
 
-  strncpy(hist_hdr.dimen, "seconds", sizeof(hist_hdr.dimen));
-  hist_hdr.dimen_abbrev = 's';
+/*
+ * Trailer of profiles of KIND written by sp_write_profile: metadata of
+ * the profile with "kind=KIND" added, so that tools can tell them from
+ * the profile itself.  Returns a malloc'ed buffer of *SIZE bytes.
+ */
+unsigned char *
+sp_profile_trailer (const char *kind, size_t *size)
+{
+  char *meta;
+  if (asprintf(&meta, "%skind=%s\n", profile_meta, kind) < 0)
+    {
+      EPRINTF("malloc: %s", strerror(errno));
+      return NULL;
+    }
+  *size = gmon_meta_size(meta);
+  unsigned char *const trailer = malloc(*size);
+  if (trailer)
+    gmon_meta_encode(trailer, meta);
+  else
+    EPRINTF("malloc: %s", strerror(errno));
+  free(meta);
+  return trailer;
+}
 
-  unsigned char *p = mempcpy(header, &ghdr, sizeof(struct my_gmon_hdr));
-  if (NEED_DUMMY_HIST_HDR)
+/*
+ * Writes a profile of KIND of the same layout as the one prepared by
+ * sp_prepare_profile, but with histogram BINS followed by gmon RECORDS
+ * of RECORDS_SIZE bytes, and as made by RUNS runs, to PATH (replacing it
+ * atomically).  Returns 0 on success.
+ */
+int
+sp_write_profile (const char *path, const char *kind, const unsigned short *bins,
+		  const void *records, size_t records_size, unsigned int runs)
+{
+  if (!sp_prepare_profile())
+    return -1;
+
+  size_t trailer_size;
+  unsigned char *const trailer = sp_profile_trailer(kind, &trailer_size);
+  if (!trailer)
+    return -1;
+  unsigned char *const tail = malloc(records_size + trailer_size);
+  if (!tail)
     {
-      *p++ = GMON_TAG_TIME_HIST;
-      
-      hist_hdr.hist_size = 1;
-      hist_hdr.low_pc = 0;	/* XXX */
-      hist_hdr.high_pc = 0 + (65536 * 2 / scale);
-
-      p = mempcpy(p, &hist_hdr, sizeof(struct my_hist_hdr));
-      memset(p, '\0', sizeof(unsigned short));
-      p += sizeof(unsigned short);
+      EPRINTF("malloc: %s", strerror(errno));
+      free(trailer);
+      return -1;
     }
-  *p++ = GMON_TAG_TIME_HIST;
-  hist_hdr.low_pc = lowpc;
-  hist_hdr.hist_size = nsamples;
-  hist_hdr.high_pc = lowpc + nsamples * (65536 * 2 / scale);
-  p = mempcpy(p, &hist_hdr, sizeof(struct my_hist_hdr));
-  assert(p == (unsigned char *) header + HEADER_SIZE);
+  if (records_size)
+    memcpy(tail, records, records_size);
+  memcpy(tail + records_size, trailer, trailer_size);
+  free(trailer);
+
+  char hdr[SP_HEADER_SIZE];
+  memcpy(hdr, profile_header, SP_HEADER_SIZE);
+  struct sp_gmon_spare *const spare = sp_gmon_spare(hdr);
+  spare->created = time(NULL);
+  spare->runs = runs < UINT16_MAX ? runs : UINT16_MAX;
+  spare->checksum = sp_gmon_header_checksum(profile_header, tail,
+					    records_size + trailer_size);
+
+  const size_t size = (SP_HEADER_SIZE + program.nsamples * sizeof(unsigned short) +
+		       records_size + trailer_size);
+  const struct iovec iov[3] =
+    {
+      { hdr, SP_HEADER_SIZE },
+      { (void *) bins, program.nsamples * sizeof(unsigned short) },
+      { tail, records_size + trailer_size },
+    };
+  char tmpname[strlen(path) + sizeof(".XXXXXX")];
+  sprintf(tmpname, "%s.XXXXXX", path);
+  const int fd = mkostemp(tmpname, O_CLOEXEC);
+  if (fd < 0)
+    {
+      EPRINTF("cannot create %#s: %s", tmpname, strerror(errno));
+      free(tail);
+      return -1;
+    }
+  fchmod(fd, sp_file_mode);
+  const _Bool ok = writev(fd, iov, 3) == (ssize_t) size && rename(tmpname, path) == 0;
+  if (!ok)
+    {
+      EPRINTF("cannot write %#s: %s", path, strerror(errno));
+      unlink(tmpname);
+    }
+  close(fd);
+  free(tail);
+  return ok ? 0 : -1;
+}
+
+static void
+startup_done (void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  DPRINTF("la_preinit took %ld us",
+	  (long) ((now.tv_sec - start_time.tv_sec) * 1000000
+		  + (now.tv_nsec - start_time.tv_nsec) / 1000));
 }
 
 void
 la_preinit (uintptr_t *cookie)
 {
-  const char *const debug_env = getenv(ENV_PREFIX "DEBUG");
-  _Bool debug = debug_env && (*debug_env != '\0');
-
-  if (debug)
-    DPRINTF("Entering %s", __func__);
+  if (sp_debug)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &start_time);
+      DPRINTF("Entering %s", __func__);
+    }
+  libcache_report();
 
-  const char *const progname = match_program_name();
   if (!progname)
     return;
 
@@ -248,7 +811,7 @@ la_preinit (uintptr_t *cookie)
       return;
     }
 
-  if (debug)
+  if (sp_debug)
     DPRINTF("Range: %#" PRIxPTR " - %#" PRIxPTR " (%zu bytes), load offset: %#" PRIxPTR,
 	    lowpc, (uintptr_t) (lowpc + (memsz - 1)), memsz, load_addr);
 
@@ -272,91 +835,83 @@ la_preinit (uintptr_t *cookie)
     }
 
   uintmax_t nsamples_tmp;
-  size_t nsamples, bufsiz, mapsiz;
+  size_t nsamples, bufsiz;
   if (__builtin_mul_overflow((memsz + 1) / 2, s_scale, &nsamples_tmp) ||
       (nsamples = nsamples_tmp / 65536) != nsamples_tmp / 65536 ||
       __builtin_mul_overflow(nsamples, sizeof(unsigned short), &bufsiz) ||
-      __builtin_add_overflow(bufsiz, HEADER_SIZE, &mapsiz))
+      bufsiz > SIZE_MAX / 2)
     {
       EPRINTF("profile buffer size overflow (segment size %zu, scale %u)",
 	      memsz, s_scale);
       return;
     }
 
-  if (debug)
+  if (sp_debug)
     DPRINTF("scale = %u, %zu samples", s_scale, nsamples);
 
-  const char *outputenv = getenv(ENV_PREFIX "PROFILE_OUTPUT");
-  if (!outputenv)
-    outputenv = "/var/tmp";
-  char fnbuf[strlen(outputenv) + 1 + strlen(progname) + sizeof(".profile")];
-  {
-    char *p = stpcpy(fnbuf, outputenv);
-    if (fnbuf != p && p[-1] != '/')
-      *p++ = '/';
-    stpcpy(stpcpy(p, progname), ".profile");
-  }
-  if (debug)
-    DPRINTF("file = %#s", fnbuf);
-
-  int fd = open(fnbuf, O_RDWR | O_CREAT, DEFFILEMODE);
-  struct stat statbuf;
-  if (fstat(fd, &statbuf))
+  const struct sp_object *const obj = objmap_find(map);
+  program.build_id = obj ? obj->build_id : NULL;
+  program.load_addr = load_addr;
+  program.lowpc = lowpc;
+  program.memsz = memsz;
+  program.scale = s_scale;
+  program.nsamples = nsamples;
+
+  /* Short-lived processes leave everything about the profile until exit
+     (see shortrun.c). */
+  unsigned short *const private_bins = shortrun_init(nsamples);
+  if (private_bins)
     {
-      EPRINTF("fstat: %s", strerror(errno));
-      close(fd);
+      timeline_init();
+      recorder_start();
+      callers_init(nsamples);
+      libprof_init(s_scale);
+      if (sampler_start(private_bins, bufsiz, lowpc, s_scale))
+	EPRINTF("profil: %s", strerror(errno));
+      else if (sp_debug)
+	startup_done();
       return;
     }
 
-  if (statbuf.st_size == 0)
-    {
-      int e = posix_fallocate(fd, 0, mapsiz);
-      if (e)
-	{
-	  EPRINTF("cannot allocate %zu bytes for %#s: %s",
-		  mapsiz, fnbuf, strerror(e));
-	  close(fd);
-	  return;
-	}
-    }
-  else if (statbuf.st_size != mapsiz)
-    {
-      EPRINTF("profile file size mismatch (shall be %zu bytes)", mapsiz);
-      close(fd);
-      return;
-    }
-
-  void *const mapbase = mmap(NULL, mapsiz, PROT_READ | PROT_WRITE,
-			     MAP_SHARED | MAP_FILE, fd, 0);
-  if (mapbase == MAP_FAILED)
-    {
-      EPRINTF("mmap: %s", strerror(errno));
-      close(fd);
-      return;
-    }
-  close(fd);
-
-  char header[HEADER_SIZE];
-  make_gmon_header(header, lowpc - load_addr, nsamples, s_scale);
-  
-  if (statbuf.st_size == 0)
-    memcpy(mapbase, header, HEADER_SIZE);
-  else if (memcmp(mapbase, header, HEADER_SIZE))
-    {
-      EPRINTF("profile header mismatch");
-      munmap(mapbase, mapsiz);
-      return;
-    }
-
-  if (debug)
-    DPRINTF("profil(%p, %zu, %#zx, %u)",
-	    (char *) mapbase + HEADER_SIZE, bufsiz, lowpc, s_scale);
-  if (profil((void *)((char *) mapbase + HEADER_SIZE), bufsiz, lowpc, s_scale))
+  if (!sp_prepare_profile())
+    return;
+  const size_t mapsiz = profile_mapsiz;
+  const char *const fnbuf = profile_path;
+  void *const mapbase = sp_map_profile();
+  if (!mapbase)
+    return;
+  container_init(fnbuf, mapbase, mapsiz, SP_HEADER_SIZE, nsamples, lowpc - load_addr,
+		 lowpc - load_addr + nsamples * (65536 * 2 / s_scale));
+
+  hugetext_remap((const unsigned short *) ((char *) mapbase + SP_HEADER_SIZE),
+		 nsamples, lowpc, memsz, s_scale,
+		 PROT_EXEC | (ph->p_flags & PF_R ? PROT_READ : 0)
+		 | (ph->p_flags & PF_W ? PROT_WRITE : 0));
+  prefetch_start((const unsigned short *) ((char *) mapbase + SP_HEADER_SIZE),
+		 nsamples, lowpc, memsz, s_scale);
+  timeline_init();
+  recorder_start();
+  callers_init(nsamples);
+  libprof_init(s_scale);
+  trigger_init(nsamples);
+
+  struct sp_gmon_spare *const spare = sp_gmon_spare(mapbase);
+  unsigned short *const bins = flush_init((void *) ((char *) mapbase + SP_HEADER_SIZE),
+					  nsamples, &spare->seq_begin, &spare->seq_end);
+  if (bins == (void *) ((char *) mapbase + SP_HEADER_SIZE))
+    sampler_seqlock(&spare->seq_begin, &spare->seq_end);
+
+  if (sp_debug)
+    DPRINTF("profil(%p, %zu, %#zx, %u)", bins, bufsiz, lowpc, s_scale);
+  if (sampler_start(bins, bufsiz, lowpc, s_scale))
     {
       EPRINTF("profil: %s", strerror(errno));
       munmap(mapbase, mapsiz);
       return;
     }
+  trigger_start();
+  if (sp_debug)
+    startup_done();
 }
 
 int
@@ -0,0 +1,190 @@
+/*
+ * Simple Profiler - internal declarations.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+#ifndef SIMPLEPROF_H
+#define SIMPLEPROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <link.h>
+#include <sys/types.h>
+
+#define ENV_PREFIX	"SP_"
+
+extern void eprintf (const char *, const char *, ...);
+#define DPRINTF(Fmt, ...)	eprintf("debug", Fmt , ## __VA_ARGS__)
+#define EPRINTF(Fmt, ...)	eprintf("error", Fmt , ## __VA_ARGS__)
+
+/* simpleprof.c */
+extern _Bool sp_debug;
+extern mode_t sp_file_mode;	/* of files created, as the umask says */
+extern const char *sp_progname (void);
+extern char *sp_output_path (const char *name, const char *suffix);
+extern _Bool sp_env_flag (const char *name);
+extern _Bool sp_prepare_profile (void);
+extern void *sp_map_profile (void);
+extern void *sp_map_file (const char *fn, const char *header,
+			  const unsigned char *trailer, size_t trailer_size,
+			  size_t mapsiz);
+extern size_t sp_profile_size (void);
+extern uint64_t sp_profile_hash (void);
+extern size_t sp_profile_nbins (void);
+extern const char *sp_profile_header (void);
+extern unsigned char *sp_profile_trailer (const char *kind, size_t *size);
+extern int sp_write_profile (const char *path, const char *kind,
+			     const unsigned short *bins,
+			     const void *records, size_t records_size,
+			     unsigned int runs);
+extern const char *sp_profile_path (void);
+extern char *sp_snapshot_path (const char *kind, const struct timespec *when);
+
+/* objmap.c - objects loaded in the base namespace */
+struct sp_object
+{
+  const struct link_map *map;
+  const char *name;		/* never NULL */
+  uintptr_t base;		/* load bias (l_addr) */
+  uintptr_t lowpc, highpc;	/* first executable segment (absolute) */
+  const char *build_id;		/* hex NT_GNU_BUILD_ID, or NULL */
+};
+
+extern void objmap_add (const struct link_map *map);
+extern void objmap_remove (const struct link_map *map);
+extern const struct sp_object *objmap_lookup (uintptr_t pc);
+extern const struct sp_object *objmap_find (const struct link_map *map);
+extern const struct sp_object *objmap_get (unsigned int index);
+extern _Bool objmap_is_libc (const struct link_map *map);
+extern _Bool objmap_phdrs (const struct link_map *map,
+			   const ElfW(Phdr) **phdrp, unsigned int *phnump);
+
+/* libcache.c */
+extern void libcache_init (void);
+extern char *libcache_search (const char *name, uintptr_t *cookie);
+extern void libcache_opened (const struct link_map *map);
+extern void libcache_report (void);
+
+/* sampler.c */
+struct sp_sample
+{
+  uintptr_t pc, sp, fp;		/* interrupted machine state */
+  uintptr_t lr;			/* link register, or 0 if none */
+  const struct sp_fiber *fiber;	/* running fiber, or NULL */
+};
+
+extern unsigned int sampler_frequency (void);
+extern _Bool sampler_has_context (void);
+extern int sampler_start (unsigned short *buf, size_t bufsiz,
+			  uintptr_t lowpc, unsigned int scale);
+extern void sampler_seqlock (uint16_t *begin, uint16_t *end);
+extern unsigned int sampler_boost (unsigned int ratio, unsigned int count);
+extern unsigned int sampler_backtrace (const struct sp_sample *sample,
+				       uintptr_t *pcs, unsigned int max);
+extern void sampler_enable (_Bool on);
+extern void sampler_window (unsigned short *bins);
+extern size_t sampler_bin (uintptr_t pc);
+extern unsigned int sampler_ratio (void);
+
+/* timeline.c */
+extern _Bool timeline_init (void);
+extern void timeline_sample (const struct sp_sample *sample);
+
+/* iotrace.c */
+extern _Bool iotrace_init (void);
+extern uintptr_t iotrace_symbind (const char *symname, uintptr_t value,
+				  const struct link_map *defmap);
+
+/* fiber.c */
+struct sp_fiber
+{
+  uint64_t id;			/* 1, 2, ... in order of first sight */
+  uintptr_t task;		/* entry point or task type, or 0 */
+  uintptr_t stack_lo, stack_hi;	/* or 0 if not known */
+};
+
+extern _Bool fiber_init (void);
+extern uintptr_t fiber_symbind (const char *symname, uintptr_t value,
+				const struct link_map *defmap);
+extern const struct sp_fiber *fiber_current (uintptr_t sp);
+
+/* callers.c */
+extern void callers_init (size_t nbins);
+extern void callers_sample (const struct sp_sample *sample,
+			    unsigned int weight);
+
+/* libprof.c */
+extern void libprof_init (unsigned int scale);
+extern void libprof_open (const struct sp_object *obj);
+extern void libprof_close (const struct link_map *map);
+extern void libprof_sample (const struct sp_sample *sample,
+			    unsigned int weight);
+
+/* recorder.c */
+extern _Bool recorder_init (void);
+extern uintptr_t recorder_symbind (const char *symname, uintptr_t value,
+				   const struct link_map *defmap);
+extern void recorder_start (void);
+extern void recorder_sample (const struct sp_sample *sample,
+			     unsigned int weight);
+
+/* trigger.c */
+extern _Bool trigger_init (size_t nbins);
+extern void trigger_start (void);
+
+/* hugetext.c */
+extern void hugetext_remap (const unsigned short *bins, size_t nbins,
+			    uintptr_t lowpc, size_t memsz, unsigned int scale,
+			    int prot);
+
+/* prefetch.c */
+extern void prefetch_start (const unsigned short *bins, size_t nbins,
+			    uintptr_t lowpc, size_t memsz, unsigned int scale);
+
+/* flush.c */
+extern unsigned short *flush_init (unsigned short *bins, size_t nbins,
+				   uint16_t *seq_begin, uint16_t *seq_end);
+extern void flush_sync (void);
+
+/* rotate.c */
+extern int rotate_lock (const char *path);
+extern int rotate_lock_dir (const char *path);
+extern void rotate_unlock (int lockfd);
+extern _Bool rotate_due (const void *image, size_t header_size, size_t bins_end);
+extern int rotate_archive (const char *path);
+extern void rotate_hold (int fd);
+extern void rotate_enforce_budget (int lockfd);
+
+/* shortrun.c */
+extern unsigned short *shortrun_init (size_t nbins);
+
+/* container.c */
+extern void container_init (const char *path, const void *image, size_t size,
+			    size_t bins_offset, size_t nbins,
+			    uintptr_t lowpc, uintptr_t highpc);
+
+#endif /* SIMPLEPROF_H */
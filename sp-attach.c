@@ -0,0 +1,802 @@
+/*
+ * Simple Profiler - profile an already running process.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * sp-attach samples program counters of all threads of a running process
+ * for a while, and adds them to the profile the process would have
+ * written under simpleprof.so: same name, same header and histogram
+ * layout, so the result can be read by gprof, sp-export and others, and
+ * accumulates with profiles from runs under LD_AUDIT.
+ *
+ * Samples are taken with perf_event_open(2) on the task clock of each
+ * thread, at the rate simpleprof.so uses per second of CPU time, as
+ * ITIMER_PROF does.
+ * Where perf events are not available (e.g. kernel.perf_event_paranoid),
+ * running threads are stopped with ptrace(2) at each tick instead, which
+ * is much more intrusive.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <link.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include "sptool.h"
+
+#define ENV_PREFIX	"SP_"
+
+#if defined __x86_64__
+# define REGS_PC(r)	((r).rip)
+#elif defined __i386__
+# define REGS_PC(r)	((r).eip)
+#elif defined __aarch64__
+# define REGS_PC(r)	((r).pc)
+#endif
+
+#define RING_PAGES	8	/* data pages of each perf ring buffer */
+
+static pid_t target;
+static unsigned int rate;
+static volatile sig_atomic_t interrupted;
+
+/* Histogram, counted as profil(3) does. */
+static unsigned short *bins;
+static size_t nbins;
+static uintptr_t pc_offset;
+static unsigned int pc_scale;
+static unsigned long long ncounted, noutside, nlost;
+
+static void
+count (uint64_t pc)
+{
+  size_t i = (pc - pc_offset) / 2;
+
+  if (pc < pc_offset)
+    i = nbins;
+  else if (sizeof(unsigned long long int) > sizeof(size_t))
+    i = (unsigned long long int) i * pc_scale / 65536;
+  else
+    i = i / 65536 * pc_scale + i % 65536 * pc_scale / 65536;
+  if (i < nbins)
+    {
+      if (bins[i] < USHRT_MAX)
+	bins[i]++;
+      ncounted++;
+    }
+  else
+    noutside++;
+}
+
+/* Threads of the target. */
+struct thread
+{
+  pid_t tid;
+  int fd;			/* perf event, or -1 */
+  struct perf_event_mmap_page *ring;
+  _Bool seized;			/* by ptrace */
+  _Bool seen;
+};
+
+static struct thread *threads;
+static size_t nthreads;
+
+static _Bool use_ptrace;
+static mode_t file_mode;	/* of profiles created */
+
+static int
+open_event (pid_t tid)
+{
+  struct perf_event_attr attr =
+    {
+      .size = sizeof(attr),
+      .type = PERF_TYPE_SOFTWARE,
+      .config = PERF_COUNT_SW_TASK_CLOCK,
+      .sample_period = 1000000000 / rate,
+      .sample_type = PERF_SAMPLE_IP,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+    };
+
+  return syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Starts sampling thread TID.  Returns 0, or -1 with errno set. */
+static int
+start_thread (struct thread *t, pid_t tid)
+{
+  memset(t, 0, sizeof(*t));
+  t->tid = tid;
+  t->fd = -1;
+  t->seen = 1;
+
+  if (use_ptrace)
+    {
+      if (ptrace(PTRACE_SEIZE, tid, NULL, NULL))
+	return -1;
+      t->seized = 1;
+      return 0;
+    }
+
+  if ((t->fd = open_event(tid)) < 0)
+    return -1;
+  const size_t size = (1 + RING_PAGES) * sysconf(_SC_PAGESIZE);
+  void *const ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, t->fd, 0);
+  if (ring == MAP_FAILED)
+    {
+      const int e = errno;
+      close(t->fd);
+      errno = e;
+      return -1;
+    }
+  t->ring = ring;
+  return 0;
+}
+
+static void
+stop_thread (struct thread *t)
+{
+  if (t->ring)
+    munmap(t->ring, (1 + RING_PAGES) * sysconf(_SC_PAGESIZE));
+  if (t->fd >= 0)
+    close(t->fd);
+  if (t->seized)
+    ptrace(PTRACE_DETACH, t->tid, NULL, NULL);
+  t->ring = NULL;
+  t->fd = -1;
+  t->seized = 0;
+}
+
+/*
+ * Starts sampling threads of the target which appeared since the last
+ * call, and forgets ones which are gone.  Returns the number of threads,
+ * or -1 if the first one could not be sampled (errno set).
+ */
+static ssize_t
+scan_threads (void)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%ld/task", (long) target);
+  DIR *const dir = opendir(path);
+  if (!dir)
+    return nthreads ? 0 : -1;
+
+  for (size_t i = 0; i < nthreads; i++)
+    threads[i].seen = 0;
+
+  const struct dirent *de;
+  while ((de = readdir(dir)) != NULL)
+    {
+      const pid_t tid = atoi(de->d_name);
+      size_t i;
+
+      if (tid <= 0)
+	continue;
+      for (i = 0; i < nthreads && threads[i].tid != tid; i++)
+	;
+      if (i < nthreads)
+	{
+	  threads[i].seen = 1;
+	  continue;
+	}
+
+      struct thread *const p = realloc(threads, (nthreads + 1) * sizeof(*p));
+      if (!p)
+	error(EXIT_FAILURE, errno, "malloc");
+      threads = p;
+      if (start_thread(&threads[nthreads], tid))
+	{
+	  if (!nthreads)
+	    {
+	      const int e = errno;
+	      closedir(dir);
+	      errno = e;
+	      return -1;
+	    }
+	  continue;		/* exited meanwhile */
+	}
+      nthreads++;
+    }
+  closedir(dir);
+
+  size_t n = 0;
+  for (size_t i = 0; i < nthreads; i++)
+    if (threads[i].seen)
+      threads[n++] = threads[i];
+    else
+      stop_thread(&threads[i]);
+  nthreads = n;
+  return nthreads;
+}
+
+/* Counts samples in the ring buffer of T. */
+static void
+drain (struct thread *t)
+{
+  struct perf_event_mmap_page *const meta = t->ring;
+  const unsigned char *const data = (const unsigned char *) meta + meta->data_offset;
+  const uint64_t size = meta->data_size;
+  const uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+  uint64_t tail = meta->data_tail;
+
+  while (tail < head)
+    {
+      struct perf_event_header hdr;
+      unsigned char rec[64];
+
+      /* Records may wrap around the end of the ring. */
+      for (size_t i = 0; i < sizeof(hdr); i++)
+	((unsigned char *) &hdr)[i] = data[(tail + i) % size];
+      if (hdr.size < sizeof(hdr) || tail + hdr.size > head)
+	break;
+      if (hdr.size <= sizeof(rec))
+	{
+	  for (size_t i = 0; i < hdr.size; i++)
+	    rec[i] = data[(tail + i) % size];
+	  if (hdr.type == PERF_RECORD_SAMPLE && hdr.size >= sizeof(hdr) + sizeof(uint64_t))
+	    {
+	      uint64_t ip;
+	      memcpy(&ip, rec + sizeof(hdr), sizeof(ip));
+	      count(ip);
+	    }
+	  else if (hdr.type == PERF_RECORD_LOST && hdr.size >= sizeof(hdr) + 2 * sizeof(uint64_t))
+	    {
+	      uint64_t lost;
+	      memcpy(&lost, rec + sizeof(hdr) + sizeof(uint64_t), sizeof(lost));
+	      nlost += lost;
+	    }
+	}
+      tail += hdr.size;
+    }
+  __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Returns nonzero if thread TID is running or runnable. */
+static _Bool
+is_running (pid_t tid)
+{
+  char path[64], buf[512];
+  snprintf(path, sizeof(path), "/proc/%ld/task/%ld/stat", (long) target, (long) tid);
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = '\0';
+
+  /* The state follows the command name, which may contain anything. */
+  const char *const p = strrchr(buf, ')');
+  return p && p[1] == ' ' && p[2] == 'R';
+}
+
+/*
+ * Stops T if it is running, and counts where it was.  Returns 0, or -1
+ * if the thread is gone.
+ */
+static int
+ptrace_sample (struct thread *t)
+{
+#ifdef REGS_PC
+  if (!is_running(t->tid))
+    return 0;
+  if (ptrace(PTRACE_INTERRUPT, t->tid, NULL, NULL))
+    return errno == ESRCH ? -1 : 0;
+
+  for (;;)
+    {
+      int status;
+
+      if (waitpid(t->tid, &status, __WALL) < 0)
+	return errno == EINTR ? 0 : -1;
+      if (WIFEXITED(status) || WIFSIGNALED(status))
+	{
+	  t->seized = 0;
+	  return -1;
+	}
+      if (!WIFSTOPPED(status))
+	continue;
+
+      const int sig = WSTOPSIG(status);
+      if (status >> 16 != PTRACE_EVENT_STOP)
+	{
+	  /* A signal for the program; deliver it and wait for our stop. */
+	  ptrace(PTRACE_CONT, t->tid, NULL, (void *) (uintptr_t) sig);
+	  continue;
+	}
+      if (sig != SIGTRAP)
+	{
+	  /* Group-stop; leave it stopped as it would be without us. */
+	  ptrace(PTRACE_LISTEN, t->tid, NULL, NULL);
+	  return 0;
+	}
+
+      struct user_regs_struct regs;
+      struct iovec iov = { &regs, sizeof(regs) };
+      if (!ptrace(PTRACE_GETREGSET, t->tid, (void *) NT_PRSTATUS, &iov))
+	count(REGS_PC(regs));
+      ptrace(PTRACE_CONT, t->tid, NULL, NULL);
+      return 0;
+    }
+#else
+  return -1;
+#endif
+}
+
+static void
+on_signal (int signo)
+{
+  interrupted = 1;
+}
+
+/* Samples the target for SECONDS or until it exits. */
+static void
+sample (unsigned int seconds)
+{
+  struct timespec now, end, next_scan;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  end.tv_sec += seconds;
+  next_scan = end;
+
+  const long tick_ns = use_ptrace ? 1000000000L / rate : 100000000L;
+  while (!interrupted)
+    {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > end.tv_sec ||
+	  (now.tv_sec == end.tv_sec && now.tv_nsec >= end.tv_nsec))
+	break;
+      if (kill(target, 0) && errno == ESRCH)
+	break;
+
+      /* Pick up new threads every second. */
+      if (now.tv_sec != next_scan.tv_sec)
+	{
+	  scan_threads();
+	  next_scan = now;
+	}
+
+      const struct timespec ts = { 0, tick_ns };
+      nanosleep(&ts, NULL);
+
+      for (size_t i = 0; i < nthreads; i++)
+	if (use_ptrace)
+	  {
+	    if (ptrace_sample(&threads[i]))
+	      threads[i].seized = 0;
+	  }
+	else
+	  drain(&threads[i]);
+    }
+
+  for (size_t i = 0; i < nthreads; i++)
+    {
+      if (!use_ptrace)
+	drain(&threads[i]);
+      stop_thread(&threads[i]);
+    }
+}
+
+/*
+ * Finds the executable segment of the target's program: its link-time
+ * address *LINK_LOWPC, size *MEMSZ, and where it is mapped *LOWPC.
+ */
+static void
+locate_text (const char *exe, uint64_t *link_lowpc, uint64_t *memsz, uint64_t *lowpc)
+{
+  const int fd = open(exe, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  ElfW(Ehdr) ehdr;
+  ElfW(Phdr) phdr[256];
+
+  if (fd < 0 || fstat(fd, &st))
+    error(EXIT_FAILURE, errno, "%s", exe);
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+      ehdr.e_ident[EI_CLASS] != (__ELF_NATIVE_CLASS == 64 ? ELFCLASS64 : ELFCLASS32) ||
+      ehdr.e_phentsize != sizeof(ElfW(Phdr)) ||
+      ehdr.e_phnum > sizeof(phdr) / sizeof(phdr[0]) ||
+      pread(fd, phdr, ehdr.e_phnum * sizeof(ElfW(Phdr)), ehdr.e_phoff)
+      != (ssize_t) (ehdr.e_phnum * sizeof(ElfW(Phdr))))
+    error(EXIT_FAILURE, 0, "%s: not an ELF file of this architecture", exe);
+  close(fd);
+
+  /* The first executable segment, as simpleprof.so takes. */
+  const ElfW(Phdr) *ph = NULL;
+  for (unsigned int i = 0; i < ehdr.e_phnum && !ph; i++)
+    if (phdr[i].p_type == PT_LOAD && (phdr[i].p_flags & PF_X) && phdr[i].p_memsz)
+      ph = &phdr[i];
+  if (!ph)
+    error(EXIT_FAILURE, 0, "%s: no loadable and executable segment found", exe);
+  *link_lowpc = ph->p_vaddr;
+  *memsz = ph->p_memsz;
+
+  /* Its mapping is the one of the same file at the same offset. */
+  const uint64_t pagesize = sysconf(_SC_PAGESIZE);
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%ld/maps", (long) target);
+  FILE *const fp = fopen(path, "re");
+  if (!fp)
+    error(EXIT_FAILURE, errno, "%s", path);
+
+  char *line = NULL;
+  size_t linesize = 0;
+  _Bool found = 0;
+  while (!found && getline(&line, &linesize, fp) > 0)
+    {
+      unsigned long long start, offset, inode;
+      unsigned int major, minor;
+      char perms[5];
+
+      if (sscanf(line, "%llx-%*x %4s %llx %x:%x %llu",
+		 &start, perms, &offset, &major, &minor, &inode) == 6 &&
+	  perms[2] == 'x' && inode == st.st_ino &&
+	  major == major(st.st_dev) && minor == minor(st.st_dev) &&
+	  offset == (ph->p_offset & ~(pagesize - 1)))
+	{
+	  *lowpc = start - (ph->p_vaddr & ~(pagesize - 1)) + ph->p_vaddr;
+	  found = 1;
+	}
+    }
+  free(line);
+  fclose(fp);
+  if (!found)
+    error(EXIT_FAILURE, 0, "cannot find text of %s in %s", exe, path);
+}
+
+/*
+ * Returns malloc'ed name of the target as simpleprof.so takes it: the
+ * basename of AT_EXECFN, read from the target's memory, or else of its
+ * argv[0].
+ */
+static char *
+target_progname (void)
+{
+  char path[64], buf[PATH_MAX];
+  ssize_t len = -1;
+
+  snprintf(path, sizeof(path), "/proc/%ld/auxv", (long) target);
+  FILE *fp = fopen(path, "re");
+  if (fp)
+    {
+      ElfW(auxv_t) aux;
+      while (fread(&aux, sizeof(aux), 1, fp) == 1 && aux.a_type != AT_NULL)
+	if (aux.a_type == AT_EXECFN)
+	  {
+	    /* The string may end just before the end of the stack. */
+	    struct iovec local = { buf, sizeof(buf) - 1 };
+	    struct iovec remote = { (void *) aux.a_un.a_val, sizeof(buf) - 1 };
+	    len = process_vm_readv(target, &local, 1, &remote, 1, 0);
+	    break;
+	  }
+      fclose(fp);
+    }
+  if (len <= 0 || !memchr(buf, '\0', len))
+    {
+      snprintf(path, sizeof(path), "/proc/%ld/cmdline", (long) target);
+      const int fd = open(path, O_RDONLY | O_CLOEXEC);
+      len = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+      if (fd >= 0)
+	close(fd);
+    }
+  if (len <= 0)
+    error(EXIT_FAILURE, errno, "cannot find the name of %ld", (long) target);
+  buf[len] = '\0';
+
+  char *const name = strdup(basename(buf));
+  if (!name)
+    error(EXIT_FAILURE, errno, "malloc");
+  return name;
+}
+
+/*
+ * Returns malloc'ed key of a program without build ID as simpleprof.so
+ * makes it with SP_PROFILE_BUILDID: "hash-" and a hash of its executable
+ * segment of MEMSZ bytes at LOWPC in the target.  Returns NULL if it
+ * cannot be read.
+ */
+static char *
+text_hash (uint64_t lowpc, uint64_t memsz)
+{
+  unsigned char *const text = malloc(memsz + 1);
+  if (!text)
+    error(EXIT_FAILURE, errno, "malloc");
+  struct iovec local = { text, memsz };
+  struct iovec remote = { (void *) (uintptr_t) lowpc, memsz };
+  if (process_vm_readv(target, &local, 1, &remote, 1, 0) != (ssize_t) memsz)
+    {
+      error(0, errno, "cannot read text of %ld", (long) target);
+      free(text);
+      return NULL;
+    }
+
+  /* FNV-1a over 64-bit words, as simpleprof.so does. */
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint64_t i = 0; i < memsz; i += sizeof(uint64_t))
+    {
+      uint64_t w = 0;
+      memcpy(&w, text + i, memsz - i < sizeof(w) ? memsz - i : sizeof(w));
+      h = (h ^ w) * 0x100000001b3ULL;
+    }
+  free(text);
+
+  char *hex;
+  if (asprintf(&hex, "hash-%016" PRIx64, h) < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  return hex;
+}
+
+/*
+ * Opens profile PATH, creating it with HEADER and TRAILER if it does not
+ * exist, and maps it.  The file must be of the same layout otherwise.
+ */
+static void *
+map_profile (const char *path, const char *header,
+	     const unsigned char *trailer, size_t trailer_size, size_t mapsiz)
+{
+  int fd;
+
+  while ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+    {
+      if (errno != ENOENT)
+	error(EXIT_FAILURE, errno, "%s", path);
+
+      /* Create it complete under another name, then link it. */
+      char tmpname[strlen(path) + sizeof(".XXXXXX")];
+      sprintf(tmpname, "%s.XXXXXX", path);
+      const int tmp = mkostemp(tmpname, O_CLOEXEC);
+      if (tmp < 0)
+	error(EXIT_FAILURE, errno, "%s", tmpname);
+
+      char hdr[SP_HEADER_SIZE];
+      memcpy(hdr, header, SP_HEADER_SIZE);
+      struct sp_gmon_spare *const spare = sp_gmon_spare(hdr);
+      spare->created = time(NULL);
+      spare->checksum = sp_gmon_header_checksum(header, trailer, trailer_size);
+
+      if (fchmod(tmp, file_mode) || ftruncate(tmp, mapsiz) ||
+	  pwrite(tmp, hdr, SP_HEADER_SIZE, 0) != SP_HEADER_SIZE ||
+	  pwrite(tmp, trailer, trailer_size, mapsiz - trailer_size) != (ssize_t) trailer_size ||
+	  (link(tmpname, path) && errno != EEXIST))
+	{
+	  const int e = errno;
+	  unlink(tmpname);
+	  error(EXIT_FAILURE, e, "%s", path);
+	}
+      unlink(tmpname);
+      close(tmp);
+    }
+
+  struct stat st;
+  if (fstat(fd, &st))
+    error(EXIT_FAILURE, errno, "%s", path);
+  if ((size_t) st.st_size != mapsiz)
+    error(EXIT_FAILURE, 0, "%s: size mismatch (%zu, expected %zu)",
+	  path, (size_t) st.st_size, mapsiz);
+
+  unsigned char *const image = mmap(NULL, mapsiz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED)
+    error(EXIT_FAILURE, errno, "%s: mmap", path);
+  close(fd);
+
+  const size_t spare_offset = offsetof(struct gmon_hdr, spare);
+  const size_t spare_end = spare_offset + sizeof(struct sp_gmon_spare);
+  if (memcmp(image, header, spare_offset) ||
+      memcmp(image + spare_end, header + spare_end, SP_HEADER_SIZE - spare_end) ||
+      memcmp(image + mapsiz - trailer_size, trailer, trailer_size))
+    error(EXIT_FAILURE, 0, "%s: profile of another build, scale or rate", path);
+  return image;
+}
+
+/* Adds counted samples to the profile IMAGE. */
+static void
+fold (unsigned char *image)
+{
+  struct sp_gmon_spare *const spare = sp_gmon_spare(image);
+  unsigned short *const shared = (unsigned short *) (image + SP_HEADER_SIZE);
+
+  __atomic_fetch_add(&spare->seq_begin, 1, __ATOMIC_SEQ_CST);
+  for (size_t i = 0; i < nbins; i++)
+    if (bins[i])
+      __atomic_fetch_add(&shared[i], bins[i], __ATOMIC_RELAXED);
+  __atomic_fetch_add(&spare->seq_end, 1, __ATOMIC_SEQ_CST);
+
+  uint16_t runs = __atomic_load_n(&spare->runs, __ATOMIC_RELAXED);
+  while (runs < UINT16_MAX &&
+	 !__atomic_compare_exchange_n(&spare->runs, &runs, runs + 1, 0,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-d SECONDS] [-m perf|ptrace] [-o OUTPUT] PID\n",
+	  program_invocation_short_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned int seconds = 30;
+  const char *output = NULL;
+  char dummy[1];
+  int opt;
+
+  const mode_t mask = umask(0);
+  umask(mask);
+  file_mode = DEFFILEMODE & ~mask;
+
+  while ((opt = getopt(argc, argv, "d:hm:o:")) != -1)
+    switch (opt)
+      {
+      case 'd':
+	if (sscanf(optarg, "%u %c", &seconds, dummy) != 1 || seconds == 0)
+	  error(EXIT_FAILURE, 0, "invalid duration %s", optarg);
+	break;
+      case 'm':
+	if (!strcmp(optarg, "ptrace"))
+	  use_ptrace = 1;
+	else if (strcmp(optarg, "perf"))
+	  error(EXIT_FAILURE, 0, "unknown method %s", optarg);
+	break;
+      case 'o':
+	output = optarg;
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  if (optind + 1 != argc || sscanf(argv[optind], "%d %c", &target, dummy) != 1 ||
+      target <= 0)
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+
+  /* Same rate and scale as simpleprof.so would use. */
+  rate = getauxval(AT_CLKTCK);
+  if (!rate)
+    rate = 100;
+  pc_scale = 0x10000 * sizeof(unsigned short) / 4;
+  const char *const env = getenv(ENV_PREFIX "SCALE");
+  if (env)
+    {
+      unsigned int scale;
+
+      if (sscanf(env, "%u %c", &scale, dummy) != 1 || scale == 0 ||
+	  (pc_scale = 0x10000 * sizeof(unsigned short) / scale) == 0)
+	error(EXIT_FAILURE, 0, "invalid %s %s", ENV_PREFIX "SCALE", env);
+    }
+
+  char exe[64];
+  snprintf(exe, sizeof(exe), "/proc/%ld/exe", (long) target);
+  uint64_t link_lowpc, memsz, lowpc;
+  locate_text(exe, &link_lowpc, &memsz, &lowpc);
+  pc_offset = lowpc;
+
+  uintmax_t nbins_tmp;
+  if (__builtin_mul_overflow((memsz + 1) / 2, pc_scale, &nbins_tmp) ||
+      (nbins = nbins_tmp / 65536) != nbins_tmp / 65536 ||
+      !(bins = calloc(nbins, sizeof(*bins))))
+    error(EXIT_FAILURE, ENOMEM, "histogram of %" PRIu64 " bytes", memsz);
+
+  /* Name and metadata as simpleprof.so gives them. */
+  char *const progname = target_progname();
+  unsigned char id[BUILD_ID_MAX];
+  char *idhex = build_id_hex(id, elf_build_id(exe, id));
+  if (!*idhex && getenv(ENV_PREFIX "PROFILE_BUILDID") &&
+      *getenv(ENV_PREFIX "PROFILE_BUILDID"))
+    {
+      char *const hash = text_hash(lowpc, memsz);
+      if (hash)
+	{
+	  free(idhex);
+	  idhex = hash;
+	}
+    }
+  char *meta, *path;
+  if (asprintf(&meta, "program=%s\n%s%s%s", progname,
+	       *idhex ? "build-id=" : "", idhex, *idhex ? "\n" : "") < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  if (output)
+    path = strdup(output);
+  else
+    {
+      const char *dir = getenv(ENV_PREFIX "PROFILE_OUTPUT");
+      if (!dir)
+	dir = "/var/tmp";
+      const _Bool by_id = *idhex;
+      if (asprintf(&path, "%s%s%s%s%s.profile", dir,
+		   *dir && dir[strlen(dir) - 1] != '/' ? "/" : "",
+		   progname, by_id ? "." : "", by_id ? idhex : "") < 0)
+	path = NULL;
+    }
+  if (!path)
+    error(EXIT_FAILURE, errno, "malloc");
+
+  const size_t trailer_size = gmon_meta_size(meta);
+  unsigned char trailer[trailer_size];
+  gmon_meta_encode(trailer, meta);
+  char header[SP_HEADER_SIZE];
+  sp_gmon_header(header, link_lowpc, nbins, pc_scale, rate);
+  const size_t mapsiz = SP_HEADER_SIZE + nbins * sizeof(unsigned short) + trailer_size;
+
+  /* Check the profile before stopping anything. */
+  unsigned char *const image = map_profile(path, header, trailer, trailer_size, mapsiz);
+
+  struct sigaction sa = { .sa_handler = on_signal };
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  if (scan_threads() < 0)
+    {
+      if (use_ptrace || (errno != EACCES && errno != EPERM && errno != ENOENT &&
+			 errno != ENOSYS && errno != EOPNOTSUPP))
+	error(EXIT_FAILURE, errno, "cannot attach to %ld", (long) target);
+      error(0, errno, "perf_event_open; falling back to ptrace");
+      use_ptrace = 1;
+      if (scan_threads() < 0)
+	error(EXIT_FAILURE, errno, "cannot attach to %ld", (long) target);
+    }
+#ifndef REGS_PC
+  if (use_ptrace)
+    error(EXIT_FAILURE, 0, "ptrace sampling is not supported on this architecture");
+#endif
+
+  sample(seconds);
+  fold(image);
+  munmap(image, mapsiz);
+
+  fprintf(stderr, "%s: %llu samples of %s", program_invocation_short_name,
+	  ncounted, progname);
+  if (noutside || nlost)
+    fprintf(stderr, " (%llu outside the program, %llu lost)", noutside, nlost);
+  fprintf(stderr, " added to %s\n", path);
+
+  free(threads);
+  free(bins);
+  free(meta);
+  free(idhex);
+  free(path);
+  free(progname);
+  return EXIT_SUCCESS;
+}
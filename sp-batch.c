@@ -0,0 +1,578 @@
+/*
+ * sp-batch - flat profiles of many programs from many profiles at once.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * PROFILEs, of any programs, are read by a pool of threads, each of
+ * which takes the next file as soon as it is done with one, and summed
+ * into groups of the same build ID and histogram layout (low_pc,
+ * high_pc, number of bins and rate) with atomic adds, so that no file
+ * is read twice and no thread waits for another.  Snapshots and callers
+ * profiles, whose samples are in the profile already, are skipped.
+ *
+ * Symbols of each build are then loaded once: from an EXECUTABLE given
+ * with -e, or by build ID from the symbol cache or a debug file, so
+ * that profiles of programs long since replaced can still be reported
+ * on as long as their symbols were cached.  Profiles record only the
+ * basename of the program, which is no way to find it.  Builds of a
+ * program without build ID are told apart by the address range of
+ * their text.  Each build gets a flat profile of its own in DIR with
+ * -o, and the functions taking the most time across all of them are
+ * listed on the standard output.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "sptool.h"
+
+#ifdef HAVE_CXA_DEMANGLE
+extern char *__cxa_demangle (const char *mangled, char *buf, size_t *len,
+			     int *status);
+#endif
+
+/* Profiles of the same build and histogram layout, summed. */
+struct group
+{
+  struct group *next;
+  char *key;			/* build ID in hex, or program if none */
+  char *program;		/* as recorded in the first profile, or NULL */
+  struct gmon_hist layout;	/* without bins */
+  uint64_t *sums;		/* per bin */
+  size_t profiles;
+};
+
+/* A build, with samples of its groups per function. */
+struct binary
+{
+  char *key, *program;
+  const struct gmon_hist *text;	/* of its only group if no build ID */
+  const struct symtab *symtab;
+  size_t profiles;
+  uint32_t rate;		/* of every group, or 0 if they differ */
+  uint64_t samples;
+  double seconds;
+  uint64_t *counts;		/* per symbol; the last one is unknown */
+  double *times;
+};
+
+struct entry
+{
+  const struct binary *bin;
+  size_t sym;
+};
+
+static const char **profiles;
+static size_t nprofiles, next_profile;
+static size_t nread;		/* of them, successfully */
+
+static struct group *groups;
+static pthread_mutex_t groups_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Bool failed;
+
+static const char **exes;	/* with -e */
+static char **exe_ids;
+static size_t nexes;
+
+static struct group *
+find_group (const char *key, const char *program, const struct gmon_hist *h)
+{
+  pthread_mutex_lock(&groups_lock);
+  struct group *g;
+  for (g = groups; g; g = g->next)
+    if (!strcmp(g->key, key) &&
+	g->layout.low_pc == h->low_pc && g->layout.high_pc == h->high_pc &&
+	g->layout.size == h->size && g->layout.rate == h->rate)
+      break;
+  if (!g)
+    {
+      if (!(g = calloc(1, sizeof(*g))) ||
+	  !(g->key = strdup(key)) ||
+	  (program && !(g->program = strdup(program))) ||
+	  !(g->sums = calloc(h->size, sizeof(*g->sums))))
+	error(EXIT_FAILURE, errno, "malloc");
+      g->layout = *h;
+      g->layout.bins = NULL;
+      g->next = groups;
+      groups = g;
+    }
+  pthread_mutex_unlock(&groups_lock);
+  return g;
+}
+
+static void
+add_profile (const char *path)
+{
+  struct gmon_data data;
+  if (gmon_read(path, &data))
+    {
+      __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  /* Snapshots and callers profiles repeat samples of the profile. */
+  char *const kind = gmon_meta(&data, "kind");
+  if (data.nhists == 0 || kind)
+    {
+      free(kind);
+      gmon_free(&data);
+      return;
+    }
+
+  /* Profiles of simpleprof.so may start with a one-bin dummy. */
+  const struct gmon_hist *h = &data.hists[0];
+  for (size_t i = 1; i < data.nhists; i++)
+    if (data.hists[i].size > h->size)
+      h = &data.hists[i];
+
+  char *const id = gmon_meta(&data, "build-id");
+  char *const program = gmon_meta(&data, "program");
+  struct group *const g = find_group(id && *id ? id : program ? program : "",
+				     program, h);
+  for (size_t i = 0; i < h->size; i++)
+    {
+      const unsigned int count = gmon_bin(h, i);
+      if (count)
+	__atomic_fetch_add(&g->sums[i], count, __ATOMIC_RELAXED);
+    }
+  __atomic_fetch_add(&g->profiles, 1, __ATOMIC_RELAXED);
+  free(id);
+  free(program);
+  gmon_free(&data);
+}
+
+/* Whether KEY of a group of PROGRAM is a build ID (or a hash of one). */
+static _Bool
+has_build_id (const char *key, const char *program)
+{
+  return *key && !(program && !strcmp(key, program));
+}
+
+static void *
+worker (void *arg)
+{
+  size_t i;
+
+  while ((i = __atomic_fetch_add(&next_profile, 1, __ATOMIC_RELAXED)) < nprofiles)
+    add_profile(profiles[i]);
+  return NULL;
+}
+
+/* Symbols of the build of KEY of PROGRAM.  Executables given with -e
+   without build ID are taken by name. */
+static const struct symtab *
+load_symbols (const char *key, const char *program)
+{
+  for (size_t i = 0; i < nexes; i++)
+    if (*exe_ids[i]
+	? !strcmp(exe_ids[i], key)
+	: program && !strcmp(basename(exes[i]), program))
+      return symtab_load_cached(exes[i]);
+  return has_build_id(key, program) ? symtab_load_build_id(key) : NULL;
+}
+
+static void
+count_group (struct binary *b, const struct group *g)
+{
+  const struct symtab *const tab = b->symtab;
+  const size_t nsyms = tab ? tab->nsyms : 0;
+  const double period = g->layout.rate ? 1.0 / g->layout.rate : 0.01;
+
+  for (size_t i = 0; i < g->layout.size; i++)
+    {
+      if (!g->sums[i])
+	continue;
+
+      const struct sym *const sym = tab ? symtab_lookup(tab, gmon_bin_addr(&g->layout, i)) : NULL;
+      const size_t s = sym ? (size_t) (sym - tab->syms) : nsyms;
+      b->counts[s] += g->sums[i];
+      b->times[s] += g->sums[i] * period;
+      b->samples += g->sums[i];
+      b->seconds += g->sums[i] * period;
+    }
+  b->profiles += g->profiles;
+  if (b->profiles == g->profiles)
+    b->rate = g->layout.rate;
+  else if (b->rate != g->layout.rate)
+    b->rate = 0;
+}
+
+static char *
+function_name (const struct entry *e)
+{
+  const struct symtab *const tab = e->bin->symtab;
+  const char *const name = (tab && e->sym < tab->nsyms
+			    ? tab->syms[e->sym].name : "<unknown>");
+  char *s = NULL;
+#ifdef HAVE_CXA_DEMANGLE
+  int status;
+  if (!strncmp(name, "_Z", 2))
+    s = __cxa_demangle(name, NULL, NULL, &status);
+#endif
+  if (!s && !(s = strdup(name)))
+    error(EXIT_FAILURE, errno, "malloc");
+  return s;
+}
+
+static int
+compare_entries (const void *a, const void *b)
+{
+  const struct entry *const x = a, *const y = b;
+  const double tx = x->bin->times[x->sym], ty = y->bin->times[y->sym];
+
+  if (tx != ty)
+    return tx < ty ? 1 : -1;
+  if (x->bin != y->bin)
+    return strcmp(x->bin->key, y->bin->key);
+  return (x->sym > y->sym) - (x->sym < y->sym);
+}
+
+/* Name of the report of B in DIR (malloc'ed). */
+static char *
+report_path (const char *dir, const struct binary *b, _Bool json)
+{
+  const char *base = b->program ? strrchr(b->program, '/') : NULL;
+  base = base ? base + 1 : b->program ? b->program : "unknown";
+  char *path;
+
+  if (b->text)
+    {
+      if (asprintf(&path, "%s/%s-%" PRIx64 "-%" PRIx64 ".%s", dir, base,
+		   b->text->low_pc, b->text->high_pc, json ? "json" : "txt") < 0)
+	error(EXIT_FAILURE, errno, "malloc");
+    }
+  else if (asprintf(&path, "%s/%s-%s.%s", dir, base, b->key, json ? "json" : "txt") < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  return path;
+}
+
+/*
+ * Writes the N ENTRIES, hottest first, as a flat profile: of B only,
+ * or across all builds if B is NULL, with the program of each.
+ */
+static void
+report (FILE *fp, const struct binary *b, const struct entry *entries, size_t n,
+	size_t max_lines, _Bool json, double seconds)
+{
+  if (json)
+    {
+      if (b)
+	{
+	  fprintf(fp, "{\"program\":");
+	  json_string(fp, b->program ? b->program : "");
+	  fprintf(fp, ",\"build_id\":");
+	  json_string(fp, b->text ? "" : b->key);
+	  if (b->text)
+	    fprintf(fp, ",\"low_pc\":\"%#" PRIx64 "\",\"high_pc\":\"%#" PRIx64 "\"",
+		    b->text->low_pc, b->text->high_pc);
+	  fprintf(fp, ",\"profiles\":%zu,\"rate\":%" PRIu32 ",\"samples\":%" PRIu64,
+		  b->profiles, b->rate, b->samples);
+	}
+      else
+	fprintf(fp, "{\"profiles\":%zu", nread);
+      fprintf(fp, ",\"seconds\":%.2f,\"functions\":[", seconds);
+    }
+  else
+    {
+      if (b && b->text)
+	fprintf(fp, "Flat profile of %s, text %#" PRIx64 "-%#" PRIx64
+		" (%zu profiles):\n\n", b->program ? b->program : "unknown",
+		b->text->low_pc, b->text->high_pc, b->profiles);
+      else if (b)
+	fprintf(fp, "Flat profile of %s (%zu profiles):\n\n",
+		b->program ? b->program : b->key, b->profiles);
+      else
+	fprintf(fp, "Top functions across %zu profiles:\n\n", nread);
+      if (b && b->rate)
+	fprintf(fp, "Each sample counts as %g seconds.\n", 1.0 / b->rate);
+      fprintf(fp, "  %%   cumulative   self\n"
+	      " time   seconds   seconds    samples  %sname\n",
+	      b ? "" : "program: ");
+    }
+
+  double cumulative = 0;
+  for (size_t i = 0; i < n && i < max_lines; i++)
+    {
+      const struct entry *const e = &entries[i];
+      const double self = e->bin->times[e->sym];
+      char *const name = function_name(e);
+
+      cumulative += self;
+      if (json)
+	{
+	  fprintf(fp, "%s{", i ? "," : "");
+	  if (!b)
+	    {
+	      fprintf(fp, "\"program\":");
+	      json_string(fp, e->bin->program ? e->bin->program : e->bin->key);
+	      fputc(',', fp);
+	    }
+	  fprintf(fp, "\"name\":");
+	  json_string(fp, name);
+	  if (e->bin->symtab && e->sym < e->bin->symtab->nsyms)
+	    fprintf(fp, ",\"address\":\"%#" PRIx64 "\"", e->bin->symtab->syms[e->sym].addr);
+	  fprintf(fp, ",\"samples\":%" PRIu64 ",\"seconds\":%.2f,\"percent\":%.2f}",
+		  e->bin->counts[e->sym], self, seconds ? 100.0 * self / seconds : 0.0);
+	}
+      else
+	{
+	  const char *const prog = e->bin->program ? e->bin->program : e->bin->key;
+	  const char *const slash = strrchr(prog, '/');
+	  fprintf(fp, "%6.2f %9.2f %9.2f %10" PRIu64 "  %s%s%s\n",
+		  seconds ? 100.0 * self / seconds : 0.0, cumulative, self,
+		  e->bin->counts[e->sym], b ? "" : slash ? slash + 1 : prog,
+		  b ? "" : ": ", name);
+	}
+      free(name);
+    }
+  if (json)
+    fputs("]}\n", fp);
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-e EXECUTABLE]... [-f text|json] [-l LIST] [-n LINES]"
+	  " [-o DIR] [-t THREADS] [PROFILE]...\n"
+	  "LIST names more PROFILEs, one per line (- for the standard input).\n",
+	  program_invocation_short_name);
+}
+
+static void
+add_path (const char *path)
+{
+  static size_t alloc;
+
+  if (nprofiles == alloc)
+    {
+      alloc = alloc ? 2 * alloc : 1024;
+      if (!(profiles = realloc(profiles, alloc * sizeof(*profiles))))
+	error(EXIT_FAILURE, errno, "malloc");
+    }
+  profiles[nprofiles++] = path;
+}
+
+static void
+read_list (const char *list)
+{
+  FILE *const fp = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  if (!fp)
+    error(EXIT_FAILURE, errno, "%s", list);
+
+  char *line = NULL;
+  size_t size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &size, fp)) > 0)
+    {
+      if (line[len - 1] == '\n')
+	line[--len] = '\0';
+      if (len == 0)
+	continue;
+      char *const path = strdup(line);
+      if (!path)
+	error(EXIT_FAILURE, errno, "malloc");
+      add_path(path);
+    }
+  if (ferror(fp))
+    error(EXIT_FAILURE, errno, "%s", list);
+  free(line);
+  if (fp != stdin)
+    fclose(fp);
+}
+
+int
+main (int argc, char *argv[])
+{
+  _Bool json = 0;
+  const char *dir = NULL;
+  size_t max_lines = 50;
+  long nthreads = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:f:hl:n:o:t:")) != -1)
+    switch (opt)
+      {
+      case 'e':
+	{
+	  unsigned char id[BUILD_ID_MAX];
+
+	  if (!(exes = realloc(exes, (nexes + 1) * sizeof(*exes))) ||
+	      !(exe_ids = realloc(exe_ids, (nexes + 1) * sizeof(*exe_ids))))
+	    error(EXIT_FAILURE, errno, "malloc");
+	  exes[nexes] = optarg;
+	  exe_ids[nexes++] = build_id_hex(id, elf_build_id(optarg, id));
+	}
+	break;
+      case 'f':
+	if (!strcmp(optarg, "json"))
+	  json = 1;
+	else if (!strcmp(optarg, "text"))
+	  json = 0;
+	else
+	  error(EXIT_FAILURE, 0, "unknown format %s", optarg);
+	break;
+      case 'l':
+	read_list(optarg);
+	break;
+      case 'n':
+	max_lines = strtoul(optarg, NULL, 10);
+	break;
+      case 'o':
+	dir = optarg;
+	break;
+      case 't':
+	if ((nthreads = strtol(optarg, NULL, 10)) <= 0)
+	  error(EXIT_FAILURE, 0, "invalid number of threads %s", optarg);
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  for (; optind < argc; optind++)
+    add_path(argv[optind]);
+  if (nprofiles == 0)
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+
+  if (nthreads == 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ((size_t) nthreads > nprofiles)
+    nthreads = nprofiles;
+  pthread_t *const threads = malloc(nthreads * sizeof(*threads));
+  if (!threads)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (long t = 1; t < nthreads; t++)
+    {
+      const int e = pthread_create(&threads[t], NULL, worker, NULL);
+      if (e)
+	error(EXIT_FAILURE, e, "pthread_create");
+    }
+  worker(NULL);
+  for (long t = 1; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  free(threads);
+
+  /* One binary per build, whatever layouts its groups have; without
+     build ID, one per text range. */
+  struct binary *bins = NULL;
+  size_t nbins = 0;
+  for (const struct group *g = groups; g; g = g->next)
+    {
+      const _Bool by_id = has_build_id(g->key, g->program);
+      size_t i;
+      for (i = 0; i < nbins; i++)
+	if (!strcmp(bins[i].key, g->key) &&
+	    (by_id || (bins[i].text->low_pc == g->layout.low_pc &&
+		       bins[i].text->high_pc == g->layout.high_pc)))
+	  break;
+      if (i == nbins)
+	{
+	  if (!(bins = realloc(bins, (nbins + 1) * sizeof(*bins))))
+	    error(EXIT_FAILURE, errno, "malloc");
+	  struct binary *const b = &bins[nbins++];
+	  memset(b, 0, sizeof(*b));
+	  b->key = g->key;
+	  b->program = g->program;
+	  b->text = by_id ? NULL : &g->layout;
+	  if (!(b->symtab = load_symbols(b->key, b->program)) && by_id)
+	    error(0, 0, "warning: no symbols of %s%s%s", b->program ? b->program : "",
+		  b->program ? ", build " : "build ", b->key);
+	  else if (!b->symtab)
+	    error(0, 0, "warning: no symbols of %s, text %#" PRIx64 "-%#" PRIx64
+		  " (no build ID; give it with -e)", b->program ? b->program : "unknown",
+		  b->text->low_pc, b->text->high_pc);
+	  const size_t n = (b->symtab ? b->symtab->nsyms : 0) + 1;
+	  if (!(b->counts = calloc(n, sizeof(*b->counts))) ||
+	      !(b->times = calloc(n, sizeof(*b->times))))
+	    error(EXIT_FAILURE, errno, "malloc");
+	}
+      count_group(&bins[i], g);
+    }
+
+  /* Functions with samples of every build, hottest first. */
+  struct entry *entries = NULL;
+  size_t nentries = 0, alloc = 0;
+  double seconds = 0;
+  for (size_t i = 0; i < nbins; i++)
+    {
+      const size_t n = (bins[i].symtab ? bins[i].symtab->nsyms : 0) + 1;
+      for (size_t s = 0; s < n; s++)
+	if (bins[i].counts[s])
+	  {
+	    if (nentries == alloc)
+	      {
+		alloc = alloc ? 2 * alloc : 1024;
+		if (!(entries = realloc(entries, alloc * sizeof(*entries))))
+		  error(EXIT_FAILURE, errno, "malloc");
+	      }
+	    entries[nentries].bin = &bins[i];
+	    entries[nentries++].sym = s;
+	  }
+      seconds += bins[i].seconds;
+      nread += bins[i].profiles;
+    }
+  if (nentries)
+    qsort(entries, nentries, sizeof(*entries), compare_entries);
+
+  if (dir)
+    {
+      struct entry *const own = malloc((nentries + 1) * sizeof(*own));
+      if (!own)
+	error(EXIT_FAILURE, errno, "malloc");
+      for (size_t i = 0; i < nbins; i++)
+	{
+	  size_t n = 0;
+	  for (size_t k = 0; k < nentries; k++)
+	    if (entries[k].bin == &bins[i])
+	      own[n++] = entries[k];
+
+	  char *const path = report_path(dir, &bins[i], json);
+	  FILE *const fp = fopen(path, "w");
+	  if (!fp)
+	    error(EXIT_FAILURE, errno, "%s", path);
+	  report(fp, &bins[i], own, n, SIZE_MAX, json, bins[i].seconds);
+	  if (fclose(fp))
+	    error(EXIT_FAILURE, errno, "%s", path);
+	  free(path);
+	}
+      free(own);
+    }
+
+  report(stdout, NULL, entries, nentries, max_lines, json, seconds);
+  if (fflush(stdout))
+    error(EXIT_FAILURE, errno, "stdout");
+
+  free(entries);
+  for (size_t i = 0; i < nbins; i++)
+    {
+      free(bins[i].counts);
+      free(bins[i].times);
+    }
+  free(bins);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
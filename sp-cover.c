@@ -0,0 +1,285 @@
+/*
+ * sp-cover - find functions never sampled across many profiles.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every PROFILE of EXECUTABLE's build is folded into a bitmap of bins
+ * which ever got a sample, and functions of EXECUTABLE none of whose
+ * bins did are listed.  Profiles of other builds are skipped.
+ *
+ * With -o, the bitmap is saved in a file of its own (struct cover_header
+ * followed by the bits, one per bin, in 64-bit words of host byte
+ * order), which is accepted as a PROFILE later, so that months of
+ * profiles need to be read only once.  The bitmap is folded in words,
+ * 64 bins at a time.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "sptool.h"
+
+#define COVER_MAGIC	"SPCOVER1"
+
+struct cover_header
+{
+  char magic[8];
+  uint64_t low_pc, high_pc;	/* link-time */
+  uint32_t nbins;
+  uint32_t profiles;		/* folded into it, saturating */
+  char build_id[2 * BUILD_ID_MAX + 8];	/* hex, NUL-padded */
+};
+
+/* The bitmap, whose layout is set by the first input. */
+static struct cover_header cover;
+static uint64_t *bits;
+static size_t nwords;
+
+static _Bool
+set_layout (const char *path, uint64_t low_pc, uint64_t high_pc, uint32_t nbins)
+{
+  if (!bits)
+    {
+      cover.low_pc = low_pc;
+      cover.high_pc = high_pc;
+      cover.nbins = nbins;
+      nwords = (nbins + 63) / 64;
+      if (!(bits = calloc(nwords, sizeof(*bits))))
+	error(EXIT_FAILURE, errno, "malloc");
+      return 1;
+    }
+  if (low_pc == cover.low_pc && high_pc == cover.high_pc && nbins == cover.nbins)
+    return 1;
+  error(0, 0, "warning: %s: histogram layout differs, skipped", path);
+  return 0;
+}
+
+static _Bool
+same_build (const char *path, const char *id)
+{
+  if (!id || !*id || !*cover.build_id || !strcmp(id, cover.build_id))
+    return 1;
+  error(0, 0, "warning: %s is of build %s, not %s; skipped",
+	path, id, cover.build_id);
+  return 0;
+}
+
+/* Folds the bitmap file PATH (opened as FP) in.  Returns 0 on success. */
+static int
+add_bitmap (const char *path, FILE *fp)
+{
+  struct cover_header hdr;
+
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+      hdr.build_id[sizeof(hdr.build_id) - 1] != '\0')
+    {
+      error(0, 0, "%s: truncated", path);
+      return -1;
+    }
+  if (!same_build(path, hdr.build_id) ||
+      !set_layout(path, hdr.low_pc, hdr.high_pc, hdr.nbins))
+    return 0;
+
+  uint64_t *const in = malloc(nwords * sizeof(*in));
+  if (!in)
+    error(EXIT_FAILURE, errno, "malloc");
+  if (fread(in, sizeof(*in), nwords, fp) != nwords)
+    {
+      error(0, 0, "%s: truncated", path);
+      free(in);
+      return -1;
+    }
+  for (size_t w = 0; w < nwords; w++)
+    bits[w] |= in[w];
+  cover.profiles = (hdr.profiles > UINT32_MAX - cover.profiles
+		    ? UINT32_MAX : cover.profiles + hdr.profiles);
+  free(in);
+  return 0;
+}
+
+static int
+add_profile (const char *path)
+{
+  FILE *const fp = fopen(path, "r");
+  if (!fp)
+    {
+      error(0, errno, "%s", path);
+      return -1;
+    }
+
+  char magic[sizeof(cover.magic)];
+  if (fread(magic, sizeof(magic), 1, fp) == 1 &&
+      !memcmp(magic, COVER_MAGIC, sizeof(magic)))
+    {
+      rewind(fp);
+      const int ret = add_bitmap(path, fp);
+      fclose(fp);
+      return ret;
+    }
+  fclose(fp);
+
+  struct gmon_data data;
+  if (gmon_read(path, &data))
+    return -1;
+  if (data.nhists == 0)
+    {
+      gmon_free(&data);
+      return 0;
+    }
+
+  /* Profiles of simpleprof.so may start with a one-bin dummy. */
+  const struct gmon_hist *h = &data.hists[0];
+  for (size_t i = 1; i < data.nhists; i++)
+    if (data.hists[i].size > h->size)
+      h = &data.hists[i];
+
+  char *const id = gmon_meta(&data, "build-id");
+  if (same_build(path, id) && set_layout(path, h->low_pc, h->high_pc, h->size))
+    {
+      for (size_t w = 0; w < nwords; w++)
+	{
+	  const size_t base = w * 64;
+	  const size_t n = h->size - base < 64 ? h->size - base : 64;
+	  uint64_t word = 0;
+
+	  for (size_t b = 0; b < n; b++)
+	    word |= (uint64_t) (gmon_bin(h, base + b) != 0) << b;
+	  bits[w] |= word;
+	}
+      if (cover.profiles < UINT32_MAX)
+	cover.profiles++;
+      if (!*cover.build_id && id && strlen(id) < sizeof(cover.build_id))
+	strcpy(cover.build_id, id);
+    }
+  free(id);
+  gmon_free(&data);
+  return 0;
+}
+
+static _Bool
+bin_hit (size_t i)
+{
+  return bits[i / 64] >> (i % 64) & 1;
+}
+
+/* First bin covering ADDR; as gmon_bin_addr, bins need not be integral. */
+static size_t
+bin_of (uint64_t addr)
+{
+  return (size_t) ((double) (addr - cover.low_pc) * cover.nbins
+		   / (cover.high_pc - cover.low_pc));
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-q] [-o BITMAP] EXECUTABLE PROFILE...\n"
+	  "PROFILE may also be a BITMAP saved before.\n",
+	  program_invocation_short_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *output = NULL;
+  _Bool quiet = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ho:q")) != -1)
+    switch (opt)
+      {
+      case 'o':
+	output = optarg;
+	break;
+      case 'q':
+	quiet = 1;
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  if (argc - optind < 2)
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+
+  const char *const exe = argv[optind++];
+  const struct symtab *const symtab = symtab_load_cached(exe);
+  if (!symtab)
+    error(EXIT_FAILURE, 0, "%s: no symbols", exe);
+  unsigned char id[BUILD_ID_MAX];
+  char *const exe_id = build_id_hex(id, elf_build_id(exe, id));
+  memcpy(cover.magic, COVER_MAGIC, sizeof(cover.magic));
+  strcpy(cover.build_id, exe_id);
+  free(exe_id);
+
+  int status = EXIT_SUCCESS;
+  for (; optind < argc; optind++)
+    if (add_profile(argv[optind]))
+      status = EXIT_FAILURE;
+  if (!bits)
+    error(EXIT_FAILURE, 0, "no profile of %s", exe);
+
+  if (output)
+    {
+      FILE *const fp = fopen(output, "w");
+      if (!fp ||
+	  fwrite(&cover, sizeof(cover), 1, fp) != 1 ||
+	  fwrite(bits, sizeof(*bits), nwords, fp) != nwords ||
+	  fclose(fp))
+	error(EXIT_FAILURE, errno, "%s", output);
+    }
+
+  size_t nfuncs = 0, ndead = 0;
+  uint64_t dead_bytes = 0;
+  for (size_t i = 0; i < symtab->nsyms; i++)
+    {
+      const struct sym *const sym = &symtab->syms[i];
+      const uint64_t end = sym->addr + (sym->size ? sym->size : 1);
+
+      if (sym->addr < cover.low_pc || end > cover.high_pc ||
+	  (i > 0 && sym->addr == symtab->syms[i - 1].addr))
+	continue;
+      nfuncs++;
+
+      _Bool hit = 0;
+      for (size_t b = bin_of(sym->addr); b <= bin_of(end - 1) && b < cover.nbins && !hit; b++)
+	hit = bin_hit(b);
+      if (hit)
+	continue;
+      ndead++;
+      dead_bytes += sym->size;
+      if (!quiet)
+	printf("%#" PRIx64 " %" PRIu64 " %s\n", sym->addr, sym->size, sym->name);
+    }
+  if (fflush(stdout))
+    error(EXIT_FAILURE, errno, "stdout");
+  fprintf(stderr, "%zu of %zu functions (%" PRIu64 " bytes) never sampled"
+	  " in %" PRIu32 " profiles\n", ndead, nfuncs, dead_bytes, cover.profiles);
+  return status;
+}
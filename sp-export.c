@@ -0,0 +1,577 @@
+/*
+ * sp-export - convert gmon.out profiles to other formats.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Supported output formats:
+ *
+ *   callgrind	for KCachegrind/QCachegrind.  Histogram bins become
+ *		instruction-level costs, arcs become calls.
+ *   pprof	profile.proto of https://github.com/google/pprof,
+ *		gzip-compressed if built with zlib.  Arcs are emitted as
+ *		two-frame samples of a separate "calls" sample type.
+ *   gmon	the profile in gmon.out format, as taken out of a
+ *		container, for gprof.
+ *
+ * EXECUTABLE may be omitted if the first PROFILE is a container (.spc),
+ * which carries the program name and symbols of its hot functions.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#ifdef HAVE_ZLIB_H
+# include <zlib.h>
+#endif
+
+#include "sptool.h"
+#include "spcontainer.h"
+
+struct profile
+{
+  const char *path;
+  const char *exe;
+  struct gmon_data data;
+  const struct symtab *symtab;
+};
+
+static const char *
+symbol_name (const struct profile *prof, uint64_t addr, uint64_t *start)
+{
+  const struct sym *const sym = prof->symtab ? symtab_lookup(prof->symtab, addr) : NULL;
+
+  if (!sym)
+    {
+      *start = addr;
+      return NULL;
+    }
+  *start = sym->addr;
+  return sym->name;
+}
+
+/* Callgrind format. */
+
+static void
+callgrind_fn (FILE *fp, const char *name, uint64_t addr)
+{
+  if (name)
+    fprintf(fp, "fn=%s\n", name);
+  else
+    fprintf(fp, "fn=%#" PRIx64 "\n", addr);
+}
+
+static int
+export_callgrind (const struct profile *prof, FILE *fp)
+{
+  fprintf(fp, "# callgrind format\nversion: 1\ncreator: %s\n",
+	  program_invocation_short_name);
+  fprintf(fp, "cmd: %s\npositions: instr\nevents: Samples\n\n", prof->exe);
+  fprintf(fp, "ob=%s\n", prof->exe);
+
+  const char *cur = NULL;
+  uint64_t cur_start = UINT64_MAX;
+
+  for (size_t h = 0; h < prof->data.nhists; h++)
+    {
+      const struct gmon_hist *const hist = &prof->data.hists[h];
+
+      for (size_t i = 0; i < hist->size; i++)
+	{
+	  const unsigned int count = gmon_bin(hist, i);
+	  if (!count)
+	    continue;
+
+	  const uint64_t addr = gmon_bin_addr(hist, i);
+	  uint64_t start;
+	  const char *const name = symbol_name(prof, addr, &start);
+
+	  if (start != cur_start || name != cur)
+	    {
+	      callgrind_fn(fp, name, start);
+	      cur = name;
+	      cur_start = start;
+	    }
+	  fprintf(fp, "%#" PRIx64 " %u\n", addr, count);
+	}
+    }
+
+  for (size_t i = 0; i < prof->data.narcs; i++)
+    {
+      const struct gmon_arc *const arc = &prof->data.arcs[i];
+      uint64_t from_start, self_start;
+      const char *const from = symbol_name(prof, arc->from_pc, &from_start);
+      const char *const self = symbol_name(prof, arc->self_pc, &self_start);
+
+      /* Arcs with unknown caller carry no information gprof could use
+	 either; skip them. */
+      if (!from)
+	continue;
+      callgrind_fn(fp, from, from_start);
+      if (self)
+	fprintf(fp, "cfn=%s\n", self);
+      else
+	fprintf(fp, "cfn=%#" PRIx64 "\n", self_start);
+      fprintf(fp, "calls=%" PRIu32 " %#" PRIx64 "\n%#" PRIx64 " 0\n",
+	      arc->count, arc->self_pc, arc->from_pc);
+    }
+  return 0;
+}
+
+/* pprof format. */
+
+struct pbuf
+{
+  unsigned char *data;
+  size_t len, cap;
+};
+
+static void
+pbuf_put (struct pbuf *b, const void *p, size_t n)
+{
+  if (b->cap - b->len < n)
+    {
+      while (b->cap - b->len < n)
+	b->cap = b->cap ? b->cap * 2 : 256;
+      if (!(b->data = realloc(b->data, b->cap)))
+	error(EXIT_FAILURE, errno, "malloc");
+    }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static void
+pbuf_varint (struct pbuf *b, uint64_t v)
+{
+  unsigned char tmp[10];
+  size_t n = 0;
+
+  do
+    {
+      tmp[n] = v & 0x7f;
+      v >>= 7;
+      if (v)
+	tmp[n] |= 0x80;
+      n++;
+    }
+  while (v);
+  pbuf_put(b, tmp, n);
+}
+
+/* Field of wire type 0 (varint). */
+static void
+pbuf_uint (struct pbuf *b, unsigned int field, uint64_t v)
+{
+  pbuf_varint(b, (uint64_t) field << 3);
+  pbuf_varint(b, v);
+}
+
+/* Field of wire type 2 (length-delimited). */
+static void
+pbuf_bytes (struct pbuf *b, unsigned int field, const void *p, size_t n)
+{
+  pbuf_varint(b, (uint64_t) field << 3 | 2);
+  pbuf_varint(b, n);
+  pbuf_put(b, p, n);
+}
+
+static void
+pbuf_message (struct pbuf *b, unsigned int field, struct pbuf *msg)
+{
+  pbuf_bytes(b, field, msg->data, msg->len);
+  msg->len = 0;
+}
+
+struct strtab
+{
+  struct pbuf *out;
+  const char **strs;
+  size_t n;
+};
+
+/* Index of S in the string table, adding it if necessary.  Linear
+   search is fine for the few strings we have besides function names,
+   which are known to be distinct and appended by the caller. */
+static uint64_t
+string_index (struct strtab *t, const char *s)
+{
+  for (size_t i = 0; i < t->n; i++)
+    if (!strcmp(t->strs[i], s))
+      return i;
+  if (!(t->strs = realloc(t->strs, (t->n + 1) * sizeof(*t->strs))))
+    error(EXIT_FAILURE, errno, "malloc");
+  t->strs[t->n] = s;
+  pbuf_bytes(t->out, 6, s, strlen(s));
+  return t->n++;
+}
+
+static void
+value_type (struct pbuf *b, unsigned int field, struct strtab *st,
+	    const char *type, const char *unit)
+{
+  struct pbuf vt = { 0 };
+
+  pbuf_uint(&vt, 1, string_index(st, type));
+  pbuf_uint(&vt, 2, string_index(st, unit));
+  pbuf_message(b, field, &vt);
+  free(vt.data);
+}
+
+struct pfunc
+{
+  uint64_t start;
+  const char *name;
+  uint64_t id;
+};
+
+static int
+compare_pfunc (const void *a, const void *b)
+{
+  const struct pfunc *const x = a;
+  const struct pfunc *const y = b;
+
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+static int
+export_pprof (const struct profile *prof, FILE *fp)
+{
+  struct pbuf out = { 0 }, msg = { 0 }, sub = { 0 };
+  struct strtab st = { &out, NULL, 0 };
+
+  string_index(&st, "");
+  value_type(&out, 1, &st, "samples", "count");
+  value_type(&out, 1, &st, "cpu", "nanoseconds");
+  value_type(&out, 1, &st, "calls", "count");
+
+  uint32_t rate = 0;
+  for (size_t h = 0; h < prof->data.nhists && !rate; h++)
+    rate = prof->data.hists[h].rate;
+  const uint64_t period = 1000000000 / (rate ? rate : 100);
+
+  /* Collect locations (one per nonzero bin and arc endpoint) and
+     functions.  Location IDs are 1-based indices into locs[]. */
+  size_t nlocs = 0, caplocs = 0;
+  uint64_t *locs = NULL;
+#define ADD_LOC(Addr)							\
+  ({									\
+    if (nlocs == caplocs)						\
+      {									\
+	caplocs = caplocs ? caplocs * 2 : 1024;				\
+	if (!(locs = realloc(locs, caplocs * sizeof(*locs))))		\
+	  error(EXIT_FAILURE, errno, "malloc");				\
+      }									\
+    locs[nlocs++] = (Addr);						\
+    nlocs;								\
+  })
+
+  uint64_t lowest = UINT64_MAX, highest = 0;
+
+  for (size_t h = 0; h < prof->data.nhists; h++)
+    {
+      const struct gmon_hist *const hist = &prof->data.hists[h];
+
+      for (size_t i = 0; i < hist->size; i++)
+	{
+	  const unsigned int count = gmon_bin(hist, i);
+	  if (!count)
+	    continue;
+
+	  const uint64_t addr = gmon_bin_addr(hist, i);
+	  const uint64_t id = ADD_LOC(addr);
+
+	  pbuf_uint(&msg, 1, id);
+	  pbuf_uint(&msg, 2, count);
+	  pbuf_uint(&msg, 2, count * period);
+	  pbuf_uint(&msg, 2, 0);
+	  pbuf_message(&out, 2, &msg);
+	  if (addr < lowest)
+	    lowest = addr;
+	  if (addr >= highest)
+	    highest = addr + 1;
+	}
+    }
+  for (size_t i = 0; i < prof->data.narcs; i++)
+    {
+      const struct gmon_arc *const arc = &prof->data.arcs[i];
+      uint64_t start;
+
+      if (!symbol_name(prof, arc->from_pc, &start))
+	continue;
+      /* Leaf first. */
+      pbuf_uint(&msg, 1, ADD_LOC(arc->self_pc));
+      pbuf_uint(&msg, 1, ADD_LOC(arc->from_pc));
+      pbuf_uint(&msg, 2, 0);
+      pbuf_uint(&msg, 2, 0);
+      pbuf_uint(&msg, 2, arc->count);
+      pbuf_message(&out, 2, &msg);
+    }
+#undef ADD_LOC
+
+  /* Mapping. */
+  unsigned char id[BUILD_ID_MAX];
+  char *idhex = build_id_hex(id, elf_build_id(prof->exe, id));
+  if (!*idhex)
+    {
+      /* The program may be gone; the profile knows its build ID. */
+      char *const meta_id = gmon_meta(&prof->data, "build-id");
+      if (meta_id)
+	{
+	  free(idhex);
+	  idhex = meta_id;
+	}
+    }
+  pbuf_uint(&msg, 1, 1);
+  pbuf_uint(&msg, 2, lowest != UINT64_MAX ? lowest : 0);
+  pbuf_uint(&msg, 3, highest);
+  pbuf_uint(&msg, 5, string_index(&st, prof->exe));
+  if (*idhex)
+    pbuf_uint(&msg, 6, string_index(&st, idhex));
+  pbuf_uint(&msg, 7, prof->symtab != NULL);
+  pbuf_message(&out, 3, &msg);
+
+  /* Functions, one per distinct symbol, found by binary search. */
+  struct pfunc *funcs = NULL;
+  size_t nfuncs = 0;
+  uint64_t *loc_func = malloc((nlocs + 1) * sizeof(*loc_func));
+  if (!loc_func)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (size_t i = 0; i < nlocs; i++)
+    {
+      uint64_t start;
+      const char *const name = symbol_name(prof, locs[i], &start);
+
+      loc_func[i] = 0;
+      if (!name)
+	continue;
+
+      size_t lo = 0, hi = nfuncs;
+      while (lo < hi)
+	{
+	  const size_t mid = (lo + hi) / 2;
+	  if (funcs[mid].start < start)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      if (lo == nfuncs || funcs[lo].start != start)
+	{
+	  if (!(funcs = realloc(funcs, (nfuncs + 1) * sizeof(*funcs))))
+	    error(EXIT_FAILURE, errno, "malloc");
+	  memmove(&funcs[lo + 1], &funcs[lo], (nfuncs - lo) * sizeof(*funcs));
+	  funcs[lo].start = start;
+	  funcs[lo].name = name;
+	  funcs[lo].id = ++nfuncs;
+	}
+      loc_func[i] = funcs[lo].id;
+    }
+  qsort(funcs, nfuncs, sizeof(*funcs), compare_pfunc);
+  for (size_t i = 0; i < nfuncs; i++)
+    {
+      pbuf_uint(&msg, 1, funcs[i].id);
+      /* Function names are distinct, so skip string_index lookup. */
+      if (!(st.strs = realloc(st.strs, (st.n + 1) * sizeof(*st.strs))))
+	error(EXIT_FAILURE, errno, "malloc");
+      st.strs[st.n] = funcs[i].name;
+      pbuf_bytes(&out, 6, funcs[i].name, strlen(funcs[i].name));
+      pbuf_uint(&msg, 2, st.n);
+      pbuf_uint(&msg, 3, st.n);
+      st.n++;
+      pbuf_message(&out, 5, &msg);
+    }
+
+  for (size_t i = 0; i < nlocs; i++)
+    {
+      pbuf_uint(&msg, 1, i + 1);
+      pbuf_uint(&msg, 2, 1);
+      pbuf_uint(&msg, 3, locs[i]);
+      if (loc_func[i])
+	{
+	  pbuf_uint(&sub, 1, loc_func[i]);
+	  pbuf_message(&msg, 4, &sub);
+	}
+      pbuf_message(&out, 4, &msg);
+    }
+
+  value_type(&out, 11, &st, "cpu", "nanoseconds");
+  pbuf_uint(&out, 12, period);
+
+  int ret = 0;
+#ifdef HAVE_ZLIB_H
+  gzFile gz = gzdopen(dup(fileno(fp)), "wb");
+  if (!gz || gzwrite(gz, out.data, out.len) != (int) out.len)
+    ret = -1;
+  if (gz && gzclose(gz) != Z_OK)
+    ret = -1;
+#else
+  if (fwrite(out.data, 1, out.len, fp) != out.len)
+    ret = -1;
+#endif
+
+  free(idhex);
+  free(funcs);
+  free(loc_func);
+  free(locs);
+  free(st.strs);
+  free(out.data);
+  free(msg.data);
+  free(sub.data);
+  return ret;
+}
+
+static int
+export_gmon (const struct profile *prof, FILE *fp)
+{
+  return fwrite(prof->data.image, 1, prof->data.size, fp) == prof->data.size ? 0 : -1;
+}
+
+static const struct format
+{
+  const char *name;
+  const char *suffix;
+  int (*export) (const struct profile *, FILE *);
+} formats[] =
+  {
+    { "callgrind", ".callgrind", export_callgrind },
+#ifdef HAVE_ZLIB_H
+    { "pprof", ".pb.gz", export_pprof },
+#else
+    { "pprof", ".pb", export_pprof },
+#endif
+    { "gmon", ".gmon", export_gmon },
+  };
+
+/* Returns nonzero if PATH is a container (see spcontainer.h). */
+static _Bool
+is_container (const char *path)
+{
+  char magic[sizeof(((struct spc_header *) 0)->magic)];
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  const _Bool ret = (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		     !memcmp(magic, SPC_MAGIC, sizeof(magic)));
+  close(fd);
+  return ret;
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-f FORMAT] [-o OUTPUT] [EXECUTABLE] PROFILE...\n"
+	  "Formats:", program_invocation_short_name);
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    fprintf(fp, " %s", formats[i].name);
+  fputs("\nWithout -o, output for each PROFILE goes to PROFILE plus suffix"
+	" of the format.\n", fp);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const struct format *format = &formats[0];
+  const char *output = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:ho:")) != -1)
+    switch (opt)
+      {
+      case 'f':
+	format = NULL;
+	for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+	  if (!strcmp(optarg, formats[i].name))
+	    format = &formats[i];
+	if (!format)
+	  error(EXIT_FAILURE, 0, "unknown format %s", optarg);
+	break;
+      case 'o':
+	output = optarg;
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  /* Containers need no executable. */
+  const char *const exe = (optind < argc && is_container(argv[optind])
+			   ? NULL : argv[optind++]);
+  if (optind >= argc || (output && argc - optind > 1))
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+
+  const struct symtab *const symtab = exe ? symtab_load_cached(exe) : NULL;
+  unsigned char id[BUILD_ID_MAX];
+  char *const exe_id = build_id_hex(id, exe ? elf_build_id(exe, id) : 0);
+  int status = EXIT_SUCCESS;
+
+  for (; optind < argc; optind++)
+    {
+      struct profile prof = { .path = argv[optind], .exe = exe, .symtab = symtab };
+
+      if (gmon_read(prof.path, &prof.data))
+	{
+	  status = EXIT_FAILURE;
+	  continue;
+	}
+
+      /* Profiles from simpleprof.so record build ID of the program. */
+      char *const prof_id = gmon_meta(&prof.data, "build-id");
+      if (prof_id && *exe_id && strcmp(prof_id, exe_id))
+	error(0, 0, "warning: %s is of build %s, but %s is %s",
+	      prof.path, prof_id, exe, exe_id);
+      free(prof_id);
+
+      char *program = NULL;
+      if (!exe)
+	{
+	  program = gmon_meta(&prof.data, "program");
+	  prof.exe = program ? program : prof.path;
+	}
+      if (!prof.symtab)
+	prof.symtab = prof.data.symtab;
+
+      char *outpath = NULL;
+      if (!output && asprintf(&outpath, "%s%s", prof.path, format->suffix) < 0)
+	error(EXIT_FAILURE, errno, "malloc");
+      const char *const path = output ? output : outpath;
+      FILE *fp = strcmp(path, "-") ? fopen(path, "w") : stdout;
+      if (!fp)
+	{
+	  error(0, errno, "%s", path);
+	  status = EXIT_FAILURE;
+	}
+      else if (format->export(&prof, fp) || (fp != stdout ? fclose(fp) : fflush(fp)))
+	{
+	  error(0, errno, "%s", path);
+	  status = EXIT_FAILURE;
+	}
+      free(outpath);
+      free(program);
+      gmon_free(&prof.data);
+    }
+  free(exe_id);
+  return status;
+}
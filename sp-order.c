@@ -0,0 +1,202 @@
+/*
+ * sp-order - make a linker function ordering file from profiles.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Samples of all PROFILEs of EXECUTABLE are summed per function, and
+ * functions are listed hottest first, followed by functions without
+ * samples but called (arcs), most called first.  The rest is left out,
+ * so that the linker places it apart from them.
+ *
+ * Output formats:
+ *
+ *   symbols	one symbol per line, for lld --symbol-ordering-file.
+ *   sections	one section name (.text.<symbol>) per line, for gold
+ *		--section-ordering-file.  The program must be compiled
+ *		with -ffunction-sections.
+ *   ld		a .text output section statement listing the sections,
+ *		for GNU ld --section-ordering-file (binutils 2.43 and
+ *		later), also with -ffunction-sections.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "sptool.h"
+
+enum format { FORMAT_SYMBOLS, FORMAT_SECTIONS, FORMAT_LD };
+
+struct func
+{
+  const struct sym *sym;
+  uint64_t samples, calls;
+};
+
+static int
+compare_funcs (const void *a, const void *b)
+{
+  const struct func *const x = a, *const y = b;
+
+  if (x->samples != y->samples)
+    return x->samples < y->samples ? 1 : -1;
+  if (x->calls != y->calls)
+    return x->calls < y->calls ? 1 : -1;
+  return (x->sym->addr > y->sym->addr) - (x->sym->addr < y->sym->addr);
+}
+
+/* Adds samples and calls of the profile PATH to FUNCS of SYMTAB. */
+static int
+add_profile (const char *path, const struct symtab *symtab, const char *exe_id,
+	     struct func *funcs)
+{
+  struct gmon_data data;
+
+  if (gmon_read(path, &data))
+    return -1;
+
+  char *const prof_id = gmon_meta(&data, "build-id");
+  if (prof_id && *exe_id && strcmp(prof_id, exe_id))
+    error(0, 0, "warning: %s is of build %s, but the executable is %s",
+	  path, prof_id, exe_id);
+  free(prof_id);
+
+  for (size_t h = 0; h < data.nhists; h++)
+    {
+      const struct gmon_hist *const hist = &data.hists[h];
+
+      for (size_t i = 0; i < hist->size; i++)
+	{
+	  const unsigned int count = gmon_bin(hist, i);
+	  const struct sym *const sym = (count
+					 ? symtab_lookup(symtab, gmon_bin_addr(hist, i))
+					 : NULL);
+	  if (sym)
+	    funcs[sym - symtab->syms].samples += count;
+	}
+    }
+  for (size_t i = 0; i < data.narcs; i++)
+    {
+      const struct sym *const sym = symtab_lookup(symtab, data.arcs[i].self_pc);
+      if (sym)
+	funcs[sym - symtab->syms].calls += data.arcs[i].count;
+    }
+  gmon_free(&data);
+  return 0;
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-f FORMAT] [-o OUTPUT] EXECUTABLE PROFILE...\n"
+	  "Formats: symbols sections ld\n", program_invocation_short_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum format format = FORMAT_SYMBOLS;
+  const char *output = "-";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:ho:")) != -1)
+    switch (opt)
+      {
+      case 'f':
+	if (!strcmp(optarg, "symbols"))
+	  format = FORMAT_SYMBOLS;
+	else if (!strcmp(optarg, "sections"))
+	  format = FORMAT_SECTIONS;
+	else if (!strcmp(optarg, "ld"))
+	  format = FORMAT_LD;
+	else
+	  error(EXIT_FAILURE, 0, "unknown format %s", optarg);
+	break;
+      case 'o':
+	output = optarg;
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  if (argc - optind < 2)
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+
+  const char *const exe = argv[optind++];
+  const struct symtab *const symtab = symtab_load_cached(exe);
+  if (!symtab)
+    error(EXIT_FAILURE, 0, "%s: no symbols", exe);
+  unsigned char id[BUILD_ID_MAX];
+  char *const exe_id = build_id_hex(id, elf_build_id(exe, id));
+
+  struct func *const funcs = calloc(symtab->nsyms, sizeof(*funcs));
+  if (!funcs)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (size_t i = 0; i < symtab->nsyms; i++)
+    funcs[i].sym = &symtab->syms[i];
+
+  int status = EXIT_SUCCESS;
+  for (; optind < argc; optind++)
+    if (add_profile(argv[optind], symtab, exe_id, funcs))
+      status = EXIT_FAILURE;
+  qsort(funcs, symtab->nsyms, sizeof(*funcs), compare_funcs);
+
+  FILE *const fp = strcmp(output, "-") ? fopen(output, "w") : stdout;
+  if (!fp)
+    error(EXIT_FAILURE, errno, "%s", output);
+
+  if (format == FORMAT_LD)
+    fputs(".text : {\n", fp);
+  size_t nunnamed = 0;
+  for (size_t i = 0; i < symtab->nsyms && (funcs[i].samples || funcs[i].calls); i++)
+    if (symtab_unnamed(funcs[i].sym))
+      nunnamed++;		/* no symbol the linker could place */
+    else
+      switch (format)
+	{
+	case FORMAT_SYMBOLS:
+	  fprintf(fp, "%s\n", funcs[i].sym->name);
+	  break;
+	case FORMAT_SECTIONS:
+	  fprintf(fp, ".text.%s\n", funcs[i].sym->name);
+	  break;
+	case FORMAT_LD:
+	  fprintf(fp, "  *(.text.%s)\n", funcs[i].sym->name);
+	  break;
+	}
+  if (format == FORMAT_LD)
+    fputs("}\n", fp);
+  if (nunnamed)
+    error(0, 0, "warning: %zu functions without a symbol left out", nunnamed);
+
+  if (fp != stdout ? fclose(fp) : fflush(fp))
+    error(EXIT_FAILURE, errno, "%s", output);
+  free(funcs);
+  free(exe_id);
+  return status;
+}
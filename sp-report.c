@@ -0,0 +1,522 @@
+/*
+ * sp-report - flat profile of large profiles, quickly.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Same as "gprof -b -p", but for profiles of hundreds of megabytes:
+ * symbols come from the symbol cache shared with sp-export, their start
+ * addresses are laid out in an array of their own for a branchless
+ * binary search, and the histogram is split among threads, each of
+ * which walks its bins in address order and searches only when a bin
+ * is past the current function.  C++ names are demangled if built with
+ * libstdc++.
+ *
+ * With -b line or -b inline, samples are attributed to source lines, or
+ * to chains of inlined calls down to source lines, instead, from DWARF
+ * debug information of the program or of its separate debug file (see
+ * dwarf.c), which is cached by build ID as symbols are.
+ *
+ * Output is text in gprof's layout, or JSON with -f json.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "sptool.h"
+
+#ifdef HAVE_CXA_DEMANGLE
+extern char *__cxa_demangle (const char *mangled, char *buf, size_t *len,
+			     int *status);
+#endif
+
+/* Histograms smaller than this are not worth a thread. */
+#define BINS_PER_THREAD	(1 << 20)
+
+enum by { BY_FUNCTION, BY_LINE, BY_INLINE };
+
+static const struct symtab *symtab;
+static struct srcmap *srcmap;
+
+/* Units samples are counted for: functions, or regions of SRCMAP. */
+static size_t nunits;
+static uint64_t *starts;	/* for the search */
+static uint64_t *limits;	/* end of each unit */
+
+struct job
+{
+  const struct gmon_hist *hist;
+  size_t from, to;		/* bins */
+  uint64_t *counts;		/* per unit; the last one is unknown */
+  pthread_t thread;
+};
+
+/* Index of the last unit starting at or before ADDR, or SIZE_MAX. */
+static size_t
+find_unit (uint64_t addr)
+{
+  const uint64_t *base = starts;
+  size_t n = nunits;
+
+  if (n == 0 || addr < starts[0])
+    return SIZE_MAX;
+  while (n > 1)
+    {
+      const size_t half = n / 2;
+      base = base[half] <= addr ? base + half : base;
+      n -= half;
+    }
+  return base - starts;
+}
+
+static void *
+count_bins (void *arg)
+{
+  struct job *const job = arg;
+  size_t s = SIZE_MAX;
+  uint64_t next = 0;		/* start of the unit after S */
+
+  for (size_t i = job->from; i < job->to; i++)
+    {
+      const unsigned int count = gmon_bin(job->hist, i);
+      if (!count)
+	continue;
+
+      const uint64_t addr = gmon_bin_addr(job->hist, i);
+      if (addr >= next)
+	{
+	  s = find_unit(addr);
+	  if (s == SIZE_MAX)
+	    next = nunits ? starts[0] : UINT64_MAX;
+	  else
+	    next = s + 1 < nunits ? starts[s + 1] : UINT64_MAX;
+	}
+      if (s != SIZE_MAX && addr < limits[s])
+	job->counts[s] += count;
+      else
+	job->counts[nunits] += count;
+    }
+  return NULL;
+}
+
+/* Returns NAME demangled (malloc'ed), or NULL to use it as is. */
+static char *
+demangle (const char *name)
+{
+#ifdef HAVE_CXA_DEMANGLE
+  int status;
+  if (!strncmp(name, "_Z", 2))
+    return __cxa_demangle(name, NULL, NULL, &status);
+#endif
+  return NULL;
+}
+
+struct frame
+{
+  char *function;		/* demangled, malloc'ed */
+  const char *file;		/* or NULL */
+  uint32_t line;
+};
+
+static char *
+function_name (const char *name)
+{
+  char *s = demangle(name ? name : "<unknown>");
+  if (!s && !(s = strdup(name ? name : "<unknown>")))
+    error(EXIT_FAILURE, errno, "malloc");
+  return s;
+}
+
+/*
+ * Frames of unit U, the outermost (the function in the symbol table)
+ * first.  Each inlined call is a frame, whose location is the call site
+ * of the one inside, and the location of the innermost is the line.
+ */
+static size_t
+unit_frames (size_t u, struct frame **framesp)
+{
+  const struct src_region *const r = srcmap && u < nunits ? &srcmap->regions[u] : NULL;
+  size_t n = 1;
+
+  for (uint32_t i = r ? r->inlined : SRC_NONE; i != SRC_NONE; i = srcmap->inlines[i].parent)
+    n++;
+  struct frame *const frames = calloc(n, sizeof(*frames));
+  if (!frames)
+    error(EXIT_FAILURE, errno, "malloc");
+
+  const struct sym *const sym = (u >= nunits ? NULL
+				 : r ? symtab_lookup(symtab, r->addr)
+				 : &symtab->syms[u]);
+  frames[0].function = function_name(sym ? sym->name : NULL);
+  if (r && r->file != SRC_NONE)
+    {
+      frames[n - 1].file = srcmap->strings + r->file;
+      frames[n - 1].line = r->line;
+    }
+  size_t k = n - 1;
+  for (uint32_t i = r ? r->inlined : SRC_NONE; i != SRC_NONE; i = srcmap->inlines[i].parent, k--)
+    {
+      const struct src_inline *const in = &srcmap->inlines[i];
+      frames[k].function = function_name(in->name != SRC_NONE
+					  ? srcmap->strings + in->name : NULL);
+      if (in->call_file != SRC_NONE)
+	{
+	  frames[k - 1].file = srcmap->strings + in->call_file;
+	  frames[k - 1].line = in->call_line;
+	}
+    }
+  *framesp = frames;
+  return n;
+}
+
+static void
+free_frames (struct frame *frames, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    free(frames[i].function);
+  free(frames);
+}
+
+/* Text naming unit U (malloc'ed), by which units are also merged. */
+static char *
+unit_name (size_t u, enum by by)
+{
+  struct frame *frames;
+  const size_t n = unit_frames(u, &frames);
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *const fp = open_memstream(&buf, &size);
+  if (!fp)
+    error(EXIT_FAILURE, errno, "open_memstream");
+
+  for (size_t i = by == BY_INLINE ? 0 : n - 1; i < n; i++)
+    {
+      fprintf(fp, "%s%s", i > 0 && by == BY_INLINE ? " > " : "", frames[i].function);
+      if (frames[i].file)
+	fprintf(fp, " (%s:%" PRIu32 ")", frames[i].file, frames[i].line);
+    }
+  if (fclose(fp))
+    error(EXIT_FAILURE, errno, "open_memstream");
+  free_frames(frames, n);
+  return buf;
+}
+
+static void
+json_frame (FILE *fp, const struct frame *f)
+{
+  fprintf(fp, "\"function\":");
+  json_string(fp, f->function);
+  if (f->file)
+    {
+      fprintf(fp, ",\"file\":");
+      json_string(fp, f->file);
+      fprintf(fp, ",\"line\":%" PRIu32, f->line);
+    }
+}
+
+struct entry
+{
+  char *name;
+  size_t unit;
+  uint64_t addr, samples;
+};
+
+static int
+compare_names (const void *a, const void *b)
+{
+  const struct entry *const x = a, *const y = b;
+  const int cmp = strcmp(x->name, y->name);
+
+  return cmp ? cmp : (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int
+compare_entries (const void *a, const void *b)
+{
+  const struct entry *const x = a, *const y = b;
+
+  if (x->samples != y->samples)
+    return x->samples < y->samples ? 1 : -1;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-b function|line|inline] [-f text|json] [-n LINES]"
+	  " [-o OUTPUT] [-t THREADS] EXECUTABLE PROFILE\n",
+	  program_invocation_short_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  enum by by = BY_FUNCTION;
+  _Bool json = 0;
+  const char *output = "-";
+  size_t max_lines = SIZE_MAX;
+  long nthreads = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:f:hn:o:t:")) != -1)
+    switch (opt)
+      {
+      case 'b':
+	if (!strcmp(optarg, "function"))
+	  by = BY_FUNCTION;
+	else if (!strcmp(optarg, "line"))
+	  by = BY_LINE;
+	else if (!strcmp(optarg, "inline"))
+	  by = BY_INLINE;
+	else
+	  error(EXIT_FAILURE, 0, "unknown unit %s", optarg);
+	break;
+      case 'f':
+	if (!strcmp(optarg, "json"))
+	  json = 1;
+	else if (!strcmp(optarg, "text"))
+	  json = 0;
+	else
+	  error(EXIT_FAILURE, 0, "unknown format %s", optarg);
+	break;
+      case 'n':
+	max_lines = strtoul(optarg, NULL, 10);
+	break;
+      case 'o':
+	output = optarg;
+	break;
+      case 't':
+	if ((nthreads = strtol(optarg, NULL, 10)) <= 0)
+	  error(EXIT_FAILURE, 0, "invalid number of threads %s", optarg);
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  if (argc - optind != 2)
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+  const char *const exe = argv[optind];
+  const char *const path = argv[optind + 1];
+
+  if (!(symtab = symtab_load_cached(exe)))
+    error(EXIT_FAILURE, 0, "%s: no symbols", exe);
+  if (by != BY_FUNCTION)
+    {
+      if (!(srcmap = srcmap_load_cached(exe)))
+	return EXIT_FAILURE;
+      nunits = srcmap->nregions;
+    }
+  else
+    nunits = symtab->nsyms;
+  if (!(starts = malloc((nunits + 1) * sizeof(*starts))) ||
+      !(limits = malloc((nunits + 1) * sizeof(*limits))))
+    error(EXIT_FAILURE, errno, "malloc");
+  for (size_t i = 0; i < nunits; i++)
+    if (srcmap)
+      {
+	/* Regions end where the next begins; the last is a gap. */
+	starts[i] = srcmap->regions[i].addr;
+	limits[i] = i + 1 < nunits ? srcmap->regions[i + 1].addr : starts[i];
+      }
+    else
+      {
+	const struct sym *const sym = &symtab->syms[i];
+	starts[i] = sym->addr;
+	limits[i] = (sym->size ? sym->addr + sym->size
+		     : i + 1 < nunits ? symtab->syms[i + 1].addr : UINT64_MAX);
+      }
+
+  struct gmon_data data;
+  if (gmon_read(path, &data))
+    return EXIT_FAILURE;
+
+  unsigned char id[BUILD_ID_MAX];
+  char *const exe_id = build_id_hex(id, elf_build_id(exe, id));
+  char *const prof_id = gmon_meta(&data, "build-id");
+  if (prof_id && *exe_id && strcmp(prof_id, exe_id))
+    error(0, 0, "warning: %s is of build %s, but %s is %s",
+	  path, prof_id, exe, exe_id);
+  free(prof_id);
+  free(exe_id);
+
+  /* Split every histogram into jobs of about the same size. */
+  size_t total_bins = 0;
+  uint32_t rate = 0;
+  for (size_t h = 0; h < data.nhists; h++)
+    {
+      total_bins += data.hists[h].size;
+      if (data.hists[h].size > 1)
+	rate = data.hists[h].rate;
+    }
+  if (nthreads == 0)
+    {
+      nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+      if (nthreads > (long) (total_bins / BINS_PER_THREAD) + 1)
+	nthreads = total_bins / BINS_PER_THREAD + 1;
+    }
+  const size_t per_job = total_bins / nthreads + 1;
+
+  struct job *jobs = NULL;
+  size_t njobs = 0;
+  for (size_t h = 0; h < data.nhists; h++)
+    for (size_t from = 0; from < data.hists[h].size; from += per_job)
+      {
+	if (!(jobs = realloc(jobs, (njobs + 1) * sizeof(*jobs))) ||
+	    !(jobs[njobs].counts = calloc(nunits + 1, sizeof(uint64_t))))
+	  error(EXIT_FAILURE, errno, "malloc");
+	jobs[njobs].hist = &data.hists[h];
+	jobs[njobs].from = from;
+	jobs[njobs].to = (data.hists[h].size - from > per_job
+			  ? from + per_job : data.hists[h].size);
+	njobs++;
+      }
+  for (size_t j = 1; j < njobs; j++)
+    {
+      const int e = pthread_create(&jobs[j].thread, NULL, count_bins, &jobs[j]);
+      if (e)
+	error(EXIT_FAILURE, e, "pthread_create");
+    }
+  if (njobs)
+    count_bins(&jobs[0]);
+  for (size_t j = 1; j < njobs; j++)
+    {
+      pthread_join(jobs[j].thread, NULL);
+      for (size_t i = 0; i <= nunits; i++)
+	jobs[0].counts[i] += jobs[j].counts[i];
+      free(jobs[j].counts);
+    }
+
+  /* Units with samples, hottest first; with source lines, units of
+     the same name (e.g. the same line in two places) are merged. */
+  struct entry *const entries = malloc((nunits + 1) * sizeof(*entries));
+  if (!entries)
+    error(EXIT_FAILURE, errno, "malloc");
+  size_t nentries = 0;
+  uint64_t total = 0;
+  for (size_t i = 0; njobs && i <= nunits; i++)
+    if (jobs[0].counts[i])
+      {
+	entries[nentries].name = unit_name(i, by);
+	entries[nentries].unit = i;
+	entries[nentries].addr = i < nunits ? starts[i] : UINT64_MAX;
+	entries[nentries].samples = jobs[0].counts[i];
+	total += jobs[0].counts[i];
+	nentries++;
+      }
+  if (by != BY_FUNCTION && nentries > 0)
+    {
+      qsort(entries, nentries, sizeof(*entries), compare_names);
+      size_t n = 1;
+      for (size_t i = 1; i < nentries; i++)
+	if (!strcmp(entries[n - 1].name, entries[i].name))
+	  {
+	    entries[n - 1].samples += entries[i].samples;
+	    free(entries[i].name);
+	  }
+	else
+	  entries[n++] = entries[i];
+      nentries = n;
+    }
+  qsort(entries, nentries, sizeof(*entries), compare_entries);
+
+  FILE *const fp = strcmp(output, "-") ? fopen(output, "w") : stdout;
+  if (!fp)
+    error(EXIT_FAILURE, errno, "%s", output);
+
+  const double period = rate ? 1.0 / rate : 0.01;
+  if (json)
+    {
+      fprintf(fp, "{\"profile\":");
+      json_string(fp, path);
+      fprintf(fp, ",\"executable\":");
+      json_string(fp, exe);
+      fprintf(fp, ",\"rate\":%" PRIu32 ",\"samples\":%" PRIu64 ",\"%s\":[",
+	      rate, total, by == BY_FUNCTION ? "functions" : "lines");
+    }
+  else
+    fprintf(fp, "Flat profile:\n\n"
+	    "Each sample counts as %g seconds.\n"
+	    "  %%   cumulative   self\n"
+	    " time   seconds   seconds    samples  name\n", period);
+
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < nentries && i < max_lines; i++)
+    {
+      const struct entry *const e = &entries[i];
+
+      cumulative += e->samples;
+      if (!json)
+	fprintf(fp, "%6.2f %9.2f %9.2f %10" PRIu64 "  %s\n",
+		100.0 * e->samples / total, cumulative * period,
+		e->samples * period, e->samples, e->name);
+      else if (by == BY_FUNCTION)
+	{
+	  fprintf(fp, "%s{\"name\":", i ? "," : "");
+	  json_string(fp, e->name);
+	  if (e->addr != UINT64_MAX)
+	    fprintf(fp, ",\"address\":\"%#" PRIx64 "\"", e->addr);
+	}
+      else
+	{
+	  struct frame *frames;
+	  const size_t n = unit_frames(e->unit, &frames);
+
+	  fputs(i ? ",{" : "{", fp);
+	  if (by == BY_LINE)
+	    json_frame(fp, &frames[n - 1]);
+	  else
+	    for (size_t k = 0; k < n; k++)
+	      {
+		fputs(k ? ",{" : "\"frames\":[{", fp);
+		json_frame(fp, &frames[k]);
+		fputs(k + 1 < n ? "}" : "}]", fp);
+	      }
+	  free_frames(frames, n);
+	}
+      if (json)
+	fprintf(fp, ",\"samples\":%" PRIu64 ",\"percent\":%.2f}",
+		e->samples, 100.0 * e->samples / total);
+    }
+  if (json)
+    fputs("]}\n", fp);
+
+  if (fp != stdout ? fclose(fp) : fflush(fp))
+    error(EXIT_FAILURE, errno, "%s", output);
+  if (njobs)
+    free(jobs[0].counts);
+  free(jobs);
+  for (size_t i = 0; i < nentries; i++)
+    free(entries[i].name);
+  free(entries);
+  free(starts);
+  free(limits);
+  srcmap_free(srcmap);
+  gmon_free(&data);
+  return EXIT_SUCCESS;
+}
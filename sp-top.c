@@ -0,0 +1,534 @@
+/*
+ * sp-top - show functions of running programs taking the most time.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Processes running under simpleprof.so keep their profiles mapped
+ * shared for as long as they run, so /proc/PID/maps of every process
+ * already is a registry of live profiles: no file needs to be written
+ * for it, and none goes stale when a process is killed.  Profiles found
+ * there (or given by name) are mapped read-only, their bins are copied
+ * under the seqlock every DELAY seconds, and the differences from the
+ * last copy are shown per function as the share of a CPU spent in it.
+ *
+ * A file used by several processes, i.e. processes of the same program,
+ * is shown once with the samples of all of them.  Bins saturate at
+ * 65535 samples, after which they show no more.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/gmon_out.h>
+
+#include "sptool.h"
+
+#ifdef HAVE_CXA_DEMANGLE
+extern char *__cxa_demangle (const char *mangled, char *buf, size_t *len,
+			     int *status);
+#endif
+
+/* A profile being watched. */
+struct live
+{
+  struct live *next;
+  dev_t dev;
+  ino_t ino;
+  char *path;
+  char *program;		/* as recorded in the profile */
+  const struct symtab *symtab;	/* or NULL */
+  const void *map;
+  size_t mapsize;
+  struct gmon_hist hist;	/* bins point to CUR */
+  unsigned char *prev, *cur;
+  size_t npids;			/* mapping it in this round */
+  _Bool seen;
+};
+
+/* A function with samples since the last round. */
+struct row
+{
+  const struct live *live;
+  const struct sym *sym;	/* or NULL if unknown */
+  uint64_t samples;
+};
+
+static struct live *lives;
+
+/* Files found not to be profiles, not to be looked at again. */
+static struct file_id
+{
+  dev_t dev;
+  ino_t ino;
+} *ignored;
+static size_t nignored;
+
+static _Bool
+is_ignored (dev_t dev, ino_t ino)
+{
+  for (size_t i = 0; i < nignored; i++)
+    if (ignored[i].dev == dev && ignored[i].ino == ino)
+      return 1;
+  return 0;
+}
+
+static void
+ignore (dev_t dev, ino_t ino)
+{
+  if (!(ignored = realloc(ignored, (nignored + 1) * sizeof(*ignored))))
+    error(EXIT_FAILURE, errno, "malloc");
+  ignored[nignored].dev = dev;
+  ignored[nignored++].ino = ino;
+}
+
+/* Symbols of the build of profile DATA, by way of process PID if any. */
+static const struct symtab *
+load_symbols (const struct gmon_data *data, pid_t pid)
+{
+  char *const id = gmon_meta(data, "build-id");
+  const struct symtab *tab = NULL;
+
+  if (pid)
+    {
+      char exe[sizeof("/proc//exe") + 3 * sizeof(pid)];
+      unsigned char own[BUILD_ID_MAX];
+      sprintf(exe, "/proc/%ld/exe", (long) pid);
+      char *const hex = build_id_hex(own, elf_build_id(exe, own));
+      /* Profiles of shared libraries (see libprof.c) are of other builds. */
+      if (!id || strncmp(id, "hash-", 5) == 0 ? !*hex : !strcmp(id, hex))
+	tab = symtab_load_cached(exe);
+      free(hex);
+    }
+  if (!tab && id && *id)
+    tab = symtab_load_build_id(id);
+  free(id);
+  return tab;
+}
+
+/* Starts watching PATH, which is file DEV:INO mapped by PID (or 0). */
+static struct live *
+add_live (const char *path, dev_t dev, ino_t ino, pid_t pid)
+{
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) || st.st_dev != dev || st.st_ino != ino ||
+      (size_t) st.st_size < sizeof(struct gmon_hdr))
+    {
+      /* Rotated away under the same name; found again in a later round. */
+      close(fd);
+      return NULL;
+    }
+
+  char magic[4];
+  struct gmon_data data;
+  if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+      memcmp(magic, GMON_MAGIC, sizeof(magic)) ||
+      gmon_read(path, &data))
+    {
+      close(fd);
+      ignore(dev, ino);
+      return NULL;
+    }
+  const void *const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED || data.nhists == 0 || data.size != (size_t) st.st_size)
+    {
+      if (map != MAP_FAILED)
+	munmap((void *) map, st.st_size);
+      gmon_free(&data);
+      ignore(dev, ino);
+      return NULL;
+    }
+
+  struct live *const l = calloc(1, sizeof(*l));
+  if (!l || !(l->path = strdup(path)))
+    error(EXIT_FAILURE, errno, "malloc");
+  l->dev = dev;
+  l->ino = ino;
+  l->map = map;
+  l->mapsize = st.st_size;
+  l->program = gmon_meta(&data, "program");
+  l->symtab = load_symbols(&data, pid);
+
+  /* Profiles of simpleprof.so may start with a one-bin dummy. */
+  const struct gmon_hist *h = &data.hists[0];
+  for (size_t i = 1; i < data.nhists; i++)
+    if (data.hists[i].size > h->size)
+      h = &data.hists[i];
+  l->hist = *h;
+  const size_t len = (size_t) h->size * sizeof(unsigned short);
+  if (!(l->prev = malloc(len + 1)) || !(l->cur = malloc(len + 1)))
+    error(EXIT_FAILURE, errno, "malloc");
+  gmon_copy_live(map, h->offset, len, l->cur);
+  l->hist.bins = l->cur;
+  gmon_free(&data);
+
+  l->next = lives;
+  lives = l;
+  return l;
+}
+
+static void
+free_live (struct live *l)
+{
+  munmap((void *) l->map, l->mapsize);
+  free(l->path);
+  free(l->program);
+  free(l->prev);
+  free(l->cur);
+  free(l);
+}
+
+static void
+found (const char *path, dev_t dev, ino_t ino, pid_t pid)
+{
+  struct live *l;
+
+  for (l = lives; l; l = l->next)
+    if (l->dev == dev && l->ino == ino)
+      break;
+  if (!l && !is_ignored(dev, ino))
+    l = add_live(path, dev, ino, pid);
+  if (l)
+    {
+      l->seen = 1;
+      if (pid)
+	l->npids++;
+    }
+}
+
+/* Finds profiles mapped by process PID. */
+static void
+scan_process (pid_t pid)
+{
+  char maps[sizeof("/proc//maps") + 3 * sizeof(pid)];
+  sprintf(maps, "/proc/%ld/maps", (long) pid);
+  FILE *const fp = fopen(maps, "r");
+  if (!fp)
+    return;
+
+  char *line = NULL;
+  size_t size = 0;
+  dev_t last_dev = 0;
+  ino_t last_ino = 0;
+  while (getline(&line, &size, fp) > 0)
+    {
+      char perms[5];
+      unsigned int major, minor;
+      unsigned long inode;
+      int pathpos = 0;
+
+      if (sscanf(line, "%*x-%*x %4s %*x %x:%x %lu %n",
+		 perms, &major, &minor, &inode, &pathpos) < 4 ||
+	  perms[3] != 's' || inode == 0 || !pathpos || line[pathpos] != '/')
+	continue;
+      line[strcspn(line, "\n")] = '\0';
+      const dev_t dev = makedev(major, minor);
+      /* A file may be mapped more than once, in consecutive lines. */
+      if (dev == last_dev && inode == last_ino)
+	continue;
+      last_dev = dev;
+      last_ino = inode;
+      found(line + pathpos, dev, inode, pid);
+    }
+  free(line);
+  fclose(fp);
+}
+
+static void
+scan_all (void)
+{
+  DIR *const dir = opendir("/proc");
+  if (!dir)
+    error(EXIT_FAILURE, errno, "/proc");
+
+  const pid_t self = getpid();
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL)
+    if (isdigit((unsigned char) d->d_name[0]) && atol(d->d_name) != self)
+      scan_process(atol(d->d_name));
+  closedir(dir);
+}
+
+/* Rediscovers profiles of ARGS (PIDs or files), or of all processes. */
+static void
+discover (char **args, int nargs)
+{
+  for (struct live *l = lives; l; l = l->next)
+    {
+      l->seen = 0;
+      l->npids = 0;
+    }
+
+  if (nargs == 0)
+    scan_all();
+  for (int i = 0; i < nargs; i++)
+    {
+      char *end;
+      const long pid = strtol(args[i], &end, 10);
+      struct stat st;
+
+      if (*end == '\0' && pid > 0)
+	scan_process(pid);
+      else if (!stat(args[i], &st))
+	found(args[i], st.st_dev, st.st_ino, 0);
+    }
+
+  for (struct live **p = &lives; *p; )
+    if (!(*p)->seen)
+      {
+	struct live *const l = *p;
+	*p = l->next;
+	free_live(l);
+      }
+    else
+      p = &(*p)->next;
+}
+
+/* Adds rows of samples of L since the last round to *ROWS. */
+static void
+take_samples (struct live *l, struct row **rows, size_t *nrows, size_t *alloc)
+{
+  unsigned char *const tmp = l->prev;
+  l->prev = l->cur;
+  l->cur = tmp;
+  l->hist.bins = l->cur;
+  gmon_copy_live(l->map, l->hist.offset, (size_t) l->hist.size * sizeof(unsigned short), l->cur);
+
+  const struct gmon_hist prev = { .bins = l->prev };
+  const struct sym *last = NULL;
+  for (size_t i = 0; i < l->hist.size; i++)
+    {
+      const unsigned int now = gmon_bin(&l->hist, i), before = gmon_bin(&prev, i);
+      if (now <= before)
+	continue;
+
+      const struct sym *const sym = (l->symtab
+				     ? symtab_lookup(l->symtab, gmon_bin_addr(&l->hist, i))
+				     : NULL);
+      if (*nrows == 0 || (*rows)[*nrows - 1].live != l || sym != last)
+	{
+	  if (*nrows == *alloc)
+	    {
+	      *alloc = *alloc ? 2 * *alloc : 256;
+	      if (!(*rows = realloc(*rows, *alloc * sizeof(**rows))))
+		error(EXIT_FAILURE, errno, "malloc");
+	    }
+	  (*rows)[*nrows].live = l;
+	  (*rows)[*nrows].sym = sym;
+	  (*rows)[(*nrows)++].samples = 0;
+	  last = sym;
+	}
+      (*rows)[*nrows - 1].samples += now - before;
+    }
+}
+
+static int
+compare_functions (const void *a, const void *b)
+{
+  const struct row *const x = a, *const y = b;
+
+  if (x->live != y->live)
+    return (x->live > y->live) - (x->live < y->live);
+  return (x->sym > y->sym) - (x->sym < y->sym);
+}
+
+static double
+row_cpu (const struct row *r, double elapsed)
+{
+  const double period = r->live->hist.rate ? 1.0 / r->live->hist.rate : 0.01;
+  return elapsed > 0 ? 100.0 * r->samples * period / elapsed : 0.0;
+}
+
+static double elapsed;
+
+static int
+compare_rows (const void *a, const void *b)
+{
+  const struct row *const x = a, *const y = b;
+  const double cx = row_cpu(x, elapsed), cy = row_cpu(y, elapsed);
+
+  if (cx != cy)
+    return cx < cy ? 1 : -1;
+  return compare_functions(a, b);
+}
+
+static char *
+function_name (const struct sym *sym)
+{
+  const char *const name = sym ? sym->name : "<unknown>";
+  char *s = NULL;
+#ifdef HAVE_CXA_DEMANGLE
+  int status;
+  if (!strncmp(name, "_Z", 2))
+    s = __cxa_demangle(name, NULL, NULL, &status);
+#endif
+  if (!s && !(s = strdup(name)))
+    error(EXIT_FAILURE, errno, "malloc");
+  return s;
+}
+
+static void
+show (struct row *rows, size_t nrows, size_t max_lines, _Bool clear)
+{
+  size_t nfiles = 0, npids = 0;
+  for (const struct live *l = lives; l; l = l->next)
+    {
+      nfiles++;
+      npids += l->npids;
+    }
+
+  /* Merge rows of the same function, split by other functions' bins. */
+  if (nrows)
+    qsort(rows, nrows, sizeof(*rows), compare_functions);
+  size_t n = 0;
+  double total = 0;
+  for (size_t i = 0; i < nrows; i++)
+    if (n > 0 && !compare_functions(&rows[n - 1], &rows[i]))
+      rows[n - 1].samples += rows[i].samples;
+    else
+      rows[n++] = rows[i];
+  for (size_t i = 0; i < n; i++)
+    total += row_cpu(&rows[i], elapsed);
+  if (n)
+    qsort(rows, n, sizeof(*rows), compare_rows);
+
+  const time_t now = time(NULL);
+  char stamp[16];
+  strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&now));
+  fputs(clear ? "\033[H\033[2J" : "", stdout);
+  printf("%s - %s, %zu profiles, %zu processes, %.1f%% CPU sampled\n\n"
+	 "  %%CPU    SAMPLES  PROGRAM           FUNCTION\n",
+	 program_invocation_short_name, stamp, nfiles, npids, total);
+  for (size_t i = 0; i < n && i < max_lines; i++)
+    {
+      const struct row *const r = &rows[i];
+      const char *prog = r->live->program ? r->live->program : r->live->path;
+      const char *const slash = strrchr(prog, '/');
+      char *const name = function_name(r->sym);
+
+      printf("%6.1f %10" PRIu64 "  %-16.16s  %s\n",
+	     row_cpu(r, elapsed), r->samples, slash ? slash + 1 : prog, name);
+      free(name);
+    }
+  if (!clear)
+    putchar('\n');
+  if (fflush(stdout))
+    error(EXIT_FAILURE, errno, "stdout");
+}
+
+static double
+monotonic (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-b] [-d DELAY] [-i ITERATIONS] [-n LINES] [PID|PROFILE]...\n"
+	  "Without PID or PROFILE, profiles of all processes are shown.\n",
+	  program_invocation_short_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  _Bool batch = !isatty(STDOUT_FILENO);
+  double delay = 1;
+  unsigned long iterations = 0;
+  size_t max_lines = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "bd:hi:n:")) != -1)
+    switch (opt)
+      {
+      case 'b':
+	batch = 1;
+	break;
+      case 'd':
+	if ((delay = strtod(optarg, NULL)) <= 0)
+	  error(EXIT_FAILURE, 0, "invalid delay %s", optarg);
+	break;
+      case 'i':
+	iterations = strtoul(optarg, NULL, 10);
+	break;
+      case 'n':
+	max_lines = strtoul(optarg, NULL, 10);
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+
+  discover(argv + optind, argc - optind);
+  if (!lives && optind < argc)
+    error(EXIT_FAILURE, 0, "no live profile found");
+
+  struct row *rows = NULL;
+  size_t alloc = 0;
+  double last = monotonic();
+  for (unsigned long round = 0; !iterations || round < iterations; round++)
+    {
+      const double until = last + delay;
+      for (double t = monotonic(); t < until; t = monotonic())
+	{
+	  const double left = until - t;
+	  const struct timespec ts = { left, (left - (time_t) left) * 1e9 };
+	  nanosleep(&ts, NULL);
+	}
+
+      size_t nrows = 0;
+      for (struct live *l = lives; l; l = l->next)
+	take_samples(l, &rows, &nrows, &alloc);
+      const double now = monotonic();
+      elapsed = now - last;
+      last = now;
+
+      size_t lines = max_lines;
+      struct winsize ws;
+      if (!lines)
+	lines = (!batch && !ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) && ws.ws_row > 4
+		 ? ws.ws_row - 4u : 20);
+      show(rows, nrows, lines, !batch);
+
+      /* New processes show up in the next round. */
+      discover(argv + optind, argc - optind);
+    }
+  free(rows);
+  return EXIT_SUCCESS;
+}
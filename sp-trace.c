@@ -0,0 +1,402 @@
+/*
+ * sp-trace - convert Simple Profiler timeline to Chrome trace events.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output is JSON "trace event format", which can be loaded into
+ * chrome://tracing or https://ui.perfetto.dev/.
+ *
+ * Consecutive samples of a thread are merged into nested "complete"
+ * events of their (symbolized) stack frames.  A frame is closed when
+ * a sample no longer contains it, or when the thread got no samples
+ * for more than two sampling periods (i.e. it was not running).
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sptool.h"
+#include "sptrace.h"
+
+struct object
+{
+  uint64_t lowpc, highpc, base;
+  char *path;
+  struct symtab *symtab;	/* loaded on demand */
+  _Bool tried;
+};
+
+static struct object *objects;
+static size_t nobjects;
+
+struct sample
+{
+  uint64_t time_ns;
+  uint32_t tid;
+  uint32_t depth;
+  uint64_t fiber, task;
+  const uint64_t *pc;
+};
+
+/* Samples of a fiber go to a track of their own, whichever thread ran
+   it.  Track IDs of fibers are above those of threads. */
+#define FIBER_TRACK	UINT32_C(0x80000000)
+
+static inline uint32_t
+track_of (const struct sample *s)
+{
+  return s->fiber ? FIBER_TRACK | (uint32_t) (s->fiber % FIBER_TRACK) : s->tid;
+}
+
+static void
+parse_load_map (const char *map, size_t size)
+{
+  const char *const end = map + size;
+
+  while (map < end && *map)
+    {
+      const char *const eol = memchr(map, '\n', end - map);
+      if (!eol)
+	break;
+
+      uint64_t lowpc, highpc, base;
+      int pos;
+      char line[eol - map + 1];
+      memcpy(line, map, eol - map);
+      line[eol - map] = '\0';
+      map = eol + 1;
+
+      if (sscanf(line, "%" SCNx64 " %" SCNx64 " %" SCNx64 " %n",
+		 &lowpc, &highpc, &base, &pos) != 3)
+	continue;
+      objects = realloc(objects, (nobjects + 1) * sizeof(*objects));
+      if (!objects)
+	error(EXIT_FAILURE, errno, "malloc");
+      objects[nobjects++] = (struct object) { .lowpc = lowpc,
+					      .highpc = highpc,
+					      .base = base,
+					      .path = strdup(line + pos) };
+    }
+}
+
+/* Returns symbol name for PC, or NULL. */
+static const char *
+symbolize (uint64_t pc)
+{
+  /* Later objects shadow earlier ones loaded at the same address. */
+  for (size_t i = nobjects; i-- > 0; )
+    {
+      struct object *const obj = &objects[i];
+
+      if (pc < obj->lowpc || pc >= obj->highpc)
+	continue;
+      if (!obj->tried)
+	{
+	  obj->tried = 1;
+	  if (obj->path[0] && obj->path[0] != '[')
+	    obj->symtab = symtab_load_cached(obj->path);
+	}
+
+      const struct sym *const sym = obj->symtab ? symtab_lookup(obj->symtab, pc - obj->base) : NULL;
+      if (sym)
+	return sym->name;
+
+      const char *const slash = strrchr(obj->path, '/');
+      char *name;
+      if (asprintf(&name, "%s+%#" PRIx64, slash ? slash + 1 : obj->path,
+		   pc - obj->base) < 0)
+	error(EXIT_FAILURE, errno, "malloc");
+      return name;		/* leaked, but this is a short-lived program */
+    }
+  return NULL;
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+  const struct sample *const x = a;
+  const struct sample *const y = b;
+
+  if (track_of(x) != track_of(y))
+    return track_of(x) < track_of(y) ? -1 : 1;
+  return (x->time_ns > y->time_ns) - (x->time_ns < y->time_ns);
+}
+
+struct frame
+{
+  const char *name;
+  uint64_t start_ns;
+};
+
+static void
+emit_event (FILE *fp, const char *name, uint32_t pid, uint32_t tid,
+	    uint64_t start_ns, uint64_t end_ns, _Bool *first)
+{
+  fputs(*first ? "\n" : ",\n", fp);
+  *first = 0;
+  fputs("{\"name\":", fp);
+  json_string(fp, name);
+  fprintf(fp, ",\"cat\":\"sample\",\"ph\":\"X\",\"pid\":%" PRIu32
+	  ",\"tid\":%" PRIu32 ",\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u}",
+	  pid, tid, start_ns / 1000, (unsigned int) (start_ns % 1000),
+	  (end_ns - start_ns) / 1000, (unsigned int) ((end_ns - start_ns) % 1000));
+}
+
+static void
+close_frames (FILE *fp, struct frame *stack, unsigned int *depth,
+	      unsigned int keep, uint32_t pid, uint32_t tid, uint64_t end_ns,
+	      _Bool *first)
+{
+  while (*depth > keep)
+    {
+      --*depth;
+      emit_event(fp, stack[*depth].name, pid, tid,
+		 stack[*depth].start_ns, end_ns, first);
+    }
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+  const uint64_t x = *(const uint64_t *) a;
+  const uint64_t y = *(const uint64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * ITIMER_PROF ticks are shared by all running threads, so that each of
+ * N busy threads gets a sample every N periods.  Take twice the median
+ * interval of the thread (but at least two periods) as the gap which
+ * means the thread was off CPU.
+ */
+static uint64_t
+idle_gap (const struct sample *s, size_t n, uint64_t period_ns)
+{
+  uint64_t gap = 2 * period_ns;
+
+  if (n < 2)
+    return gap;
+
+  uint64_t *const delta = malloc((n - 1) * sizeof(*delta));
+  if (!delta)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (size_t i = 1; i < n; i++)
+    delta[i - 1] = s[i].time_ns - s[i - 1].time_ns;
+  qsort(delta, n - 1, sizeof(*delta), compare_u64);
+  if (2 * delta[(n - 1) / 2] > gap)
+    gap = 2 * delta[(n - 1) / 2];
+  free(delta);
+  return gap;
+}
+
+static void
+usage (FILE *fp)
+{
+  fprintf(fp, "Usage: %s [-o OUTPUT] TRACEFILE\n",
+	  program_invocation_short_name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  const char *output = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ho:")) != -1)
+    switch (opt)
+      {
+      case 'o':
+	output = optarg;
+	break;
+      case 'h':
+	usage(stdout);
+	return EXIT_SUCCESS;
+      default:
+	usage(stderr);
+	return EXIT_FAILURE;
+      }
+  if (optind + 1 != argc)
+    {
+      usage(stderr);
+      return EXIT_FAILURE;
+    }
+
+  const char *const path = argv[optind];
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st))
+    error(EXIT_FAILURE, errno, "%s", path);
+  const unsigned char *const image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (image == MAP_FAILED)
+    error(EXIT_FAILURE, errno, "%s: mmap", path);
+  close(fd);
+
+  const struct sptrace_header *const hdr = (const struct sptrace_header *) image;
+  if ((size_t) st.st_size < sizeof(*hdr) ||
+      memcmp(hdr->magic, SPTRACE_MAGIC, sizeof(hdr->magic)) ||
+      hdr->version != SPTRACE_VERSION ||
+      hdr->record_size < sizeof(struct sptrace_record) ||
+      (hdr->record_size - sizeof(struct sptrace_record)) / sizeof(uint64_t) < hdr->max_depth ||
+      hdr->capacity == 0 || (hdr->capacity & (hdr->capacity - 1)) ||
+      hdr->map_offset > (size_t) st.st_size ||
+      hdr->map_size > st.st_size - hdr->map_offset ||
+      hdr->records_offset > (size_t) st.st_size ||
+      (uint64_t) (st.st_size - hdr->records_offset) / hdr->record_size < hdr->capacity)
+    error(EXIT_FAILURE, 0, "%s: not a valid trace file", path);
+
+  parse_load_map((const char *) image + hdr->map_offset, hdr->map_size);
+
+  /* Copy out complete records in the ring. */
+  const uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+  const uint64_t first_idx = head > hdr->capacity ? head - hdr->capacity : 0;
+  struct sample *samples = malloc((head - first_idx) * sizeof(*samples));
+  uint64_t *pcs = malloc((head - first_idx) * hdr->max_depth * sizeof(*pcs));
+  size_t nsamples = 0;
+  if ((head > first_idx) && (!samples || !pcs))
+    error(EXIT_FAILURE, errno, "malloc");
+
+  for (uint64_t idx = first_idx; idx < head; idx++)
+    {
+      const struct sptrace_record *const rec
+	= (const struct sptrace_record *) (image + hdr->records_offset
+					   + (idx & (hdr->capacity - 1)) * hdr->record_size);
+      struct sample *const s = &samples[nsamples];
+      uint64_t *const pc = &pcs[nsamples * hdr->max_depth];
+
+      if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != idx + 1)
+	continue;
+      s->time_ns = rec->time_ns;
+      s->tid = rec->tid;
+      s->fiber = rec->fiber;
+      s->task = rec->task;
+      s->depth = rec->depth < hdr->max_depth ? rec->depth : hdr->max_depth;
+      memcpy(pc, rec->pc, s->depth * sizeof(*pc));
+      s->pc = pc;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == idx + 1)
+	nsamples++;
+    }
+  qsort(samples, nsamples, sizeof(*samples), compare_samples);
+
+  FILE *fp = stdout;
+  if (output && !(fp = fopen(output, "w")))
+    error(EXIT_FAILURE, errno, "%s", output);
+
+  const uint64_t period_ns = 1000000000 / (hdr->hz ? hdr->hz : 100);
+  const uint32_t pid = hdr->pid;
+  char progname[sizeof(hdr->progname) + 1];
+  memcpy(progname, hdr->progname, sizeof(hdr->progname));
+  progname[sizeof(hdr->progname)] = '\0';
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", fp);
+  _Bool first = 1;
+
+  fprintf(fp, "\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%" PRIu32
+	  ",\"args\":{\"name\":", pid);
+  json_string(fp, progname);
+  fputs("}}", fp);
+  first = 0;
+
+  struct frame *stack = malloc((hdr->max_depth + 1) * sizeof(*stack));
+  if (!stack)
+    error(EXIT_FAILURE, errno, "malloc");
+
+  for (size_t i = 0; i < nsamples; )
+    {
+      const uint32_t tid = track_of(&samples[i]);
+      unsigned int depth = 0;
+      uint64_t last_ns = samples[i].time_ns;
+      size_t n = i;
+
+      while (n < nsamples && track_of(&samples[n]) == tid)
+	n++;
+      const uint64_t gap_ns = idle_gap(&samples[i], n - i, period_ns);
+
+      if (samples[i].fiber)
+	{
+	  const char *task = samples[i].task ? symbolize(samples[i].task) : NULL;
+	  char *name;
+	  if (asprintf(&name, "fiber %" PRIu64 "%s%s%s", samples[i].fiber,
+		       task ? " (" : "", task ? task : "", task ? ")" : "") < 0)
+	    error(EXIT_FAILURE, errno, "malloc");
+	  fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%" PRIu32
+		  ",\"tid\":%" PRIu32 ",\"args\":{\"name\":", pid, tid);
+	  json_string(fp, name);
+	  fputs("}}", fp);
+	  free(name);
+	}
+      else
+	fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%" PRIu32
+		",\"tid\":%" PRIu32 ",\"args\":{\"name\":\"%s%s%" PRIu32 "\"}}",
+		pid, tid, tid == pid ? "main " : "", "thread ", tid);
+
+      for (; i < n; i++)
+	{
+	  const struct sample *const s = &samples[i];
+
+	  if (s->time_ns - last_ns > gap_ns)
+	    close_frames(fp, stack, &depth, 0, pid, tid,
+			 last_ns + period_ns, &first);
+
+	  /* Outermost frame first; return addresses point after the call. */
+	  unsigned int keep = 0;
+	  _Bool same = 1;
+	  for (unsigned int d = 0; d < s->depth; d++)
+	    {
+	      const unsigned int k = s->depth - 1 - d;
+	      const char *name = symbolize(k ? s->pc[k] - 1 : s->pc[k]);
+	      if (!name)
+		name = "[unknown]";
+
+	      if (same && keep < depth && !strcmp(stack[keep].name, name))
+		{
+		  keep++;
+		  continue;
+		}
+	      if (same)
+		{
+		  close_frames(fp, stack, &depth, keep, pid, tid,
+			       s->time_ns, &first);
+		  same = 0;
+		}
+	      stack[depth].name = name;
+	      stack[depth].start_ns = s->time_ns;
+	      depth++;
+	    }
+	  if (same)
+	    close_frames(fp, stack, &depth, keep, pid, tid, s->time_ns, &first);
+	  last_ns = s->time_ns;
+	}
+      close_frames(fp, stack, &depth, 0, pid, tid, last_ns + period_ns, &first);
+    }
+
+  fputs("\n]}\n", fp);
+  if (fp != stdout ? fclose(fp) : fflush(fp))
+    error(EXIT_FAILURE, errno, "%s", output ? output : "stdout");
+
+  return EXIT_SUCCESS;
+}
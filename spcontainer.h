@@ -0,0 +1,88 @@
+/*
+ * Simple Profiler - self-contained profile container format.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * A container (.spc file) holds a snapshot of a profile together with
+ * everything needed to analyze it without the profiled binaries.  It
+ * is a header, a table of sections, and the sections themselves:
+ *
+ *   SPC_GMON	the profile in gmon.out format, as is
+ *   SPC_META	"key=value" lines: program, build-id, host, argv, pid,
+ *		start and end time (seconds since the Epoch), runs, hz
+ *   SPC_STATS	"key=value" lines: samples, bins (nonzero), max-bin
+ *   SPC_MAPS	load map, one object per line:
+ *		"lowpc highpc base build-id path" in hex, build-id "-"
+ *		if none
+ *   SPC_SYMS	struct spc_sym[], functions of the main program with
+ *		samples, sorted by address
+ *   SPC_STRS	names of SPC_SYMS, NUL-terminated
+ *
+ * All integers are in host byte order; readers reject other versions.
+ */
+
+#ifndef SPCONTAINER_H
+#define SPCONTAINER_H
+
+#include <stdint.h>
+
+#define SPC_MAGIC	"SPCONT01"
+#define SPC_VERSION	1
+
+enum
+  {
+    SPC_GMON = 1,
+    SPC_META,
+    SPC_STATS,
+    SPC_MAPS,
+    SPC_SYMS,
+    SPC_STRS,
+  };
+
+struct spc_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t nsections;		/* struct spc_section[] follows */
+};
+
+struct spc_section
+{
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t offset;		/* from the beginning of the file */
+  uint64_t size;
+};
+
+struct spc_sym
+{
+  uint64_t addr;		/* link-time address */
+  uint32_t size;
+  uint32_t name;		/* offset in SPC_STRS */
+};
+
+#endif /* SPCONTAINER_H */
@@ -0,0 +1,43 @@
+/*
+ * Common routines for Simple Profiler tools.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "sptool.h"
+
+void
+json_string (FILE *fp, const char *str)
+{
+  putc('"', fp);
+  for (const unsigned char *p = (const unsigned char *) str; *p; p++)
+    switch (*p)
+      {
+      case '"':
+      case '\\':
+	putc('\\', fp);
+	putc(*p, fp);
+	break;
+      default:
+	if (*p < ' ')
+	  fprintf(fp, "\\u%04x", *p);
+	else
+	  putc(*p, fp);
+	break;
+      }
+  putc('"', fp);
+}
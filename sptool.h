@@ -0,0 +1,170 @@
+/*
+ * Simple Profiler - declarations shared by command line tools.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPTOOL_H
+#define SPTOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <link.h>
+
+#include "elfnote.h"
+#include "gmonmeta.h"
+
+/* symtab.c - function symbols of an ELF file */
+struct sym
+{
+  uint64_t addr;		/* link-time virtual address */
+  uint64_t size;
+  const char *name;
+};
+
+struct symtab
+{
+  struct sym *syms;		/* sorted by address */
+  size_t nsyms;
+  char *strings;
+  _Bool partial;		/* stripped, without a debug file */
+};
+
+extern struct symtab *symtab_load (const char *path);
+extern struct symtab *symtab_load_cached (const char *path);
+extern struct symtab *symtab_load_build_id (const char *hex);
+extern const struct sym *symtab_lookup (const struct symtab *tab, uint64_t addr);
+extern _Bool symtab_unnamed (const struct sym *sym);
+extern void symtab_free (struct symtab *tab);
+extern char *symcache_dir (void);
+
+/* An ELF file of the host's class, mapped for reading its sections. */
+struct elf
+{
+  void *image;
+  size_t size;
+  const ElfW(Shdr) *shdr;
+  unsigned int shnum;
+  const char *shstrtab;
+  size_t shstrsize;
+};
+
+extern _Bool elf_open (const char *path, struct elf *elf);
+extern void elf_close (struct elf *elf);
+extern const ElfW(Shdr) *elf_section (const struct elf *elf, const char *name);
+extern size_t elf_section_build_id (const struct elf *elf, unsigned char *id);
+extern char *debug_file_find (const char *path, const struct elf *elf,
+			      const char *section);
+
+extern size_t elf_build_id (const char *path, unsigned char *id);
+extern char *build_id_hex (const unsigned char *id, size_t len);
+
+/* dwarf.c - source lines and inlined calls */
+#define SRC_NONE	UINT32_MAX
+
+/* Addresses from ADDR up to the next region's belong to FILE:LINE and to
+   the inlined call INLINED (innermost), either of which may be SRC_NONE. */
+struct src_region
+{
+  uint64_t addr;
+  uint32_t file;		/* offset in strings */
+  uint32_t line;
+  uint32_t inlined;		/* index in inlines */
+  uint32_t unused;
+};
+
+struct src_inline
+{
+  uint32_t parent;		/* index of the caller if also inlined */
+  uint32_t name;		/* of the function inlined */
+  uint32_t call_file, call_line;	/* where it was inlined */
+};
+
+struct srcmap
+{
+  struct src_region *regions;	/* sorted by address */
+  size_t nregions;
+  struct src_inline *inlines;
+  size_t ninlines;
+  char *strings;
+  size_t strsize;
+};
+
+extern struct srcmap *srcmap_load_cached (const char *path);
+extern const struct src_region *srcmap_lookup (const struct srcmap *map,
+					       uint64_t addr);
+extern void srcmap_free (struct srcmap *map);
+
+/* gmon.c - gmon.out reader */
+struct gmon_hist
+{
+  uint64_t low_pc, high_pc;
+  uint32_t size;		/* number of bins */
+  uint32_t rate;
+  char dimen[16];
+  char dimen_abbrev;
+  const unsigned char *bins;	/* unsigned short[size], maybe unaligned */
+  size_t offset;		/* of bins in the file */
+};
+
+struct gmon_arc
+{
+  uint64_t from_pc, self_pc;
+  uint32_t count;
+};
+
+struct gmon_data
+{
+  void *image;			/* consistent copy of the file */
+  size_t size;
+  struct sp_gmon_spare spare;	/* spare bytes of struct gmon_hdr */
+  struct gmon_hist *hists;
+  size_t nhists;
+  struct gmon_arc *arcs;		/* without metadata arcs */
+  size_t narcs;
+  char *meta;			/* metadata text, or NULL */
+  size_t metalen;
+  /* Only from containers (see spcontainer.h). */
+  char *container_meta;		/* "key=value" lines */
+  struct symtab *symtab;	/* functions with samples, or NULL */
+  char *maps;			/* load map text, or NULL */
+};
+
+extern int gmon_read (const char *path, struct gmon_data *data);
+extern int gmon_copy_live (const void *live, size_t offset, size_t len, void *buf);
+extern void gmon_free (struct gmon_data *data);
+extern char *gmon_meta (const struct gmon_data *data, const char *key);
+
+static inline unsigned int
+gmon_bin (const struct gmon_hist *h, size_t i)
+{
+  unsigned short v;
+  __builtin_memcpy(&v, h->bins + i * sizeof(v), sizeof(v));
+  return v;
+}
+
+/* Lowest address covered by bin I. */
+static inline uint64_t
+gmon_bin_addr (const struct gmon_hist *h, size_t i)
+{
+  /* Same as gprof, which does not require bins to be of integral size. */
+  return h->low_pc + (uint64_t) ((double) i * (h->high_pc - h->low_pc) / h->size);
+}
+
+/* Writes STR as a JSON string literal. */
+extern void json_string (FILE *fp, const char *str);
+
+#endif /* SPTOOL_H */
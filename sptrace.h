@@ -0,0 +1,85 @@
+/*
+ * Simple Profiler - timeline trace file format.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * A trace file is a header, a load map and a ring of fixed-size sample
+ * records, all in host byte order.  The file is mapped shared by the
+ * profiled process and written without locks:
+ *
+ *   idx = head++ (atomically); rec = ring[idx % capacity];
+ *   rec->seq = 0; fill in rec; rec->seq = idx + 1 (release)
+ *
+ * so a reader must ignore records whose seq does not match the index
+ * it expects, both before and after copying the record.
+ *
+ * The load map is text, one object per line:
+ *   <lowpc> <highpc> <load bias> <path>
+ * with addresses in hexadecimal.  It is rewritten at exit to include
+ * objects loaded with dlopen.
+ */
+
+#ifndef SPTRACE_H
+#define SPTRACE_H
+
+#include <stdint.h>
+
+#define SPTRACE_MAGIC	"SPTRACE1"
+#define SPTRACE_VERSION	2
+
+#define SPTRACE_MAP_SIZE	65536
+
+struct sptrace_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;		/* size of struct sptrace_record + pc[] */
+  uint32_t max_depth;		/* number of slots in pc[] */
+  uint32_t hz;			/* sampling frequency */
+  uint64_t capacity;		/* number of records, power of two */
+  uint64_t head;		/* number of records ever written */
+  uint64_t start_ns;		/* CLOCK_MONOTONIC at start */
+  uint64_t start_realtime_ns;	/* CLOCK_REALTIME at start */
+  uint32_t pid;
+  uint32_t map_offset;		/* load map text */
+  uint32_t map_size;
+  uint32_t records_offset;	/* first record */
+  char progname[64];
+};
+
+struct sptrace_record
+{
+  uint64_t seq;			/* index + 1 when complete */
+  uint64_t time_ns;		/* since start_ns */
+  uint32_t tid;
+  uint32_t depth;		/* valid entries in pc[] */
+  uint64_t fiber;		/* fiber ID (SP_FIBER), or 0 */
+  uint64_t task;		/* task of the fiber, an address, or 0 */
+  uint64_t pc[];		/* interrupted PC, then return addresses */
+};
+
+#endif /* SPTRACE_H */
@@ -0,0 +1,841 @@
+/*
+ * ELF symbol tables for Simple Profiler tools.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <inttypes.h>
+
+#include "sptool.h"
+
+#if __ELF_NATIVE_CLASS == 64
+# define NATIVE_ELFCLASS	ELFCLASS64
+# define ELF_ST_TYPE(i)		ELF64_ST_TYPE(i)
+# define ELF_ST_BIND(i)		ELF64_ST_BIND(i)
+#else
+# define NATIVE_ELFCLASS	ELFCLASS32
+# define ELF_ST_TYPE(i)		ELF32_ST_TYPE(i)
+# define ELF_ST_BIND(i)		ELF32_ST_BIND(i)
+#endif
+
+/* Maps the ELF file PATH.  Returns 0 with errno set on failure. */
+_Bool
+elf_open (const char *path, struct elf *elf)
+{
+  memset(elf, 0, sizeof(*elf));
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  struct stat st;
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) ||
+      (elf->image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+      close(fd);
+      elf->image = NULL;
+      return 0;
+    }
+  close(fd);
+  elf->size = st.st_size;
+
+  const ElfW(Ehdr) *const ehdr = elf->image;
+  if (elf->size < sizeof(*ehdr) ||
+      memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ehdr->e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+      ehdr->e_shentsize != sizeof(ElfW(Shdr)) ||
+      ehdr->e_shoff == 0 || ehdr->e_shoff > elf->size ||
+      (elf->size - ehdr->e_shoff) / sizeof(ElfW(Shdr)) < ehdr->e_shnum ||
+      ehdr->e_shstrndx >= ehdr->e_shnum)
+    {
+      munmap(elf->image, elf->size);
+      elf->image = NULL;
+      errno = ENOEXEC;
+      return 0;
+    }
+  elf->shdr = (const ElfW(Shdr) *) ((const char *) elf->image + ehdr->e_shoff);
+  elf->shnum = ehdr->e_shnum;
+
+  const ElfW(Shdr) *const strsec = &elf->shdr[ehdr->e_shstrndx];
+  if (strsec->sh_offset <= elf->size && strsec->sh_size <= elf->size - strsec->sh_offset)
+    {
+      elf->shstrtab = (const char *) elf->image + strsec->sh_offset;
+      elf->shstrsize = strsec->sh_size;
+    }
+  return 1;
+}
+
+void
+elf_close (struct elf *elf)
+{
+  if (elf->image)
+    munmap(elf->image, elf->size);
+}
+
+/* Section NAME with contents in the file, or NULL. */
+const ElfW(Shdr) *
+elf_section (const struct elf *elf, const char *name)
+{
+  for (unsigned int i = 0; i < elf->shnum; i++)
+    {
+      const ElfW(Shdr) *const s = &elf->shdr[i];
+      if (s->sh_type != SHT_NOBITS &&
+	  s->sh_name < elf->shstrsize &&
+	  !strncmp(elf->shstrtab + s->sh_name, name, elf->shstrsize - s->sh_name) &&
+	  s->sh_offset <= elf->size && s->sh_size <= elf->size - s->sh_offset)
+	return s;
+    }
+  return NULL;
+}
+
+size_t
+elf_section_build_id (const struct elf *elf, unsigned char *id)
+{
+  const ElfW(Shdr) *const s = elf_section(elf, ".note.gnu.build-id");
+  return s ? note_build_id((const char *) elf->image + s->sh_offset, s->sh_size, id) : 0;
+}
+
+/* Whether PATH has SECTION and is of build ID (if known). */
+static _Bool
+has_section (const char *path, const char *section,
+	     const unsigned char *id, size_t idlen)
+{
+  struct elf elf;
+  if (!elf_open(path, &elf))
+    return 0;
+
+  unsigned char own[BUILD_ID_MAX];
+  const size_t ownlen = elf_section_build_id(&elf, own);
+  const _Bool ok = (elf_section(&elf, section) &&
+		    (!idlen || !ownlen ||
+		     (ownlen == idlen && !memcmp(own, id, idlen))));
+  elf_close(&elf);
+  return ok;
+}
+
+/*
+ * Path (malloc'ed) of PATH itself if it has SECTION, or else of its
+ * separate debug file which has, or NULL.  Debug files are looked for
+ * as gdb does: by build ID as DIR/.build-id/xx/yyyy.debug, and then by
+ * the .gnu_debuglink name next to PATH, in its .debug subdirectory and
+ * as DIR/<directory of PATH>/NAME, for each DIR of $SP_DEBUGDIR
+ * (colon-separated, default /usr/lib/debug).  The build ID of a debug
+ * file found by name is checked instead of the CRC in .gnu_debuglink.
+ */
+char *
+debug_file_find (const char *path, const struct elf *elf, const char *section)
+{
+  if (elf_section(elf, section))
+    return strdup(path);
+
+  unsigned char id[BUILD_ID_MAX];
+  const size_t idlen = elf_section_build_id(elf, id);
+
+  const char *env = getenv("SP_DEBUGDIR");
+  char *const dirs = strdup(env && *env ? env : "/usr/lib/debug");
+  char *const real = realpath(path, NULL);
+  const char *const slash = real ? strrchr(real, '/') : NULL;
+  const int dirlen = slash ? slash - real : 0;
+  char *found = NULL, *candidate = NULL;
+
+  char *hex = build_id_hex(id, idlen);
+  for (char *dir = strtok(dirs, ":"); dir && !found && idlen > 1; dir = strtok(NULL, ":"))
+    {
+      if (asprintf(&candidate, "%s/.build-id/%.2s/%s.debug", dir, hex, hex + 2) < 0)
+	error(EXIT_FAILURE, errno, "malloc");
+      if (has_section(candidate, section, id, idlen))
+	found = candidate;
+      else
+	free(candidate);
+    }
+  free(hex);
+
+  const ElfW(Shdr) *const link = elf_section(elf, ".gnu_debuglink");
+  const char *const name = link ? (const char *) elf->image + link->sh_offset : NULL;
+  if (!found && name && real && memchr(name, '\0', link->sh_size))
+    {
+      strcpy(dirs, env && *env ? env : "/usr/lib/debug");
+      for (int i = 0; i < 2 && !found; i++)
+	{
+	  if (asprintf(&candidate, i ? "%.*s/.debug/%s" : "%.*s/%s",
+		       dirlen, real, name) < 0)
+	    error(EXIT_FAILURE, errno, "malloc");
+	  if (strcmp(candidate, real) && has_section(candidate, section, id, idlen))
+	    found = candidate;
+	  else
+	    free(candidate);
+	}
+      for (char *dir = strtok(dirs, ":"); dir && !found; dir = strtok(NULL, ":"))
+	{
+	  if (asprintf(&candidate, "%s%.*s/%s", dir, dirlen, real, name) < 0)
+	    error(EXIT_FAILURE, errno, "malloc");
+	  if (has_section(candidate, section, id, idlen))
+	    found = candidate;
+	  else
+	    free(candidate);
+	}
+    }
+  free(real);
+  free(dirs);
+  return found;
+}
+
+
+static int
+compare_syms (const void *a, const void *b)
+{
+  const struct sym *const x = a;
+  const struct sym *const y = b;
+
+  if (x->addr != y->addr)
+    return x->addr < y->addr ? -1 : 1;
+  /* Sized symbols first, so that they survive deduplication. */
+  return (x->size == 0) - (y->size == 0);
+}
+
+/* Reads function symbols from .symtab, or from .dynsym if stripped. */
+static void
+read_symbols (struct symtab *tab, const struct elf *elf)
+{
+  const ElfW(Shdr) *const shdr = elf->shdr;
+  const unsigned char *const image = elf->image;
+  const size_t size = elf->size;
+  const ElfW(Shdr) *symsec = NULL;
+
+  for (unsigned int i = 0; i < elf->shnum; i++)
+    if (shdr[i].sh_type == SHT_SYMTAB ||
+	(shdr[i].sh_type == SHT_DYNSYM && !symsec))
+      symsec = &shdr[i];
+  if (!symsec ||
+      symsec->sh_link >= elf->shnum ||
+      symsec->sh_offset > size || symsec->sh_size > size - symsec->sh_offset ||
+      shdr[symsec->sh_link].sh_offset > size ||
+      shdr[symsec->sh_link].sh_size > size - shdr[symsec->sh_link].sh_offset)
+    return;
+
+  const ElfW(Sym) *const syms = (const ElfW(Sym) *) (image + symsec->sh_offset);
+  const size_t nsyms = symsec->sh_size / sizeof(ElfW(Sym));
+  const char *const strtab = (const char *) image + shdr[symsec->sh_link].sh_offset;
+  const size_t strsize = shdr[symsec->sh_link].sh_size;
+
+  tab->strings = malloc(strsize);
+  tab->syms = malloc(nsyms * sizeof(*tab->syms));
+  if (!tab->strings || !tab->syms)
+    error(EXIT_FAILURE, errno, "malloc");
+  memcpy(tab->strings, strtab, strsize);
+
+  size_t n = 0;
+  for (size_t i = 0; i < nsyms; i++)
+    {
+      const unsigned int type = ELF_ST_TYPE(syms[i].st_info);
+
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+	  syms[i].st_shndx == SHN_UNDEF ||
+	  syms[i].st_value == 0 ||
+	  syms[i].st_name >= strsize)
+	continue;
+      tab->syms[n].addr = syms[i].st_value;
+      tab->syms[n].size = syms[i].st_size;
+      tab->syms[n].name = tab->strings + syms[i].st_name;
+      n++;
+    }
+  tab->nsyms = n;
+}
+
+/* Sorts symbols of TAB and removes aliases. */
+static void
+sort_symbols (struct symtab *tab)
+{
+  qsort(tab->syms, tab->nsyms, sizeof(*tab->syms), compare_syms);
+
+  size_t m = 0;
+  for (size_t i = 0; i < tab->nsyms; i++)
+    if (m == 0 || tab->syms[m - 1].addr != tab->syms[i].addr)
+      tab->syms[m++] = tab->syms[i];
+  tab->nsyms = m;
+}
+
+/* Reads a pointer of the DW_EH_PE_* ENCODING at *P, which is at ADDR in
+   memory.  Returns 0 (after setting *P to END) if it cannot. */
+static uint64_t
+read_encoded (const unsigned char **p, const unsigned char *end,
+	      unsigned int encoding, uint64_t addr)
+{
+  const unsigned char *q = *p;
+  uint64_t v = 0;
+  size_t n = 0;
+
+  switch (encoding & 0x0f)
+    {
+    case 0x00: n = sizeof(void *); break;	/* absptr */
+    case 0x01: case 0x09:			/* uleb128, sleb128 */
+      {
+	unsigned int shift = 0;
+	unsigned char b = 0x80;
+	while (q < end && (b & 0x80))
+	  {
+	    b = *q++;
+	    if (shift < 64)
+	      v |= (uint64_t) (b & 0x7f) << shift;
+	    shift += 7;
+	  }
+	if ((encoding & 0x0f) == 0x09 && shift < 64 && (b & 0x40))
+	  v |= ~(uint64_t) 0 << shift;
+	break;
+      }
+    case 0x02: case 0x0a: n = 2; break;
+    case 0x03: case 0x0b: n = 4; break;
+    case 0x04: case 0x0c: n = 8; break;
+    default:
+      *p = end;
+      return 0;
+    }
+  if (n)
+    {
+      if ((size_t) (end - q) < n)
+	{
+	  *p = end;
+	  return 0;
+	}
+      if (n == 2)
+	{
+	  uint16_t x;
+	  memcpy(&x, q, n);
+	  v = encoding & 0x08 ? (uint64_t) (int64_t) (int16_t) x : x;
+	}
+      else if (n == 4)
+	{
+	  uint32_t x;
+	  memcpy(&x, q, n);
+	  v = encoding & 0x08 ? (uint64_t) (int64_t) (int32_t) x : x;
+	}
+      else
+	memcpy(&v, q, n);
+      q += n;
+    }
+  if ((encoding & 0x70) == 0x10)	/* pcrel */
+    v += addr;
+  *p = q;
+  return v;
+}
+
+/* Encoding of pointers in FDEs of the CIE at P. */
+static unsigned int
+cie_fde_encoding (const unsigned char *p, const unsigned char *end)
+{
+  uint32_t len, id;
+  if ((size_t) (end - p) < 9)
+    return 0;
+  memcpy(&len, p, 4);
+  memcpy(&id, p + 4, 4);
+  if (id != 0 || len < 5 || len > (size_t) (end - p) - 4)
+    return 0;
+  end = p + 4 + len;
+  p += 8;
+
+  const unsigned int version = *p++;
+  const char *const aug = (const char *) p;
+  const unsigned char *const nul = memchr(p, '\0', end - p);
+  if (!nul || aug[0] != 'z')
+    return 0;
+  p = nul + 1;
+  if (strstr(aug, "eh"))
+    p += sizeof(void *);
+  read_encoded(&p, end, 0x01, 0);	/* code alignment factor */
+  read_encoded(&p, end, 0x09, 0);	/* data alignment factor */
+  if (version == 1)
+    p++;
+  else
+    read_encoded(&p, end, 0x01, 0);	/* return address register */
+  read_encoded(&p, end, 0x01, 0);	/* augmentation data length */
+  for (const char *a = aug + 1; *a && p < end; a++)
+    if (*a == 'R')
+      return *p;
+    else if (*a == 'P')
+      {
+	const unsigned int personality = *p++;
+	read_encoded(&p, end, personality & 0x0f, 0);
+      }
+    else if (*a == 'L')
+      p++;
+  return 0;
+}
+
+/*
+ * Adds functions which have an FDE in .eh_frame but no symbol, as in
+ * stripped binaries, named after their address.  Their sizes are those
+ * of the FDEs.  TAB must be sorted.
+ */
+static void
+add_unnamed (struct symtab *tab, const struct elf *elf)
+{
+  const ElfW(Shdr) *const sec = elf_section(elf, ".eh_frame");
+  if (!sec)
+    return;
+  const unsigned char *const start = (const unsigned char *) elf->image + sec->sh_offset;
+  const unsigned char *const end = start + sec->sh_size;
+
+  struct sym *funcs = NULL;
+  size_t nfuncs = 0, alloc = 0;
+  const unsigned char *cie = NULL;
+  unsigned int encoding = 0;
+  for (const unsigned char *p = start; (size_t) (end - p) >= 8; )
+    {
+      uint32_t len, id;
+      memcpy(&len, p, 4);
+      if (len == 0 || len == 0xffffffff || len > (size_t) (end - p) - 4)
+	break;			/* terminator, or 64-bit (not used for .eh_frame) */
+      const unsigned char *const entry = p, *const next = p + 4 + len;
+      memcpy(&id, p + 4, 4);
+      p += 8;
+
+      /* FDEs refer to their CIE by distance from the pointer. */
+      if (id != 0 && id <= (size_t) (entry + 4 - start))
+	{
+	  if (entry + 4 - id != cie)
+	    {
+	      cie = entry + 4 - id;
+	      encoding = cie_fde_encoding(cie, end);
+	    }
+	  const uint64_t addr = sec->sh_addr + (p - start);
+	  const uint64_t pc = read_encoded(&p, next, encoding, addr);
+	  const uint64_t range = read_encoded(&p, next, encoding & 0x0f, 0);
+	  if (pc && range)
+	    {
+	      if (nfuncs == alloc &&
+		  !(funcs = realloc(funcs, (alloc = alloc ? 2 * alloc : 256) * sizeof(*funcs))))
+		error(EXIT_FAILURE, errno, "malloc");
+	      funcs[nfuncs++] = (struct sym) { pc, range, NULL };
+	    }
+	}
+      p = next;
+    }
+
+  /* Keep those not covered by symbols, and name them. */
+  size_t n = 0;
+  for (size_t i = 0; i < nfuncs; i++)
+    {
+      const struct sym *const sym = symtab_lookup(tab, funcs[i].addr);
+      if (!sym || (sym->addr != funcs[i].addr && sym->size == 0))
+	funcs[n++] = funcs[i];
+    }
+  if (n == 0)
+    {
+      free(funcs);
+      return;
+    }
+
+  /* Names go after the string table, which is copied to make room. */
+  size_t strsize = 0;
+  for (size_t i = 0; i < tab->nsyms; i++)
+    {
+      const size_t end_of_name = (tab->syms[i].name - tab->strings
+				  + strlen(tab->syms[i].name) + 1);
+      if (end_of_name > strsize)
+	strsize = end_of_name;
+    }
+  char *const strings = malloc(strsize + n * 24);
+  struct sym *const syms = realloc(tab->syms, (tab->nsyms + n) * sizeof(*syms));
+  if (!strings || !syms)
+    error(EXIT_FAILURE, errno, "malloc");
+  if (strsize)
+    memcpy(strings, tab->strings, strsize);
+  for (size_t i = 0; i < tab->nsyms; i++)
+    syms[i].name = strings + (syms[i].name - tab->strings);
+  free(tab->strings);
+  char *s = strings + strsize;
+  for (size_t i = 0; i < n; i++)
+    {
+      syms[tab->nsyms + i] = funcs[i];
+      syms[tab->nsyms + i].name = s;
+      s += sprintf(s, "sub_%" PRIx64, funcs[i].addr) + 1;
+    }
+  tab->strings = strings;
+  tab->syms = syms;
+  tab->nsyms += n;
+  free(funcs);
+  sort_symbols(tab);
+}
+
+/*
+ * Function symbols of the ELF file PATH: those in .symtab, or in the
+ * separate debug file (see debug_file_find) if PATH is stripped, or in
+ * .dynsym if there is no debug file, plus unnamed functions found in
+ * .eh_frame.
+ */
+struct symtab *
+symtab_load (const char *path)
+{
+  struct elf elf;
+  if (!elf_open(path, &elf))
+    {
+      error(0, errno, "%s", path);
+      return NULL;
+    }
+
+  struct symtab *tab = calloc(1, sizeof(*tab));
+  if (!tab)
+    error(EXIT_FAILURE, errno, "malloc");
+
+  struct elf debug_elf;
+  char *const debug = debug_file_find(path, &elf, ".symtab");
+  if (debug && strcmp(debug, path) && elf_open(debug, &debug_elf))
+    {
+      read_symbols(tab, &debug_elf);
+      elf_close(&debug_elf);
+    }
+  else
+    read_symbols(tab, &elf);
+  tab->partial = !debug;
+  free(debug);
+
+  sort_symbols(tab);
+  add_unnamed(tab, &elf);
+  elf_close(&elf);
+  return tab;
+}
+
+/* Whether SYM is one of the functions named by add_unnamed. */
+_Bool
+symtab_unnamed (const struct sym *sym)
+{
+  char name[sizeof("sub_") + 16];
+
+  snprintf(name, sizeof(name), "sub_%" PRIx64, sym->addr);
+  return !strcmp(sym->name, name);
+}
+
+const struct sym *
+symtab_lookup (const struct symtab *tab, uint64_t addr)
+{
+  size_t lo = 0, hi = tab->nsyms;
+
+  /* Find the last symbol which starts at or before ADDR. */
+  while (lo < hi)
+    {
+      const size_t mid = lo + (hi - lo) / 2;
+
+      if (tab->syms[mid].addr <= addr)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+  if (lo == 0)
+    return NULL;
+
+  const struct sym *const sym = &tab->syms[lo - 1];
+  if (sym->size != 0 && addr - sym->addr >= sym->size)
+    return NULL;
+  return sym;
+}
+
+void
+symtab_free (struct symtab *tab)
+{
+  if (!tab)
+    return;
+  free(tab->syms);
+  free(tab->strings);
+  free(tab);
+}
+
+/*
+ * Returns length of NT_GNU_BUILD_ID of the ELF file, or 0 if it has none.
+ * Only headers and notes are read.
+ */
+size_t
+elf_build_id (const char *path, unsigned char *id)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+
+  size_t len = 0;
+  ElfW(Ehdr) ehdr;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+      ehdr.e_ident[EI_CLASS] != NATIVE_ELFCLASS ||
+      ehdr.e_phentsize != sizeof(ElfW(Phdr)) ||
+      ehdr.e_phnum == 0 || ehdr.e_phnum > 256)
+    goto out;
+
+  ElfW(Phdr) phdr[256];
+  const size_t phsize = ehdr.e_phnum * sizeof(phdr[0]);
+  if (pread(fd, phdr, phsize, ehdr.e_phoff) != (ssize_t) phsize)
+    goto out;
+
+  for (unsigned int i = 0; i < ehdr.e_phnum && !len; i++)
+    {
+      if (phdr[i].p_type != PT_NOTE || phdr[i].p_filesz > 65536)
+	continue;
+
+      unsigned char notes[phdr[i].p_filesz];
+      if (pread(fd, notes, sizeof(notes), phdr[i].p_offset) != (ssize_t) sizeof(notes))
+	continue;
+      len = note_build_id(notes, sizeof(notes), id);
+    }
+
+ out:
+  close(fd);
+  return len;
+}
+
+char *
+build_id_hex (const unsigned char *id, size_t len)
+{
+  char *const hex = malloc(2 * len + 1);
+  if (!hex)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (size_t i = 0; i < len; i++)
+    sprintf(hex + 2 * i, "%02x", id[i]);
+  hex[2 * len] = '\0';
+  return hex;
+}
+
+/*
+ * On-disk symbol cache.
+ *
+ * $SP_SYMCACHE (or $XDG_CACHE_HOME/simpleprof, or ~/.cache/simpleprof)
+ * holds <build-id>.sym for every ELF file whose symbols were loaded
+ * through symtab_load_cached.  Such a file is
+ *	struct symcache_header
+ *	struct symcache_entry[nsyms]
+ *	char strings[strsize]
+ * in host byte order, written atomically by rename(2).
+ */
+
+#define SYMCACHE_MAGIC	"SPSYMC01"
+
+struct symcache_header
+{
+  char magic[8];
+  uint64_t nsyms;
+  uint64_t strsize;
+};
+
+struct symcache_entry
+{
+  uint64_t addr, size, name;	/* name is offset in strings */
+};
+
+/* Directory of the symbol cache (malloc'ed), or NULL. */
+char *
+symcache_dir (void)
+{
+  const char *env;
+  char *dir = NULL;
+
+  if ((env = getenv("SP_SYMCACHE")) != NULL && *env)
+    dir = strdup(env);
+  else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env)
+    asprintf(&dir, "%s/simpleprof", env);
+  else if ((env = getenv("HOME")) != NULL && *env)
+    asprintf(&dir, "%s/.cache/simpleprof", env);
+  return dir;
+}
+
+static struct symtab *
+symcache_read (const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  struct symtab *tab = NULL;
+  struct symcache_header hdr;
+  struct stat st;
+  if (fstat(fd, &st) ||
+      pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(hdr.magic, SYMCACHE_MAGIC, sizeof(hdr.magic)) ||
+      hdr.nsyms > (uint64_t) st.st_size / sizeof(struct symcache_entry) ||
+      (uint64_t) st.st_size != sizeof(hdr) + hdr.nsyms * sizeof(struct symcache_entry) + hdr.strsize)
+    goto out;
+
+  struct symcache_entry *const ent = malloc(hdr.nsyms * sizeof(*ent) + 1);
+  tab = calloc(1, sizeof(*tab));
+  if (!tab || !ent ||
+      !(tab->syms = malloc(hdr.nsyms * sizeof(*tab->syms) + 1)) ||
+      !(tab->strings = malloc(hdr.strsize + 1)))
+    error(EXIT_FAILURE, errno, "malloc");
+  if (pread(fd, ent, hdr.nsyms * sizeof(*ent), sizeof(hdr)) != (ssize_t) (hdr.nsyms * sizeof(*ent)) ||
+      pread(fd, tab->strings, hdr.strsize, sizeof(hdr) + hdr.nsyms * sizeof(*ent)) != (ssize_t) hdr.strsize)
+    {
+      free(ent);
+      symtab_free(tab);
+      tab = NULL;
+      goto out;
+    }
+  tab->strings[hdr.strsize] = '\0';
+  for (size_t i = 0; i < hdr.nsyms; i++)
+    {
+      tab->syms[i].addr = ent[i].addr;
+      tab->syms[i].size = ent[i].size;
+      tab->syms[i].name = tab->strings + (ent[i].name < hdr.strsize ? ent[i].name : hdr.strsize);
+    }
+  tab->nsyms = hdr.nsyms;
+  free(ent);
+
+ out:
+  close(fd);
+  return tab;
+}
+
+static void
+symcache_write (const char *dir, const char *path, const struct symtab *tab)
+{
+  /* Only names actually used are written, so we rebuild the string table. */
+  struct symcache_header hdr;
+  memcpy(hdr.magic, SYMCACHE_MAGIC, sizeof(hdr.magic));
+  hdr.nsyms = tab->nsyms;
+  hdr.strsize = 0;
+  for (size_t i = 0; i < tab->nsyms; i++)
+    hdr.strsize += strlen(tab->syms[i].name) + 1;
+
+  struct symcache_entry *const ent = malloc(tab->nsyms * sizeof(*ent) + 1);
+  char *const strings = malloc(hdr.strsize + 1);
+  if (!ent || !strings)
+    error(EXIT_FAILURE, errno, "malloc");
+  char *s = strings;
+  for (size_t i = 0; i < tab->nsyms; i++)
+    {
+      ent[i].addr = tab->syms[i].addr;
+      ent[i].size = tab->syms[i].size;
+      ent[i].name = s - strings;
+      s = stpcpy(s, tab->syms[i].name) + 1;
+    }
+
+  char *tmp;
+  if (asprintf(&tmp, "%s.%ld.tmp", path, (long) getpid()) < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  mkdir(dir, 0777);
+  FILE *fp = fopen(tmp, "w");
+  if (fp)
+    {
+      fwrite(&hdr, sizeof(hdr), 1, fp);
+      fwrite(ent, sizeof(*ent), tab->nsyms, fp);
+      fwrite(strings, 1, hdr.strsize, fp);
+      if (fclose(fp) || rename(tmp, path))
+	unlink(tmp);
+    }
+  free(tmp);
+  free(ent);
+  free(strings);
+}
+
+/*
+ * Same as symtab_load, but looks up the build ID of PATH in memory
+ * and in the on-disk cache first, so that the ELF file is read only
+ * once however many profiles are processed.
+ */
+struct symtab *
+symtab_load_cached (const char *path)
+{
+  static struct loaded
+  {
+    struct loaded *next;
+    char *key;			/* build ID in hex, or path if none */
+    struct symtab *tab;
+  } *loaded;
+
+  unsigned char id[BUILD_ID_MAX];
+  const size_t idlen = elf_build_id(path, id);
+  char *const key = idlen ? build_id_hex(id, idlen) : strdup(path);
+  if (!key)
+    error(EXIT_FAILURE, errno, "malloc");
+
+  for (struct loaded *l = loaded; l; l = l->next)
+    if (!strcmp(l->key, key))
+      {
+	free(key);
+	return l->tab;
+      }
+
+  struct symtab *tab = NULL;
+  char *const dir = idlen ? symcache_dir() : NULL;
+  char *cache = NULL;
+  if (dir && asprintf(&cache, "%s/%s.sym", dir, key) < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  if (cache)
+    tab = symcache_read(cache);
+  /* Symbols of a stripped file are not cached, so that those of the
+     same build unstripped or with a debug file found later are. */
+  if (!tab && (tab = symtab_load(path)) != NULL && cache && !tab->partial)
+    symcache_write(dir, cache, tab);
+  free(cache);
+  free(dir);
+
+  struct loaded *const l = malloc(sizeof(*l));
+  if (!l)
+    error(EXIT_FAILURE, errno, "malloc");
+  l->key = key;
+  l->tab = tab;
+  l->next = loaded;
+  loaded = l;
+  return tab;
+}
+
+/*
+ * Symbols of the build whose ID is HEX, for profiles of programs not
+ * at hand: from the on-disk cache, or from the debug file
+ * DIR/.build-id/xx/yyyy.debug for each DIR of $SP_DEBUGDIR.  Returns
+ * NULL if neither is found.
+ */
+struct symtab *
+symtab_load_build_id (const char *hex)
+{
+  if (strlen(hex) < 4)
+    return NULL;
+
+  struct symtab *tab = NULL;
+  char *const dir = symcache_dir();
+  char *cache = NULL;
+  if (dir && asprintf(&cache, "%s/%s.sym", dir, hex) < 0)
+    error(EXIT_FAILURE, errno, "malloc");
+  if (cache)
+    tab = symcache_read(cache);
+  free(cache);
+  free(dir);
+
+  const char *env = getenv("SP_DEBUGDIR");
+  char *const dirs = strdup(env && *env ? env : "/usr/lib/debug");
+  if (!dirs)
+    error(EXIT_FAILURE, errno, "malloc");
+  for (char *d = strtok(dirs, ":"); d && !tab; d = strtok(NULL, ":"))
+    {
+      char *candidate;
+      if (asprintf(&candidate, "%s/.build-id/%.2s/%s.debug", d, hex, hex + 2) < 0)
+	error(EXIT_FAILURE, errno, "malloc");
+
+      unsigned char id[BUILD_ID_MAX];
+      char *const own = build_id_hex(id, elf_build_id(candidate, id));
+      if (!strcmp(own, hex))
+	tab = symtab_load_cached(candidate);
+      free(own);
+      free(candidate);
+    }
+  free(dirs);
+  return tab;
+}
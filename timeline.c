@@ -0,0 +1,235 @@
+/*
+ * Timeline recorder for Simple Profiler.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * When SP_TIMELINE is set, every sample is also logged with its time
+ * and thread ID (and optionally a frame pointer backtrace) into a ring
+ * in <progname>.<pid>.trace.  See sptrace.h for the format, and
+ * sp-trace(1) for conversion to Chrome trace event format.
+ *
+ * Traces are left behind at exit, and count against SP_PROFILE_BUDGET
+ * like snapshots; the trace of a running process is held as a profile
+ * is, so that it is not deleted.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "simpleprof.h"
+#include "sptrace.h"
+
+#define DEFAULT_RECORDS	65536
+#define MAX_DEPTH	64
+
+static struct sptrace_header *trace;
+static size_t trace_size;
+static unsigned char *records;
+
+static inline uint64_t
+now_ns (clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+write_load_map (void)
+{
+  char *const map = (char *) trace + trace->map_offset;
+  size_t len = 0;
+  const struct sp_object *obj;
+
+  for (unsigned int i = 0; (obj = objmap_get(i)) != NULL; i++)
+    {
+      if (!obj->highpc)
+	continue;
+      int n = snprintf(map + len, SPTRACE_MAP_SIZE - len,
+		       "%" PRIxPTR " %" PRIxPTR " %" PRIxPTR " %s\n",
+		       obj->lowpc, obj->highpc, obj->base, obj->name);
+      if (n < 0 || (size_t) n >= SPTRACE_MAP_SIZE - len)
+	break;
+      len += n;
+    }
+  memset(map + len, '\0', SPTRACE_MAP_SIZE - len);
+  trace->map_size = len;
+}
+
+_Bool
+timeline_init (void)
+{
+  if (!sp_env_flag(ENV_PREFIX "TIMELINE"))
+    return 0;
+  if (!sampler_has_context())
+    {
+      EPRINTF("%s is not supported on this architecture",
+	      ENV_PREFIX "TIMELINE");
+      return 0;
+    }
+
+  unsigned long nrecords = DEFAULT_RECORDS;
+  unsigned int depth = 1;
+  const char *env;
+  char dummy[1];
+
+  if ((env = getenv(ENV_PREFIX "TIMELINE_SIZE")) != NULL &&
+      (sscanf(env, "%lu %c", &nrecords, dummy) != 1 ||
+       nrecords == 0 || nrecords > (1UL << 30)))
+    {
+      EPRINTF("invalid %s %#s", ENV_PREFIX "TIMELINE_SIZE", env);
+      return 0;
+    }
+  while (nrecords & (nrecords - 1))
+    nrecords = (nrecords | (nrecords - 1)) + 1;
+
+  if ((env = getenv(ENV_PREFIX "TIMELINE_DEPTH")) != NULL &&
+      (sscanf(env, "%u %c", &depth, dummy) != 1 ||
+       depth == 0 || depth > MAX_DEPTH))
+    {
+      EPRINTF("invalid %s %#s", ENV_PREFIX "TIMELINE_DEPTH", env);
+      return 0;
+    }
+
+  const size_t record_size = sizeof(struct sptrace_record) + depth * sizeof(uint64_t);
+  const size_t records_offset = sizeof(struct sptrace_header) + SPTRACE_MAP_SIZE;
+  trace_size = records_offset + nrecords * record_size;
+
+  char suffix[sizeof(".trace") + 3 * sizeof(pid_t) + 1];
+  snprintf(suffix, sizeof(suffix), ".%ld.trace", (long) getpid());
+  char *const fn = sp_output_path(sp_progname(), suffix);
+  if (!fn)
+    return 0;
+
+  int fd = open(fn, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, DEFFILEMODE);
+  if (fd < 0)
+    {
+      EPRINTF("cannot open %#s: %s", fn, strerror(errno));
+      free(fn);
+      return 0;
+    }
+  int e = posix_fallocate(fd, 0, trace_size);
+  if (e)
+    {
+      EPRINTF("cannot allocate %zu bytes for %#s: %s",
+	      trace_size, fn, strerror(e));
+      close(fd);
+      unlink(fn);
+      free(fn);
+      return 0;
+    }
+  void *const p = mmap(NULL, trace_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_FILE, fd, 0);
+  if (p == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      close(fd);
+      unlink(fn);
+      free(fn);
+      return 0;
+    }
+
+  struct sptrace_header *const hdr = p;
+  hdr->version = SPTRACE_VERSION;
+  hdr->record_size = record_size;
+  hdr->max_depth = depth;
+  hdr->hz = sampler_frequency();
+  hdr->capacity = nrecords;
+  hdr->head = 0;
+  hdr->start_ns = now_ns(CLOCK_MONOTONIC);
+  hdr->start_realtime_ns = now_ns(CLOCK_REALTIME);
+  hdr->pid = getpid();
+  hdr->map_offset = sizeof(struct sptrace_header);
+  hdr->records_offset = records_offset;
+  strncpy(hdr->progname, sp_progname(), sizeof(hdr->progname) - 1);
+
+  trace = hdr;
+  records = (unsigned char *) p + records_offset;
+  write_load_map();
+  /* Magic last, so that a reader never sees half-initialized header. */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(hdr->magic, SPTRACE_MAGIC, sizeof(hdr->magic));
+
+  rotate_hold(fd);
+  const int lockfd = rotate_lock(fn);
+  rotate_enforce_budget(lockfd);
+  rotate_unlock(lockfd);
+
+  if (sp_debug)
+    DPRINTF("timeline: %#s, %lu records of depth %u", fn, nrecords, depth);
+  free(fn);
+  return 1;
+}
+
+/* Called from SIGPROF handler. */
+void
+timeline_sample (const struct sp_sample *sample)
+{
+  struct sptrace_header *const hdr = trace;
+  if (!hdr)
+    return;
+
+  const uint64_t idx = __atomic_fetch_add(&hdr->head, 1, __ATOMIC_RELAXED);
+  struct sptrace_record *const rec
+    = (struct sptrace_record *) (records + (idx & (hdr->capacity - 1)) * hdr->record_size);
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  uintptr_t pcs[MAX_DEPTH];
+  const unsigned int depth = sampler_backtrace(sample, pcs, hdr->max_depth);
+
+  rec->time_ns = now_ns(CLOCK_MONOTONIC) - hdr->start_ns;
+  rec->tid = syscall(SYS_gettid);
+  rec->depth = depth;
+  rec->fiber = sample->fiber ? sample->fiber->id : 0;
+  rec->task = sample->fiber ? sample->fiber->task : 0;
+  for (unsigned int i = 0; i < depth; i++)
+    rec->pc[i] = pcs[i];
+  __atomic_store_n(&rec->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void __attribute__((destructor))
+timeline_fini (void)
+{
+  if (!trace || trace->pid != (uint32_t) getpid())
+    return;
+
+  /* Objects may have been loaded with dlopen since we started. */
+  write_load_map();
+}
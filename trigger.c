@@ -0,0 +1,214 @@
+/*
+ * Simple Profiler - sampling triggered by CPU usage.
+ * Copyright (C) 2020  TAKAI Kousuke
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As additional permission under GNU GPL version 3 section 7,
+ * you may dynamically link this program into independent programs,
+ * regardless of the license terms of these independent programs,
+ * provided that you also meet the terms and conditions of the license
+ * of those programs.  An independent program is a program which is not
+ * derived from or based on this program.  If you modify this program,
+ * you may extend this exception to your version of the program, but
+ * you are not obligated to do so.  If you do not wish to do so,
+ * delete this exception statement from your version.
+ */
+
+/*
+ * With SP_CPU_THRESHOLD=<percent>, the sampler starts stopped, and a
+ * watchdog thread measures CPU time of the process every second.  While
+ * it used at least that percentage of one CPU over the last second, the
+ * sampler runs; no timer runs nor any signal is taken otherwise.
+ *
+ * Samples still go to the profile, but are also counted into a buffer of
+ * the current window, which is written to a profile of its own,
+ * <progname>.<pid>.<UTC start time>.cpu.profile, when usage drops below
+ * the threshold or the process exits.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "simpleprof.h"
+
+#define INTERVAL	1	/* second */
+
+static unsigned int threshold;	/* percent of one CPU */
+static unsigned short *window;
+static size_t nbins;
+static _Bool active;
+static struct timespec window_start;	/* CLOCK_REALTIME */
+static pthread_mutex_t window_lock = PTHREAD_MUTEX_INITIALIZER;
+static pid_t owner;
+
+static inline uint64_t
+clock_ns (clockid_t clk)
+{
+  struct timespec ts;
+
+  clock_gettime(clk, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Sets up the sampler, which is to count into NBINS bins, to start
+ * stopped if SP_CPU_THRESHOLD is set.  Call before sampler_start.
+ */
+_Bool
+trigger_init (size_t n)
+{
+  const char *const env = getenv(ENV_PREFIX "CPU_THRESHOLD");
+  if (!env || !*env)
+    return 0;
+
+  char dummy[1];
+  if (sscanf(env, "%u %c", &threshold, dummy) != 1 || threshold == 0)
+    {
+      EPRINTF("invalid %s %#s", ENV_PREFIX "CPU_THRESHOLD", env);
+      return 0;
+    }
+  if (!sampler_has_context())
+    {
+      EPRINTF("%s is not supported on this architecture",
+	      ENV_PREFIX "CPU_THRESHOLD");
+      return 0;
+    }
+
+  void *const buf = mmap(NULL, n * sizeof(*window), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED)
+    {
+      EPRINTF("mmap: %s", strerror(errno));
+      return 0;
+    }
+  window = buf;
+  nbins = n;
+  owner = getpid();
+  sampler_enable(0);
+  return 1;
+}
+
+static void
+open_window (unsigned int usage)
+{
+  memset(window, 0, nbins * sizeof(*window));
+  clock_gettime(CLOCK_REALTIME, &window_start);
+  active = 1;
+  sampler_window(window);
+  sampler_enable(1);
+  if (sp_debug)
+    DPRINTF("CPU usage %u%%, sampling", usage);
+}
+
+/* Stops sampling and writes out the window.  Call with window_lock. */
+static void
+close_window (void)
+{
+  sampler_enable(0);
+  sampler_window(NULL);
+  active = 0;
+
+  char *const fn = sp_snapshot_path("cpu", &window_start);
+  if (fn && sp_write_profile(fn, "cpu", window, NULL, 0, 1) == 0 && sp_debug)
+    DPRINTF("wrote %#s", fn);
+  free(fn);
+}
+
+static void *
+trigger_thread (void *arg)
+{
+  uint64_t last_cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  uint64_t last_wall = clock_ns(CLOCK_MONOTONIC);
+  struct timespec ts = { .tv_sec = INTERVAL };
+
+  for (;;)
+    {
+      while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+	;
+      ts.tv_sec = INTERVAL;
+      ts.tv_nsec = 0;
+
+      const uint64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+      const uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+      const unsigned int usage = (wall > last_wall
+				  ? (cpu - last_cpu) * 100 / (wall - last_wall) : 0);
+      last_cpu = cpu;
+      last_wall = wall;
+
+      pthread_mutex_lock(&window_lock);
+      if (!active && usage >= threshold)
+	open_window(usage);
+      else if (active && usage < threshold)
+	{
+	  if (sp_debug)
+	    DPRINTF("CPU usage %u%%, not sampling", usage);
+	  close_window();
+	}
+      pthread_mutex_unlock(&window_lock);
+    }
+  return NULL;
+}
+
+/* Starts the watchdog, after sampler_start. */
+void
+trigger_start (void)
+{
+  if (!window)
+    return;
+
+  /* The watchdog must not take signals meant for the program. */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+
+  pthread_t thread;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  const int e = pthread_create(&thread, &attr, trigger_thread, NULL);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+  if (e)
+    {
+      /* Better always than never. */
+      EPRINTF("pthread_create: %s", strerror(e));
+      sampler_enable(1);
+      return;
+    }
+  if (sp_debug)
+    DPRINTF("sampling while CPU usage is at least %u%%", threshold);
+}
+
+static void __attribute__((destructor))
+trigger_fini (void)
+{
+  if (!window || owner != getpid())
+    return;
+
+  pthread_mutex_lock(&window_lock);
+  if (active)
+    close_window();
+  pthread_mutex_unlock(&window_lock);
+}